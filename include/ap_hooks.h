@@ -34,6 +34,18 @@
 
 #ifdef APR_HOOK_PROBES_ENABLED
 #include "ap_hook_probes.h"
+#elif defined(AP_ENABLE_USDT) && !defined(APR_HOOKS_H)
+/* Without hook probes of its own, trace every hook run with USDT probes */
+#include "ap_usdt.h"
+#define APR_HOOK_PROBES_ENABLED 1
+#define APR_HOOK_PROBE_ENTRY(ud,ns,name,args) \
+    do { (void)(ud); AP_USDT_PROBE2(hook__entry, #ns, #name); } while (0)
+#define APR_HOOK_PROBE_RETURN(ud,ns,name,rv,args) \
+    AP_USDT_PROBE3(hook__return, #ns, #name, rv)
+#define APR_HOOK_PROBE_INVOKE(ud,ns,name,src,args) \
+    AP_USDT_PROBE3(hook__invoke, #ns, #name, src)
+#define APR_HOOK_PROBE_COMPLETE(ud,ns,name,src,rv,args) \
+    AP_USDT_PROBE4(hook__complete, #ns, #name, src, rv)
 #endif
 
 #include "apr.h"
@@ -477,6 +477,23 @@
  *                         core_dir_config
  * 20140627.10 (2.5.0-dev) Add ap_proxy_de_socketfy to mod_proxy.h
  * 20150121.0 (2.5.0-dev)  Revert field addition from core_dir_config; r1653666
+ * 20150121.1 (2.5.0-dev)  Add util_iptrie.h
+ * 20150121.2 (2.5.0-dev)  Add util_ldap_cache_shard_locks and
+ *                         search_cache_negative_ttl to util_ldap_state_t
+ * 20150121.3 (2.5.0-dev)  Add timing to request_rec, request_timing to
+ *                         core_server_config, ap_request_timing_t,
+ *                         ap_request_timing_init(), ap_request_phase_name(),
+ *                         ap_run_timed_request_hook() and
+ *                         AP_RUN_REQUEST_HOOK() to http_request.h
+ * 20150121.4 (2.5.0-dev)  Add recycled_pools, recycled_pools_peak,
+ *                         pool_hits, pool_misses and pools_destroyed to
+ *                         process_score
+ * 20150121.5 (2.5.0-dev)  Add util_headers.h
+ * 20150121.6 (2.5.0-dev)  Add ap_dbd_result_t, ap_dbd_cached_select(),
+ *                         ap_dbd_async_fn and ap_dbd_select_async() to
+ *                         mod_dbd.h, cache_timeout to dbd_cfg_t
+ * 20150121.7 (2.5.0-dev)  Add ap_headers_t and the ap_headers_*() functions
+ *                         to util_headers.h
  */
 
 #define MODULE_MAGIC_COOKIE 0x41503235UL /* "AP25" */
@@ -484,7 +501,7 @@
 #ifndef MODULE_MAGIC_NUMBER_MAJOR
 #define MODULE_MAGIC_NUMBER_MAJOR 20150121
 #endif
-#define MODULE_MAGIC_NUMBER_MINOR 0                 /* 0...n */
+#define MODULE_MAGIC_NUMBER_MINOR 7                 /* 0...n */
 
 /**
  * Determine if the server's current MODULE_MAGIC_NUMBER is at least a
@@ -0,0 +1,76 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file  ap_usdt.h
+ * @brief Statically defined tracing probes
+ *
+ * @defgroup APACHE_CORE_USDT USDT probes
+ * @ingroup  APACHE_CORE
+ *
+ * When httpd is configured with --enable-usdt, the AP_USDT_PROBE macros
+ * place user-level statically defined tracing probes of the provider "ap"
+ * using sys/sdt.h, which bpftrace, perf, SystemTap and DTrace can attach
+ * to by name.  An unattached probe is a single nop instruction and its
+ * arguments are only evaluated into registers, so they should be cheap
+ * expressions.  Without --enable-usdt the macros expand to nothing.
+ *
+ * Every hook run by the ap_run_* functions of the core and of modules
+ * built along with it fires the generic probes
+ *
+ *   hook__entry(ns, hook), hook__invoke(ns, hook, module),
+ *   hook__complete(ns, hook, module, rv), hook__return(ns, hook, rv)
+ *
+ * with the hook namespace and name as strings, and as module the name of
+ * the module which registered the hook function, such as "mod_rewrite.c".
+ * Filters fire filter__input__entry/return and filter__output__entry/return
+ * in ap_get_brigade() and ap_pass_brigade(), the worker and event MPMs fire
+ * mpm__queue__push/pop, and mod_proxy fires proxy__acquire__entry/return,
+ * proxy__connect__entry/return and proxy__release.  Example bpftrace
+ * scripts are in support/usdt.
+ * @{
+ */
+
+#ifndef AP_USDT_H
+#define AP_USDT_H
+
+#ifdef AP_ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define AP_USDT_PROBE0(name) \
+    DTRACE_PROBE(ap, name)
+#define AP_USDT_PROBE1(name,a1) \
+    DTRACE_PROBE1(ap, name, a1)
+#define AP_USDT_PROBE2(name,a1,a2) \
+    DTRACE_PROBE2(ap, name, a1, a2)
+#define AP_USDT_PROBE3(name,a1,a2,a3) \
+    DTRACE_PROBE3(ap, name, a1, a2, a3)
+#define AP_USDT_PROBE4(name,a1,a2,a3,a4) \
+    DTRACE_PROBE4(ap, name, a1, a2, a3, a4)
+
+#else /* AP_ENABLE_USDT */
+
+#define AP_USDT_PROBE0(name)
+#define AP_USDT_PROBE1(name,a1)
+#define AP_USDT_PROBE2(name,a1,a2)
+#define AP_USDT_PROBE3(name,a1,a2,a3)
+#define AP_USDT_PROBE4(name,a1,a2,a3,a4)
+
+#endif /* AP_ENABLE_USDT */
+
+#endif /* AP_USDT_H */
+/** @} */
@@ -27,6 +27,7 @@
 #define HEARTBEAT_H
 
 #include "apr.h"
+#include "apr_general.h"
 #include "apr_time.h"
 
 #ifdef __cplusplus
@@ -47,6 +48,65 @@ typedef struct hm_slot_server_t
     int id;
 } hm_slot_server_t;
 
+/*
+ * Heartbeats are sent either as a query string,
+ *   v=1&ready=<n>&busy=<n>[&port=<n>][&load=<f>&rps=<n>&p50=<ms>...]
+ * or in the compact binary form below, which starts with a NUL byte so
+ * that it can never be mistaken for the former.  All fields are 32 bit
+ * unsigned integers in network byte order:
+ *
+ *   0  "\0HB" and HM_BINARY_VERSION     16  load average * 100
+ *   4  ready                            20  requests per second
+ *   8  busy                             24  latency median, ms
+ *  12  port, 0 for 80                   28  latency 90th percentile, ms
+ *                                       32  latency 99th percentile, ms
+ */
+#define HM_BINARY_VERSION  2
+#define HM_BINARY_MSG_LEN  36
+
+/*
+ * Name of the slotmem holding the snapshot of the servers' state, which
+ * mod_heartmonitor publishes after every update and the heartbeat
+ * lbmethod selects from.  Its only slot is an hm_snapshot_t followed by
+ * two tables of 'max' entries each, sorted by ip.  The writer fills the
+ * table that (generation + 1) & 1 selects and then increments the
+ * generation; a reader uses the table of the generation it read, and
+ * only trusts the result if the generation is still the same after.
+ * The snapshot only exists when mod_heartmonitor listens for the
+ * heartbeats itself, and is empty until its generation is first
+ * incremented.
+ */
+#define HM_SNAPSHOT_SLOTMEM "mod_heartmonitor-snapshot"
+
+typedef struct hm_snapshot_server_t
+{
+    char ip[MAXIPSIZE];
+    int busy;
+    int ready;
+    apr_time_t seen;
+    int load;                    /* load average * 100 */
+    int rps;                     /* requests per second */
+    int p50;                     /* latency percentiles, ms */
+    int p90;
+    int p99;
+} hm_snapshot_server_t;
+
+typedef struct hm_snapshot_t
+{
+    volatile apr_uint32_t generation;
+    unsigned int max;            /* entries per table */
+    unsigned int num[2];         /* entries used in each table */
+} hm_snapshot_t;
+
+#define HM_SNAPSHOT_SIZE(max) \
+    (APR_ALIGN_DEFAULT(sizeof(hm_snapshot_t)) + \
+     2 * (max) * sizeof(hm_snapshot_server_t))
+
+#define HM_SNAPSHOT_TABLE(snap, gen) \
+    ((hm_snapshot_server_t *)((char *)(snap) + \
+                              APR_ALIGN_DEFAULT(sizeof(hm_snapshot_t))) \
+     + ((gen) & 1) * (snap)->max)
+
 /* default name of heartbeat data file, created in the configured
  * runtime directory when mod_slotmem_shm is not available
  */
@@ -705,6 +705,12 @@ typedef struct {
 #define AP_HTTP_EXPECT_STRICT_ENABLE   1
 #define AP_HTTP_EXPECT_STRICT_DISABLE  2
     int http_expect_strict;
+
+#define AP_REQUEST_TIMING_UNSET   0
+#define AP_REQUEST_TIMING_OFF     1
+#define AP_REQUEST_TIMING_ON      2
+#define AP_REQUEST_TIMING_DETAIL  3
+    int request_timing;
 } core_server_config;
 
 /* for AddOutputFiltersByType in core.c */
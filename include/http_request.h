@@ -587,6 +587,123 @@ AP_DECLARE(apr_bucket *) ap_bucket_eor_make(apr_bucket *b, request_rec *r);
 AP_DECLARE(apr_bucket *) ap_bucket_eor_create(apr_bucket_alloc_t *list,
                                               request_rec *r);
 
+/**
+ * @defgroup APACHE_CORE_REQ_TIMING Request Phase Timing
+ * @{
+ */
+
+/** The request processing phases timed when RequestTiming is enabled */
+typedef enum {
+    AP_REQUEST_PHASE_READ,           /**< reading the request line and headers */
+    AP_REQUEST_PHASE_POST_READ,      /**< post_read_request hook */
+    AP_REQUEST_PHASE_WALK,           /**< &lt;Location&gt; and &lt;If&gt; walks */
+    AP_REQUEST_PHASE_TRANSLATE,      /**< translate_name hook */
+    AP_REQUEST_PHASE_MAP_TO_STORAGE, /**< map_to_storage hook, including the
+                                      *   &lt;Directory&gt; and &lt;Files&gt; walks */
+    AP_REQUEST_PHASE_HEADER_PARSER,  /**< header_parser hook */
+    AP_REQUEST_PHASE_AUTH,           /**< access, authentication and
+                                      *   authorization hooks */
+    AP_REQUEST_PHASE_TYPE,           /**< type_checker hook */
+    AP_REQUEST_PHASE_FIXUPS,         /**< fixups hook */
+    AP_REQUEST_PHASE_HANDLER,        /**< handler hook */
+    AP_REQUEST_PHASES
+} ap_request_phase_e;
+
+/** Time spent by the functions of one module in one hook */
+typedef struct {
+    /** The hook, e.g. "translate_name" */
+    const char *hook;
+    /** The module, as registered with the hook, e.g. "mod_rewrite.c" */
+    const char *module;
+    /** Time spent, excluding any internal redirect run within */
+    apr_interval_time_t time;
+    /** Number of calls */
+    int calls;
+} ap_request_timing_hook_t;
+
+/** Time spent in one filter */
+typedef struct {
+    /** The filter */
+    ap_filter_rec_t *frec;
+    /** Non-zero for an input filter */
+    int input;
+    /** Time spent in the filter and the filters it called */
+    apr_interval_time_t time;
+    /** Time spent in the filter itself, including any connection filters
+     *  it called */
+    apr_interval_time_t self;
+    /** Number of calls */
+    int calls;
+} ap_request_timing_filter_t;
+
+/**
+ * Timing of a request, r->timing.  Internal redirects share the timing of
+ * the original request, and the time of a phase excludes the phases of
+ * any internal redirect run within it.  Subrequests are not timed on
+ * their own; their time is part of the phase of the request which ran
+ * them.
+ */
+typedef struct ap_request_timing_t {
+    /** Time spent in each ap_request_phase_e */
+    apr_interval_time_t phase[AP_REQUEST_PHASES];
+    /** Non-zero if hooks and filters are timed too (RequestTiming Detail) */
+    int detail;
+    /** ap_request_timing_hook_t for each module and hook, if detail */
+    apr_array_header_t *hooks;
+    /** ap_request_timing_filter_t for each filter, if detail */
+    apr_array_header_t *filters;
+    /** @internal time already accounted within the current hook */
+    apr_interval_time_t nested;
+    /** @internal time already accounted within the current filter */
+    apr_interval_time_t filter_nested;
+} ap_request_timing_t;
+
+/**
+ * Start timing a request if RequestTiming is enabled for its server.
+ * This is called by ap_read_request() once the virtual host is known,
+ * and accounts the time since r->request_time to AP_REQUEST_PHASE_READ.
+ * @param r The request
+ */
+AP_DECLARE(void) ap_request_timing_init(request_rec *r);
+
+/**
+ * Return the name of a request phase, as used by the %{...}T log format
+ * @param phase The ap_request_phase_e
+ * @return The name, e.g. "translate", or NULL if @a phase is out of range
+ */
+AP_DECLARE(const char *) ap_request_phase_name(int phase);
+
+/**
+ * Run the functions of a request hook taking only the request, accounting
+ * their time to a phase of r->timing.  Use AP_RUN_REQUEST_HOOK() rather
+ * than calling this directly.
+ * @param r The request, with r->timing set
+ * @param phase The ap_request_phase_e to account the time to
+ * @param hook The name of the hook
+ * @param hooks The hook functions, as returned by ap_hook_get_<hook>()
+ * @param run_all Non-zero for a RUN_ALL hook, zero for a RUN_FIRST hook
+ * @return The result, as of the corresponding ap_run_<hook>()
+ */
+AP_CORE_DECLARE(int) ap_run_timed_request_hook(request_rec *r, int phase,
+                                               const char *hook,
+                                               apr_array_header_t *hooks,
+                                               int run_all);
+
+/**
+ * Run a request hook, such as translate_name, timing it if r->timing is
+ * set.  Only the core runs the request hooks.
+ * @param r The request
+ * @param phase The ap_request_phase_e to account the time to
+ * @param name The hook
+ * @param run_all Non-zero for a RUN_ALL hook, zero for a RUN_FIRST hook
+ */
+#define AP_RUN_REQUEST_HOOK(r, phase, name, run_all) \
+    ((r)->timing ? ap_run_timed_request_hook((r), (phase), #name, \
+                                             ap_hook_get_##name(), (run_all)) \
+                 : ap_run_##name(r))
+
+/** @} */
+
 #ifdef __cplusplus
 }
 #endif
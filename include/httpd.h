@@ -1044,6 +1044,10 @@ struct request_rec {
     apr_table_t *trailers_in;
     /** MIME trailer environment from the response */
     apr_table_t *trailers_out;
+
+    /** Time spent in the processing phases, if enabled by RequestTiming;
+     *  NULL otherwise.  See http_request.h */
+    struct ap_request_timing_t *timing;
 };
 
 /**
@@ -143,6 +143,12 @@ struct process_score {
     apr_uint32_t keep_alive;        /* async connections in keep alive */
     apr_uint32_t suspended;         /* connections suspended by some module */
     int bucket;             /* Listener bucket used by this child */
+    /* transaction pool recycling (for async MPMs) */
+    apr_uint32_t recycled_pools;      /* pools kept for reuse */
+    apr_uint32_t recycled_pools_peak; /* high-water mark of recycled_pools */
+    apr_uint32_t pool_hits;           /* connections given a recycled pool */
+    apr_uint32_t pool_misses;         /* connections given a new pool */
+    apr_uint32_t pools_destroyed;     /* pools destroyed over the budget */
 };
 
 /* Scoreboard is now in 'local' memory, since it isn't updated once created,
@@ -0,0 +1,269 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file  util_headers.h
+ * @brief Well-known HTTP header names and indexed header collections
+ *
+ * @defgroup APACHE_CORE_HEADERS Well-known header names
+ * @ingroup  APACHE_CORE
+ *
+ * Code which walks a header table and treats some headers specially,
+ * such as the hop-by-hop headers a proxy must not forward, would
+ * otherwise compare every header name against a list of names with
+ * strcasecmp().  ap_header_id() instead maps a name to a small integer
+ * with one case-insensitive hash of the name and one comparison, so that
+ * the caller can switch() on the result or test it against a set of
+ * headers.
+ *
+ * The header tables of the request remain ordinary apr_table_t, which
+ * every module reads and writes.  An ap_headers_t wraps such a table
+ * and keeps, for each well-known header, the position of its first
+ * entry, so that looking one up takes a single comparison instead of a
+ * scan of the table.  The wrapped table can still be changed directly
+ * with the apr_table functions: the index is checked against the table
+ * on each lookup and rebuilt when entries moved.  Changes made through
+ * ap_headers_set() and friends keep the index up to date, and store
+ * well-known names spelt as ap_header_name() spells them as its interned
+ * strings, without copying them.  ap_headers_clone() makes a copy-on-write clone, which
+ * shares the table until either side is changed.
+ * @{
+ */
+
+#ifndef APACHE_UTIL_HEADERS_H
+#define APACHE_UTIL_HEADERS_H
+
+#include "httpd.h"
+#include "apr_tables.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Identifiers of the well-known header names */
+typedef enum {
+    AP_HEADER_UNKNOWN = 0,          /**< not a well-known header */
+    AP_HEADER_ACCEPT,
+    AP_HEADER_ACCEPT_CHARSET,
+    AP_HEADER_ACCEPT_ENCODING,
+    AP_HEADER_ACCEPT_LANGUAGE,
+    AP_HEADER_ACCEPT_RANGES,
+    AP_HEADER_AGE,
+    AP_HEADER_ALLOW,
+    AP_HEADER_AUTHORIZATION,
+    AP_HEADER_CACHE_CONTROL,
+    AP_HEADER_CONNECTION,
+    AP_HEADER_CONTENT_DISPOSITION,
+    AP_HEADER_CONTENT_ENCODING,
+    AP_HEADER_CONTENT_LANGUAGE,
+    AP_HEADER_CONTENT_LENGTH,
+    AP_HEADER_CONTENT_LOCATION,
+    AP_HEADER_CONTENT_MD5,
+    AP_HEADER_CONTENT_RANGE,
+    AP_HEADER_CONTENT_TYPE,
+    AP_HEADER_COOKIE,
+    AP_HEADER_DATE,
+    AP_HEADER_DESTINATION,
+    AP_HEADER_ETAG,
+    AP_HEADER_EXPECT,
+    AP_HEADER_EXPIRES,
+    AP_HEADER_FORWARDED,
+    AP_HEADER_FROM,
+    AP_HEADER_HOST,
+    AP_HEADER_IF_MATCH,
+    AP_HEADER_IF_MODIFIED_SINCE,
+    AP_HEADER_IF_NONE_MATCH,
+    AP_HEADER_IF_RANGE,
+    AP_HEADER_IF_UNMODIFIED_SINCE,
+    AP_HEADER_KEEP_ALIVE,
+    AP_HEADER_LAST_MODIFIED,
+    AP_HEADER_LINK,
+    AP_HEADER_LOCATION,
+    AP_HEADER_MAX_FORWARDS,
+    AP_HEADER_ORIGIN,
+    AP_HEADER_PRAGMA,
+    AP_HEADER_PROXY_AUTHENTICATE,
+    AP_HEADER_PROXY_AUTHORIZATION,
+    AP_HEADER_PROXY_CONNECTION,
+    AP_HEADER_RANGE,
+    AP_HEADER_REFERER,
+    AP_HEADER_RETRY_AFTER,
+    AP_HEADER_SERVER,
+    AP_HEADER_SET_COOKIE,
+    AP_HEADER_SET_COOKIE2,
+    AP_HEADER_TE,
+    AP_HEADER_TRAILER,
+    AP_HEADER_TRAILERS,             /**< misspelt Trailer, still stripped */
+    AP_HEADER_TRANSFER_ENCODING,
+    AP_HEADER_UPGRADE,
+    AP_HEADER_URI,
+    AP_HEADER_USER_AGENT,
+    AP_HEADER_VARY,
+    AP_HEADER_VIA,
+    AP_HEADER_WARNING,
+    AP_HEADER_WWW_AUTHENTICATE,
+    AP_HEADER_X_FORWARDED_FOR,
+    AP_HEADER_X_FORWARDED_HOST,
+    AP_HEADER_X_FORWARDED_SERVER,
+    AP_HEADER_MAX                   /**< number of identifiers */
+} ap_header_e;
+
+/** A set of well-known headers, see AP_HEADER_BIT() */
+typedef apr_uint64_t ap_header_set_t;
+
+/** The set containing only the header @a id */
+#define AP_HEADER_BIT(id) ((ap_header_set_t)1 << (id))
+
+/** Test whether the header @a id is in the set @a set */
+#define AP_HEADER_IN_SET(set, id) (((set) & AP_HEADER_BIT(id)) != 0)
+
+/**
+ * Set up the lookup table used by ap_header_id().  The core calls this
+ * in its pre_config hook; later calls do nothing.
+ */
+AP_DECLARE(void) ap_header_init(void);
+
+/**
+ * Look up a header name
+ * @param name The header name, compared case-insensitively
+ * @return The identifier of the name, or AP_HEADER_UNKNOWN
+ */
+AP_DECLARE(int) ap_header_id(const char *name);
+
+/**
+ * Return the canonical spelling of a well-known header name
+ * @param id The identifier
+ * @return The name, or NULL for AP_HEADER_UNKNOWN or an invalid identifier
+ */
+AP_DECLARE(const char *) ap_header_name(int id);
+
+/**
+ * Remove all the headers of a set from a table
+ * @param t The table
+ * @param set The headers to remove
+ * @return The number of distinct header names removed
+ * @remark This scans @a t once, and calls apr_table_unset() only for the
+ *         headers which are present, instead of once per header in @a set.
+ */
+AP_DECLARE(int) ap_headers_strip(apr_table_t *t, ap_header_set_t set);
+
+/** An indexed collection of headers, wrapping an apr_table_t */
+typedef struct ap_headers_t ap_headers_t;
+
+/**
+ * Wrap a header table in a collection
+ * @param p The pool to allocate the collection, any copy of the table and
+ *          the names and values copied by ap_headers_set() from, which
+ *          must live as long as the table
+ * @param t The table
+ * @return The collection
+ */
+AP_DECLARE(ap_headers_t *) ap_headers_make(apr_pool_t *p, apr_table_t *t);
+
+/**
+ * Make a copy-on-write clone of a collection
+ * @param p The pool to allocate the clone and its copy of the table from
+ * @param h The collection to clone
+ * @return The clone.  It shares the table of @a h until one of them is
+ *         changed through the ap_headers functions, which then first
+ *         makes a shallow copy of the table for itself.
+ * @remark The shared table must not be changed directly while it is
+ *         shared; use ap_headers_writable() to get a table to change.
+ */
+AP_DECLARE(ap_headers_t *) ap_headers_clone(apr_pool_t *p, ap_headers_t *h);
+
+/**
+ * Return the table of a collection, for reading with the apr_table API
+ * @param h The collection
+ * @return The table, which may be shared with clones
+ */
+AP_DECLARE(const apr_table_t *) ap_headers_table(const ap_headers_t *h);
+
+/**
+ * Return the table of a collection, for changing with the apr_table API
+ * @param h The collection
+ * @return The table, copied first if it was shared with clones
+ */
+AP_DECLARE(apr_table_t *) ap_headers_writable(ap_headers_t *h);
+
+/**
+ * Get the value of the first entry of a well-known header
+ * @param h The collection
+ * @param id The identifier of the header, see ap_header_id()
+ * @return The value, or NULL if there is none
+ */
+AP_DECLARE(const char *) ap_headers_get_id(ap_headers_t *h, int id);
+
+/**
+ * Get the value of the first entry of a header, like apr_table_get()
+ * @param h The collection
+ * @param name The name of the header, compared case-insensitively
+ * @return The value, or NULL if there is none
+ * @remark Names which are not well-known are looked up with
+ *         apr_table_get().
+ */
+AP_DECLARE(const char *) ap_headers_get(ap_headers_t *h, const char *name);
+
+/**
+ * Replace the entries of a header, like apr_table_set()
+ * @param h The collection
+ * @param name The name of the header
+ * @param val The value, which is copied
+ */
+AP_DECLARE(void) ap_headers_set(ap_headers_t *h, const char *name,
+                                const char *val);
+
+/**
+ * Replace the entries of a header, like apr_table_setn()
+ * @param h The collection
+ * @param name The name of the header, which is not copied
+ * @param val The value, which is not copied
+ */
+AP_DECLARE(void) ap_headers_setn(ap_headers_t *h, const char *name,
+                                 const char *val);
+
+/**
+ * Add an entry for a header, like apr_table_addn()
+ * @param h The collection
+ * @param name The name of the header, which is not copied
+ * @param val The value, which is not copied
+ */
+AP_DECLARE(void) ap_headers_addn(ap_headers_t *h, const char *name,
+                                 const char *val);
+
+/**
+ * Append a value to the first entry of a header, or add an entry, like
+ * apr_table_mergen()
+ * @param h The collection
+ * @param name The name of the header, which is not copied
+ * @param val The value, which is not copied
+ */
+AP_DECLARE(void) ap_headers_mergen(ap_headers_t *h, const char *name,
+                                   const char *val);
+
+/**
+ * Remove all the entries of a header, like apr_table_unset()
+ * @param h The collection
+ * @param name The name of the header
+ */
+AP_DECLARE(void) ap_headers_unset(ap_headers_t *h, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* !APACHE_UTIL_HEADERS_H */
+/** @} */
@@ -0,0 +1,100 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file  util_iptrie.h
+ * @brief IP address prefix matching
+ *
+ * @defgroup APACHE_CORE_IPTRIE IP prefix tries
+ * @ingroup  APACHE_CORE
+ *
+ * A path-compressed binary (Patricia) trie of IPv4 and IPv6 prefixes,
+ * built once at configuration time and then searched read-only by any
+ * number of threads.  A lookup costs at most one node visit per bit of
+ * the address, independent of the number of prefixes stored, which makes
+ * it suitable for large access and trusted proxy lists where a linear
+ * apr_ipsubnet_test() scan would dominate request processing.
+ * @{
+ */
+
+#ifndef APACHE_UTIL_IPTRIE_H
+#define APACHE_UTIL_IPTRIE_H
+
+#include "httpd.h"
+#include "apr_network_io.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Opaque IP prefix trie */
+typedef struct ap_iptrie_t ap_iptrie_t;
+
+/**
+ * Create an empty IP prefix trie
+ * @param p The pool to allocate the trie and its nodes from
+ * @return The new trie
+ */
+AP_DECLARE(ap_iptrie_t *) ap_iptrie_make(apr_pool_t *p);
+
+/**
+ * Add an address or network to the trie.
+ * @param t The trie
+ * @param ipstr The address, in the same forms accepted by
+ *        apr_ipsubnet_create(): a full IPv4 or IPv6 address, or a partial
+ *        IPv4 address such as "10.1" which implies the network 10.1.0.0/16
+ * @param mask_or_numbits An optional prefix length such as "24", or for
+ *        IPv4 a dotted netmask such as "255.255.255.0"; NULL matches
+ *        @a ipstr only
+ * @param value An opaque value returned by ap_iptrie_match() for addresses
+ *        within the network
+ * @return APR_SUCCESS; APR_EINVAL if @a ipstr does not look like an IP
+ *         address at all; APR_EBADIP if it is malformed; APR_EBADMASK if
+ *         the mask is invalid or is a non-contiguous netmask, which cannot
+ *         be represented as a prefix
+ * @remark If the same network is added more than once, the value given
+ *         first is kept.
+ */
+AP_DECLARE(apr_status_t) ap_iptrie_add(ap_iptrie_t *t, const char *ipstr,
+                                       const char *mask_or_numbits,
+                                       void *value);
+
+/**
+ * Test an address against the trie.
+ * @param t The trie
+ * @param sa The address to test; IPv4-mapped IPv6 addresses are tested
+ *        against the IPv4 networks, as apr_ipsubnet_test() does
+ * @param value If non-NULL, set on a match to the value of the matching
+ *        network which was added first, so that the result is the same as
+ *        that of a linear scan of the networks in the order they were added
+ * @return Non-zero if @a sa is within any network in the trie
+ */
+AP_DECLARE(int) ap_iptrie_match(const ap_iptrie_t *t,
+                                const apr_sockaddr_t *sa, void **value);
+
+/**
+ * Return the number of distinct networks stored in the trie
+ * @param t The trie
+ * @return The number of networks
+ */
+AP_DECLARE(int) ap_iptrie_count(const ap_iptrie_t *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* !APACHE_UTIL_IPTRIE_H */
+/** @} */
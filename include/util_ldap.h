@@ -181,6 +181,11 @@ typedef struct util_ldap_state_t {
     apr_interval_time_t connection_pool_ttl;
     int retries;                        /* number of retries for failed bind/search/compare */
     apr_interval_time_t retry_delay;    /* delay between retries of failed bind/search/compare */
+
+    /* one lock per cache shard; util_ldap_cache_lock guards the shared
+     * memory allocator only */
+    apr_global_mutex_t **util_ldap_cache_shard_locks;
+    long search_cache_negative_ttl;     /* TTL for failed searches, 0 = off */
 } util_ldap_state_t;
 
 /* Used to store arrays of attribute labels/values. */
@@ -585,6 +585,22 @@ SOURCE=.\include\util_filter.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\server\util_headers.c
+# End Source File
+# Begin Source File
+
+SOURCE=.\include\util_headers.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\server\util_iptrie.c
+# End Source File
+# Begin Source File
+
+SOURCE=.\include\util_iptrie.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\server\util_md5.c
 # End Source File
 # Begin Source File
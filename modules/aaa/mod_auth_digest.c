@@ -71,10 +71,13 @@
 #include "util_md5.h"
 #include "util_mutex.h"
 #include "apr_shm.h"
-#include "apr_rmm.h"
 #include "ap_provider.h"
+#if APR_HAS_THREADS
+#include "apr_thread_mutex.h"
+#endif
 
 #include "mod_auth.h"
+#include "mod_status.h"
 
 #if APR_HAVE_UNISTD_H
 #include <unistd.h>
@@ -114,20 +117,40 @@ typedef struct digest_config_struct {
 
 typedef struct hash_entry {
     unsigned long      key;                     /* the key for this entry    */
-    struct hash_entry *next;                    /* next entry in the bucket  */
+    apr_uint32_t       next;                    /* next entry in the bucket  */
     unsigned long      nonce_count;             /* for nonce-count checking  */
     char               last_nonce[NONCE_LEN+1]; /* for one-time nonce's      */
 } client_entry;
 
+/*
+ * The client list is split into stripes, each with its own lock, its own
+ * share of the hash buckets (those with bucket % num_stripes == stripe)
+ * and its own free list of fixed-size entries, so that requests from
+ * clients in different stripes never wait for each other.  Entries are
+ * linked by slot number rather than by pointer: slot n is slots[n - 1],
+ * and 0 ends a list.
+ */
+typedef struct client_stripe {
+    apr_uint32_t       free;                    /* first free slot           */
+    unsigned long      num_entries;
+    unsigned long      num_created;
+    unsigned long      num_removed;
+} client_stripe;
+
 static struct hash_table {
-    client_entry  **table;
+    apr_uint32_t   *table;
+    client_stripe  *stripes;
+    client_entry   *slots;
     unsigned long   tbl_len;
-    unsigned long   num_entries;
-    unsigned long   num_created;
-    unsigned long   num_removed;
+    unsigned long   num_stripes;
+    unsigned long   num_slots;
     unsigned long   num_renewed;
+    unsigned long   opaque_cntr;
+    apr_time_t      otn_counter;
 } *client_list;
 
+#define CLIENT_SLOT(n)  (&client_list->slots[(n) - 1])
+
 
 /* struct to hold a parsed Authorization header */
 
@@ -169,22 +192,41 @@ static unsigned char *secret;
 /* client-list, opaque, and one-time-nonce stuff */
 
 static apr_shm_t      *client_shm =  NULL;
-static apr_rmm_t      *client_rmm = NULL;
 static unsigned long  *opaque_cntr;
 static apr_time_t     *otn_counter;     /* one-time-nonce counter */
-static apr_global_mutex_t *client_lock = NULL;
+static apr_global_mutex_t **client_locks = NULL;
+static unsigned long   num_client_locks = 0;
 static apr_global_mutex_t *opaque_lock = NULL;
 static const char     *client_mutex_type = "authdigest-client";
 static const char     *opaque_mutex_type = "authdigest-opaque";
 static const char     *client_shm_filename;
 
-#define DEF_SHMEM_SIZE  1000L           /* ~ 12 entries */
+/*
+ * Each child reserves OPAQUE_BLOCK opaque values at a time from the shared
+ * counter and hands them out itself, so the global opaque_lock is only
+ * taken once every OPAQUE_BLOCK new clients.
+ */
+#define OPAQUE_BLOCK    64
+static unsigned long   opaque_next = 0;
+static unsigned long   opaque_end = 0;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *opaque_local_lock = NULL;
+#endif
+
+#define DEF_SHMEM_SIZE  2000L           /* ~ 21 entries in 4 stripes */
 #define DEF_NUM_BUCKETS 15L
 #define HASH_DEPTH      5
+#define MAX_NUM_STRIPES 8L
 
 static apr_size_t shmem_size  = DEF_SHMEM_SIZE;
 static unsigned long num_buckets = DEF_NUM_BUCKETS;
 
+/* size of the shared memory in front of the client entries */
+#define TABLE_HDR_SIZE(buckets, stripes) \
+    (APR_ALIGN_DEFAULT(sizeof(*client_list)) \
+     + APR_ALIGN_DEFAULT((buckets) * sizeof(apr_uint32_t)) \
+     + APR_ALIGN_DEFAULT((stripes) * sizeof(client_stripe)))
+
 
 module AP_MODULE_DECLARE_DATA auth_digest_module;
 
@@ -197,19 +239,21 @@ static apr_status_t cleanup_tables(void *not_used)
     ap_log_error(APLOG_MARK, APLOG_INFO, 0, NULL, APLOGNO(01756)
                   "cleaning up shared memory");
 
-    if (client_rmm) {
-        apr_rmm_destroy(client_rmm);
-        client_rmm = NULL;
-    }
-
     if (client_shm) {
         apr_shm_destroy(client_shm);
         client_shm = NULL;
     }
 
-    if (client_lock) {
-        apr_global_mutex_destroy(client_lock);
-        client_lock = NULL;
+    if (client_locks) {
+        unsigned long idx;
+
+        for (idx = 0; idx < num_client_locks; idx++) {
+            if (client_locks[idx]) {
+                apr_global_mutex_destroy(client_locks[idx]);
+            }
+        }
+        client_locks = NULL;
+        num_client_locks = 0;
     }
 
     if (opaque_lock) {
@@ -218,6 +262,8 @@ static apr_status_t cleanup_tables(void *not_used)
     }
 
     client_list = NULL;
+    opaque_cntr = NULL;
+    otn_counter = NULL;
 
     return APR_SUCCESS;
 }
@@ -235,10 +281,29 @@ static void log_error_and_cleanup(char *msg, apr_status_t sts, server_rec *s)
 
 static int initialize_tables(server_rec *s, apr_pool_t *ctx)
 {
-    unsigned long idx;
+    unsigned long idx, num_stripes, num_slots;
+    char *base;
     apr_status_t   sts;
 
-    /* set up client list */
+    /* set up client list; a small segment gets fewer stripes, so that each
+     * has room for HASH_DEPTH entries and clients hashed to the same stripe
+     * don't keep evicting each other
+     */
+
+    num_stripes = num_buckets < MAX_NUM_STRIPES ? num_buckets
+                                                : MAX_NUM_STRIPES;
+    for (;;) {
+        num_slots = (shmem_size - TABLE_HDR_SIZE(num_buckets, num_stripes))
+                    / sizeof(client_entry);
+        if (num_stripes == 1 || num_slots >= num_stripes * HASH_DEPTH) {
+            break;
+        }
+        num_stripes = num_slots / HASH_DEPTH ? num_slots / HASH_DEPTH : 1;
+    }
+    if (num_slots == 0) {
+        log_error_and_cleanup("AuthDigestShmemSize too small", -1, s);
+        return !OK;
+    }
 
     /* Create the shared memory segment */
 
@@ -260,43 +325,46 @@ static int initialize_tables(server_rec *s, apr_pool_t *ctx)
         return HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    sts = apr_rmm_init(&client_rmm,
-                       NULL, /* no lock, we'll do the locking ourselves */
-                       apr_shm_baseaddr_get(client_shm),
-                       shmem_size, ctx);
-    if (sts != APR_SUCCESS) {
-        log_error_and_cleanup("failed to initialize rmm", sts, s);
-        return !OK;
-    }
+    base = apr_shm_baseaddr_get(client_shm);
+    client_list = (struct hash_table *)base;
+    memset(client_list, 0, sizeof(*client_list));
+    base += APR_ALIGN_DEFAULT(sizeof(*client_list));
+    client_list->table = (apr_uint32_t *)base;
+    base += APR_ALIGN_DEFAULT(num_buckets * sizeof(apr_uint32_t));
+    client_list->stripes = (client_stripe *)base;
+    base += APR_ALIGN_DEFAULT(num_stripes * sizeof(client_stripe));
+    client_list->slots = (client_entry *)base;
 
-    client_list = apr_rmm_addr_get(client_rmm, apr_rmm_malloc(client_rmm, sizeof(*client_list) +
-                                                          sizeof(client_entry*)*num_buckets));
-    if (!client_list) {
-        log_error_and_cleanup("failed to allocate shared memory", -1, s);
-        return !OK;
-    }
-    client_list->table = (client_entry**) (client_list + 1);
     for (idx = 0; idx < num_buckets; idx++) {
-        client_list->table[idx] = NULL;
+        client_list->table[idx] = 0;
+    }
+    memset(client_list->stripes, 0, num_stripes * sizeof(client_stripe));
+    /* deal the entries out to the stripes' free lists */
+    for (idx = num_slots; idx > 0; idx--) {
+        client_stripe *stripe = &client_list->stripes[(idx - 1) % num_stripes];
+        CLIENT_SLOT(idx)->next = stripe->free;
+        stripe->free = idx;
     }
     client_list->tbl_len     = num_buckets;
-    client_list->num_entries = 0;
-
-    sts = ap_global_mutex_create(&client_lock, NULL, client_mutex_type, NULL,
-                                 s, ctx, 0);
-    if (sts != APR_SUCCESS) {
-        log_error_and_cleanup("failed to create lock (client_lock)", sts, s);
-        return !OK;
+    client_list->num_stripes = num_stripes;
+    client_list->num_slots   = num_slots;
+
+    client_locks = apr_pcalloc(ctx, num_stripes * sizeof(*client_locks));
+    num_client_locks = num_stripes;
+    for (idx = 0; idx < num_stripes; idx++) {
+        sts = ap_global_mutex_create(&client_locks[idx], NULL,
+                                     client_mutex_type,
+                                     apr_ltoa(ctx, (long)idx), s, ctx, 0);
+        if (sts != APR_SUCCESS) {
+            log_error_and_cleanup("failed to create lock (client_lock)", sts, s);
+            return !OK;
+        }
     }
 
 
     /* setup opaque */
 
-    opaque_cntr = apr_rmm_addr_get(client_rmm, apr_rmm_malloc(client_rmm, sizeof(*opaque_cntr)));
-    if (opaque_cntr == NULL) {
-        log_error_and_cleanup("failed to allocate shared memory", -1, s);
-        return !OK;
-    }
+    opaque_cntr = &client_list->opaque_cntr;
     *opaque_cntr = 1UL;
 
     sts = ap_global_mutex_create(&opaque_lock, NULL, opaque_mutex_type, NULL,
@@ -309,11 +377,7 @@ static int initialize_tables(server_rec *s, apr_pool_t *ctx)
 
     /* setup one-time-nonce counter */
 
-    otn_counter = apr_rmm_addr_get(client_rmm, apr_rmm_malloc(client_rmm, sizeof(*otn_counter)));
-    if (otn_counter == NULL) {
-        log_error_and_cleanup("failed to allocate shared memory", -1, s);
-        return !OK;
-    }
+    otn_counter = &client_list->otn_counter;
     *otn_counter = 0;
     /* no lock here */
 
@@ -388,28 +452,32 @@ static int initialize_module(apr_pool_t *p, apr_pool_t *plog,
 static void initialize_child(apr_pool_t *p, server_rec *s)
 {
     apr_status_t sts;
+    unsigned long idx;
 
     if (!client_shm) {
         return;
     }
 
-    /* Get access to rmm in child */
-    sts = apr_rmm_attach(&client_rmm,
-                         NULL,
-                         apr_shm_baseaddr_get(client_shm),
-                         p);
-    if (sts != APR_SUCCESS) {
-        log_error_and_cleanup("failed to attach to rmm", sts, s);
-        return;
+    for (idx = 0; idx < num_client_locks; idx++) {
+        sts = apr_global_mutex_child_init(&client_locks[idx],
+                                  apr_global_mutex_lockfile(client_locks[idx]),
+                                  p);
+        if (sts != APR_SUCCESS) {
+            log_error_and_cleanup("failed to create lock (client_lock)", sts, s);
+            return;
+        }
     }
 
-    sts = apr_global_mutex_child_init(&client_lock,
-                                      apr_global_mutex_lockfile(client_lock),
-                                      p);
+    opaque_next = opaque_end = 0;
+#if APR_HAS_THREADS
+    sts = apr_thread_mutex_create(&opaque_local_lock,
+                                  APR_THREAD_MUTEX_DEFAULT, p);
     if (sts != APR_SUCCESS) {
-        log_error_and_cleanup("failed to create lock (client_lock)", sts, s);
+        log_error_and_cleanup("failed to create lock (opaque_local_lock)",
+                              sts, s);
         return;
     }
+#endif
     sts = apr_global_mutex_child_init(&opaque_lock,
                                       apr_global_mutex_lockfile(opaque_lock),
                                       p);
@@ -628,15 +696,20 @@ static const char *set_shmem_size(cmd_parms *cmd, void *config,
                           size_str, NULL);
     }
 
-    min = sizeof(*client_list) + sizeof(client_entry*) + sizeof(client_entry);
+    min = TABLE_HDR_SIZE(1, 1) + sizeof(client_entry);
     if (size < min) {
         return apr_psprintf(cmd->pool, "size in AuthDigestShmemSize too small: "
                            "%ld < %ld", size, min);
     }
 
     shmem_size  = size;
-    num_buckets = (size - sizeof(*client_list)) /
-                  (sizeof(client_entry*) + HASH_DEPTH * sizeof(client_entry));
+    if ((apr_size_t)size > TABLE_HDR_SIZE(0, MAX_NUM_STRIPES)) {
+        num_buckets = (size - TABLE_HDR_SIZE(0, MAX_NUM_STRIPES)) /
+                      (sizeof(apr_uint32_t) + HASH_DEPTH * sizeof(client_entry));
+    }
+    else {
+        num_buckets = 0;
+    }
     if (num_buckets == 0) {
         num_buckets = 1;
     }
@@ -729,29 +802,35 @@ static const command_rec digest_cmds[] =
  */
 static client_entry *get_client(unsigned long key, const request_rec *r)
 {
-    int bucket;
-    client_entry *entry, *prev = NULL;
+    unsigned long bucket;
+    apr_uint32_t n, prev = 0;
+    apr_global_mutex_t *lock;
+    client_entry *entry = NULL;
 
 
     if (!key || !client_shm)  return NULL;
 
     bucket = key % client_list->tbl_len;
-    entry  = client_list->table[bucket];
+    lock   = client_locks[bucket % client_list->num_stripes];
 
-    apr_global_mutex_lock(client_lock);
+    apr_global_mutex_lock(lock);
 
-    while (entry && key != entry->key) {
-        prev  = entry;
-        entry = entry->next;
+    n = client_list->table[bucket];
+    while (n && key != CLIENT_SLOT(n)->key) {
+        prev = n;
+        n    = CLIENT_SLOT(n)->next;
     }
 
-    if (entry && prev) {                /* move entry to front of list */
-        prev->next  = entry->next;
-        entry->next = client_list->table[bucket];
-        client_list->table[bucket] = entry;
+    if (n) {
+        entry = CLIENT_SLOT(n);
+        if (prev) {                     /* move entry to front of list */
+            CLIENT_SLOT(prev)->next = entry->next;
+            entry->next = client_list->table[bucket];
+            client_list->table[bucket] = n;
+        }
     }
 
-    apr_global_mutex_unlock(client_lock);
+    apr_global_mutex_unlock(lock);
 
     if (entry) {
         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(01764)
@@ -767,52 +846,77 @@ static client_entry *get_client(unsigned long key, const request_rec *r)
 
 
 /* A simple garbage-collecter to remove unused clients. It removes the
- * last entry in each bucket and updates the counters. Returns the
- * number of removed entries.
+ * last entry in each bucket of the given stripe and updates the counters.
+ * Must be called with the stripe's lock held. Returns the number of
+ * removed entries.
  */
-static long gc(void)
+static long gc(unsigned long stripe_idx)
 {
-    client_entry *entry, *prev;
+    client_stripe *stripe = &client_list->stripes[stripe_idx];
+    apr_uint32_t n, prev;
     unsigned long num_removed = 0, idx;
 
     /* garbage collect all last entries */
 
-    for (idx = 0; idx < client_list->tbl_len; idx++) {
-        entry = client_list->table[idx];
-        prev  = NULL;
-        while (entry->next) {   /* find last entry */
-            prev  = entry;
-            entry = entry->next;
+    for (idx = stripe_idx; idx < client_list->tbl_len;
+         idx += client_list->num_stripes) {
+        n    = client_list->table[idx];
+        prev = 0;
+        if (!n) {
+            continue;
+        }
+        while (CLIENT_SLOT(n)->next) {  /* find last entry */
+            prev = n;
+            n    = CLIENT_SLOT(n)->next;
         }
         if (prev) {
-            prev->next = NULL;   /* cut list */
+            CLIENT_SLOT(prev)->next = 0;        /* cut list */
         }
         else {
-            client_list->table[idx] = NULL;
-        }
-        if (entry) {                    /* remove entry */
-            apr_rmm_free(client_rmm, apr_rmm_offset_get(client_rmm, entry));
-            num_removed++;
+            client_list->table[idx] = 0;
         }
+        CLIENT_SLOT(n)->next = stripe->free;    /* remove entry */
+        stripe->free = n;
+        num_removed++;
     }
 
     /* update counters and log */
 
-    client_list->num_entries -= num_removed;
-    client_list->num_removed += num_removed;
+    stripe->num_entries -= num_removed;
+    stripe->num_removed += num_removed;
 
     return num_removed;
 }
 
 
+/* Sum up the per-stripe counters; only an indication, as the other stripes
+ * are read without their locks.
+ */
+static void client_totals(unsigned long *entries, unsigned long *created,
+                          unsigned long *removed)
+{
+    unsigned long idx;
+
+    *entries = *created = *removed = 0;
+    for (idx = 0; idx < client_list->num_stripes; idx++) {
+        *entries += client_list->stripes[idx].num_entries;
+        *created += client_list->stripes[idx].num_created;
+        *removed += client_list->stripes[idx].num_removed;
+    }
+}
+
+
 /*
  * Add a new client to the list. Returns the entry if successful, NULL
- * otherwise. This triggers the garbage collection if memory is low.
+ * otherwise. This triggers the garbage collection if the client's stripe
+ * has no free entries left.
  */
 static client_entry *add_client(unsigned long key, client_entry *info,
                                 server_rec *s)
 {
-    int bucket;
+    unsigned long bucket, stripe_idx;
+    client_stripe *stripe;
+    apr_uint32_t n;
     client_entry *entry;
 
 
@@ -820,40 +924,47 @@ static client_entry *add_client(unsigned long key, client_entry *info,
         return NULL;
     }
 
-    bucket = key % client_list->tbl_len;
+    bucket     = key % client_list->tbl_len;
+    stripe_idx = bucket % client_list->num_stripes;
+    stripe     = &client_list->stripes[stripe_idx];
 
-    apr_global_mutex_lock(client_lock);
+    apr_global_mutex_lock(client_locks[stripe_idx]);
 
     /* try to allocate a new entry */
 
-    entry = apr_rmm_addr_get(client_rmm, apr_rmm_malloc(client_rmm, sizeof(client_entry)));
-    if (!entry) {
-        long num_removed = gc();
+    n = stripe->free;
+    if (!n) {
+        long num_removed = gc(stripe_idx);
+        unsigned long entries, created, removed;
+
+        client_totals(&entries, &created, &removed);
         ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(01766)
                      "gc'd %ld client entries. Total new clients: "
                      "%ld; Total removed clients: %ld; Total renewed clients: "
                      "%ld", num_removed,
-                     client_list->num_created - client_list->num_renewed,
-                     client_list->num_removed, client_list->num_renewed);
-        entry = apr_rmm_addr_get(client_rmm, apr_rmm_malloc(client_rmm, sizeof(client_entry)));
-        if (!entry) {
+                     created - client_list->num_renewed,
+                     removed, client_list->num_renewed);
+        n = stripe->free;
+        if (!n) {
             ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(01767)
                          "unable to allocate new auth_digest client");
-            apr_global_mutex_unlock(client_lock);
+            apr_global_mutex_unlock(client_locks[stripe_idx]);
             return NULL;       /* give up */
         }
     }
+    entry = CLIENT_SLOT(n);
+    stripe->free = entry->next;
 
     /* now add the entry */
 
     memcpy(entry, info, sizeof(client_entry));
     entry->key  = key;
     entry->next = client_list->table[bucket];
-    client_list->table[bucket] = entry;
-    client_list->num_created++;
-    client_list->num_entries++;
+    client_list->table[bucket] = n;
+    stripe->num_created++;
+    stripe->num_entries++;
 
-    apr_global_mutex_unlock(client_lock);
+    apr_global_mutex_unlock(client_locks[stripe_idx]);
 
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(01768)
                  "allocated new client %lu", key);
@@ -1095,15 +1206,26 @@ static const char *gen_nonce(apr_pool_t *p, apr_time_t now, const char *opaque,
 static client_entry *gen_client(const request_rec *r)
 {
     unsigned long op;
-    client_entry new_entry = { 0, NULL, 0, "" }, *entry;
+    client_entry new_entry = { 0, 0, 0, "" }, *entry;
 
     if (!opaque_cntr) {
         return NULL;
     }
 
-    apr_global_mutex_lock(opaque_lock);
-    op = (*opaque_cntr)++;
-    apr_global_mutex_unlock(opaque_lock);
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(opaque_local_lock);
+#endif
+    if (opaque_next == opaque_end) {
+        apr_global_mutex_lock(opaque_lock);
+        opaque_next = *opaque_cntr;
+        *opaque_cntr += OPAQUE_BLOCK;
+        apr_global_mutex_unlock(opaque_lock);
+        opaque_end = opaque_next + OPAQUE_BLOCK;
+    }
+    op = opaque_next++;
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(opaque_local_lock);
+#endif
 
     if (!(entry = add_client(op, &new_entry, r->server))) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01769)
@@ -1905,6 +2027,74 @@ static int add_auth_info(request_rec *r)
     return OK;
 }
 
+/*
+ * mod_status output: client list usage, per stripe, and how full the
+ * buckets are.  Read without locks, so the figures are approximate.
+ */
+static int digest_status_hook(request_rec *r, int flags)
+{
+    unsigned long idx, n, entries, created, removed;
+    unsigned long depth[HASH_DEPTH + 2];
+    apr_uint32_t slot;
+
+    if (!client_shm || !client_list) {
+        return OK;
+    }
+
+    client_totals(&entries, &created, &removed);
+
+    /* chains may change under us, so never walk further than HASH_DEPTH+1 */
+    memset(depth, 0, sizeof(depth));
+    for (idx = 0; idx < client_list->tbl_len; idx++) {
+        for (n = 0, slot = client_list->table[idx];
+             slot && slot <= client_list->num_slots && n <= HASH_DEPTH;
+             slot = CLIENT_SLOT(slot)->next) {
+            n++;
+        }
+        depth[n]++;
+    }
+
+    if (flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "AuthDigestClients: %lu\n"
+                   "AuthDigestClientSlots: %lu\n"
+                   "AuthDigestClientsCreated: %lu\n"
+                   "AuthDigestClientsRemoved: %lu\n"
+                   "AuthDigestClientsRenewed: %lu\n",
+                   entries, client_list->num_slots, created, removed,
+                   client_list->num_renewed);
+        return OK;
+    }
+
+    ap_rputs("<hr />\n<h2>Digest Authentication Clients</h2>\n", r);
+    ap_rprintf(r, "<dl><dt>%lu clients in %lu entries, %lu buckets, "
+               "%lu stripes</dt>\n"
+               "<dt>%lu created, %lu removed, %lu renewed</dt></dl>\n",
+               entries, client_list->num_slots, client_list->tbl_len,
+               client_list->num_stripes, created, removed,
+               client_list->num_renewed);
+
+    ap_rputs("<table border=\"0\"><tr><th>Clients per bucket</th>"
+             "<th>Buckets</th></tr>\n", r);
+    for (idx = 0; idx <= HASH_DEPTH + 1; idx++) {
+        ap_rprintf(r, "<tr><td>%lu%s</td><td>%lu</td></tr>\n", idx,
+                   idx > HASH_DEPTH ? "+" : "", depth[idx]);
+    }
+    ap_rputs("</table>\n", r);
+
+    ap_rputs("<table border=\"0\"><tr><th>Stripe</th><th>Clients</th>"
+             "<th>Created</th><th>Removed</th></tr>\n", r);
+    for (idx = 0; idx < client_list->num_stripes; idx++) {
+        client_stripe *stripe = &client_list->stripes[idx];
+
+        ap_rprintf(r, "<tr><td>%lu</td><td>%lu</td><td>%lu</td>"
+                   "<td>%lu</td></tr>\n", idx, stripe->num_entries,
+                   stripe->num_created, stripe->num_removed);
+    }
+    ap_rputs("</table>\n", r);
+
+    return OK;
+}
+
 static void register_hooks(apr_pool_t *p)
 {
     static const char * const cfgPost[]={ "http_core.c", NULL };
@@ -1920,6 +2110,8 @@ static void register_hooks(apr_pool_t *p)
     ap_hook_fixups(add_auth_info, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_note_auth_failure(hook_note_digest_auth_failure, NULL, NULL,
                               APR_HOOK_MIDDLE);
+    APR_OPTIONAL_HOOK(ap, status_hook, digest_status_hook, NULL, NULL,
+                      APR_HOOK_MIDDLE);
 
 }
 
@@ -39,7 +39,7 @@ typedef struct {
 } authn_dbd_rec;
 
 /* optional function - look it up once in post_config */
-static ap_dbd_t *(*authn_dbd_acquire_fn)(request_rec*) = NULL;
+static APR_OPTIONAL_FN_TYPE(ap_dbd_cached_select) *authn_dbd_select_fn = NULL;
 static void (*authn_dbd_prepare_fn)(server_rec*, const char*, const char*) = NULL;
 static APR_OPTIONAL_FN_TYPE(ap_authn_cache_store) *authn_cache_store = NULL;
 #define AUTHN_CACHE_STORE(r,user,realm,data) \
@@ -73,7 +73,7 @@ static const char *authn_dbd_prepare(cmd_parms *cmd, void *cfg, const char *quer
         if (authn_dbd_prepare_fn == NULL) {
             return "You must load mod_dbd to enable AuthDBD functions";
         }
-        authn_dbd_acquire_fn = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_acquire);
+        authn_dbd_select_fn = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_cached_select);
     }
     label = apr_psprintf(cmd->pool, "authn_dbd_%d", ++label_num);
 
@@ -92,90 +92,93 @@ static const command_rec authn_dbd_cmds[] =
                   "Query used to fetch password for user+realm"),
     {NULL}
 };
-static authn_status authn_dbd_password(request_rec *r, const char *user,
-                                       const char *password)
+/* Look up the first row of a query; the remaining columns of that row
+ * are added to the environment as AUTHENTICATE_<column name>
+ */
+static authn_status authn_dbd_lookup(request_rec *r, const char *label,
+                                     int nargs, const char **args,
+                                     const char **value)
 {
+    ap_dbd_result_t *res;
+    const char **row;
+    const char *errmsg;
     apr_status_t rv;
-    const char *dbd_password = NULL;
-    apr_dbd_prepared_t *statement;
-    apr_dbd_results_t *res = NULL;
-    apr_dbd_row_t *row = NULL;
-    int ret;
 
-    authn_dbd_conf *conf = ap_get_module_config(r->per_dir_config,
-                                                &authn_dbd_module);
-    ap_dbd_t *dbd = authn_dbd_acquire_fn(r);
-    if (dbd == NULL) {
+    rv = authn_dbd_select_fn(r, label, nargs, args, &res, &errmsg);
+    if (rv == APR_ECONNREFUSED) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01653)
                       "Failed to acquire database connection to look up "
-                      "user '%s'", user);
-        return AUTH_GENERAL_ERROR;
-    }
-
-    if (conf->user == NULL) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01654)
-                      "No AuthDBDUserPWQuery has been specified");
+                      "user '%s'", args[0]);
         return AUTH_GENERAL_ERROR;
     }
-
-    statement = apr_hash_get(dbd->prepared, conf->user, APR_HASH_KEY_STRING);
-    if (statement == NULL) {
+    if (rv == APR_NOTFOUND) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01655)
                       "A prepared statement could not be found for "
-                      "AuthDBDUserPWQuery with the key '%s'", conf->user);
+                      "the key '%s'", label);
         return AUTH_GENERAL_ERROR;
     }
-    if ((ret = apr_dbd_pvselect(dbd->driver, r->pool, dbd->handle, &res,
-                                statement, 0, user, NULL) != 0)) {
+    if (rv == APR_INCOMPLETE) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01657)
+                      "Error retrieving results while looking up '%s%s%s' "
+                      "in database [%s]", args[0], nargs > 1 ? ":" : "",
+                      nargs > 1 ? args[1] : "", errmsg);
+        return AUTH_GENERAL_ERROR;
+    }
+    if (rv != APR_SUCCESS) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01656)
-                      "Query execution error looking up '%s' "
-                      "in database [%s]",
-                      user, apr_dbd_error(dbd->driver, dbd->handle, ret));
+                      "Query execution error looking up '%s%s%s' "
+                      "in database [%s]", args[0], nargs > 1 ? ":" : "",
+                      nargs > 1 ? args[1] : "", errmsg);
         return AUTH_GENERAL_ERROR;
     }
-    for (rv = apr_dbd_get_row(dbd->driver, r->pool, res, &row, -1);
-         rv != -1;
-         rv = apr_dbd_get_row(dbd->driver, r->pool, res, &row, -1)) {
-        if (rv != 0) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01657)
-                          "Error retrieving results while looking up '%s' "
-                          "in database", user);
-            return AUTH_GENERAL_ERROR;
-        }
-        if (dbd_password == NULL) {
-#if APU_MAJOR_VERSION > 1 || (APU_MAJOR_VERSION == 1 && APU_MINOR_VERSION >= 3)
-            /* add the rest of the columns to the environment */
-            int i = 1;
-            const char *name;
-            for (name = apr_dbd_get_name(dbd->driver, res, i);
-                 name != NULL;
-                 name = apr_dbd_get_name(dbd->driver, res, i)) {
+    if (res->rows->nelts == 0) {
+        return AUTH_USER_NOT_FOUND;
+    }
 
-                char *str = apr_pstrcat(r->pool, AUTHN_PREFIX,
-                                        name,
-                                        NULL);
-                int j = sizeof(AUTHN_PREFIX)-1; /* string length of "AUTHENTICATE_", excluding the trailing NIL */
-                while (str[j]) {
-                    if (!apr_isalnum(str[j])) {
-                        str[j] = '_';
-                    }
-                    else {
-                        str[j] = apr_toupper(str[j]);
-                    }
-                    j++;
+    row = APR_ARRAY_IDX(res->rows, 0, const char **);
+    if (res->names) {
+        /* add the rest of the columns to the environment */
+        int i;
+        for (i = 1; i < res->ncols && res->names[i] != NULL; i++) {
+            char *str = apr_pstrcat(r->pool, AUTHN_PREFIX,
+                                    res->names[i],
+                                    NULL);
+            int j = sizeof(AUTHN_PREFIX)-1; /* string length of "AUTHENTICATE_", excluding the trailing NIL */
+            while (str[j]) {
+                if (!apr_isalnum(str[j])) {
+                    str[j] = '_';
+                }
+                else {
+                    str[j] = apr_toupper(str[j]);
                 }
-                apr_table_set(r->subprocess_env, str,
-                              apr_dbd_get_entry(dbd->driver, row, i));
-                i++;
+                j++;
             }
-#endif
-            dbd_password = apr_dbd_get_entry(dbd->driver, row, 0);
+            apr_table_set(r->subprocess_env, str, row[i]);
         }
-        /* we can't break out here or row won't get cleaned up */
     }
 
-    if (!dbd_password) {
-        return AUTH_USER_NOT_FOUND;
+    *value = row[0];
+    return *value ? AUTH_USER_FOUND : AUTH_USER_NOT_FOUND;
+}
+static authn_status authn_dbd_password(request_rec *r, const char *user,
+                                       const char *password)
+{
+    apr_status_t rv;
+    const char *dbd_password = NULL;
+    authn_status ret;
+
+    authn_dbd_conf *conf = ap_get_module_config(r->per_dir_config,
+                                                &authn_dbd_module);
+
+    if (conf->user == NULL) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01654)
+                      "No AuthDBDUserPWQuery has been specified");
+        return AUTH_GENERAL_ERROR;
+    }
+
+    ret = authn_dbd_lookup(r, conf->user, 1, &user, &dbd_password);
+    if (ret != AUTH_USER_FOUND) {
+        return ret;
     }
     AUTHN_CACHE_STORE(r, user, NULL, dbd_password);
 
@@ -190,86 +193,23 @@ static authn_status authn_dbd_password(request_rec *r, const char *user,
 static authn_status authn_dbd_realm(request_rec *r, const char *user,
                                     const char *realm, char **rethash)
 {
-    apr_status_t rv;
     const char *dbd_hash = NULL;
-    apr_dbd_prepared_t *statement;
-    apr_dbd_results_t *res = NULL;
-    apr_dbd_row_t *row = NULL;
-    int ret;
+    const char *args[2];
+    authn_status ret;
 
     authn_dbd_conf *conf = ap_get_module_config(r->per_dir_config,
                                                 &authn_dbd_module);
-    ap_dbd_t *dbd = authn_dbd_acquire_fn(r);
-    if (dbd == NULL) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01658)
-                      "Failed to acquire database connection to look up "
-                      "user '%s:%s'", user, realm);
-        return AUTH_GENERAL_ERROR;
-    }
     if (conf->realm == NULL) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01659)
                       "No AuthDBDUserRealmQuery has been specified");
         return AUTH_GENERAL_ERROR;
     }
-    statement = apr_hash_get(dbd->prepared, conf->realm, APR_HASH_KEY_STRING);
-    if (statement == NULL) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01660)
-                      "A prepared statement could not be found for "
-                      "AuthDBDUserRealmQuery with the key '%s'", conf->realm);
-        return AUTH_GENERAL_ERROR;
-    }
-    if ((ret = apr_dbd_pvselect(dbd->driver, r->pool, dbd->handle, &res,
-                                statement, 0, user, realm, NULL) != 0)) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01661)
-                      "Query execution error looking up '%s:%s' "
-                      "in database [%s]",
-                      user, realm,
-                      apr_dbd_error(dbd->driver, dbd->handle, ret));
-        return AUTH_GENERAL_ERROR;
-    }
-    for (rv = apr_dbd_get_row(dbd->driver, r->pool, res, &row, -1);
-         rv != -1;
-         rv = apr_dbd_get_row(dbd->driver, r->pool, res, &row, -1)) {
-        if (rv != 0) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01662)
-                          "Error retrieving results while looking up '%s:%s' "
-                          "in database", user, realm);
-            return AUTH_GENERAL_ERROR;
-        }
-        if (dbd_hash == NULL) {
-#if APU_MAJOR_VERSION > 1 || (APU_MAJOR_VERSION == 1 && APU_MINOR_VERSION >= 3)
-            /* add the rest of the columns to the environment */
-            int i = 1;
-            const char *name;
-            for (name = apr_dbd_get_name(dbd->driver, res, i);
-                 name != NULL;
-                 name = apr_dbd_get_name(dbd->driver, res, i)) {
 
-                char *str = apr_pstrcat(r->pool, AUTHN_PREFIX,
-                                        name,
-                                        NULL);
-                int j = sizeof(AUTHN_PREFIX)-1; /* string length of "AUTHENTICATE_", excluding the trailing NIL */
-                while (str[j]) {
-                    if (!apr_isalnum(str[j])) {
-                        str[j] = '_';
-                    }
-                    else {
-                        str[j] = apr_toupper(str[j]);
-                    }
-                    j++;
-                }
-                apr_table_set(r->subprocess_env, str,
-                              apr_dbd_get_entry(dbd->driver, row, i));
-                i++;
-            }
-#endif
-            dbd_hash = apr_dbd_get_entry(dbd->driver, row, 0);
-        }
-        /* we can't break out here or row won't get cleaned up */
-    }
-
-    if (!dbd_hash) {
-        return AUTH_USER_NOT_FOUND;
+    args[0] = user;
+    args[1] = realm;
+    ret = authn_dbd_lookup(r, conf->realm, 2, args, &dbd_hash);
+    if (ret != AUTH_USER_FOUND) {
+        return ret;
     }
     AUTHN_CACHE_STORE(r, user, realm, dbd_hash);
     *rethash = apr_pstrdup(r->pool, dbd_hash);
@@ -15,6 +15,10 @@
  */
 
 #include "apr_strings.h"
+#include "apr_hash.h"
+#if APR_HAS_THREADS
+#include "apr_thread_rwlock.h"
+#endif
 
 #include "ap_config.h"
 #include "ap_provider.h"
@@ -29,8 +33,40 @@
 
 typedef struct {
     char *pwfile;
+    /* how often to stat a cached file, or < 0 to not cache it */
+    apr_interval_time_t cache_interval;
+    unsigned int cache_interval_set:1;
 } authn_file_config_rec;
 
+/*
+ * With AuthUserFileCache, every child process keeps the parsed contents of
+ * each password file it uses, indexed by user.  Users defined more than
+ * once keep all their lines in file order, so that lookups find the same
+ * line as a scan of the file would.
+ */
+typedef struct authn_file_line_t authn_file_line_t;
+struct authn_file_line_t {
+    /* the second field: the password hash, or the realm for htdigest */
+    const char *field2;
+    /* the third field: the htdigest hash */
+    const char *field3;
+    authn_file_line_t *next;
+};
+
+typedef struct {
+    apr_pool_t *pool;
+    apr_hash_t *users;
+    apr_time_t mtime;
+    apr_off_t size;
+    apr_time_t checked;
+} authn_file_cache_t;
+
+static apr_pool_t *cache_pool;
+static apr_hash_t *cache_files;
+#if APR_HAS_THREADS
+static apr_thread_rwlock_t *cache_lock;
+#endif
+
 static APR_OPTIONAL_FN_TYPE(ap_authn_cache_store) *authn_cache_store = NULL;
 #define AUTHN_CACHE_STORE(r,user,realm,data) \
     if (authn_cache_store != NULL) \
@@ -41,19 +77,213 @@ static void *create_authn_file_dir_config(apr_pool_t *p, char *d)
     authn_file_config_rec *conf = apr_palloc(p, sizeof(*conf));
 
     conf->pwfile = NULL;     /* just to illustrate the default really */
+    conf->cache_interval = -1;
+    conf->cache_interval_set = 0;
     return conf;
 }
 
+static void *merge_authn_file_dir_config(apr_pool_t *p, void *basev,
+                                         void *addv)
+{
+    authn_file_config_rec *base = basev;
+    authn_file_config_rec *add = addv;
+    authn_file_config_rec *conf = apr_palloc(p, sizeof(*conf));
+
+    conf->pwfile = add->pwfile ? add->pwfile : base->pwfile;
+    conf->cache_interval = add->cache_interval_set ? add->cache_interval
+                                                   : base->cache_interval;
+    conf->cache_interval_set = add->cache_interval_set
+                               || base->cache_interval_set;
+    return conf;
+}
+
+static const char *set_cache_interval(cmd_parms *cmd, void *config,
+                                      const char *arg)
+{
+    authn_file_config_rec *conf = config;
+    char *endptr;
+    long secs;
+
+    if (!strcasecmp(arg, "off")) {
+        conf->cache_interval = -1;
+    }
+    else {
+        secs = strtol(arg, &endptr, 10);
+        if (*endptr || endptr == arg || secs < 0) {
+            return "AuthUserFileCache must be 'Off' or a number of seconds";
+        }
+        conf->cache_interval = apr_time_from_sec(secs);
+    }
+    conf->cache_interval_set = 1;
+    return NULL;
+}
+
 static const command_rec authn_file_cmds[] =
 {
     AP_INIT_TAKE1("AuthUserFile", ap_set_file_slot,
                   (void *)APR_OFFSETOF(authn_file_config_rec, pwfile),
                   OR_AUTHCFG, "text file containing user IDs and passwords"),
+    AP_INIT_TAKE1("AuthUserFileCache", set_cache_interval, NULL, OR_AUTHCFG,
+                  "'Off', or keep the AuthUserFile in memory and check it "
+                  "for changes at most every given number of seconds"),
     {NULL}
 };
 
 module AP_MODULE_DECLARE_DATA authn_file_module;
 
+static apr_status_t cache_load(authn_file_cache_t *cache, const char *fname)
+{
+    ap_configfile_t *f;
+    char l[MAX_STRING_LEN];
+    apr_pool_t *p;
+    apr_hash_t *users;
+    apr_status_t status;
+
+    apr_pool_create(&p, cache_pool);
+    apr_pool_tag(p, "authn_file_cache");
+
+    status = ap_pcfg_openfile(&f, p, fname);
+    if (status != APR_SUCCESS) {
+        apr_pool_destroy(p);
+        return status;
+    }
+
+    users = apr_hash_make(p);
+    while (!(ap_cfg_getline(l, MAX_STRING_LEN, f))) {
+        const char *rpw, *w;
+        authn_file_line_t *line, *last;
+
+        /* Skip # or blank lines. */
+        if ((l[0] == '#') || (!l[0])) {
+            continue;
+        }
+
+        rpw = l;
+        w = ap_getword(p, &rpw, ':');
+
+        line = apr_palloc(p, sizeof(*line));
+        line->field2 = ap_getword(p, &rpw, ':');
+        line->field3 = ap_getword(p, &rpw, ':');
+        line->next = NULL;
+
+        last = apr_hash_get(users, w, APR_HASH_KEY_STRING);
+        if (!last) {
+            apr_hash_set(users, w, APR_HASH_KEY_STRING, line);
+        }
+        else {
+            while (last->next) {
+                last = last->next;
+            }
+            last->next = line;
+        }
+    }
+    ap_cfg_closefile(f);
+
+    if (cache->pool) {
+        apr_pool_destroy(cache->pool);
+    }
+    cache->pool = p;
+    cache->users = users;
+
+    return APR_SUCCESS;
+}
+
+/* Find the cached copy of the file, and stat and reload it if it is due
+ * for a check.  Called with cache_lock held exclusively.
+ */
+static apr_status_t cache_refresh(request_rec *r, authn_file_config_rec *conf,
+                                  apr_time_t now, authn_file_cache_t **out)
+{
+    authn_file_cache_t *cache;
+    apr_status_t status = APR_SUCCESS;
+
+    cache = apr_hash_get(cache_files, conf->pwfile, APR_HASH_KEY_STRING);
+    if (!cache) {
+        cache = apr_pcalloc(cache_pool, sizeof(*cache));
+        apr_hash_set(cache_files, apr_pstrdup(cache_pool, conf->pwfile),
+                     APR_HASH_KEY_STRING, cache);
+    }
+
+    if (!cache->pool || now - cache->checked >= conf->cache_interval) {
+        apr_finfo_t finfo;
+
+        status = apr_stat(&finfo, conf->pwfile,
+                          APR_FINFO_MTIME | APR_FINFO_SIZE, r->pool);
+        if (status == APR_SUCCESS
+            && (!cache->pool || finfo.mtime != cache->mtime
+                || finfo.size != cache->size)) {
+            status = cache_load(cache, conf->pwfile);
+            if (status == APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02825)
+                              "loaded password file %s into memory, "
+                              "%u users", conf->pwfile,
+                              apr_hash_count(cache->users));
+                cache->mtime = finfo.mtime;
+                cache->size = finfo.size;
+            }
+        }
+        if (status == APR_SUCCESS) {
+            cache->checked = now;
+        }
+    }
+
+    *out = cache;
+    return status;
+}
+
+/*
+ * Look up the second field of the first line for user, or if realm is
+ * given the third field of the first line for user and realm, in the
+ * cached copy of the password file.  The result is copied to r->pool.
+ */
+static apr_status_t cache_lookup(request_rec *r, authn_file_config_rec *conf,
+                                 const char *user, const char *realm,
+                                 char **result)
+{
+    authn_file_cache_t *cache;
+    authn_file_line_t *line;
+    apr_time_t now = apr_time_now();
+    apr_status_t status = APR_SUCCESS;
+
+    *result = NULL;
+
+#if APR_HAS_THREADS
+    /* Lookups share the lock.  Only a thread which finds the copy due
+     * for a check takes it exclusively, to stat and maybe reload the file.
+     */
+    apr_thread_rwlock_rdlock(cache_lock);
+    cache = apr_hash_get(cache_files, conf->pwfile, APR_HASH_KEY_STRING);
+    if (!cache || !cache->pool
+        || now - cache->checked >= conf->cache_interval) {
+        apr_thread_rwlock_unlock(cache_lock);
+        apr_thread_rwlock_wrlock(cache_lock);
+        status = cache_refresh(r, conf, now, &cache);
+    }
+#else
+    status = cache_refresh(r, conf, now, &cache);
+#endif
+
+    if (status == APR_SUCCESS) {
+        line = apr_hash_get(cache->users, user, APR_HASH_KEY_STRING);
+        for (; line; line = line->next) {
+            if (!realm) {
+                *result = apr_pstrdup(r->pool, line->field2);
+                break;
+            }
+            if (!strcmp(realm, line->field2)) {
+                *result = apr_pstrdup(r->pool, line->field3);
+                break;
+            }
+        }
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(cache_lock);
+#endif
+
+    return status;
+}
+
 static authn_status check_password(request_rec *r, const char *user,
                                    const char *password)
 {
@@ -70,6 +300,16 @@ static authn_status check_password(request_rec *r, const char *user,
         return AUTH_GENERAL_ERROR;
     }
 
+    if (conf->cache_interval >= 0) {
+        status = cache_lookup(r, conf, user, NULL, &file_password);
+        if (status != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(02867)
+                          "Could not open password file: %s", conf->pwfile);
+            return AUTH_GENERAL_ERROR;
+        }
+        goto found;
+    }
+
     status = ap_pcfg_openfile(&f, r->pool, conf->pwfile);
 
     if (status != APR_SUCCESS) {
@@ -96,6 +336,7 @@ static authn_status check_password(request_rec *r, const char *user,
     }
     ap_cfg_closefile(f);
 
+found:
     if (!file_password) {
         return AUTH_USER_NOT_FOUND;
     }
@@ -125,6 +366,16 @@ static authn_status get_realm_hash(request_rec *r, const char *user,
         return AUTH_GENERAL_ERROR;
     }
 
+    if (conf->cache_interval >= 0) {
+        status = cache_lookup(r, conf, user, realm, &file_hash);
+        if (status != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(02868)
+                          "Could not open password file: %s", conf->pwfile);
+            return AUTH_GENERAL_ERROR;
+        }
+        goto found;
+    }
+
     status = ap_pcfg_openfile(&f, r->pool, conf->pwfile);
 
     if (status != APR_SUCCESS) {
@@ -153,6 +404,7 @@ static authn_status get_realm_hash(request_rec *r, const char *user,
     }
     ap_cfg_closefile(f);
 
+found:
     if (!file_hash) {
         return AUTH_USER_NOT_FOUND;
     }
@@ -173,19 +425,39 @@ static void opt_retr(void)
 {
     authn_cache_store = APR_RETRIEVE_OPTIONAL_FN(ap_authn_cache_store);
 }
+
+static void authn_file_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_allocator_t *allocator;
+
+    /* the cache is only ever changed with cache_lock held exclusively,
+     * give it its own allocator so that it doesn't race with other users
+     * of pchild
+     */
+    apr_allocator_create(&allocator);
+    apr_pool_create_ex(&cache_pool, p, NULL, allocator);
+    apr_allocator_owner_set(allocator, cache_pool);
+    apr_pool_tag(cache_pool, "authn_file_cache");
+    cache_files = apr_hash_make(cache_pool);
+#if APR_HAS_THREADS
+    apr_thread_rwlock_create(&cache_lock, p);
+#endif
+}
+
 static void register_hooks(apr_pool_t *p)
 {
     ap_register_auth_provider(p, AUTHN_PROVIDER_GROUP, "file",
                               AUTHN_PROVIDER_VERSION,
                               &authn_file_provider, AP_AUTH_INTERNAL_PER_CONF);
     ap_hook_optional_fn_retrieve(opt_retr, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(authn_file_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 AP_DECLARE_MODULE(authn_file) =
 {
     STANDARD20_MODULE_STUFF,
     create_authn_file_dir_config,    /* dir config creater */
-    NULL,                            /* dir merger --- default is to override */
+    merge_authn_file_dir_config,     /* dir merger */
     NULL,                            /* server config */
     NULL,                            /* merge server config */
     authn_file_cmds,                 /* command apr_table_t */
@@ -15,6 +15,11 @@
  */
 
 #include "apr_strings.h"
+#include "apr_sha1.h"
+#if APR_HAS_THREADS
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#endif
 
 #include "ap_config.h"
 #include "ap_provider.h"
@@ -37,6 +42,9 @@ typedef struct authn_cache_dircfg {
     apr_interval_time_t timeout;
     apr_array_header_t *providers;
     const char *context;
+    /* how long to remember a successful password check, 0 to not */
+    apr_interval_time_t verified_timeout;
+    unsigned int verified_timeout_set:1;
 } authn_cache_dircfg;
 
 /* FIXME:
@@ -48,6 +56,28 @@ static ap_socache_instance_t *socache_instance = NULL;
 static const char *const authn_cache_id = "authn-socache";
 static int configured;
 
+/*
+ * Successful password checks are remembered under a keyed hash of the
+ * cache key, the password and the stored hash, so that neither the
+ * password nor anything that could be used to test guesses against it
+ * is ever written to the cache.  A changed stored hash yields a new key.
+ */
+#define VERIFIED_SECRET_LEN 32
+#define VERIFIED_RETAINED_ID "mod_authn_socache_verified_secret"
+static unsigned char *verified_secret;
+
+/*
+ * Limit on the number of password checks run at the same time in a child
+ * process on a cache miss, so that a flood of bad passwords against an
+ * expensive hash can't occupy every CPU.
+ */
+static int verify_limit = 0;
+#if APR_HAS_THREADS
+static int verify_active;
+static apr_thread_mutex_t *verify_mutex;
+static apr_thread_cond_t *verify_cond;
+#endif
+
 static apr_status_t remove_lock(void *data)
 {
     if (authn_cache_mutex) {
@@ -79,6 +109,19 @@ static int authn_cache_precfg(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *p
                                           AP_SOCACHE_DEFAULT_PROVIDER,
                                           AP_SOCACHE_PROVIDER_VERSION);
     configured = 0;
+    verify_limit = 0;
+
+    verified_secret = ap_retained_data_get(VERIFIED_RETAINED_ID);
+    if (verified_secret == NULL) {
+        verified_secret = ap_retained_data_create(VERIFIED_RETAINED_ID,
+                                                  VERIFIED_SECRET_LEN);
+        rv = apr_generate_random_bytes(verified_secret, VERIFIED_SECRET_LEN);
+        if (rv != APR_SUCCESS) {
+            ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog, APLOGNO(02827)
+                          "failed to generate secret for %s", authn_cache_id);
+            return 500; /* An HTTP status would be a misnomer! */
+        }
+    }
     return OK;
 }
 static int authn_cache_post_config(apr_pool_t *pconf, apr_pool_t *plog,
@@ -145,6 +188,13 @@ static void authn_cache_child_init(apr_pool_t *p, server_rec *s)
         ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(01678)
                      "failed to initialise mutex in child_init");
     }
+#if APR_HAS_THREADS
+    if (verify_limit > 0) {
+        verify_active = 0;
+        apr_thread_mutex_create(&verify_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+        apr_thread_cond_create(&verify_cond, p);
+    }
+#endif
 }
 
 static const char *authn_cache_socache(cmd_parms *cmd, void *CFG,
@@ -199,6 +249,8 @@ static void* authn_cache_dircfg_create(apr_pool_t *pool, char *s)
     ret->timeout = apr_time_from_sec(300);
     ret->providers = NULL;
     ret->context = directory;
+    ret->verified_timeout = 0;
+    ret->verified_timeout_set = 0;
     return ret;
 }
 /* not sure we want this.  Might be safer to document use-all-or-none */
@@ -217,6 +269,10 @@ static void* authn_cache_dircfg_merge(apr_pool_t *pool, void *BASE, void *ADD)
     if (add->providers == NULL) {
         ret->providers = base->providers;
     }
+    if (!add->verified_timeout_set) {
+        ret->verified_timeout = base->verified_timeout;
+        ret->verified_timeout_set = base->verified_timeout_set;
+    }
     return ret;
 }
 
@@ -241,6 +297,32 @@ static const char *authn_cache_timeout(cmd_parms *cmd, void *CFG,
     return NULL;
 }
 
+static const char *authn_cache_verified_timeout(cmd_parms *cmd, void *CFG,
+                                                const char *arg)
+{
+    authn_cache_dircfg *cfg = CFG;
+    int secs = atoi(arg);
+    if (secs < 0) {
+        return "AuthnCacheVerifiedTimeout must not be negative";
+    }
+    cfg->verified_timeout = apr_time_from_sec(secs);
+    cfg->verified_timeout_set = 1;
+    return NULL;
+}
+
+static const char *authn_cache_verify_limit(cmd_parms *cmd, void *CFG,
+                                            const char *arg)
+{
+    const char *errmsg = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (errmsg)
+        return errmsg;
+    verify_limit = atoi(arg);
+    if (verify_limit < 0) {
+        return "AuthnCacheVerifyLimit must not be negative";
+    }
+    return NULL;
+}
+
 static const command_rec authn_cache_cmds[] =
 {
     /* global stuff: cache and mutex */
@@ -248,6 +330,9 @@ static const command_rec authn_cache_cmds[] =
                   "socache provider for authn cache"),
     AP_INIT_NO_ARGS("AuthnCacheEnable", authn_cache_enable, NULL, RSRC_CONF,
                     "enable socache configuration in htaccess even if not enabled anywhere else"),
+    AP_INIT_TAKE1("AuthnCacheVerifyLimit", authn_cache_verify_limit, NULL,
+                  RSRC_CONF, "Maximum number of concurrent password checks "
+                  "on cache misses per child process, 0 for no limit"),
     /* per-dir stuff */
     AP_INIT_ITERATE("AuthnCacheProvideFor", authn_cache_setprovider, NULL,
                     OR_AUTHCFG, "Determine what authn providers to cache for"),
@@ -256,6 +341,9 @@ static const command_rec authn_cache_cmds[] =
     AP_INIT_TAKE1("AuthnCacheContext", ap_set_string_slot,
                   (void*)APR_OFFSETOF(authn_cache_dircfg, context),
                   ACCESS_CONF, "Context for authn cache"),
+    AP_INIT_TAKE1("AuthnCacheVerifiedTimeout", authn_cache_verified_timeout,
+                  NULL, OR_AUTHCFG, "Timeout (secs) for remembering "
+                  "successful password checks, 0 to disable"),
     {NULL}
 };
 
@@ -355,6 +443,101 @@ static void ap_authn_cache_store(request_rec *r, const char *module,
 }
 
 #define MAX_VAL_LEN 100
+
+/* HMAC-SHA1 (RFC 2104) of the key, password and hash, as a cache key */
+static const char *construct_verified_key(request_rec *r, const char *key,
+                                          const char *password,
+                                          const char *hash)
+{
+    apr_sha1_ctx_t ctx;
+    unsigned char pad[64];
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    char *vkey;
+    apr_size_t i;
+
+    /* VERIFIED_SECRET_LEN is shorter than the SHA-1 block size */
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, verified_secret, VERIFIED_SECRET_LEN);
+    for (i = 0; i < sizeof(pad); i++) {
+        pad[i] ^= 0x36;
+    }
+    apr_sha1_init(&ctx);
+    apr_sha1_update_binary(&ctx, pad, sizeof(pad));
+    apr_sha1_update_binary(&ctx, (const unsigned char *)key, strlen(key) + 1);
+    apr_sha1_update_binary(&ctx, (const unsigned char *)password,
+                           strlen(password) + 1);
+    apr_sha1_update_binary(&ctx, (const unsigned char *)hash, strlen(hash));
+    apr_sha1_final(digest, &ctx);
+
+    for (i = 0; i < sizeof(pad); i++) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    apr_sha1_init(&ctx);
+    apr_sha1_update_binary(&ctx, pad, sizeof(pad));
+    apr_sha1_update_binary(&ctx, digest, sizeof(digest));
+    apr_sha1_final(digest, &ctx);
+
+    vkey = apr_palloc(r->pool, 2 + 2 * sizeof(digest) + 1);
+    vkey[0] = 'v';
+    vkey[1] = ':';
+    ap_bin2hex(digest, sizeof(digest), vkey + 2);
+    return vkey;
+}
+
+static apr_status_t limited_password_validate(request_rec *r,
+                                              const char *user,
+                                              const char *password,
+                                              const char *hash)
+{
+    apr_status_t rv;
+
+#if APR_HAS_THREADS
+    if (verify_limit > 0) {
+        apr_thread_mutex_lock(verify_mutex);
+        while (verify_active >= verify_limit) {
+            apr_thread_cond_wait(verify_cond, verify_mutex);
+        }
+        verify_active++;
+        apr_thread_mutex_unlock(verify_mutex);
+    }
+#endif
+
+    rv = ap_password_validate(r, user, password, hash);
+
+#if APR_HAS_THREADS
+    if (verify_limit > 0) {
+        apr_thread_mutex_lock(verify_mutex);
+        verify_active--;
+        apr_thread_cond_signal(verify_cond);
+        apr_thread_mutex_unlock(verify_mutex);
+    }
+#endif
+
+    return rv;
+}
+
+static void store_verified(request_rec *r, authn_cache_dircfg *dcfg,
+                           const char *user, const char *vkey)
+{
+    apr_status_t rv;
+    static const unsigned char ok[] = "1";
+
+    /* as in ap_authn_cache_store(), don't wait for a busy mutex */
+    rv = apr_global_mutex_trylock(authn_cache_mutex);
+    if (rv != APR_SUCCESS) {
+        return;
+    }
+    rv = socache_provider->store(socache_instance, r->server,
+                                 (unsigned char*)vkey, strlen(vkey),
+                                 apr_time_now() + dcfg->verified_timeout,
+                                 (unsigned char*)ok, sizeof(ok) - 1, r->pool);
+    if (rv == APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02828)
+                      "Authn cache: remembered verified password for %s",
+                      user);
+    }
+    apr_global_mutex_unlock(authn_cache_mutex);
+}
 static authn_status check_password(request_rec *r, const char *user,
                                    const char *password)
 {
@@ -403,7 +586,31 @@ static authn_status check_password(request_rec *r, const char *user,
         return AUTH_USER_NOT_FOUND;
     }
 
-    rv = ap_password_validate(r, user, password, (char*) val);
+    if (dcfg->verified_timeout > 0) {
+        const char *vkey = construct_verified_key(r, key, password,
+                                                  (char*) val);
+        unsigned char vval[8];
+        unsigned int vvallen = sizeof(vval);
+
+        rv = socache_provider->retrieve(socache_instance, r->server,
+                                        (unsigned char*)vkey, strlen(vkey),
+                                        vval, &vvallen, r->pool);
+        if (rv == APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02829)
+                          "Authn cache: password for %s verified before",
+                          user);
+            return AUTH_GRANTED;
+        }
+
+        rv = limited_password_validate(r, user, password, (char*) val);
+        if (rv != APR_SUCCESS) {
+            return AUTH_DENIED;
+        }
+        store_verified(r, dcfg, user, vkey);
+        return AUTH_GRANTED;
+    }
+
+    rv = limited_password_validate(r, user, password, (char*) val);
     if (rv != APR_SUCCESS) {
         return AUTH_DENIED;
     }
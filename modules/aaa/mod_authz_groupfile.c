@@ -43,6 +43,10 @@
 
 #include "apr_strings.h"
 #include "apr_lib.h" /* apr_isspace */
+#include "apr_hash.h"
+#if APR_HAS_THREADS
+#include "apr_thread_rwlock.h"
+#endif
 
 #include "ap_config.h"
 #include "ap_provider.h"
@@ -59,22 +63,85 @@
 
 typedef struct {
     char *groupfile;
+    /* how often to stat a cached file, or < 0 to not cache it */
+    apr_interval_time_t cache_interval;
+    unsigned int cache_interval_set:1;
 } authz_groupfile_config_rec;
 
+/*
+ * With AuthGroupFileCache, every child process keeps the parsed contents
+ * of each group file it uses, as a hash of users to the array of groups
+ * they are a member of.
+ */
+typedef struct {
+    apr_pool_t *pool;
+    apr_hash_t *users;
+    apr_time_t mtime;
+    apr_off_t size;
+    apr_time_t checked;
+} authz_groupfile_cache_t;
+
+static apr_pool_t *cache_pool;
+static apr_hash_t *cache_files;
+#if APR_HAS_THREADS
+static apr_thread_rwlock_t *cache_lock;
+#endif
+
 static void *create_authz_groupfile_dir_config(apr_pool_t *p, char *d)
 {
     authz_groupfile_config_rec *conf = apr_palloc(p, sizeof(*conf));
 
     conf->groupfile = NULL;
+    conf->cache_interval = -1;
+    conf->cache_interval_set = 0;
+    return conf;
+}
+
+static void *merge_authz_groupfile_dir_config(apr_pool_t *p, void *basev,
+                                              void *addv)
+{
+    authz_groupfile_config_rec *base = basev;
+    authz_groupfile_config_rec *add = addv;
+    authz_groupfile_config_rec *conf = apr_palloc(p, sizeof(*conf));
+
+    conf->groupfile = add->groupfile ? add->groupfile : base->groupfile;
+    conf->cache_interval = add->cache_interval_set ? add->cache_interval
+                                                   : base->cache_interval;
+    conf->cache_interval_set = add->cache_interval_set
+                               || base->cache_interval_set;
     return conf;
 }
 
+static const char *set_cache_interval(cmd_parms *cmd, void *config,
+                                      const char *arg)
+{
+    authz_groupfile_config_rec *conf = config;
+    char *endptr;
+    long secs;
+
+    if (!strcasecmp(arg, "off")) {
+        conf->cache_interval = -1;
+    }
+    else {
+        secs = strtol(arg, &endptr, 10);
+        if (*endptr || endptr == arg || secs < 0) {
+            return "AuthGroupFileCache must be 'Off' or a number of seconds";
+        }
+        conf->cache_interval = apr_time_from_sec(secs);
+    }
+    conf->cache_interval_set = 1;
+    return NULL;
+}
+
 static const command_rec authz_groupfile_cmds[] =
 {
     AP_INIT_TAKE1("AuthGroupFile", ap_set_file_slot,
                   (void *)APR_OFFSETOF(authz_groupfile_config_rec, groupfile),
                   OR_AUTHCFG,
                   "text file containing group names and member user IDs"),
+    AP_INIT_TAKE1("AuthGroupFileCache", set_cache_interval, NULL, OR_AUTHCFG,
+                  "'Off', or keep the AuthGroupFile in memory and check it "
+                  "for changes at most every given number of seconds"),
     {NULL}
 };
 
@@ -131,6 +198,164 @@ static apr_status_t groups_for_user(apr_pool_t *p, char *user, char *grpfile,
     return APR_SUCCESS;
 }
 
+static apr_status_t cache_load(authz_groupfile_cache_t *cache,
+                               const char *grpfile)
+{
+    ap_configfile_t *f;
+    apr_pool_t *p, *sp;
+    apr_hash_t *users;
+    struct ap_varbuf vb;
+    const char *group_name, *ll, *w;
+    apr_status_t status;
+    apr_size_t group_len;
+
+    apr_pool_create(&p, cache_pool);
+    apr_pool_tag(p, "authz_groupfile_cache");
+
+    if ((status = ap_pcfg_openfile(&f, p, grpfile)) != APR_SUCCESS) {
+        apr_pool_destroy(p);
+        return status;
+    }
+
+    users = apr_hash_make(p);
+    apr_pool_create(&sp, p);
+    ap_varbuf_init(p, &vb, VARBUF_INIT_LEN);
+
+    while (!(ap_varbuf_cfg_getline(&vb, f, VARBUF_MAX_LEN))) {
+        if ((vb.buf[0] == '#') || (!vb.buf[0])) {
+            continue;
+        }
+        ll = vb.buf;
+        apr_pool_clear(sp);
+
+        group_name = ap_getword(sp, &ll, ':');
+        group_len = strlen(group_name);
+
+        while (group_len && apr_isspace(*(group_name + group_len - 1))) {
+            --group_len;
+        }
+        group_name = apr_pstrmemdup(p, group_name, group_len);
+
+        while (ll[0]) {
+            apr_array_header_t *groups;
+
+            w = ap_getword_conf(sp, &ll);
+            groups = apr_hash_get(users, w, APR_HASH_KEY_STRING);
+            if (!groups) {
+                groups = apr_array_make(p, 1, sizeof(const char *));
+                apr_hash_set(users, apr_pstrdup(p, w), APR_HASH_KEY_STRING,
+                             groups);
+            }
+            else if (APR_ARRAY_IDX(groups, groups->nelts - 1,
+                                   const char *) == group_name) {
+                /* listed twice in this group */
+                continue;
+            }
+            APR_ARRAY_PUSH(groups, const char *) = group_name;
+        }
+    }
+    ap_cfg_closefile(f);
+    apr_pool_destroy(sp);
+    ap_varbuf_free(&vb);
+
+    if (cache->pool) {
+        apr_pool_destroy(cache->pool);
+    }
+    cache->pool = p;
+    cache->users = users;
+
+    return APR_SUCCESS;
+}
+
+/* Find the cached copy of the file, and stat and reload it if it is due
+ * for a check.  Called with cache_lock held exclusively.
+ */
+static apr_status_t cache_refresh(request_rec *r,
+                                  authz_groupfile_config_rec *conf,
+                                  apr_time_t now,
+                                  authz_groupfile_cache_t **out)
+{
+    authz_groupfile_cache_t *cache;
+    apr_status_t status = APR_SUCCESS;
+
+    cache = apr_hash_get(cache_files, conf->groupfile, APR_HASH_KEY_STRING);
+    if (!cache) {
+        cache = apr_pcalloc(cache_pool, sizeof(*cache));
+        apr_hash_set(cache_files, apr_pstrdup(cache_pool, conf->groupfile),
+                     APR_HASH_KEY_STRING, cache);
+    }
+
+    if (!cache->pool || now - cache->checked >= conf->cache_interval) {
+        apr_finfo_t finfo;
+
+        status = apr_stat(&finfo, conf->groupfile,
+                          APR_FINFO_MTIME | APR_FINFO_SIZE, r->pool);
+        if (status == APR_SUCCESS
+            && (!cache->pool || finfo.mtime != cache->mtime
+                || finfo.size != cache->size)) {
+            status = cache_load(cache, conf->groupfile);
+            if (status == APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02826)
+                              "loaded group file %s into memory, "
+                              "%u users", conf->groupfile,
+                              apr_hash_count(cache->users));
+                cache->mtime = finfo.mtime;
+                cache->size = finfo.size;
+            }
+        }
+        if (status == APR_SUCCESS) {
+            cache->checked = now;
+        }
+    }
+
+    *out = cache;
+    return status;
+}
+
+/* As groups_for_user(), using the cached copy of the group file */
+static apr_status_t cached_groups_for_user(request_rec *r, char *user,
+                                           authz_groupfile_config_rec *conf,
+                                           apr_table_t **out)
+{
+    authz_groupfile_cache_t *cache;
+    apr_array_header_t *groups;
+    apr_table_t *grps = apr_table_make(r->pool, 15);
+    apr_time_t now = apr_time_now();
+    apr_status_t status = APR_SUCCESS;
+
+#if APR_HAS_THREADS
+    /* Lookups share the lock.  Only a thread which finds the copy due
+     * for a check takes it exclusively, to stat and maybe reload the file.
+     */
+    apr_thread_rwlock_rdlock(cache_lock);
+    cache = apr_hash_get(cache_files, conf->groupfile, APR_HASH_KEY_STRING);
+    if (!cache || !cache->pool
+        || now - cache->checked >= conf->cache_interval) {
+        apr_thread_rwlock_unlock(cache_lock);
+        apr_thread_rwlock_wrlock(cache_lock);
+        status = cache_refresh(r, conf, now, &cache);
+    }
+#else
+    status = cache_refresh(r, conf, now, &cache);
+#endif
+
+    if (status == APR_SUCCESS
+        && (groups = apr_hash_get(cache->users, user, APR_HASH_KEY_STRING))) {
+        int i;
+
+        for (i = 0; i < groups->nelts; i++) {
+            apr_table_set(grps, APR_ARRAY_IDX(groups, i, const char *), "in");
+        }
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(cache_lock);
+#endif
+
+    *out = grps;
+    return status;
+}
+
 static authz_status group_check_authorization(request_rec *r,
                                               const char *require_args,
                                               const void *parsed_require_args)
@@ -160,8 +385,13 @@ static authz_status group_check_authorization(request_rec *r,
         return AUTHZ_DENIED;
     }
 
-    status = groups_for_user(r->pool, user, conf->groupfile,
-                                &grpstatus);
+    if (conf->cache_interval >= 0) {
+        status = cached_groups_for_user(r, user, conf, &grpstatus);
+    }
+    else {
+        status = groups_for_user(r->pool, user, conf->groupfile,
+                                 &grpstatus);
+    }
 
     if (status != APR_SUCCESS) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(01665)
@@ -228,8 +458,13 @@ static authz_status filegroup_check_authorization(request_rec *r,
         return AUTHZ_DENIED;
     }
 
-    status = groups_for_user(r->pool, user, conf->groupfile,
-                             &grpstatus);
+    if (conf->cache_interval >= 0) {
+        status = cached_groups_for_user(r, user, conf, &grpstatus);
+    }
+    else {
+        status = groups_for_user(r->pool, user, conf->groupfile,
+                                 &grpstatus);
+    }
     if (status != APR_SUCCESS) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(01669)
                       "Could not open group file: %s",
@@ -306,6 +541,24 @@ static void authz_groupfile_getfns(void)
     authz_owner_get_file_group = APR_RETRIEVE_OPTIONAL_FN(authz_owner_get_file_group);
 }
 
+static void authz_groupfile_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_allocator_t *allocator;
+
+    /* the cache is only ever changed with cache_lock held exclusively,
+     * give it its own allocator so that it doesn't race with other users
+     * of pchild
+     */
+    apr_allocator_create(&allocator);
+    apr_pool_create_ex(&cache_pool, p, NULL, allocator);
+    apr_allocator_owner_set(allocator, cache_pool);
+    apr_pool_tag(cache_pool, "authz_groupfile_cache");
+    cache_files = apr_hash_make(cache_pool);
+#if APR_HAS_THREADS
+    apr_thread_rwlock_create(&cache_lock, p);
+#endif
+}
+
 static void register_hooks(apr_pool_t *p)
 {
     ap_register_auth_provider(p, AUTHZ_PROVIDER_GROUP, "group",
@@ -317,13 +570,14 @@ static void register_hooks(apr_pool_t *p)
                               &authz_filegroup_provider,
                               AP_AUTH_INTERNAL_PER_CONF);
     ap_hook_optional_fn_retrieve(authz_groupfile_getfns, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(authz_groupfile_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 AP_DECLARE_MODULE(authz_groupfile) =
 {
     STANDARD20_MODULE_STUFF,
     create_authz_groupfile_dir_config,/* dir config creater */
-    NULL,                             /* dir merger -- default is to override */
+    merge_authz_groupfile_dir_config, /* dir merger */
     NULL,                             /* server config */
     NULL,                             /* merge server config */
     authz_groupfile_cmds,             /* command apr_table_t */
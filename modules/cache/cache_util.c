@@ -17,6 +17,7 @@
 #include "mod_cache.h"
 
 #include "cache_util.h"
+#include "util_headers.h"
 #include <ap_provider.h>
 
 APLOG_USE_MODULE(cache);
@@ -523,6 +524,7 @@ int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
     apr_time_t age_c = 0;
     cache_info *info = &(h->cache_obj->info);
     const char *warn_head;
+    ap_headers_t *resp_hdrs;
     cache_server_conf *conf =
       (cache_server_conf *)ap_get_module_config(r->server->module_config,
                                                 &cache_module);
@@ -593,7 +595,10 @@ int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
         return 0;
     }
 
-    if ((agestr = apr_table_get(h->resp_hdrs, "Age"))) {
+    /* These come from the cached response, looked up several times. */
+    resp_hdrs = ap_headers_make(r->pool, h->resp_hdrs);
+
+    if ((agestr = ap_headers_get_id(resp_hdrs, AP_HEADER_AGE))) {
         age_c = apr_atoi64(agestr);
     }
 
@@ -674,12 +679,12 @@ int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
          (info->expire != APR_DATE_BAD) &&
          (age < (apr_time_sec(info->expire - info->date) + maxstale - minfresh)))) {
 
-        warn_head = apr_table_get(h->resp_hdrs, "Warning");
+        warn_head = ap_headers_get_id(resp_hdrs, AP_HEADER_WARNING);
 
         /* it's fresh darlings... */
         /* set age header on response */
-        apr_table_set(h->resp_hdrs, "Age",
-                      apr_psprintf(r->pool, "%lu", (unsigned long)age));
+        ap_headers_setn(resp_hdrs, "Age",
+                        apr_psprintf(r->pool, "%lu", (unsigned long)age));
 
         /* add warning if maxstale overrode freshness calculation */
         if (!(((maxage != -1) && age < maxage) ||
@@ -688,8 +693,8 @@ int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
             /* make sure we don't stomp on a previous warning */
             if ((warn_head == NULL) ||
                 ((warn_head != NULL) && (ap_strstr_c(warn_head, "110") == NULL))) {
-                apr_table_mergen(h->resp_hdrs, "Warning",
-                                 "110 Response is stale");
+                ap_headers_mergen(resp_hdrs, "Warning",
+                                  "110 Response is stale");
             }
         }
 
@@ -698,8 +703,8 @@ int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
          * s-maxage appears in the response, and the response header age
          * calculated is more than 24 hours add the warning 113
          */
-        if ((maxage_cresp == -1) && (smaxage == -1) && (apr_table_get(
-                h->resp_hdrs, "Expires") == NULL) && (age > 86400)) {
+        if ((maxage_cresp == -1) && (smaxage == -1) && (ap_headers_get_id(
+                resp_hdrs, AP_HEADER_EXPIRES) == NULL) && (age > 86400)) {
 
             /* Make sure we don't stomp on a previous warning, and don't dup
              * a 113 marning that is already present. Also, make sure to add
@@ -707,8 +712,8 @@ int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
              */
             if ((warn_head == NULL) ||
                 ((warn_head != NULL) && (ap_strstr_c(warn_head, "113") == NULL))) {
-                apr_table_mergen(h->resp_hdrs, "Warning",
-                                 "113 Heuristic expiration");
+                ap_headers_mergen(resp_hdrs, "Warning",
+                                  "113 Heuristic expiration");
             }
         }
         return 1;    /* Cache object is fresh (enough) */
@@ -761,11 +766,11 @@ int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
                 r->unparsed_uri);
 
         /* make sure we don't stomp on a previous warning */
-        warn_head = apr_table_get(h->resp_hdrs, "Warning");
+        warn_head = ap_headers_get_id(resp_hdrs, AP_HEADER_WARNING);
         if ((warn_head == NULL) ||
             ((warn_head != NULL) && (ap_strstr_c(warn_head, "110") == NULL))) {
-            apr_table_mergen(h->resp_hdrs, "Warning",
-                             "110 Response is stale");
+            ap_headers_mergen(resp_hdrs, "Warning",
+                              "110 Response is stale");
         }
 
         return 1;
@@ -1197,6 +1202,15 @@ CACHE_DECLARE(apr_table_t *)ap_cache_cacheable_headers(apr_pool_t *pool,
                                                         apr_table_t *t,
                                                         server_rec *s)
 {
+    static const ap_header_set_t hop_by_hop_hdrs =
+        AP_HEADER_BIT(AP_HEADER_CONNECTION)
+        | AP_HEADER_BIT(AP_HEADER_KEEP_ALIVE)
+        | AP_HEADER_BIT(AP_HEADER_PROXY_AUTHENTICATE)
+        | AP_HEADER_BIT(AP_HEADER_PROXY_AUTHORIZATION)
+        | AP_HEADER_BIT(AP_HEADER_TE)
+        | AP_HEADER_BIT(AP_HEADER_TRAILERS)
+        | AP_HEADER_BIT(AP_HEADER_TRANSFER_ENCODING)
+        | AP_HEADER_BIT(AP_HEADER_UPGRADE);
     cache_server_conf *conf;
     char **header;
     int i;
@@ -1214,15 +1228,7 @@ CACHE_DECLARE(apr_table_t *)ap_cache_cacheable_headers(apr_pool_t *pool,
      * 13.5.1 of RFC 2616
      */
     headers_out = apr_table_copy(pool, t);
-
-    apr_table_unset(headers_out, "Connection");
-    apr_table_unset(headers_out, "Keep-Alive");
-    apr_table_unset(headers_out, "Proxy-Authenticate");
-    apr_table_unset(headers_out, "Proxy-Authorization");
-    apr_table_unset(headers_out, "TE");
-    apr_table_unset(headers_out, "Trailers");
-    apr_table_unset(headers_out, "Transfer-Encoding");
-    apr_table_unset(headers_out, "Upgrade");
+    ap_headers_strip(headers_out, hop_by_hop_hdrs);
 
     conf = (cache_server_conf *)ap_get_module_config(s->module_config,
                                                      &cache_module);
@@ -17,11 +17,19 @@
 #include "httpd.h"
 #include "http_config.h"
 #include "http_log.h"
+#include "http_protocol.h"
 #include "apr_strings.h"
+#include "apr_atomic.h"
+#include "apr_shm.h"
+
+#define APR_WANT_BYTEFUNC
+#define APR_WANT_MEMFUNC
+#include "apr_want.h"
 
 #include "ap_mpm.h"
 #include "scoreboard.h"
 #include "mod_watchdog.h"
+#include "heartbeat.h"
 
 #ifndef HEARTBEAT_INTERVAL
 #define HEARTBEAT_INTERVAL (1)
@@ -36,12 +44,106 @@ typedef struct hb_ctx_t
     int server_limit;
     int thread_limit;
     apr_status_t status;
+    int binary;                       /* send the compact format */
+    apr_uint32_t *last_hist;          /* histogram at the last heartbeat */
+    unsigned long last_count;         /* requests at the last heartbeat */
+    apr_time_t last_time;
 } hb_ctx_t;
 
-static const char *msg_format = "v=%u&ready=%u&busy=%u";
+/*
+ * The duration of every request is counted in a histogram in shared
+ * memory, from which the watchdog takes the percentiles of the requests
+ * completed in each interval.  Durations in milliseconds below 16 have a
+ * bucket each; above, each power of two is split in 8 buckets, so a
+ * percentile is off by at most 1/8.  The histogram is created once in the
+ * process pool, so that the children of the previous generation keep
+ * counting into it after a graceful restart.
+ */
+#define HB_HIST_LINEAR   16
+#define HB_HIST_SUB_BITS 3
+#define HB_HIST_MAX_EXP  24           /* up to 2^25 ms, about 9 hours */
+#define HB_HIST_BUCKETS  (HB_HIST_LINEAR + (HB_HIST_MAX_EXP - 3) \
+                                           * (1 << HB_HIST_SUB_BITS))
+#define HB_HIST_RETAINED_ID "mod_heartbeat-histogram"
+
+static apr_uint32_t *hb_hist = NULL;
+
+static const char *msg_format = "v=%u&ready=%u&busy=%u"
+                                "&load=%d.%02d&rps=%u&p50=%u&p90=%u&p99=%u";
 
 #define MSG_VERSION (1)
 
+static int hb_hist_bucket(apr_uint64_t ms)
+{
+    int e = 3;
+
+    if (ms < HB_HIST_LINEAR) {
+        return (int)ms;
+    }
+    while (e < HB_HIST_MAX_EXP && (ms >> (e + 1)) != 0) {
+        e++;
+    }
+    if ((ms >> (e + 1)) != 0) {
+        return HB_HIST_BUCKETS - 1;
+    }
+    return HB_HIST_LINEAR + (e - 4) * (1 << HB_HIST_SUB_BITS)
+           + (int)((ms >> (e - HB_HIST_SUB_BITS))
+                   & ((1 << HB_HIST_SUB_BITS) - 1));
+}
+
+/* the upper bound of a bucket, in milliseconds */
+static apr_uint32_t hb_hist_value(int b)
+{
+    int e, sub;
+
+    if (b < HB_HIST_LINEAR) {
+        return b;
+    }
+    e = 4 + (b - HB_HIST_LINEAR) / (1 << HB_HIST_SUB_BITS);
+    sub = (b - HB_HIST_LINEAR) % (1 << HB_HIST_SUB_BITS);
+    return ((apr_uint32_t)((1 << HB_HIST_SUB_BITS) + sub + 1)
+            << (e - HB_HIST_SUB_BITS)) - 1;
+}
+
+/* the p-th percentile of the n requests counted in hist */
+static apr_uint32_t hb_percentile(const apr_uint32_t *hist, apr_uint32_t n,
+                                  int p)
+{
+    apr_uint64_t rank;
+    apr_uint32_t seen = 0;
+    int b;
+
+    if (n == 0) {
+        return 0;
+    }
+    rank = ((apr_uint64_t)n * p + 99) / 100;
+    for (b = 0; b < HB_HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    return hb_hist_value(b < HB_HIST_BUCKETS ? b : HB_HIST_BUCKETS - 1);
+}
+
+static int hb_log_transaction(request_rec *r)
+{
+    if (hb_hist) {
+        apr_time_t spent = apr_time_now() - r->request_time;
+
+        apr_atomic_inc32(&hb_hist[hb_hist_bucket(spent > 0
+                                                 ? apr_time_as_msec(spent)
+                                                 : 0)]);
+    }
+    return DECLINED;
+}
+
+static void hb_put32(char *buf, apr_uint32_t v)
+{
+    v = htonl(v);
+    memcpy(buf, &v, sizeof(v));
+}
+
 static int hb_monitor(hb_ctx_t *ctx, apr_pool_t *p)
 {
     apr_size_t len;
@@ -50,6 +152,11 @@ static int hb_monitor(hb_ctx_t *ctx, apr_pool_t *p)
     int i, j;
     apr_uint32_t ready = 0;
     apr_uint32_t busy = 0;
+    apr_uint32_t rps = 0, p50 = 0, p90 = 0, p99 = 0;
+    unsigned long count = 0;
+    ap_loadavg_t la;
+    int load;
+    apr_time_t now = apr_time_now();
     ap_generation_t mpm_generation;
 
     ap_mpm_query(AP_MPMQ_GENERATION, &mpm_generation);
@@ -75,10 +182,61 @@ static int hb_monitor(hb_ctx_t *ctx, apr_pool_t *p)
                      ps->generation == mpm_generation) {
                 busy++;
             }
+
+            count += ws->access_count;
         }
     }
 
-    len = apr_snprintf(buf, sizeof(buf), msg_format, MSG_VERSION, ready, busy);
+    /* the requests counted since the previous heartbeat; the counters
+     * only ever grow, so unsigned differences are right across wraps */
+    if (hb_hist) {
+        apr_uint32_t delta[HB_HIST_BUCKETS];
+        apr_uint32_t n = 0;
+
+        for (i = 0; i < HB_HIST_BUCKETS; i++) {
+            apr_uint32_t cur = apr_atomic_read32(&hb_hist[i]);
+
+            delta[i] = cur - ctx->last_hist[i];
+            ctx->last_hist[i] = cur;
+            n += delta[i];
+        }
+        if (ctx->last_time) {
+            p50 = hb_percentile(delta, n, 50);
+            p90 = hb_percentile(delta, n, 90);
+            p99 = hb_percentile(delta, n, 99);
+        }
+    }
+
+    /* access counts restart with their process; don't report garbage */
+    if (ctx->last_time && count > ctx->last_count
+        && now > ctx->last_time) {
+        rps = (apr_uint32_t)((count - ctx->last_count) * APR_USEC_PER_SEC
+                             / (now - ctx->last_time));
+    }
+    ctx->last_count = count;
+    ctx->last_time = now;
+
+    ap_get_loadavg(&la);
+    load = la.loadavg >= 0 ? (int)(la.loadavg * 100 + 0.5) : 0;
+
+    if (ctx->binary) {
+        memcpy(buf, "\0HB", 3);
+        buf[3] = HM_BINARY_VERSION;
+        hb_put32(buf + 4, ready);
+        hb_put32(buf + 8, busy);
+        hb_put32(buf + 12, 0);
+        hb_put32(buf + 16, (apr_uint32_t)load);
+        hb_put32(buf + 20, rps);
+        hb_put32(buf + 24, p50);
+        hb_put32(buf + 28, p90);
+        hb_put32(buf + 32, p99);
+        len = HM_BINARY_MSG_LEN;
+    }
+    else {
+        len = apr_snprintf(buf, sizeof(buf), msg_format, MSG_VERSION,
+                           ready, busy, load / 100, load % 100, rps,
+                           p50, p90, p99);
+    }
 
     do {
         apr_status_t rv;
@@ -118,6 +276,10 @@ static int hb_watchdog_init(server_rec *s, const char *name, apr_pool_t *pool)
 
     ap_mpm_query(AP_MPMQ_HARD_LIMIT_THREADS, &ctx->thread_limit);
     ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &ctx->server_limit);
+    ctx->last_hist = apr_pcalloc(pool, HB_HIST_BUCKETS
+                                       * sizeof(*ctx->last_hist));
+    ctx->last_count = 0;
+    ctx->last_time = 0;
 
     return OK;
 }
@@ -148,8 +310,56 @@ static int hb_watchdog_need(server_rec *s, const char *name,
         return DECLINED;
 }
 
+/* Find or create the histogram, if heartbeats are sent */
+static int hb_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                          apr_pool_t *ptemp, server_rec *s)
+{
+    hb_ctx_t *ctx = ap_get_module_config(s->module_config, &heartbeat_module);
+    apr_pool_t *pproc = s->process->pool;
+    const char *fname = NULL;
+    apr_shm_t **retained;
+    apr_status_t rv;
+
+    hb_hist = NULL;
+    if (!ctx->active) {
+        return OK;
+    }
+
+    retained = ap_retained_data_get(HB_HIST_RETAINED_ID);
+    if (retained == NULL) {
+        retained = ap_retained_data_create(HB_HIST_RETAINED_ID,
+                                           sizeof(*retained));
+    }
+    if (*retained == NULL) {
+        apr_size_t size = HB_HIST_BUCKETS * sizeof(*hb_hist);
+
+        rv = apr_shm_create(retained, size, NULL, pproc);
+        if (APR_STATUS_IS_ENOTIMPL(rv)) {
+            fname = ap_runtime_dir_relative(ptemp, "heartbeat_hist");
+            apr_shm_remove(fname, ptemp);
+            rv = apr_shm_create(retained, size, apr_pstrdup(pproc, fname),
+                                pproc);
+        }
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(02874)
+                         "Heartbeat: could not create shared memory for "
+                         "the request durations%s%s; p50, p90 and p99 are "
+                         "not measured", fname ? " at " : "",
+                         fname ? fname : "");
+            *retained = NULL;
+            return OK;
+        }
+        memset(apr_shm_baseaddr_get(*retained), 0, size);
+    }
+    hb_hist = apr_shm_baseaddr_get(*retained);
+
+    return OK;
+}
+
 static void hb_register_hooks(apr_pool_t *p)
 {
+    ap_hook_post_config(hb_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_log_transaction(hb_log_transaction, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_watchdog_need(hb_watchdog_need, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_watchdog_init(hb_watchdog_init, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_watchdog_step(hb_watchdog_step, NULL, NULL, APR_HOOK_MIDDLE);
@@ -211,9 +421,36 @@ static const char *cmd_hb_address(cmd_parms *cmd,
     return NULL;
 }
 
+static const char *cmd_hb_format(cmd_parms *cmd,
+                                 void *dconf, const char *format)
+{
+    hb_ctx_t *ctx =
+        (hb_ctx_t *) ap_get_module_config(cmd->server->module_config,
+                                          &heartbeat_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err != NULL) {
+        return err;
+    }
+
+    if (!strcasecmp(format, "binary")) {
+        ctx->binary = 1;
+    }
+    else if (!strcasecmp(format, "text")) {
+        ctx->binary = 0;
+    }
+    else {
+        return "HeartbeatFormat: must be 'text' or 'binary'";
+    }
+
+    return NULL;
+}
+
 static const command_rec hb_cmds[] = {
     AP_INIT_TAKE1("HeartbeatAddress", cmd_hb_address, NULL, RSRC_CONF,
                   "Address to send heartbeat requests"),
+    AP_INIT_TAKE1("HeartbeatFormat", cmd_hb_format, NULL, RSRC_CONF,
+                  "Format of the heartbeat: 'text' (default) or 'binary'"),
     {NULL}
 };
 
@@ -22,6 +22,13 @@
 #include "apr_strings.h"
 #include "apr_hash.h"
 #include "apr_time.h"
+#include "apr_atomic.h"
+
+#define APR_WANT_BYTEFUNC
+#define APR_WANT_MEMFUNC
+#define APR_WANT_STRFUNC
+#include "apr_want.h"
+
 #include "ap_mpm.h"
 #include "scoreboard.h"
 #include "mod_watchdog.h"
@@ -37,8 +44,14 @@
 
 #define HM_WATHCHDOG_NAME ("_heartmonitor_")
 
+/* datagrams read at most per poll, and receive buffer to ask for */
+#define HM_RECV_BATCH (64)
+#define HM_RECV_BUFSIZE (256 * 1024)
+
 static const ap_slotmem_provider_t *storage = NULL;
 static ap_slotmem_instance_t *slotmem = NULL;
+static ap_slotmem_instance_t *snapmem = NULL;
+static hm_snapshot_t *snapshot = NULL;
 static int maxworkers = 0;
 
 module AP_MODULE_DECLARE_DATA heartmonitor_module;
@@ -50,6 +63,11 @@ typedef struct hm_server_t
     int ready;
     unsigned int port;
     apr_time_t seen;
+    int load;                    /* load average * 100 */
+    int rps;                     /* requests per second */
+    int p50;                     /* latency percentiles, ms */
+    int p90;
+    int p99;
 } hm_server_t;
 
 typedef struct hm_ctx_t
@@ -101,6 +119,13 @@ static apr_status_t hm_listen(hm_ctx_t *ctx)
         return rv;
     }
 
+    /* many backends sending at short intervals can overrun the default */
+    rv = apr_socket_opt_set(ctx->sock, APR_SO_RCVBUF, HM_RECV_BUFSIZE);
+    if (rv) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, ctx->s, APLOGNO(02844)
+                     "Failed to set the receive buffer size of the socket.");
+    }
+
     rv = apr_socket_bind(ctx->sock, ctx->mcast_addr);
     if (rv) {
         ap_log_error(APLOG_MARK, APLOG_CRIT, rv, ctx->s, APLOGNO(02071)
@@ -162,6 +187,114 @@ static void qs_to_table(const char *input, apr_table_t *parms,
     }
 }
 
+static apr_uint32_t hm_get32(const char *buf)
+{
+    apr_uint32_t v;
+
+    memcpy(&v, buf, sizeof(v));
+    return ntohl(v);
+}
+
+/*
+ * Parse a heartbeat in either format (see heartbeat.h) into msg, without
+ * building a table.  buf must be NUL terminated at len.
+ * Returns 0 if the message is malformed.
+ */
+static int hm_parse_msg(char *buf, apr_size_t len, hm_server_t *msg)
+{
+    char *key, *value, *strtok_state;
+    int have = 0;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->port = 80;
+
+    if (len >= HM_BINARY_MSG_LEN && !memcmp(buf, "\0HB", 3)) {
+        if ((unsigned char)buf[3] != HM_BINARY_VERSION) {
+            return 0;
+        }
+        msg->ready = (int)hm_get32(buf + 4);
+        msg->busy = (int)hm_get32(buf + 8);
+        if (hm_get32(buf + 12)) {
+            msg->port = hm_get32(buf + 12);
+        }
+        msg->load = (int)hm_get32(buf + 16);
+        msg->rps = (int)hm_get32(buf + 20);
+        msg->p50 = (int)hm_get32(buf + 24);
+        msg->p90 = (int)hm_get32(buf + 28);
+        msg->p99 = (int)hm_get32(buf + 32);
+        return 1;
+    }
+
+    for (key = apr_strtok(buf, "&", &strtok_state); key;
+         key = apr_strtok(NULL, "&", &strtok_state)) {
+        value = strchr(key, '=');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        if (!strcmp(key, "v")) {
+            have |= 1;
+        }
+        else if (!strcmp(key, "busy")) {
+            msg->busy = atoi(value);
+            have |= 2;
+        }
+        else if (!strcmp(key, "ready")) {
+            msg->ready = atoi(value);
+            have |= 4;
+        }
+        else if (!strcmp(key, "port")) {
+            msg->port = atoi(value);
+        }
+        else if (!strcmp(key, "load")) {
+            msg->load = (int)(atof(value) * 100 + 0.5);
+        }
+        else if (!strcmp(key, "rps")) {
+            msg->rps = atoi(value);
+        }
+        else if (!strcmp(key, "p50")) {
+            msg->p50 = atoi(value);
+        }
+        else if (!strcmp(key, "p90")) {
+            msg->p90 = atoi(value);
+        }
+        else if (!strcmp(key, "p99")) {
+            msg->p99 = atoi(value);
+        }
+    }
+
+    /* the version, busy and ready are required */
+    return have == 7;
+}
+
+/* Write the line of a server to the heartbeat file */
+static void hm_file_put_server(apr_file_t *fp, const char *ip,
+                               const hm_server_t *s, apr_time_t seen)
+{
+    apr_file_printf(fp, "%s &ready=%u&busy=%u&lastseen=%u&port=%u"
+                    "&load=%d.%02d&rps=%u&p50=%u&p90=%u&p99=%u\n",
+                    ip, s->ready, s->busy, (unsigned int) seen, s->port,
+                    s->load / 100, s->load % 100, s->rps,
+                    s->p50, s->p90, s->p99);
+}
+
+/* the optional fields of a line of the heartbeat file */
+static void hm_file_get_metrics(apr_table_t *hbt, hm_server_t *node)
+{
+    const char *v;
+
+    v = apr_table_get(hbt, "load");
+    node->load = v ? (int)(atof(v) * 100 + 0.5) : 0;
+    v = apr_table_get(hbt, "rps");
+    node->rps = v ? atoi(v) : 0;
+    v = apr_table_get(hbt, "p50");
+    node->p50 = v ? atoi(v) : 0;
+    v = apr_table_get(hbt, "p90");
+    node->p90 = v ? atoi(v) : 0;
+    v = apr_table_get(hbt, "p99");
+    node->p99 = v ? atoi(v) : 0;
+}
+
 
 #define SEEN_TIMEOUT (30)
 
@@ -329,13 +462,12 @@ static apr_status_t hm_file_update_stat(hm_ctx_t *ctx, hm_server_t *s, apr_pool_
                 } else {
                     node.port = 80;
                 }
-                apr_file_printf(fp, "%s &ready=%u&busy=%u&lastseen=%u&port=%u\n",
-                                ip, node.ready, node.busy, (unsigned int) seen, node.port);
+                hm_file_get_metrics(hbt, &node);
+                hm_file_put_server(fp, ip, &node, seen);
             } else {
                 apr_time_t seen;
                 seen = apr_time_sec(now - s->seen);
-                apr_file_printf(fp, "%s &ready=%u&busy=%u&lastseen=%u&port=%u\n",
-                                s->ip, s->ready, s->busy, (unsigned int) seen, s->port);
+                hm_file_put_server(fp, s->ip, s, seen);
                 updated = 1;
             }
         } while (1);
@@ -344,8 +476,7 @@ static apr_status_t hm_file_update_stat(hm_ctx_t *ctx, hm_server_t *s, apr_pool_
     if (!updated) {
         apr_time_t seen;
         seen = apr_time_sec(now - s->seen);
-        apr_file_printf(fp, "%s &ready=%u&busy=%u&lastseen=%u&port=%u\n",
-                        s->ip, s->ready, s->busy, (unsigned int) seen, s->port);
+        hm_file_put_server(fp, s->ip, s, seen);
     }
 
     rv = apr_file_flush(fp);
@@ -422,8 +553,7 @@ static apr_status_t hm_file_update_stats(hm_ctx_t *ctx, apr_pool_t *p)
              */
         }
         else {
-            apr_file_printf(fp, "%s &ready=%u&busy=%u&lastseen=%u&port=%u\n",
-                            s->ip, s->ready, s->busy, (unsigned int) seen, s->port);
+            hm_file_put_server(fp, s->ip, s, seen);
         }
     }
 
@@ -487,9 +617,53 @@ static apr_status_t hm_slotmem_update_stats(hm_ctx_t *ctx, apr_pool_t *p)
     }
     return APR_SUCCESS;
 }
+static int hm_snapshot_cmp(const void *a, const void *b)
+{
+    return strcmp(((const hm_snapshot_server_t *)a)->ip,
+                  ((const hm_snapshot_server_t *)b)->ip);
+}
+
+/* Publish the live servers to the snapshot */
+static void hm_snapshot_publish(hm_ctx_t *ctx, apr_pool_t *p)
+{
+    /* the watchdog is a singleton, so there is only one writer */
+    apr_uint32_t next = snapshot->generation + 1;
+    hm_snapshot_server_t *table = HM_SNAPSHOT_TABLE(snapshot, next);
+    apr_hash_index_t *hi;
+    apr_time_t now = apr_time_now();
+    unsigned int n = 0;
+
+    for (hi = apr_hash_first(p, ctx->servers);
+         hi != NULL && n < snapshot->max; hi = apr_hash_next(hi)) {
+        hm_server_t *s = NULL;
+
+        apr_hash_this(hi, NULL, NULL, (void **) &s);
+        if (apr_time_sec(now - s->seen) > SEEN_TIMEOUT) {
+            continue;
+        }
+        apr_cpystrn(table[n].ip, s->ip, MAXIPSIZE);
+        table[n].busy = s->busy;
+        table[n].ready = s->ready;
+        table[n].seen = s->seen;
+        table[n].load = s->load;
+        table[n].rps = s->rps;
+        table[n].p50 = s->p50;
+        table[n].p90 = s->p90;
+        table[n].p99 = s->p99;
+        n++;
+    }
+    qsort(table, n, sizeof(*table), hm_snapshot_cmp);
+    snapshot->num[next & 1] = n;
+
+    /* a full barrier, so the table is complete before it is used */
+    apr_atomic_inc32(&snapshot->generation);
+}
+
 /* Store/update the stats */
 static apr_status_t hm_update_stats(hm_ctx_t *ctx, apr_pool_t *p)
 {
+    if (snapshot)
+        hm_snapshot_publish(ctx, p);
     if (slotmem)
         return hm_slotmem_update_stats(ctx, p);
     else
@@ -503,12 +677,9 @@ static hm_server_t *hm_get_server(hm_ctx_t *ctx, const char *ip, const int port)
     s = apr_hash_get(ctx->servers, ip, APR_HASH_KEY_STRING);
 
     if (s == NULL) {
-        s = apr_palloc(ctx->p, sizeof(hm_server_t));
+        s = apr_pcalloc(ctx->p, sizeof(hm_server_t));
         s->ip = apr_pstrdup(ctx->p, ip);
         s->port = port;
-        s->ready = 0;
-        s->busy = 0;
-        s->seen = 0;
         apr_hash_set(ctx->servers, s->ip, APR_HASH_KEY_STRING, s);
     }
 
@@ -519,34 +690,28 @@ static hm_server_t *hm_get_server(hm_ctx_t *ctx, const char *ip, const int port)
 static void hm_processmsg(hm_ctx_t *ctx, apr_pool_t *p,
                                   apr_sockaddr_t *from, char *buf, int len)
 {
-    apr_table_t *tbl;
+    hm_server_t msg;
 
     buf[len] = '\0';
 
-    tbl = apr_table_make(p, 10);
-
-    qs_to_table(buf, tbl, p);
-
-    if (apr_table_get(tbl, "v") != NULL &&
-        apr_table_get(tbl, "busy") != NULL &&
-        apr_table_get(tbl, "ready") != NULL) {
+    if (hm_parse_msg(buf, len, &msg)) {
         char *ip;
-        int port = 80;
         hm_server_t *s;
-        /* TODO: REMOVE ME BEFORE PRODUCTION (????) */
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, ctx->s, APLOGNO(02086)
-                     "%pI busy=%s ready=%s", from,
-                     apr_table_get(tbl, "busy"), apr_table_get(tbl, "ready"));
 
-        apr_sockaddr_ip_get(&ip, from);
+        ap_log_error(APLOG_MARK, APLOG_TRACE1, 0, ctx->s, APLOGNO(02086)
+                     "%pI busy=%d ready=%d", from, msg.busy, msg.ready);
 
-        if (apr_table_get(tbl, "port") != NULL)
-            port = atoi(apr_table_get(tbl, "port"));
+        apr_sockaddr_ip_get(&ip, from);
 
-        s = hm_get_server(ctx, ip, port);
+        s = hm_get_server(ctx, ip, msg.port);
 
-        s->busy = atoi(apr_table_get(tbl, "busy"));
-        s->ready = atoi(apr_table_get(tbl, "ready"));
+        s->busy = msg.busy;
+        s->ready = msg.ready;
+        s->load = msg.load;
+        s->rps = msg.rps;
+        s->p50 = msg.p50;
+        s->p90 = msg.p90;
+        s->p99 = msg.p99;
         s->seen = apr_time_now();
     }
     else {
@@ -556,29 +721,34 @@ static void hm_processmsg(hm_ctx_t *ctx, apr_pool_t *p,
     }
 
 }
-/* Read message from multicast socket */
+/* Read the messages waiting on the multicast socket, HM_RECV_BATCH at
+ * most, so that a burst of heartbeats costs one poll */
 #define MAX_MSG_LEN (1000)
 static apr_status_t hm_recv(hm_ctx_t *ctx, apr_pool_t *p)
 {
     char buf[MAX_MSG_LEN + 1];
     apr_sockaddr_t from;
-    apr_size_t len = MAX_MSG_LEN;
-    apr_status_t rv;
+    apr_size_t len;
+    apr_status_t rv = APR_SUCCESS;
+    int n;
 
     from.pool = p;
 
-    rv = apr_socket_recvfrom(&from, ctx->sock, 0, buf, &len);
+    for (n = 0; n < HM_RECV_BATCH; n++) {
+        len = MAX_MSG_LEN;
+        rv = apr_socket_recvfrom(&from, ctx->sock, 0, buf, &len);
 
-    if (APR_STATUS_IS_EAGAIN(rv)) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, ctx->s, APLOGNO(02088) "would block");
-        return APR_SUCCESS;
-    }
-    else if (rv) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, ctx->s, APLOGNO(02089) "recvfrom failed");
-        return rv;
-    }
+        if (APR_STATUS_IS_EAGAIN(rv)) {
+            /* drained */
+            return APR_SUCCESS;
+        }
+        else if (rv) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, ctx->s, APLOGNO(02089) "recvfrom failed");
+            return rv;
+        }
 
-    hm_processmsg(ctx, p, &from, buf, len);
+        hm_processmsg(ctx, p, &from, buf, len);
+    }
 
     return rv;
 }
@@ -696,6 +866,24 @@ static int hm_post_config(apr_pool_t *p, apr_pool_t *plog,
                              "slotmem_create for status failed");
                 return !OK;
             }
+            /* only the watchdog of HeartbeatListen publishes it, the
+             * heartbeat handler runs in every child */
+            snapshot = NULL;
+            snapmem = NULL;
+            if (ctx->active) {
+                storage->create(&snapmem, HM_SNAPSHOT_SLOTMEM,
+                                HM_SNAPSHOT_SIZE(maxworkers), 1, 0, p);
+                if (!snapmem
+                    || storage->dptr(snapmem, 0, (void **)&snapshot)
+                       != APR_SUCCESS) {
+                    ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s,
+                                 APLOGNO(02842)
+                                 "slotmem_create for the snapshot failed");
+                    return !OK;
+                }
+                snapshot->max = maxworkers;
+                snapshot->num[0] = snapshot->num[1] = 0;
+            }
         }
     }
 
@@ -733,7 +921,6 @@ static int hm_handler(request_rec *r)
     apr_size_t len;
     char *buf;
     apr_status_t status;
-    apr_table_t *tbl;
     hm_server_t hmserver;
     char *ip;
     hm_ctx_t *ctx;
@@ -749,7 +936,7 @@ static int hm_handler(request_rec *r)
     ctx = ap_get_module_config(r->server->module_config,
             &heartmonitor_module);
 
-    buf = apr_pcalloc(r->pool, MAX_MSG_LEN);
+    buf = apr_pcalloc(r->pool, MAX_MSG_LEN + 1);
     input_brigade = apr_brigade_create(r->connection->pool, r->connection->bucket_alloc);
     status = ap_get_brigade(r->input_filters, input_brigade, AP_MODE_READBYTES, APR_BLOCK_READ, MAX_MSG_LEN);
     if (status != APR_SUCCESS) {
@@ -759,15 +946,11 @@ static int hm_handler(request_rec *r)
 
     /* we can't use hm_processmsg because it uses hm_get_server() */
     buf[len] = '\0';
-    tbl = apr_table_make(r->pool, 10);
-    qs_to_table(buf, tbl, r->pool);
+    if (!hm_parse_msg(buf, len, &hmserver)) {
+        return HTTP_BAD_REQUEST;
+    }
     apr_sockaddr_ip_get(&ip, r->connection->client_addr);
     hmserver.ip = ip;
-    hmserver.port = 80;
-    if (apr_table_get(tbl, "port") != NULL)
-        hmserver.port = atoi(apr_table_get(tbl, "port"));
-    hmserver.busy = atoi(apr_table_get(tbl, "busy"));
-    hmserver.ready = atoi(apr_table_get(tbl, "ready"));
     hmserver.seen = apr_time_now();
     hm_update_stat(ctx, &hmserver, r->pool);
 
@@ -26,6 +26,12 @@
 #include "apr_tables.h"
 #include "apr_lib.h"
 #include "apr_dbd.h"
+#include "apr_sha1.h"
+#include "apu_version.h"
+#if APR_HAS_THREADS
+#include "apr_thread_mutex.h"
+#include "apr_thread_pool.h"
+#endif
 
 #define APR_WANT_MEMFUNC
 #define APR_WANT_STRFUNC
@@ -35,6 +41,9 @@
 #include "http_config.h"
 #include "http_log.h"
 #include "http_request.h"
+#include "ap_mpm.h"
+#include "ap_socache.h"
+#include "util_mutex.h"
 #include "mod_dbd.h"
 
 extern module AP_MODULE_DECLARE_DATA dbd_module;
@@ -72,7 +81,8 @@ typedef struct {
 } svr_cfg;
 
 typedef enum { cmd_name, cmd_params, cmd_persist,
-               cmd_min, cmd_keep, cmd_max, cmd_exp
+               cmd_min, cmd_keep, cmd_max, cmd_exp,
+               cmd_cache_timeout, cmd_cache_entries, cmd_async_threads
 } cmd_parts;
 
 static apr_pool_t *config_pool;
@@ -91,6 +101,50 @@ static const char *const no_dbdriver = "[DBDriver unset]";
 
 #define DEFAULT_SQL_INIT_ARRAY_SIZE 5
 
+/* Result cache: results are stored under the SHA1 of the connection
+ * parameters, statement label and arguments, either in a per-child table
+ * of at most cache_entries results or, with DBDResultCacheSOCache, in a
+ * shared object cache.  Results larger than DBD_CACHE_MAX_VALUE are never
+ * cached.
+ */
+#define DBD_CACHE_KEYLEN APR_SHA1_DIGESTSIZE
+#define DBD_CACHE_MAX_VALUE 8192
+#define DEFAULT_CACHE_ENTRIES 1024
+
+typedef struct {
+    unsigned char key[DBD_CACHE_KEYLEN];
+    apr_time_t expiry;
+    int slot;
+    apr_size_t len;
+    /* the encoded result follows */
+} dbd_cache_entry;
+
+static const char *const dbd_cache_id = "dbd-cache";
+static int cache_configured;
+static int cache_entries;
+static ap_socache_provider_t *cache_provider;
+static const char *cache_provider_args;
+static ap_socache_instance_t *cache_instance;
+static apr_global_mutex_t *cache_mutex;
+
+/* the per-child table, used without DBDResultCacheSOCache */
+static apr_hash_t *cache_table;
+static dbd_cache_entry **cache_ring;
+static int cache_next;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *cache_table_mutex;
+#endif
+
+/* Queries started by ap_dbd_select_async run on a per-child pool of at
+ * most async_threads threads, created only if the MPM can suspend requests
+ */
+#define DEFAULT_ASYNC_THREADS 4
+
+static int async_threads;
+#if APR_HAS_THREADS
+static apr_thread_pool_t *async_pool;
+#endif
+
 static void *create_dbd_config(apr_pool_t *pool, server_rec *s)
 {
     svr_cfg *svr = apr_pcalloc(pool, sizeof(svr_cfg));
@@ -100,6 +154,7 @@ static void *create_dbd_config(apr_pool_t *pool, server_rec *s)
     cfg->name = no_dbdriver; /* to generate meaningful error messages */
     cfg->params = ""; /* don't risk segfault on misconfiguration */
     cfg->persist = -1;
+    cfg->cache_timeout = -1;
 #if APR_HAS_THREADS
     cfg->nmin = DEFAULT_NMIN;
     cfg->nkeep = DEFAULT_NKEEP;
@@ -124,6 +179,8 @@ static void *merge_dbd_config(apr_pool_t *pool, void *basev, void *addv)
     new->name = (add->name != no_dbdriver) ? add->name : base->name;
     new->params = strcmp(add->params, "") ? add->params : base->params;
     new->persist = (add->persist != -1) ? add->persist : base->persist;
+    new->cache_timeout = (add->cache_timeout != -1) ? add->cache_timeout
+                                                    : base->cache_timeout;
 #if APR_HAS_THREADS
     new->nmin = (add->set&NMIN_SET) ? add->nmin : base->nmin;
     new->nkeep = (add->set&NKEEP_SET) ? add->nkeep : base->nkeep;
@@ -237,6 +294,81 @@ static const char *dbd_param_int(cmd_parms *cmd, void *dconf, const char *val)
 }
 #endif
 
+static const char *dbd_cache_param(cmd_parms *cmd, void *dconf,
+                                   const char *val)
+{
+    svr_cfg *svr = ap_get_module_config(cmd->server->module_config,
+                                        &dbd_module);
+    const char *p;
+
+    for (p = val; *p; ++p) {
+        if (!apr_isdigit(*p)) {
+            return "Argument must be numeric!";
+        }
+    }
+
+    switch ((long) cmd->info) {
+    case cmd_cache_timeout:
+        svr->cfg->cache_timeout = atoi(val);
+        break;
+    case cmd_cache_entries:
+        p = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+        if (p) {
+            return p;
+        }
+        cache_entries = atoi(val);
+        if (cache_entries < 1) {
+            return "DBDResultCacheEntries must be at least 1";
+        }
+        break;
+    case cmd_async_threads:
+        p = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+        if (p) {
+            return p;
+        }
+        async_threads = atoi(val);
+        break;
+    }
+
+    return NULL;
+}
+
+static const char *dbd_cache_socache(cmd_parms *cmd, void *dconf,
+                                     const char *arg)
+{
+    const char *errmsg = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    const char *sep, *name;
+
+    if (errmsg) {
+        return errmsg;
+    }
+
+    /* Argument is of form 'name:args' or just 'name'. */
+    sep = ap_strchr_c(arg, ':');
+    if (sep) {
+        name = apr_pstrmemdup(cmd->pool, arg, sep - arg);
+        sep++;
+    }
+    else {
+        name = arg;
+    }
+
+    /* the instance is only created in post_config, if some server has
+     * a DBDResultCacheTimeout
+     */
+    cache_provider = ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP, name,
+                                        AP_SOCACHE_PROVIDER_VERSION);
+    if (cache_provider == NULL) {
+        return apr_psprintf(cmd->pool,
+                            "DBDResultCacheSOCache: Unknown socache provider "
+                            "'%s'. Maybe you need to load the appropriate "
+                            "socache module (mod_socache_%s?)", name, name);
+    }
+    cache_provider_args = sep;
+
+    return NULL;
+}
+
 static const char *dbd_param_flag(cmd_parms *cmd, void *dconf, int flag)
 {
     svr_cfg *svr = ap_get_module_config(cmd->server->module_config,
@@ -287,7 +419,20 @@ static const command_rec dbd_cmds[] = {
                    "statement inherited from main server) and label"),
     AP_INIT_TAKE1("DBDInitSQL", dbd_init_sql, NULL, RSRC_CONF,
                    "SQL statement to be executed after connection is created"),
+    AP_INIT_TAKE1("DBDResultCacheTimeout", dbd_cache_param,
+                  (void*)cmd_cache_timeout, RSRC_CONF,
+                  "Seconds to cache the results of lookups (0 to disable)"),
+    AP_INIT_TAKE1("DBDResultCacheEntries", dbd_cache_param,
+                  (void*)cmd_cache_entries, RSRC_CONF,
+                  "Maximum number of results cached per child process"),
+    AP_INIT_TAKE1("DBDResultCacheSOCache", dbd_cache_socache, NULL, RSRC_CONF,
+                  "Shared object cache to hold lookup results, as "
+                  "provider[:args]"),
 #if APR_HAS_THREADS
+    AP_INIT_TAKE1("DBDAsyncThreads", dbd_cache_param,
+                  (void*)cmd_async_threads, RSRC_CONF,
+                  "Maximum number of threads per child process running "
+                  "asynchronous queries (0 to disable)"),
     AP_INIT_TAKE1("DBDMin", dbd_param_int, (void*)cmd_min, RSRC_CONF,
                   "Minimum number of connections"),
     /* XXX: note that mod_proxy calls this "smax" */
@@ -305,8 +450,23 @@ static const command_rec dbd_cmds[] = {
 static int dbd_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
                           apr_pool_t *ptemp)
 {
+   apr_status_t rv = ap_mutex_register(pconf, dbd_cache_id, NULL,
+                                       APR_LOCK_DEFAULT, 0);
+   if (rv != APR_SUCCESS) {
+       ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog, APLOGNO(02831)
+                     "failed to register %s mutex", dbd_cache_id);
+       return 500; /* An HTTP status would be a misnomer! */
+   }
+
    config_pool = pconf;
    group_list = NULL;
+   cache_configured = 0;
+   cache_entries = DEFAULT_CACHE_ENTRIES;
+   cache_provider = NULL;
+   cache_provider_args = NULL;
+   cache_instance = NULL;
+   cache_mutex = NULL;
+   async_threads = DEFAULT_ASYNC_THREADS;
    return OK;
 }
 
@@ -338,6 +498,64 @@ typedef struct {
     const char *label, *query;
 } dbd_query_t;
 
+static apr_status_t dbd_cache_remove_lock(void *data)
+{
+    if (cache_mutex) {
+        apr_global_mutex_destroy(cache_mutex);
+        cache_mutex = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t dbd_cache_destroy(void *data)
+{
+    if (cache_instance) {
+        cache_provider->destroy(cache_instance, (server_rec*)data);
+        cache_instance = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+static int dbd_cache_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                 apr_pool_t *ptemp, server_rec *s)
+{
+    static struct ap_socache_hints dbd_cache_hints = {64, 256, 60000000};
+    const char *errmsg;
+    apr_status_t rv;
+
+    errmsg = cache_provider->create(&cache_instance, cache_provider_args,
+                                    ptemp, pconf);
+    if (errmsg) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, 0, plog, APLOGNO(02869)
+                      "DBDResultCacheSOCache: %s", errmsg);
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+
+    if (cache_provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+        rv = ap_global_mutex_create(&cache_mutex, NULL, dbd_cache_id, NULL,
+                                    s, pconf, 0);
+        if (rv != APR_SUCCESS) {
+            ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog, APLOGNO(02832)
+                          "failed to create %s mutex", dbd_cache_id);
+            return 500; /* An HTTP status would be a misnomer! */
+        }
+        apr_pool_cleanup_register(pconf, NULL, dbd_cache_remove_lock,
+                                  apr_pool_cleanup_null);
+    }
+
+    rv = cache_provider->init(cache_instance, dbd_cache_id,
+                              &dbd_cache_hints, s, pconf);
+    if (rv != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog, APLOGNO(02833)
+                      "failed to initialise %s cache", dbd_cache_id);
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+    apr_pool_cleanup_register(pconf, (void*)s, dbd_cache_destroy,
+                              apr_pool_cleanup_null);
+
+    return OK;
+}
+
 static int dbd_post_config(apr_pool_t *pconf, apr_pool_t *plog,
                            apr_pool_t *ptemp, server_rec *s)
 {
@@ -351,6 +569,10 @@ static int dbd_post_config(apr_pool_t *pconf, apr_pool_t *plog,
         apr_hash_index_t *hi_first = apr_hash_first(ptemp, cfg->queries);
         dbd_group_t *group;
 
+        if (cfg->cache_timeout > 0) {
+            cache_configured = 1;
+        }
+
         /* dbd_setup in 2.2.3 and under was causing spurious error messages
          * when dbd isn't configured.  We can stop that with a quick check here
          * together with a similar check in ap_dbd_open (where being
@@ -428,6 +650,10 @@ static int dbd_post_config(apr_pool_t *pconf, apr_pool_t *plog,
         }
     }
 
+    if (cache_configured && cache_provider) {
+        return dbd_cache_post_config(pconf, plog, ptemp, s);
+    }
+
     return OK;
 }
 
@@ -699,6 +925,18 @@ static apr_status_t dbd_setup_init(apr_pool_t *pool, server_rec *s)
     return rv;
 }
 
+static apr_status_t dbd_cache_table_cleanup(void *data)
+{
+    int i;
+
+    for (i = 0; i < cache_entries; ++i) {
+        free(cache_ring[i]);
+        cache_ring[i] = NULL;
+    }
+    cache_table = NULL;
+    return APR_SUCCESS;
+}
+
 static void dbd_child_init(apr_pool_t *p, server_rec *s)
 {
   apr_status_t rv = dbd_setup_init(p, s);
@@ -706,6 +944,59 @@ static void dbd_child_init(apr_pool_t *p, server_rec *s)
     ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(00636)
                  "child init failed!");
   }
+
+#if APR_HAS_THREADS
+  async_pool = NULL;
+  if (async_threads > 0) {
+    int can_suspend = 0;
+
+    /* without an MPM which can suspend requests, ap_dbd_select_async
+     * returns APR_ENOTIMPL and callers fall back to blocking queries
+     */
+    if (ap_mpm_query(AP_MPMQ_CAN_SUSPEND, &can_suspend) == APR_SUCCESS
+        && can_suspend) {
+      rv = apr_thread_pool_create(&async_pool, 0, async_threads, p);
+      if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(02870)
+                     "failed to create thread pool for asynchronous "
+                     "queries");
+        async_pool = NULL;
+      }
+    }
+  }
+#endif
+
+  if (!cache_configured) {
+    return;
+  }
+  if (cache_provider) {
+    if (cache_mutex) {
+      rv = apr_global_mutex_child_init(&cache_mutex,
+                                       apr_global_mutex_lockfile(cache_mutex),
+                                       p);
+      if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(02834)
+                     "failed to initialise %s mutex in child", dbd_cache_id);
+        cache_configured = 0;
+      }
+    }
+    return;
+  }
+
+#if APR_HAS_THREADS
+  rv = apr_thread_mutex_create(&cache_table_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+  if (rv != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(02835)
+                 "failed to create result cache mutex, caching disabled");
+    cache_configured = 0;
+    return;
+  }
+#endif
+  cache_table = apr_hash_make(p);
+  cache_ring = apr_pcalloc(p, cache_entries * sizeof(dbd_cache_entry *));
+  cache_next = 0;
+  apr_pool_cleanup_register(p, NULL, dbd_cache_table_cleanup,
+                            apr_pool_cleanup_null);
 }
 
 #if APR_HAS_THREADS
@@ -962,6 +1253,549 @@ DBD_DECLARE_NONSTD(ap_dbd_t *) ap_dbd_cacquire(conn_rec *c)
 }
 #endif
 
+/* Result cache: key, encoding and the two stores */
+
+static void dbd_cache_key(unsigned char *key, dbd_cfg_t *cfg,
+                          const char *label, int nargs, const char **args)
+{
+    apr_sha1_ctx_t sha1;
+    int i;
+
+    apr_sha1_init(&sha1);
+    apr_sha1_update_binary(&sha1, (const unsigned char *)cfg->name,
+                           strlen(cfg->name) + 1);
+    apr_sha1_update_binary(&sha1, (const unsigned char *)cfg->params,
+                           strlen(cfg->params) + 1);
+    apr_sha1_update_binary(&sha1, (const unsigned char *)label,
+                           strlen(label) + 1);
+    for (i = 0; i < nargs; ++i) {
+        /* a NULL argument hashes differently from an empty one */
+        if (args[i]) {
+            apr_sha1_update_binary(&sha1, (const unsigned char *)"V", 1);
+            apr_sha1_update_binary(&sha1, (const unsigned char *)args[i],
+                                   strlen(args[i]) + 1);
+        }
+        else {
+            apr_sha1_update_binary(&sha1, (const unsigned char *)"N", 1);
+        }
+    }
+    apr_sha1_final(key, &sha1);
+}
+
+/* Each value is a tag, 'V' or 'N' for NULL, followed by the string */
+static apr_size_t dbd_cache_value_len(const char *val)
+{
+    return 1 + (val ? strlen(val) + 1 : 0);
+}
+
+static char *dbd_cache_put_value(char *p, const char *val)
+{
+    if (!val) {
+        *p++ = 'N';
+        return p;
+    }
+    *p++ = 'V';
+    return strcpy(p, val) + strlen(val) + 1;
+}
+
+static int dbd_cache_get_value(const char **p, const char *end,
+                               const char **val)
+{
+    const char *nul;
+
+    if (*p >= end) {
+        return 0;
+    }
+    if (*(*p)++ == 'N') {
+        *val = NULL;
+        return 1;
+    }
+    if ((nul = memchr(*p, '\0', end - *p)) == NULL) {
+        return 0;
+    }
+    *val = *p;
+    *p = nul + 1;
+    return 1;
+}
+
+/* Encode as: ncols, the names, then the values row by row.  Returns NULL
+ * if the encoding would be longer than max, unless max is 0.
+ */
+static char *dbd_cache_encode(apr_pool_t *pool, ap_dbd_result_t *res,
+                              apr_size_t max, apr_size_t *len)
+{
+    const char *ncols = apr_itoa(pool, res->ncols);
+    apr_size_t n = strlen(ncols) + 1;
+    char *buf, *p;
+    int i, j;
+
+    for (i = 0; i < res->ncols; ++i) {
+        n += dbd_cache_value_len(res->names ? res->names[i] : NULL);
+    }
+    for (j = 0; j < res->rows->nelts; ++j) {
+        const char **row = APR_ARRAY_IDX(res->rows, j, const char **);
+        for (i = 0; i < res->ncols; ++i) {
+            n += dbd_cache_value_len(row[i]);
+        }
+        if (max && n > max) {
+            return NULL;
+        }
+    }
+    if (max && n > max) {
+        return NULL;
+    }
+
+    p = buf = apr_palloc(pool, n);
+    p = strcpy(p, ncols) + strlen(ncols) + 1;
+    for (i = 0; i < res->ncols; ++i) {
+        p = dbd_cache_put_value(p, res->names ? res->names[i] : NULL);
+    }
+    for (j = 0; j < res->rows->nelts; ++j) {
+        const char **row = APR_ARRAY_IDX(res->rows, j, const char **);
+        for (i = 0; i < res->ncols; ++i) {
+            p = dbd_cache_put_value(p, row[i]);
+        }
+    }
+
+    *len = n;
+    return buf;
+}
+
+/* Decode a buffer allocated from pool; strings point into it */
+static ap_dbd_result_t *dbd_cache_decode(apr_pool_t *pool, const char *buf,
+                                         apr_size_t len)
+{
+    ap_dbd_result_t *res;
+    const char *p = buf, *end = buf + len;
+    int i, have_names = 0;
+
+    if ((p = memchr(buf, '\0', len)) == NULL) {
+        return NULL;
+    }
+    res = apr_pcalloc(pool, sizeof(*res));
+    res->ncols = atoi(buf);
+    p++;
+    if (res->ncols <= 0 || res->ncols > (int)len) {
+        return NULL;
+    }
+
+    res->names = apr_palloc(pool, res->ncols * sizeof(const char *));
+    for (i = 0; i < res->ncols; ++i) {
+        if (!dbd_cache_get_value(&p, end, &res->names[i])) {
+            return NULL;
+        }
+        have_names |= (res->names[i] != NULL);
+    }
+    if (!have_names) {
+        res->names = NULL;
+    }
+
+    res->rows = apr_array_make(pool, 1, sizeof(const char **));
+    while (p < end) {
+        const char **row = apr_palloc(pool, res->ncols * sizeof(const char *));
+        for (i = 0; i < res->ncols; ++i) {
+            if (!dbd_cache_get_value(&p, end, &row[i])) {
+                return NULL;
+            }
+        }
+        APR_ARRAY_PUSH(res->rows, const char **) = row;
+    }
+
+    return res;
+}
+
+static char *dbd_cache_get(request_rec *r, const unsigned char *key,
+                           apr_size_t *len)
+{
+    char *buf = NULL;
+
+    if (cache_provider) {
+        unsigned int n = DBD_CACHE_MAX_VALUE;
+        apr_status_t rv;
+
+        buf = apr_palloc(r->pool, n);
+        if (cache_mutex) {
+            apr_global_mutex_lock(cache_mutex);
+        }
+        rv = cache_provider->retrieve(cache_instance, r->server,
+                                      key, DBD_CACHE_KEYLEN,
+                                      (unsigned char *)buf, &n, r->pool);
+        if (cache_mutex) {
+            apr_global_mutex_unlock(cache_mutex);
+        }
+        if (rv != APR_SUCCESS) {
+            return NULL;
+        }
+        *len = n;
+        return buf;
+    }
+
+    if (!cache_table) {
+        return NULL;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache_table_mutex);
+#endif
+    {
+        dbd_cache_entry *e = apr_hash_get(cache_table, key, DBD_CACHE_KEYLEN);
+        if (e && e->expiry > r->request_time) {
+            buf = apr_pmemdup(r->pool, e + 1, e->len);
+            *len = e->len;
+        }
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache_table_mutex);
+#endif
+
+    return buf;
+}
+
+static void dbd_cache_set(request_rec *r, const unsigned char *key,
+                          const char *buf, apr_size_t len, int timeout)
+{
+    apr_time_t expiry = r->request_time + apr_time_from_sec(timeout);
+    dbd_cache_entry *e, *old;
+
+    if (cache_provider) {
+        apr_status_t rv;
+
+        if (cache_mutex) {
+            apr_global_mutex_lock(cache_mutex);
+        }
+        rv = cache_provider->store(cache_instance, r->server,
+                                   key, DBD_CACHE_KEYLEN, expiry,
+                                   (unsigned char *)buf, (unsigned int)len,
+                                   r->pool);
+        if (cache_mutex) {
+            apr_global_mutex_unlock(cache_mutex);
+        }
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, APLOGNO(02836)
+                          "failed to store result in %s", dbd_cache_id);
+        }
+        return;
+    }
+
+    if (!cache_table || (e = malloc(sizeof(*e) + len)) == NULL) {
+        return;
+    }
+    memcpy(e->key, key, DBD_CACHE_KEYLEN);
+    e->expiry = expiry;
+    e->len = len;
+    memcpy(e + 1, buf, len);
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache_table_mutex);
+#endif
+    /* replace an expired result of the same lookup ... */
+    old = apr_hash_get(cache_table, key, DBD_CACHE_KEYLEN);
+    if (old) {
+        apr_hash_set(cache_table, old->key, DBD_CACHE_KEYLEN, NULL);
+        cache_ring[old->slot] = NULL;
+        free(old);
+    }
+    /* ... and evict the oldest result when the table is full */
+    old = cache_ring[cache_next];
+    if (old) {
+        apr_hash_set(cache_table, old->key, DBD_CACHE_KEYLEN, NULL);
+        free(old);
+    }
+    e->slot = cache_next;
+    cache_ring[cache_next] = e;
+    cache_next = (cache_next + 1) % cache_entries;
+    apr_hash_set(cache_table, e->key, DBD_CACHE_KEYLEN, e);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache_table_mutex);
+#endif
+}
+
+/* Run the statement on dbd and read the whole result into pool.  If
+ * fetching a row fails, the rows read so far are returned in *result
+ * along with APR_INCOMPLETE.
+ */
+static apr_status_t dbd_select_rows(apr_pool_t *pool, ap_dbd_t *dbd,
+                                    const char *label,
+                                    int nargs, const char **args,
+                                    ap_dbd_result_t **result,
+                                    const char **errmsg)
+{
+    apr_dbd_prepared_t *statement;
+    apr_dbd_results_t *dres = NULL;
+    apr_dbd_row_t *row = NULL;
+    ap_dbd_result_t *res;
+    int rv, i;
+
+    statement = apr_hash_get(dbd->prepared, label, APR_HASH_KEY_STRING);
+    if (statement == NULL) {
+        *errmsg = apr_psprintf(pool, "no prepared statement %s", label);
+        return APR_NOTFOUND;
+    }
+    rv = apr_dbd_pselect(dbd->driver, pool, dbd->handle, &dres,
+                         statement, 0, nargs, args);
+    if (rv != 0) {
+        *errmsg = apr_dbd_error(dbd->driver, dbd->handle, rv);
+        return APR_EGENERAL;
+    }
+
+    res = apr_pcalloc(pool, sizeof(*res));
+    res->ncols = apr_dbd_num_cols(dbd->driver, dres);
+    res->rows = apr_array_make(pool, 1, sizeof(const char **));
+#if APU_MAJOR_VERSION > 1 || (APU_MAJOR_VERSION == 1 && APU_MINOR_VERSION >= 3)
+    res->names = apr_palloc(pool, res->ncols * sizeof(const char *));
+    for (i = 0; i < res->ncols; ++i) {
+        res->names[i] = apr_dbd_get_name(dbd->driver, dres, i);
+    }
+#endif
+
+    /* read all rows, or they won't get cleaned up */
+    while ((rv = apr_dbd_get_row(dbd->driver, pool, dres, &row, -1)) == 0) {
+        const char **vals = apr_palloc(pool,
+                                       res->ncols * sizeof(const char *));
+        for (i = 0; i < res->ncols; ++i) {
+            vals[i] = apr_dbd_get_entry(dbd->driver, row, i);
+        }
+        APR_ARRAY_PUSH(res->rows, const char **) = vals;
+    }
+
+    *result = res;
+    if (rv != -1) {
+        *errmsg = apr_dbd_error(dbd->driver, dbd->handle, rv);
+        return APR_INCOMPLETE;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t dbd_select_all(request_rec *r, const char *label,
+                                   int nargs, const char **args,
+                                   ap_dbd_result_t **result,
+                                   const char **errmsg)
+{
+    ap_dbd_t *dbd = ap_dbd_acquire(r);
+
+    if (dbd == NULL) {
+        *errmsg = "failed to acquire database connection";
+        return APR_ECONNREFUSED;
+    }
+    return dbd_select_rows(r->pool, dbd, label, nargs, args, result, errmsg);
+}
+
+DBD_DECLARE_NONSTD(apr_status_t) ap_dbd_cached_select(request_rec *r,
+                                                      const char *label,
+                                                      int nargs,
+                                                      const char **args,
+                                                      ap_dbd_result_t **res,
+                                                      const char **errmsg)
+{
+    svr_cfg *svr = ap_get_module_config(r->server->module_config,
+                                        &dbd_module);
+    unsigned char key[DBD_CACHE_KEYLEN];
+    apr_size_t len;
+    apr_status_t rv;
+    char *buf;
+
+    *errmsg = NULL;
+    if (!cache_configured || svr->cfg->cache_timeout <= 0) {
+        return dbd_select_all(r, label, nargs, args, res, errmsg);
+    }
+
+    dbd_cache_key(key, svr->cfg, label, nargs, args);
+    buf = dbd_cache_get(r, key, &len);
+    if (buf && (*res = dbd_cache_decode(r->pool, buf, len)) != NULL) {
+        return APR_SUCCESS;
+    }
+
+    rv = dbd_select_all(r, label, nargs, args, res, errmsg);
+    if (rv == APR_SUCCESS && (*res)->ncols > 0
+        && (buf = dbd_cache_encode(r->pool, *res, DBD_CACHE_MAX_VALUE,
+                                   &len)) != NULL) {
+        dbd_cache_set(r, key, buf, len, svr->cfg->cache_timeout);
+    }
+
+    return rv;
+}
+
+#if APR_HAS_THREADS
+typedef struct {
+    request_rec *r;
+    ap_dbd_async_fn *fn;
+    void *baton;
+    int cache_timeout;
+    unsigned char key[DBD_CACHE_KEYLEN];
+    /* used by the query thread; the pool has its own allocator */
+    apr_pool_t *pool;
+    server_rec *s;
+    const char *label;
+    int nargs;
+    const char **args;
+    char *buf;
+    apr_size_t len;
+    /* the outcome */
+    apr_status_t rv;
+    ap_dbd_result_t *res;
+    const char *errmsg;
+} dbd_async_job;
+
+static void dbd_async_resume(void *baton);
+
+/* Runs the query of a job on a thread of async_pool; nothing but the job
+ * may be touched here, the request belongs to whichever thread resumes it.
+ */
+static void * APR_THREAD_FUNC dbd_async_query(apr_thread_t *thd, void *data)
+{
+    dbd_async_job *job = data;
+    ap_dbd_result_t *res = NULL;
+    ap_dbd_t *dbd;
+
+    dbd = ap_dbd_open(job->pool, job->s);
+    if (dbd == NULL) {
+        job->errmsg = "failed to acquire database connection";
+        job->rv = APR_ECONNREFUSED;
+    }
+    else {
+        job->rv = dbd_select_rows(job->pool, dbd, job->label, job->nargs,
+                                  job->args, &res, &job->errmsg);
+        if (job->errmsg) {
+            /* the driver's message goes with the connection */
+            job->errmsg = apr_pstrdup(job->pool, job->errmsg);
+        }
+        if (res) {
+            job->buf = dbd_cache_encode(job->pool, res, 0, &job->len);
+        }
+        ap_dbd_close(job->s, dbd);
+    }
+
+    ap_mpm_register_timed_callback(0, dbd_async_resume, job);
+    return NULL;
+}
+
+/* Runs on a worker thread, in the same way as the rest of the handler
+ * would after a query with ap_dbd_cached_select.
+ */
+static void dbd_async_resume(void *baton)
+{
+    dbd_async_job *job = baton;
+    request_rec *r = job->r;
+    conn_rec *c = r->connection;
+    int status;
+
+    apr_thread_mutex_lock(r->invoke_mtx);
+
+    if (job->pool) {
+        /* move the result from the query thread's pool to the request */
+        if (job->buf) {
+            char *buf = apr_pmemdup(r->pool, job->buf, job->len);
+
+            job->res = dbd_cache_decode(r->pool, buf, job->len);
+            if (job->res == NULL) {
+                job->errmsg = "failed to read query result";
+                job->rv = APR_EGENERAL;
+            }
+            else if (job->rv == APR_SUCCESS && job->cache_timeout > 0
+                     && job->res->ncols > 0
+                     && job->len <= DBD_CACHE_MAX_VALUE) {
+                dbd_cache_set(r, job->key, buf, job->len, job->cache_timeout);
+            }
+        }
+        if (job->errmsg) {
+            job->errmsg = apr_pstrdup(r->pool, job->errmsg);
+        }
+        apr_pool_destroy(job->pool);
+        job->pool = NULL;
+    }
+
+    status = job->fn(r, job->rv, job->res, job->errmsg, job->baton);
+    if (status == SUSPENDED) {
+        /* the callback has arranged for the request to be resumed */
+        apr_thread_mutex_unlock(r->invoke_mtx);
+        return;
+    }
+    apr_thread_mutex_unlock(r->invoke_mtx);
+
+    if (status == DONE) {
+        status = OK;
+    }
+    if (status == OK) {
+        ap_finalize_request_protocol(r);
+    }
+    else {
+        r->status = HTTP_OK;
+        ap_die(status, r);
+    }
+    ap_process_request_after_handler(r);
+
+    ap_mpm_resume_suspended(c);
+}
+
+DBD_DECLARE_NONSTD(apr_status_t) ap_dbd_select_async(request_rec *r,
+                                                     const char *label,
+                                                     int nargs,
+                                                     const char **args,
+                                                     ap_dbd_async_fn *fn,
+                                                     void *baton)
+{
+    svr_cfg *svr = ap_get_module_config(r->server->module_config,
+                                        &dbd_module);
+    dbd_async_job *job;
+    apr_status_t rv;
+    int i;
+
+    if (async_pool == NULL) {
+        return APR_ENOTIMPL;
+    }
+
+    job = apr_pcalloc(r->pool, sizeof(*job));
+    job->r = r;
+    job->fn = fn;
+    job->baton = baton;
+
+    if (cache_configured && svr->cfg->cache_timeout > 0) {
+        apr_size_t len;
+        char *buf;
+
+        job->cache_timeout = svr->cfg->cache_timeout;
+        dbd_cache_key(job->key, svr->cfg, label, nargs, args);
+        buf = dbd_cache_get(r, job->key, &len);
+        if (buf && (job->res = dbd_cache_decode(r->pool, buf, len))) {
+            /* no need for a query thread */
+            job->rv = APR_SUCCESS;
+            ap_mpm_register_timed_callback(0, dbd_async_resume, job);
+            return APR_SUCCESS;
+        }
+    }
+
+    rv = apr_pool_create(&job->pool, NULL);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    apr_pool_tag(job->pool, "dbd_async");
+    job->s = r->server;
+    job->label = apr_pstrdup(job->pool, label);
+    job->nargs = nargs;
+    job->args = apr_palloc(job->pool, (nargs + 1) * sizeof(const char *));
+    for (i = 0; i < nargs; ++i) {
+        job->args[i] = args[i] ? apr_pstrdup(job->pool, args[i]) : NULL;
+    }
+    job->args[nargs] = NULL;
+
+    rv = apr_thread_pool_push(async_pool, dbd_async_query, job,
+                              APR_THREAD_TASK_PRIORITY_NORMAL, NULL);
+    if (rv != APR_SUCCESS) {
+        apr_pool_destroy(job->pool);
+    }
+    return rv;
+}
+#else
+DBD_DECLARE_NONSTD(apr_status_t) ap_dbd_select_async(request_rec *r,
+                                                     const char *label,
+                                                     int nargs,
+                                                     const char **args,
+                                                     ap_dbd_async_fn *fn,
+                                                     void *baton)
+{
+    return APR_ENOTIMPL;
+}
+#endif
+
 static void dbd_hooks(apr_pool_t *pool)
 {
     ap_hook_pre_config(dbd_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
@@ -973,6 +1807,8 @@ static void dbd_hooks(apr_pool_t *pool)
     APR_REGISTER_OPTIONAL_FN(ap_dbd_close);
     APR_REGISTER_OPTIONAL_FN(ap_dbd_acquire);
     APR_REGISTER_OPTIONAL_FN(ap_dbd_cacquire);
+    APR_REGISTER_OPTIONAL_FN(ap_dbd_cached_select);
+    APR_REGISTER_OPTIONAL_FN(ap_dbd_select_async);
 
     APR_OPTIONAL_HOOK(dbd, post_connect, dbd_init_sql_init,
                       NULL, NULL, APR_HOOK_MIDDLE);
@@ -71,6 +71,7 @@ typedef struct {
 #endif
     apr_hash_t *queries;
     apr_array_header_t *init_queries;
+    int cache_timeout;
 } dbd_cfg_t;
 
 typedef struct {
@@ -80,6 +81,14 @@ typedef struct {
     apr_pool_t *pool;
 } ap_dbd_t;
 
+/* The complete result of a select, as returned by ap_dbd_cached_select */
+typedef struct {
+    int ncols;
+    const char **names;         /* column names, NULL if not available */
+    apr_array_header_t *rows;   /* const char *[ncols] per row, values
+                                 * which are SQL NULL are NULL */
+} ap_dbd_result_t;
+
 /* Export functions to access the database */
 
 /* acquire a connection that MUST be explicitly closed.
@@ -108,12 +117,61 @@ DBD_DECLARE_NONSTD(ap_dbd_t*) ap_dbd_cacquire(conn_rec*);
  */
 DBD_DECLARE_NONSTD(void) ap_dbd_prepare(server_rec*, const char*, const char*);
 
+/* Run the prepared select with the given label and arguments, and read
+ * its whole result into r->pool.  If DBDResultCacheTimeout is set, the
+ * result is cached for idempotent lookups such as authentication and
+ * rewrite maps, and a cached result is returned without acquiring a
+ * database connection.
+ * Returns APR_SUCCESS, APR_ECONNREFUSED if no connection could be
+ * acquired, APR_NOTFOUND if there is no statement with that label, or
+ * APR_EGENERAL if the query failed, with a message in *errmsg.  If
+ * fetching a row failed, the rows read before are returned in *res along
+ * with APR_INCOMPLETE and the message; such results are not cached.
+ */
+DBD_DECLARE_NONSTD(apr_status_t) ap_dbd_cached_select(request_rec *r,
+                                                      const char *label,
+                                                      int nargs,
+                                                      const char **args,
+                                                      ap_dbd_result_t **res,
+                                                      const char **errmsg);
+
+/* Called by ap_dbd_select_async once the query has completed, on a
+ * worker thread and in the context of the suspended request.  rv, res
+ * and errmsg are as returned by ap_dbd_cached_select.  Returns OK or DONE
+ * if the request is complete, SUSPENDED if the callback has arranged for
+ * it to be resumed again (e.g. by another ap_dbd_select_async), or an HTTP
+ * error status.
+ */
+typedef int (ap_dbd_async_fn)(request_rec *r, apr_status_t rv,
+                              ap_dbd_result_t *res, const char *errmsg,
+                              void *baton);
+
+/* Run the prepared select like ap_dbd_cached_select, but without blocking
+ * the calling thread: the query runs on one of the DBDAsyncThreads, and
+ * fn is called with its result.  A handler which gets APR_SUCCESS back
+ * MUST return SUSPENDED.  Returns APR_ENOTIMPL if the MPM cannot suspend
+ * requests or DBDAsyncThreads is 0, in which case the caller should fall
+ * back to ap_dbd_cached_select.
+ */
+DBD_DECLARE_NONSTD(apr_status_t) ap_dbd_select_async(request_rec *r,
+                                                     const char *label,
+                                                     int nargs,
+                                                     const char **args,
+                                                     ap_dbd_async_fn *fn,
+                                                     void *baton);
+
 /* Also export them as optional functions for modules that prefer it */
 APR_DECLARE_OPTIONAL_FN(ap_dbd_t*, ap_dbd_open, (apr_pool_t*, server_rec*));
 APR_DECLARE_OPTIONAL_FN(void, ap_dbd_close, (server_rec*, ap_dbd_t*));
 APR_DECLARE_OPTIONAL_FN(ap_dbd_t*, ap_dbd_acquire, (request_rec*));
 APR_DECLARE_OPTIONAL_FN(ap_dbd_t*, ap_dbd_cacquire, (conn_rec*));
 APR_DECLARE_OPTIONAL_FN(void, ap_dbd_prepare, (server_rec*, const char*, const char*));
+APR_DECLARE_OPTIONAL_FN(apr_status_t, ap_dbd_cached_select,
+                        (request_rec*, const char*, int, const char**,
+                         ap_dbd_result_t**, const char**));
+APR_DECLARE_OPTIONAL_FN(apr_status_t, ap_dbd_select_async,
+                        (request_rec*, const char*, int, const char**,
+                         ap_dbd_async_fn*, void*));
 
 APR_DECLARE_EXTERNAL_HOOK(dbd, DBD, apr_status_t, post_connect,
                           (apr_pool_t *, dbd_cfg_t *, ap_dbd_t *))
@@ -166,6 +166,23 @@ static dav_error * dav_dbm_open(apr_pool_t * p, const dav_resource *resource,
     /* ### should test this result value... */
     (void) dav_fs_dir_file_name(resource, &dirpath, &fname);
 
+    /* A walk may have listed the state dir already: don't try to open a
+     * database that isn't there */
+    if (ro && fname != NULL) {
+        apr_hash_t *statefiles = dav_fs_get_statefiles(resource);
+
+        if (statefiles != NULL) {
+            const char *state1, *state2;
+
+            dav_dbm_get_statefiles(p, fname, &state1, &state2);
+            if (apr_hash_get(statefiles, state1,
+                             APR_HASH_KEY_STRING) == NULL) {
+                *pdb = NULL;
+                return NULL;
+            }
+        }
+    }
+
     /* If not opening read-only, ensure the state dir exists */
     if (!ro) {
         /* ### what are the perf implications of always checking this? */
@@ -22,16 +22,24 @@
 #include "apr_strings.h"
 #include "apr_file_io.h"
 #include "apr_uuid.h"
+#include "apr_hash.h"
+#include "apr_shm.h"
+#include "apr_atomic.h"
+#if APR_HAS_THREADS
+#include "apr_thread_mutex.h"
+#endif
 
 #define APR_WANT_MEMFUNC
 #include "apr_want.h"
 
 #include "httpd.h"
+#include "http_config.h"
 #include "http_log.h"
 
 #include "mod_dav.h"
 #include "repos.h"
 
+APLOG_USE_MODULE(dav_fs);
 
 /* ---------------------------------------------------------------
 **
@@ -322,6 +330,277 @@ static dav_error * dav_fs_really_open_lockdb(dav_lockdb *lockdb)
     return NULL;
 }
 
+/* ---------------------------------------------------------------
+**
+** Lock record cache
+**
+** Every request on a resource consults the lock database, although most
+** resources are not locked at all.  Each child therefore remembers the
+** records it has read, including the absence of a record, keyed by lock
+** database and resource.  A generation number in shared memory is bumped
+** by whichever process changes a lock database, which invalidates the
+** caches of all children at once; the database itself remains the only
+** persistent copy of the locks.
+**
+** The children of the previous generation keep serving requests after a
+** graceful restart, so the generation number has to be the same for old
+** and new children: its segment is created once, in the process pool, and
+** found again through the retained data on every restart.
+*/
+
+#define LOCKCACHE_RETAINED_ID "mod_dav_fs-lockcache"
+
+static apr_uint32_t *lockcache_gen = NULL;
+static int lockcache_max = 0;
+
+typedef struct {
+    apr_pool_t *pool;                /* holds the hash and the records */
+    apr_hash_t *records;             /* key -> apr_datum_t, dsize 0: none */
+    int count;
+    apr_uint32_t gen;                /* generation the records belong to */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} dav_fs_lockcache;
+
+static dav_fs_lockcache *lockcache = NULL;
+
+/*
+** dav_fs_lockcache_init:
+**
+** Find or create the shared generation number, if any server uses the
+** cache.  Called from post_config, so that all children inherit it.
+*/
+apr_status_t dav_fs_lockcache_init(apr_pool_t *p, server_rec *s, int max)
+{
+    apr_pool_t *pproc = s->process->pool;
+    const char *fname = NULL;
+    apr_shm_t **retained;
+    apr_status_t rv;
+
+    lockcache_gen = NULL;
+    lockcache_max = max;
+    if (max <= 0) {
+        return APR_SUCCESS;
+    }
+
+    retained = ap_retained_data_get(LOCKCACHE_RETAINED_ID);
+    if (retained == NULL) {
+        retained = ap_retained_data_create(LOCKCACHE_RETAINED_ID,
+                                           sizeof(*retained));
+    }
+    if (*retained == NULL) {
+        rv = apr_shm_create(retained, sizeof(*lockcache_gen), NULL, pproc);
+        if (APR_STATUS_IS_ENOTIMPL(rv)) {
+            fname = ap_runtime_dir_relative(p, "davfs_lockcache");
+            apr_shm_remove(fname, p);
+            rv = apr_shm_create(retained, sizeof(*lockcache_gen),
+                                apr_pstrdup(pproc, fname), pproc);
+        }
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02838)
+                         "could not create shared memory for the lock "
+                         "database cache%s%s; the cache is disabled",
+                         fname ? " at " : "", fname ? fname : "");
+            *retained = NULL;
+            return rv;
+        }
+        apr_atomic_set32(apr_shm_baseaddr_get(*retained), 0);
+    }
+
+    lockcache_gen = apr_shm_baseaddr_get(*retained);
+
+    return APR_SUCCESS;
+}
+
+/*
+** dav_fs_lockcache_child_init:
+**
+** Set up the cache of this child process.
+*/
+apr_status_t dav_fs_lockcache_child_init(apr_pool_t *p, server_rec *s)
+{
+    dav_fs_lockcache *c;
+    apr_status_t rv;
+
+    lockcache = NULL;
+    if (lockcache_gen == NULL) {
+        return APR_SUCCESS;
+    }
+
+    c = apr_pcalloc(p, sizeof(*c));
+    if ((rv = apr_pool_create(&c->pool, p)) != APR_SUCCESS) {
+        return rv;
+    }
+    apr_pool_tag(c->pool, "dav_fs_lockcache");
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&c->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+#endif
+    c->records = apr_hash_make(c->pool);
+    c->gen = apr_atomic_read32(lockcache_gen);
+    lockcache = c;
+
+    return APR_SUCCESS;
+}
+
+/* build the cache key: the lock database path, a NUL, and the record key */
+static const char *dav_fs_lockcache_key(dav_lockdb *lockdb, apr_datum_t key,
+                                        apr_size_t *klen)
+{
+    apr_size_t plen = strlen(lockdb->info->lockdb_path) + 1;
+    char *hkey = apr_palloc(lockdb->info->pool, plen + key.dsize);
+
+    memcpy(hkey, lockdb->info->lockdb_path, plen);
+    memcpy(hkey + plen, key.dptr, key.dsize);
+    *klen = plen + key.dsize;
+
+    return hkey;
+}
+
+/*
+** dav_fs_lockcache_get:
+**
+** Look up the record for key.  On a hit, the record is copied into the
+** lockdb's pool and 1 is returned.  *gen receives the generation to pass
+** to dav_fs_lockcache_put() once the record has been read from the
+** database; it must be taken before the database is read.
+*/
+static int dav_fs_lockcache_get(dav_lockdb *lockdb, apr_datum_t key,
+                                apr_datum_t *val, apr_uint32_t *gen)
+{
+    dav_fs_lockcache *c = lockcache;
+    const apr_datum_t *rec;
+    const char *hkey;
+    apr_size_t klen;
+
+    if (c == NULL || !dav_get_lockdb_cache(lockdb->info->r)) {
+        return 0;
+    }
+
+    *gen = apr_atomic_read32(lockcache_gen);
+    hkey = dav_fs_lockcache_key(lockdb, key, &klen);
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(c->mutex);
+#endif
+    if (c->gen != *gen) {
+        apr_pool_clear(c->pool);
+        c->records = apr_hash_make(c->pool);
+        c->count = 0;
+        c->gen = *gen;
+    }
+    rec = apr_hash_get(c->records, hkey, klen);
+    if (rec != NULL) {
+        val->dsize = rec->dsize;
+        val->dptr = rec->dsize ? apr_pmemdup(lockdb->info->pool, rec->dptr,
+                                             rec->dsize)
+                               : NULL;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(c->mutex);
+#endif
+
+    return rec != NULL;
+}
+
+/*
+** dav_fs_lockcache_put:
+**
+** Remember the record for key as read from the database, unless the
+** database has been changed since generation gen.
+*/
+static void dav_fs_lockcache_put(dav_lockdb *lockdb, apr_datum_t key,
+                                 apr_datum_t val, apr_uint32_t gen)
+{
+    dav_fs_lockcache *c = lockcache;
+    apr_datum_t *rec;
+    const char *hkey;
+    apr_size_t klen;
+
+    if (c == NULL || !dav_get_lockdb_cache(lockdb->info->r)) {
+        return;
+    }
+
+    hkey = dav_fs_lockcache_key(lockdb, key, &klen);
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(c->mutex);
+#endif
+    if (c->gen == gen && apr_atomic_read32(lockcache_gen) == gen) {
+        if (c->count >= lockcache_max) {
+            /* full: start over rather than track the age of records */
+            apr_pool_clear(c->pool);
+            c->records = apr_hash_make(c->pool);
+            c->count = 0;
+        }
+        if (apr_hash_get(c->records, hkey, klen) == NULL) {
+            rec = apr_palloc(c->pool, sizeof(*rec));
+            rec->dsize = val.dsize;
+            rec->dptr = val.dsize ? apr_pmemdup(c->pool, val.dptr, val.dsize)
+                                  : NULL;
+            apr_hash_set(c->records, apr_pmemdup(c->pool, hkey, klen), klen,
+                         rec);
+            c->count++;
+        }
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(c->mutex);
+#endif
+}
+
+/* invalidate the record caches of all children */
+static void dav_fs_lockcache_changed(void)
+{
+    if (lockcache_gen != NULL) {
+        apr_atomic_inc32(lockcache_gen);
+    }
+}
+
+/*
+** dav_fs_fetch_lock_record:
+**
+** Fetch the raw lock record for key, from the cache if possible, else from
+** the lock database.  *cached is set if val must not be passed to
+** dav_dbm_freedatum().
+*/
+static dav_error * dav_fs_fetch_lock_record(dav_lockdb *lockdb,
+                                            apr_datum_t key,
+                                            apr_datum_t *val, int *cached)
+{
+    apr_uint32_t gen = 0;
+    dav_error *err;
+
+    val->dptr = NULL;
+    val->dsize = 0;
+    *cached = 1;
+
+    if (dav_fs_lockcache_get(lockdb, key, val, &gen)) {
+        return NULL;
+    }
+
+    if ((err = dav_fs_really_open_lockdb(lockdb)) != NULL) {
+        /* ### add a higher-level error? */
+        return err;
+    }
+
+    /*
+    ** If we opened readonly and the db wasn't there, then there are no
+    ** locks for this resource.
+    */
+    if (lockdb->info->db != NULL) {
+        if ((err = dav_dbm_fetch(lockdb->info->db, key, val)) != NULL)
+            return err;
+        *cached = 0;
+    }
+
+    dav_fs_lockcache_put(lockdb, key, *val, gen);
+
+    return NULL;
+}
+
 /*
 ** dav_fs_open_lockdb:
 **
@@ -441,6 +720,7 @@ static dav_error * dav_fs_save_lock_record(dav_lockdb *lockdb, apr_datum_t key,
         /* don't fail if the key is not present */
         /* ### but what about other errors? */
         (void) dav_dbm_delete(lockdb->info->db, key);
+        dav_fs_lockcache_changed();
         return NULL;
     }
 
@@ -496,7 +776,9 @@ static dav_error * dav_fs_save_lock_record(dav_lockdb *lockdb, apr_datum_t key,
         ip = ip->next;
     }
 
-    if ((err = dav_dbm_store(lockdb->info->db, key, val)) != NULL) {
+    err = dav_dbm_store(lockdb->info->db, key, val);
+    dav_fs_lockcache_changed();
+    if (err != NULL) {
         /* ### more details? add an error_id? */
         return dav_push_error(lockdb->info->pool,
                               HTTP_INTERNAL_SERVER_ERROR,
@@ -527,6 +809,7 @@ static dav_error * dav_fs_load_lock_record(dav_lockdb *lockdb, apr_datum_t key,
     dav_error *err;
     apr_size_t offset = 0;
     int need_save = DAV_FALSE;
+    int cached;
     apr_datum_t val = { 0 };
     dav_lock_discovery *dp;
     dav_lock_indirect *ip;
@@ -537,19 +820,7 @@ static dav_error * dav_fs_load_lock_record(dav_lockdb *lockdb, apr_datum_t key,
         *indirect = NULL;
     }
 
-    if ((err = dav_fs_really_open_lockdb(lockdb)) != NULL) {
-        /* ### add a higher-level error? */
-        return err;
-    }
-
-    /*
-    ** If we opened readonly and the db wasn't there, then there are no
-    ** locks for this resource. Just exit.
-    */
-    if (lockdb->info->db == NULL)
-        return NULL;
-
-    if ((err = dav_dbm_fetch(lockdb->info->db, key, &val)) != NULL)
+    if ((err = dav_fs_fetch_lock_record(lockdb, key, &val, &cached)) != NULL)
         return err;
 
     if (!val.dsize)
@@ -631,7 +902,8 @@ static dav_error * dav_fs_load_lock_record(dav_lockdb *lockdb, apr_datum_t key,
             break;
 
         default:
-            dav_dbm_freedatum(lockdb->info->db, val);
+            if (!cached)
+                dav_dbm_freedatum(lockdb->info->db, val);
 
             /* ### should use a computed_desc and insert corrupt token data */
             --offset;
@@ -646,7 +918,8 @@ static dav_error * dav_fs_load_lock_record(dav_lockdb *lockdb, apr_datum_t key,
         }
     }
 
-    dav_dbm_freedatum(lockdb->info->db, val);
+    if (!cached)
+        dav_dbm_freedatum(lockdb->info->db, val);
 
     /* Clean up this record if we found expired locks */
     /*
@@ -1134,10 +1407,18 @@ static dav_error * dav_fs_has_locks(dav_lockdb *lockdb,
                                     int *locks_present)
 {
     dav_error *err;
-    apr_datum_t key;
+    apr_datum_t key, val;
+    apr_uint32_t gen;
 
     *locks_present = 0;
 
+    key = dav_fs_build_key(lockdb->info->pool, resource);
+
+    if (dav_fs_lockcache_get(lockdb, key, &val, &gen)) {
+        *locks_present = (val.dsize != 0);
+        return NULL;
+    }
+
     if ((err = dav_fs_really_open_lockdb(lockdb)) != NULL) {
         /* ### insert a higher-level error description */
         return err;
@@ -1150,8 +1431,6 @@ static dav_error * dav_fs_has_locks(dav_lockdb *lockdb,
     if (lockdb->info->db == NULL)
         return NULL;
 
-    key = dav_fs_build_key(lockdb->info->pool, resource);
-
     *locks_present = dav_dbm_exists(lockdb->info->db, key);
 
     return NULL;
@@ -24,6 +24,7 @@
 /* per-server configuration */
 typedef struct {
     const char *lockdb_path;
+    int lockdb_cache;            /* max. cached records, -1 if unset */
 
 } dav_fs_server_conf;
 
@@ -37,9 +38,21 @@ const char *dav_get_lockdb_path(const request_rec *r)
     return conf->lockdb_path;
 }
 
+int dav_get_lockdb_cache(const request_rec *r)
+{
+    dav_fs_server_conf *conf;
+
+    conf = ap_get_module_config(r->server->module_config, &dav_fs_module);
+    return conf->lockdb_cache > 0;
+}
+
 static void *dav_fs_create_server_config(apr_pool_t *p, server_rec *s)
 {
-    return apr_pcalloc(p, sizeof(dav_fs_server_conf));
+    dav_fs_server_conf *conf = apr_pcalloc(p, sizeof(dav_fs_server_conf));
+
+    conf->lockdb_cache = -1;
+
+    return conf;
 }
 
 static void *dav_fs_merge_server_config(apr_pool_t *p,
@@ -53,6 +66,8 @@ static void *dav_fs_merge_server_config(apr_pool_t *p,
 
     newconf->lockdb_path =
         child->lockdb_path ? child->lockdb_path : parent->lockdb_path;
+    newconf->lockdb_cache =
+        child->lockdb_cache != -1 ? child->lockdb_cache : parent->lockdb_cache;
 
     return newconf;
 }
@@ -76,11 +91,63 @@ static const char *dav_fs_cmd_davlockdb(cmd_parms *cmd, void *config,
     return NULL;
 }
 
+/*
+ * Command handler for the DAVLockDBCacheSize directive, which is TAKE1
+ */
+static const char *dav_fs_cmd_davlockdbcache(cmd_parms *cmd, void *config,
+                                             const char *arg1)
+{
+    dav_fs_server_conf *conf;
+    char *end;
+    long n;
+
+    conf = ap_get_module_config(cmd->server->module_config,
+                                &dav_fs_module);
+    n = strtol(arg1, &end, 10);
+    if (*end || n < 0 || n > 1000000) {
+        return "DAVLockDBCacheSize must be a number of records "
+               "between 0 and 1000000";
+    }
+    conf->lockdb_cache = (int)n;
+
+    return NULL;
+}
+
+static int dav_fs_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                              apr_pool_t *ptemp, server_rec *s)
+{
+    server_rec *sp;
+    int max = 0;
+
+    /* one cache serves all servers; size it for the largest setting */
+    for (sp = s; sp; sp = sp->next) {
+        dav_fs_server_conf *conf;
+
+        conf = ap_get_module_config(sp->module_config, &dav_fs_module);
+        if (conf->lockdb_cache > max) {
+            max = conf->lockdb_cache;
+        }
+    }
+
+    /* without shared memory the cache is merely disabled */
+    dav_fs_lockcache_init(pconf, s, max);
+
+    return OK;
+}
+
+static void dav_fs_child_init(apr_pool_t *p, server_rec *s)
+{
+    dav_fs_lockcache_child_init(p, s);
+}
+
 static const command_rec dav_fs_cmds[] =
 {
     /* per server */
     AP_INIT_TAKE1("DAVLockDB", dav_fs_cmd_davlockdb, NULL, RSRC_CONF,
                   "specify a lock database"),
+    AP_INIT_TAKE1("DAVLockDBCacheSize", dav_fs_cmd_davlockdbcache, NULL,
+                  RSRC_CONF,
+                  "number of lock records each child caches (0 = off)"),
 
     { NULL }
 };
@@ -93,6 +160,9 @@ static void register_hooks(apr_pool_t *p)
     dav_hook_insert_all_liveprops(dav_fs_insert_all_liveprops, NULL, NULL,
                                   APR_HOOK_MIDDLE);
 
+    ap_hook_post_config(dav_fs_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(dav_fs_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+
     dav_fs_register(p);
 }
 
@@ -22,6 +22,7 @@
 #include "apr_file_io.h"
 #include "apr_strings.h"
 #include "apr_buckets.h"
+#include "apr_hash.h"
 
 #if APR_HAVE_UNISTD_H
 #include <unistd.h>             /* for getpid() */
@@ -47,6 +48,7 @@ struct dav_resource_private {
     const char *pathname;   /* full pathname to resource */
     apr_finfo_t finfo;       /* filesystem info */
     request_rec *r;
+    apr_hash_t *statefiles;  /* names in the parent's state dir, if known */
 };
 
 /* private context for doing a filesystem walk */
@@ -234,6 +236,31 @@ const char *dav_fs_pathname(const dav_resource *resource)
     return resource->info->pathname;
 }
 
+apr_hash_t *dav_fs_get_statefiles(const dav_resource *resource)
+{
+    return resource->info->statefiles;
+}
+
+/* read the names in the state dir of a directory (ending in a slash) */
+static apr_hash_t *dav_fs_read_statefiles(apr_pool_t *p, const char *dirname)
+{
+    apr_hash_t *names = apr_hash_make(p);
+    apr_finfo_t dirent;
+    apr_dir_t *dirp;
+
+    /* a missing state dir simply leaves the set empty */
+    if (apr_dir_open(&dirp, apr_pstrcat(p, dirname, DAV_FS_STATE_DIR, NULL),
+                     p) == APR_SUCCESS) {
+        while (apr_dir_read(&dirent, APR_FINFO_NAME, dirp) == APR_SUCCESS) {
+            const char *name = apr_pstrdup(p, dirent.name);
+            apr_hash_set(names, name, APR_HASH_KEY_STRING, name);
+        }
+        apr_dir_close(dirp);
+    }
+
+    return names;
+}
+
 dav_error * dav_fs_dir_file_name(
     const dav_resource *resource,
     const char **dirpath_p,
@@ -1536,6 +1563,11 @@ static dav_error * dav_fs_walker(dav_fs_walker_context *fsctx, int depth)
         /* ### need a better error */
         return dav_new_error(pool, HTTP_NOT_FOUND, 0, status, NULL);
     }
+
+    /* list the state dir once, so that opening the property database of
+     * each member does not have to try (and mostly fail) on its own */
+    fsctx->info1.statefiles = dav_fs_read_statefiles(pool, fsctx->path1.buf);
+
     while ((apr_dir_read(&dirent, APR_FINFO_DIRENT, dirp)) == APR_SUCCESS) {
         apr_size_t len;
 
@@ -1607,6 +1639,7 @@ static dav_error * dav_fs_walker(dav_fs_walker_context *fsctx, int depth)
             apr_size_t save_path_len = fsctx->path1.cur_len;
             apr_size_t save_uri_len = fsctx->uri_buf.cur_len;
             apr_size_t save_path2_len = fsctx->path2.cur_len;
+            apr_hash_t *save_statefiles = fsctx->info1.statefiles;
 
             /* adjust length to incorporate the subdir name */
             fsctx->path1.cur_len += len;
@@ -1632,6 +1665,7 @@ static dav_error * dav_fs_walker(dav_fs_walker_context *fsctx, int depth)
             fsctx->path1.cur_len = save_path_len;
             fsctx->path2.cur_len = save_path2_len;
             fsctx->uri_buf.cur_len = save_uri_len;
+            fsctx->info1.statefiles = save_statefiles;
 
             fsctx->res1.collection = 0;
             fsctx->res2.collection = 0;
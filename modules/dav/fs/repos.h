@@ -49,6 +49,10 @@ dav_error * dav_fs_dir_file_name(const dav_resource *resource,
 dav_error * dav_fs_get_locknull_members(const dav_resource *resource,
                                         dav_buffer *pbuf);
 
+/* return the names in the state directory of the resource's parent, if
+ * they have been read in advance by a walk, or NULL */
+apr_hash_t *dav_fs_get_statefiles(const dav_resource *resource);
+
 
 /* DBM functions used by the repository and locking providers */
 extern const dav_hooks_db dav_hooks_db_dbm;
@@ -67,6 +71,13 @@ void dav_dbm_close(dav_db *db);
 /* where is the lock database located? */
 const char *dav_get_lockdb_path(const request_rec *r);
 
+/* are lock records cached for this request's server? */
+int dav_get_lockdb_cache(const request_rec *r);
+
+/* set up the lock record cache (post_config), and per child */
+apr_status_t dav_fs_lockcache_init(apr_pool_t *p, server_rec *s, int max);
+apr_status_t dav_fs_lockcache_child_init(apr_pool_t *p, server_rec *s);
+
 const dav_hooks_locks *dav_fs_get_lock_hooks(request_rec *r);
 const dav_hooks_propdb *dav_fs_get_propdb_hooks(request_rec *r);
 
@@ -14,16 +14,58 @@
  * limitations under the License.
  */
 
+#include "apr_shm.h"
+#include "apr_global_mutex.h"
+#include "apr_strings.h"
+
 #include "httpd.h"
 #include "http_config.h"
+#include "http_core.h"
 #include "http_log.h"
 #include "util_filter.h"
+#include "util_mutex.h"
 
 #include "mod_ratelimit.h"
 
 #define RATE_LIMIT_FILTER_NAME "RATE_LIMIT"
 #define RATE_INTERVAL_MS (200)
 
+module AP_MODULE_DECLARE_DATA ratelimit_module;
+
+/*
+ * Bandwidth is shaped with "virtual scheduling" token buckets: a bucket
+ * records the time at which it will have refilled completely (tat), and
+ * data may be sent as soon as that time is no further ahead than the
+ * bucket's burst allowance.  Each request has one bucket, and each server
+ * with a RateLimitServerBandwidth has one in shared memory, which all the
+ * requests of all children draw from.  The buckets and their mutex are
+ * kept across restarts, so that the children of the old and of the new
+ * generation share them during a graceful restart.
+ */
+typedef struct rl_bucket_t
+{
+    apr_time_t tat;
+} rl_bucket_t;
+
+typedef struct rl_server_conf
+{
+    int speed;                  /* bytes / second for the server, or 0 */
+    int index;                  /* of the server's bucket in rl_buckets */
+} rl_server_conf;
+
+#define RL_RETAINED_ID "mod_ratelimit-buckets"
+
+typedef struct rl_retained_t
+{
+    apr_shm_t *shm;
+    int count;                  /* buckets in shm */
+    apr_global_mutex_t *mutex;
+} rl_retained_t;
+
+static const char *rl_mutex_type = "ratelimit-shm";
+static apr_global_mutex_t *rl_mutex = NULL;
+static rl_bucket_t *rl_buckets = NULL;
+
 typedef enum rl_state_e
 {
     RATE_ERROR,
@@ -35,6 +77,9 @@ typedef struct rl_ctx_t
 {
     int speed;
     int chunk_size;
+    apr_time_t tat;             /* the request's own bucket */
+    apr_interval_time_t burst;  /* allowance in advance of tat */
+    rl_server_conf *sconf;      /* server bucket, if any */
     rl_state_e state;
     apr_bucket_brigade *tmpbb;
     apr_bucket_brigade *holdingbb;
@@ -55,13 +100,53 @@ static void brigade_dump(request_rec *r, apr_bucket_brigade *bb)
 }
 #endif
 
+/*
+ * Take len bytes from the request's and the server's buckets, and return
+ * how long to wait before sending them.
+ */
+static apr_interval_time_t rl_reserve(ap_filter_t *f, rl_ctx_t *ctx,
+                                      apr_off_t len)
+{
+    apr_time_t now = apr_time_now();
+    apr_time_t at = now;
+
+    if (ctx->speed > 0) {
+        apr_time_t tat = ctx->tat > now ? ctx->tat : now;
+
+        if (tat - ctx->burst > at) {
+            at = tat - ctx->burst;
+        }
+        ctx->tat = tat + len * APR_USEC_PER_SEC / ctx->speed;
+    }
+
+    if (ctx->sconf && rl_buckets) {
+        rl_bucket_t *b = &rl_buckets[ctx->sconf->index];
+        apr_status_t rv;
+
+        if ((rv = apr_global_mutex_lock(rl_mutex)) != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, f->r, APLOGNO(02839)
+                          "rl: could not lock the server bucket");
+        }
+        else {
+            /* the server's bandwidth is handed out first come, first
+             * served: reserve the earliest slot after 'at' */
+            if (b->tat > at) {
+                at = b->tat;
+            }
+            b->tat = at + len * APR_USEC_PER_SEC / ctx->sconf->speed;
+            apr_global_mutex_unlock(rl_mutex);
+        }
+    }
+
+    return at - now;
+}
+
 static apr_status_t
 rate_limit_filter(ap_filter_t *f, apr_bucket_brigade *input_bb)
 {
     apr_status_t rv = APR_SUCCESS;
     rl_ctx_t *ctx = f->ctx;
     apr_bucket *fb;
-    int do_sleep = 0;
     apr_bucket_alloc_t *ba = f->r->connection->bucket_alloc;
     apr_bucket_brigade *bb = input_bb;
 
@@ -74,7 +159,9 @@ rate_limit_filter(ap_filter_t *f, apr_bucket_brigade *input_bb)
     if (ctx == NULL) {
 
         const char *rl = NULL;
-        int ratelimit;
+        int ratelimit = 0;
+        apr_off_t burst = 0;
+        rl_server_conf *sconf;
 
         /* no subrequests. */
         if (f->r->main != NULL) {
@@ -82,30 +169,51 @@ rate_limit_filter(ap_filter_t *f, apr_bucket_brigade *input_bb)
             return ap_pass_brigade(f->next, bb);
         }
 
-        rl = apr_table_get(f->r->subprocess_env, "rate-limit");
+        sconf = ap_get_module_config(f->r->server->module_config,
+                                     &ratelimit_module);
+        if (!sconf->speed || !rl_buckets) {
+            sconf = NULL;
+        }
 
-        if (rl == NULL) {
-            ap_remove_output_filter(f);
-            return ap_pass_brigade(f->next, bb);
+        rl = apr_table_get(f->r->subprocess_env, "rate-limit");
+        if (rl != NULL) {
+            /* rl is in kilo bytes / second  */
+            ratelimit = atoi(rl) * 1024;
         }
-        
-        /* rl is in kilo bytes / second  */
-        ratelimit = atoi(rl) * 1024;
-        if (ratelimit <= 0) {
+
+        if (ratelimit <= 0 && sconf == NULL) {
             /* remove ourselves */
             ap_remove_output_filter(f);
             return ap_pass_brigade(f->next, bb);
         }
 
+        /* rate-initial-burst is in kilo bytes, too */
+        rl = apr_table_get(f->r->subprocess_env, "rate-initial-burst");
+        if (rl != NULL && ratelimit > 0) {
+            burst = (apr_off_t)atoi(rl) * 1024;
+            if (burst < 0) {
+                burst = 0;
+            }
+        }
+
         /* first run, init stuff */
-        ctx = apr_palloc(f->r->pool, sizeof(rl_ctx_t));
+        ctx = apr_pcalloc(f->r->pool, sizeof(rl_ctx_t));
         f->ctx = ctx;
         ctx->state = RATE_LIMIT;
-        ctx->speed = ratelimit;
+        ctx->speed = ratelimit > 0 ? ratelimit : 0;
+        ctx->sconf = sconf;
+        ctx->tat = apr_time_now();
+        if (ctx->speed) {
+            ctx->burst = burst * APR_USEC_PER_SEC / ctx->speed;
+        }
 
         /* calculate how many bytes / interval we want to send */
         /* speed is bytes / second, so, how many  (speed / 1000 % interval) */
-        ctx->chunk_size = (ctx->speed / (1000 / RATE_INTERVAL_MS));
+        ctx->chunk_size = ((ctx->speed ? ctx->speed : sconf->speed)
+                           / (1000 / RATE_INTERVAL_MS));
+        if (ctx->chunk_size <= 0) {
+            ctx->chunk_size = 1;
+        }
         ctx->tmpbb = apr_brigade_create(f->r->pool, ba);
         ctx->holdingbb = apr_brigade_create(f->r->pool, ba);
     }
@@ -166,6 +274,7 @@ rate_limit_filter(ap_filter_t *f, apr_bucket_brigade *input_bb)
 
             while (!APR_BRIGADE_EMPTY(bb)) {
                 apr_bucket *stop_point;
+                apr_interval_time_t delay;
                 apr_off_t len = 0;
 
                 if (f->c->aborted) {
@@ -174,15 +283,6 @@ rate_limit_filter(ap_filter_t *f, apr_bucket_brigade *input_bb)
                     break;
                 }
 
-                if (do_sleep) {
-                    apr_sleep(RATE_INTERVAL_MS * 1000);
-                }
-                else {
-                    do_sleep = 1;
-                }
-
-                apr_brigade_length(bb, 1, &len);
-
                 rv = apr_brigade_partition(bb, ctx->chunk_size, &stop_point);
                 if (rv != APR_SUCCESS && rv != APR_INCOMPLETE) {
                     ctx->state = RATE_ERROR;
@@ -203,6 +303,15 @@ rate_limit_filter(ap_filter_t *f, apr_bucket_brigade *input_bb)
                     APR_BRIGADE_CONCAT(ctx->tmpbb, bb);
                 }
 
+                /* the chunk's buckets have been read by the partition;
+                 * wait only for as long as the buckets need to refill,
+                 * the time spent writing the previous chunk counts */
+                apr_brigade_length(ctx->tmpbb, 0, &len);
+                delay = rl_reserve(f, ctx, len);
+                if (delay > 0) {
+                    apr_sleep(delay);
+                }
+
                 fb = apr_bucket_flush_create(ba);
 
                 APR_BRIGADE_INSERT_TAIL(ctx->tmpbb, fb);
@@ -294,19 +403,148 @@ AP_RL_DECLARE_DATA const apr_bucket_type_t ap_rl_bucket_type_start = {
 
 
 
+static void *rl_create_server_config(apr_pool_t *p, server_rec *s)
+{
+    return apr_pcalloc(p, sizeof(rl_server_conf));
+}
+
+static const char *rl_set_server_bandwidth(cmd_parms *cmd, void *dummy,
+                                           const char *arg)
+{
+    rl_server_conf *sconf = ap_get_module_config(cmd->server->module_config,
+                                                 &ratelimit_module);
+    char *end;
+    long kbytes = strtol(arg, &end, 10);
+
+    /* in kilo bytes / second, like rate-limit */
+    if (*end || kbytes < 0 || kbytes > APR_INT32_MAX / 1024) {
+        return "RateLimitServerBandwidth must be a rate in KiB/s";
+    }
+    sconf->speed = (int)kbytes * 1024;
+
+    return NULL;
+}
+
+static int rl_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+                         apr_pool_t *ptemp)
+{
+    return ap_mutex_register(pconf, rl_mutex_type, NULL, APR_LOCK_DEFAULT, 0);
+}
+
+static int rl_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                          apr_pool_t *ptemp, server_rec *s)
+{
+    apr_pool_t *pproc = s->process->pool;
+    const char *fname = NULL;
+    rl_retained_t *retained;
+    apr_shm_t *shm;
+    apr_status_t rv;
+    server_rec *sp;
+    int count = 0;
+
+    rl_buckets = NULL;
+    rl_mutex = NULL;
+
+    /* the configuration is read twice; set up on the second pass only */
+    if (ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_CREATE_PRE_CONFIG) {
+        return OK;
+    }
+
+    for (sp = s; sp; sp = sp->next) {
+        rl_server_conf *sconf = ap_get_module_config(sp->module_config,
+                                                     &ratelimit_module);
+        if (sconf->speed) {
+            sconf->index = count++;
+        }
+    }
+    if (!count) {
+        return OK;
+    }
+
+    retained = ap_retained_data_get(RL_RETAINED_ID);
+    if (retained == NULL) {
+        retained = ap_retained_data_create(RL_RETAINED_ID, sizeof(*retained));
+    }
+
+    if (retained->count < count) {
+        /* a previous, smaller segment is left to the old generation */
+        rv = apr_shm_create(&shm, count * sizeof(rl_bucket_t), NULL, pproc);
+        if (APR_STATUS_IS_ENOTIMPL(rv)) {
+            fname = ap_runtime_dir_relative(pconf,
+                        apr_psprintf(ptemp, "ratelimit_shm.%d", count));
+            apr_shm_remove(fname, pconf);
+            rv = apr_shm_create(&shm, count * sizeof(rl_bucket_t),
+                                apr_pstrdup(pproc, fname), pproc);
+        }
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(02840)
+                         "rl: could not create shared memory for %d server "
+                         "bucket(s)", count);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        memset(apr_shm_baseaddr_get(shm), 0, count * sizeof(rl_bucket_t));
+        retained->shm = shm;
+        retained->count = count;
+    }
+
+    if (retained->mutex == NULL) {
+        rv = ap_global_mutex_create(&retained->mutex, NULL, rl_mutex_type,
+                                    NULL, s, pproc, 0);
+        if (rv != APR_SUCCESS) {
+            retained->mutex = NULL;
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    rl_mutex = retained->mutex;
+    rl_buckets = apr_shm_baseaddr_get(retained->shm);
+
+    return OK;
+}
+
+static void rl_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_status_t rv;
+
+    if (!rl_mutex) {
+        return;
+    }
+
+    rv = apr_global_mutex_child_init(&rl_mutex,
+                                     apr_global_mutex_lockfile(rl_mutex), p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(02841)
+                     "rl: could not initialize the server bucket mutex in "
+                     "child; server bandwidth limits are disabled");
+        rl_buckets = NULL;
+    }
+}
+
+static const command_rec rl_cmds[] =
+{
+    AP_INIT_TAKE1("RateLimitServerBandwidth", rl_set_server_bandwidth, NULL,
+                  RSRC_CONF,
+                  "Bandwidth in KiB/s that all rate limited responses of the "
+                  "server share"),
+    {NULL}
+};
+
 static void register_hooks(apr_pool_t *p)
 {
     /* run after mod_deflate etc etc, but not at connection level, ie, mod_ssl. */
     ap_register_output_filter(RATE_LIMIT_FILTER_NAME, rate_limit_filter,
                               NULL, AP_FTYPE_PROTOCOL + 3);
+    ap_hook_pre_config(rl_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(rl_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(rl_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 AP_DECLARE_MODULE(ratelimit) = {
     STANDARD20_MODULE_STUFF,
     NULL,                       /* create per-directory config structure */
     NULL,                       /* merge per-directory config structures */
-    NULL,                       /* create per-server config structure */
+    rl_create_server_config,    /* create per-server config structure */
     NULL,                       /* merge per-server config structures */
-    NULL,                       /* command apr_table_t */
+    rl_cmds,                    /* command apr_table_t */
     register_hooks
 };
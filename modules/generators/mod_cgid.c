@@ -35,6 +35,9 @@
 #include "apr_buckets.h"
 #include "apr_optional.h"
 #include "apr_signal.h"
+#include "apr_atomic.h"
+#include "apr_poll.h"
+#include "apr_shm.h"
 
 #define APR_WANT_STRFUNC
 #include "apr_want.h"
@@ -48,6 +51,12 @@
 #if APR_HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
+#if APR_HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#if APR_HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
 
 #include "util_filter.h"
 #include "httpd.h"
@@ -60,8 +69,10 @@
 #include "util_script.h"
 #include "ap_mpm.h"
 #include "mpm_common.h"
+#include "util_fcgi.h"
 #include "mod_suexec.h"
 #include "../filters/mod_include.h"
+#include "mod_status.h"
 
 #include "mod_core.h"
 
@@ -96,9 +107,14 @@ static struct sockaddr_un *server_addr;
 static apr_socklen_t server_addr_len;
 static pid_t parent_pid;
 static ap_unix_identity_t empty_ugid = { (uid_t)-1, (gid_t)-1, -1 };
+static int cgid_spawners;
 
 typedef struct { 
     apr_interval_time_t timeout;
+    int persist;                /* -1 unset, see CGIDPersistent */
+    int persist_processes;      /* 0 unset */
+    int persist_max_requests;   /* -1 unset, 0 unlimited */
+    apr_interval_time_t persist_idle_timeout; /* -1 unset */
 } cgid_dirconf;
 
 /* The APR other-child API doesn't tell us how the daemon exited
@@ -143,6 +159,7 @@ static int is_scriptaliased(request_rec *r)
 #define CGI_REQ    1
 #define SSI_REQ    2
 #define GETPID_REQ 3 /* get the pid of script created for prior request */
+#define PERSIST_REQ 4 /* start a persistent script in a reserved slot */
 
 #define ERRFN_USERDATA_KEY         "CGIDCHILDERRFN"
 
@@ -170,6 +187,14 @@ static int is_scriptaliased(request_rec *r)
 #define DEFAULT_CONNECT_ATTEMPTS  15
 #endif
 
+/* The number of processes of the cgid daemon which accept requests and
+ * start scripts, see CGIDSpawners.
+ */
+#define DEFAULT_CGID_SPAWNERS 1
+#ifndef CGID_MAX_SPAWNERS
+#define CGID_MAX_SPAWNERS 64
+#endif
+
 typedef struct {
     const char *logname;
     long logbytes;
@@ -210,12 +235,120 @@ typedef struct {
     apr_size_t uri_len;
     apr_size_t args_len;
     int loglevel; /* to stuff in server_rec */
+    apr_time_t request_time; /* along with conn_id, tells the daemon which
+                              * script a GETPID_REQ is about
+                              */
+    apr_time_t submitted;    /* when the request was sent to the daemon */
+    int persist_slot;        /* the slot a PERSIST_REQ starts a script for */
 
 #ifdef AP_CGID_USE_RLIMIT
     cgid_rlimit_t limits;
 #endif
 } cgid_req_t;
 
+/* What a spawner reports for mod_status; each spawner is the only writer
+ * of its own entry.
+ */
+typedef struct {
+    pid_t pid;
+    int busy;
+    apr_uint32_t started;        /* scripts started */
+    apr_uint32_t failed;         /* scripts which couldn't be started */
+    apr_uint64_t spawn_time;     /* total time spent starting scripts */
+    apr_uint64_t spawn_max;
+    apr_uint64_t wait_time;      /* total time requests waited to be accepted */
+    apr_uint64_t wait_max;
+} cgid_spawner_t;
+
+/* The script started for the latest request of a connection, which is
+ * looked up for GETPID_REQ by whichever spawner accepts it.  The stamp is
+ * written last and identifies the request.
+ */
+typedef struct {
+    unsigned long conn_id;
+    pid_t pid;
+    apr_uint32_t stamp;
+} cgid_script_t;
+
+/* Persistent scripts, see CGIDPersistent.  A slot is reserved by the
+ * server for a new process, which the daemon starts listening on a socket
+ * of its own.  The server sends requests straight to the socket, and the
+ * parent process stops the processes which are retired or idle for too
+ * long from its monitor hook.  The slots are kept across restarts, so
+ * that the processes used by the children of an old generation can be
+ * stopped once those are done with them.
+ */
+#ifndef CGID_PERSIST_SLOTS
+#define CGID_PERSIST_SLOTS 256
+#endif
+#define CGID_PERSIST_PATH_LEN 256
+#define DEFAULT_PERSIST_PROCESSES 4
+#define DEFAULT_PERSIST_IDLE_TIMEOUT apr_time_from_sec(300)
+#define CGID_PERSIST_START_TIMEOUT apr_time_from_sec(60)
+#define CGID_PERSIST_PROBE_TIMEOUT apr_time_from_sec(5)
+#define CGID_PERSIST_REFUSED_TIME apr_time_from_sec(60)
+#define CGID_PERSIST_RETAINED_ID "mod_cgid-persist"
+
+#define CGID_PERSIST_FREE      0
+#define CGID_PERSIST_STARTING  1  /* reserved, being started by the daemon */
+#define CGID_PERSIST_READY     2
+#define CGID_PERSIST_RETIRED   3  /* to be stopped once no request uses it */
+#define CGID_PERSIST_STOPPING  4  /* sent SIGTERM */
+#define CGID_PERSIST_REFUSED   5  /* not a FastCGI application, run the
+                                   * script as a CGI script for a while */
+
+typedef struct {
+    apr_uint32_t state;          /* CGID_PERSIST_* */
+    apr_uint32_t active;         /* requests sent to the process */
+    apr_uint32_t requests;       /* requests served by the process */
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+    int max_requests;
+    ap_generation_t generation;  /* of the child which reserved the slot */
+    apr_interval_time_t idle_timeout;
+    apr_time_t last_used;        /* or when it was reserved or stopped */
+    char script[CGID_PERSIST_PATH_LEN];
+} cgid_persist_t;
+
+/* Shared by the server and the daemon processes, followed by num_scripts
+ * cgid_script_t, one for each possible connection id.
+ */
+typedef struct {
+    apr_uint32_t connected;      /* connections made to the daemon */
+    apr_uint32_t accepted;       /* connections accepted by the daemon */
+    int num_spawners;
+    apr_size_t num_scripts;
+    cgid_spawner_t spawners[CGID_MAX_SPAWNERS];
+} cgid_shared_t;
+
+#define CGID_SCRIPTS(shared) ((cgid_script_t *)((shared) + 1))
+
+static apr_shm_t *cgid_shm;
+static cgid_shared_t *cgid_shared;
+
+/* CGID_PERSIST_SLOTS slots, NULL without shared memory */
+static cgid_persist_t *cgid_persist;
+
+/* The socket a persistent script listens on, next to the daemon's */
+static apr_status_t persist_sockaddr(apr_pool_t *p, int slot,
+                                     struct sockaddr_un **addr,
+                                     apr_socklen_t *addr_len)
+{
+    const char *path = apr_psprintf(p, "%s.%d", sockname, slot);
+    apr_size_t len = strlen(path);
+
+    if (len > sizeof((*addr)->sun_path) - 1) {
+        return APR_ENAMETOOLONG;
+    }
+    *addr_len = APR_OFFSETOF(struct sockaddr_un, sun_path) + len;
+    *addr = apr_pcalloc(p, *addr_len + 1);
+    (*addr)->sun_family = AF_UNIX;
+    strcpy((*addr)->sun_path, path);
+
+    return APR_SUCCESS;
+}
+
 /* This routine is called to create the argument list to be passed
  * to the CGI script.  When suexec is enabled, the suexec path, user, and
  * group are the first three arguments to be passed; if not, all three
@@ -476,7 +609,7 @@ static apr_status_t get_req(int fd, request_rec *r, char **argv0, char ***env,
 }
 
 static apr_status_t send_req(int fd, request_rec *r, char *argv0, char **env,
-                             int req_type)
+                             int req_type, int persist_slot)
 {
     int i;
     cgid_req_t req = {0};
@@ -502,6 +635,9 @@ static apr_status_t send_req(int fd, request_rec *r, char *argv0, char **env,
     req.uri_len = strlen(r->uri);
     req.args_len = r->args ? strlen(r->args) : 0;
     req.loglevel = r->server->log.level;
+    req.request_time = r->request_time;
+    req.submitted = apr_time_now();
+    req.persist_slot = persist_slot;
 
     /* Write the request header */
     if (req.args_len) {
@@ -594,76 +730,210 @@ static void cgid_child_errfn(apr_pool_t *pool, apr_status_t err,
     ap_log_error(APLOG_MARK, APLOG_ERR, err, r->server, APLOGNO(01241) "%s", description);
 }
 
-static int cgid_server(void *data)
+/* Remember the script started for a request, or 0 if there is none */
+static void script_pid_set(const cgid_req_t *req, pid_t pid)
 {
-    int sd, sd2, rc;
-    mode_t omask;
-    apr_pool_t *ptrans;
-    server_rec *main_server = data;
-    apr_hash_t *script_hash = apr_hash_make(pcgi);
-    apr_status_t rv;
+    cgid_script_t *script = &CGID_SCRIPTS(cgid_shared)[req->conn_id
+                                                      % cgid_shared->num_scripts];
 
-    apr_pool_create(&ptrans, pcgi);
+    script->pid = pid;
+    script->conn_id = req->conn_id;
+    apr_atomic_set32(&script->stamp, (apr_uint32_t)req->request_time);
+}
 
-    apr_signal(SIGCHLD, SIG_IGN);
-    apr_signal(SIGHUP, daemon_signal_handler);
+/* Find the script started for a request; if the spawner which accepted
+ * the request hasn't got that far, there's none yet.
+ */
+static pid_t script_pid_get(const cgid_req_t *req)
+{
+    cgid_script_t *script = &CGID_SCRIPTS(cgid_shared)[req->conn_id
+                                                      % cgid_shared->num_scripts];
 
-    /* Close our copy of the listening sockets */
-    ap_close_listeners();
+    if (apr_atomic_read32(&script->stamp) != (apr_uint32_t)req->request_time
+        || script->conn_id != req->conn_id) {
+        return 0;
+    }
+    return script->pid;
+}
 
-    /* cgid should use its own suexec doer */
-    ap_hook_get_suexec_identity(cgid_suexec_id_doer, NULL, NULL,
-                                APR_HOOK_REALLY_FIRST);
-    apr_hook_sort_all();
+static apr_status_t set_script_limits(apr_procattr_t *procattr,
+                                     cgid_req_t *req)
+{
+    apr_status_t rc = APR_SUCCESS;
 
-    if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server, APLOGNO(01242)
-                     "Couldn't create unix domain socket");
-        return errno;
+#ifdef AP_CGID_USE_RLIMIT
+#ifdef RLIMIT_CPU
+    if (req->limits.limit_cpu_set &&
+        (rc = apr_procattr_limit_set(procattr, APR_LIMIT_CPU,
+                                     &req->limits.limit_cpu)) != APR_SUCCESS) {
+        return rc;
     }
+#endif
+#if defined(RLIMIT_DATA) || defined(RLIMIT_VMEM) || defined(RLIMIT_AS)
+    if (req->limits.limit_mem_set &&
+        (rc = apr_procattr_limit_set(procattr, APR_LIMIT_MEM,
+                                     &req->limits.limit_mem)) != APR_SUCCESS) {
+        return rc;
+    }
+#endif
+#ifdef RLIMIT_NPROC
+    if (req->limits.limit_nproc_set &&
+        (rc = apr_procattr_limit_set(procattr, APR_LIMIT_NPROC,
+                                     &req->limits.limit_nproc)) != APR_SUCCESS) {
+        return rc;
+    }
+#endif
+#endif
 
-    omask = umask(0077); /* so that only Apache can use socket */
-    rc = bind(sd, (struct sockaddr *)server_addr, server_addr_len);
-    umask(omask); /* can't fail, so can't clobber errno */
-    if (rc < 0) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server, APLOGNO(01243)
-                     "Couldn't bind unix domain socket %s",
-                     sockname);
-        return errno;
+    return rc;
+}
+
+/* The environment persistent scripts are started with; the variables of
+ * each request are passed to them as FastCGI parameters instead.
+ */
+static const char *const persist_env_names[] = {
+    "PATH", "LD_LIBRARY_PATH", "TZ", "LANG", "SERVER_SOFTWARE",
+    "SERVER_ADMIN", "DOCUMENT_ROOT", NULL
+};
+
+/* Start a persistent script for the slot reserved by the server, with
+ * stdin being the socket it accepts FastCGI connections on.  Returns the
+ * pid of the script, or 0 if it couldn't be started, in which case the
+ * slot is freed.
+ */
+static pid_t persist_start(request_rec *r, cgid_req_t *req, char *argv0,
+                           char **env, apr_pool_t *ptrans)
+{
+    cgid_persist_t *slot;
+    struct sockaddr_un *addr = NULL;
+    apr_socklen_t addr_len;
+    apr_procattr_t *procattr;
+    apr_proc_t *procnew;
+    apr_file_t *listener;
+    const char * const *argv;
+    char **penv;
+    mode_t omask;
+    int lsd = -1, i, j, n;
+    apr_status_t rc;
+
+    if (req->persist_slot < 0 || req->persist_slot >= CGID_PERSIST_SLOTS) {
+        return 0;
+    }
+    slot = &cgid_persist[req->persist_slot];
+    if (apr_atomic_read32(&slot->state) != CGID_PERSIST_STARTING
+        || strcmp(slot->script, r->filename)) {
+        return 0;
     }
 
-    /* Not all flavors of unix use the current umask for AF_UNIX perms */
-    rv = apr_file_perms_set(sockname, APR_FPROT_UREAD|APR_FPROT_UWRITE|APR_FPROT_UEXECUTE);
-    if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, main_server, APLOGNO(01244)
-                     "Couldn't set permissions on unix domain socket %s",
-                     sockname);
-        return rv;
+    rc = persist_sockaddr(ptrans, req->persist_slot, &addr, &addr_len);
+    if (rc == APR_SUCCESS) {
+        unlink(addr->sun_path);
+        if ((lsd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            rc = errno;
+        }
+        else {
+            apr_pool_cleanup_register(ptrans, (void *)((long)lsd),
+                                      close_unix_socket, close_unix_socket);
+            omask = umask(0077);
+            if (bind(lsd, (struct sockaddr *)addr, addr_len) < 0
+                || listen(lsd, DEFAULT_CGID_LISTENBACKLOG) < 0) {
+                rc = errno;
+            }
+            umask(omask);
+        }
+    }
+    if (rc != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, r->server, APLOGNO(02857)
+                     "couldn't create the socket for persistent script %s",
+                     r->filename);
+        goto fail;
     }
 
-    if (listen(sd, DEFAULT_CGID_LISTENBACKLOG) < 0) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server, APLOGNO(01245)
-                     "Couldn't listen on unix domain socket");
-        return errno;
+    for (n = 0; env[n]; n++) {
+        continue;
     }
+    penv = apr_pcalloc(ptrans, (n + 1) * sizeof(char *));
+    for (i = 0, n = 0; env[i]; i++) {
+        for (j = 0; persist_env_names[j]; j++) {
+            apr_size_t len = strlen(persist_env_names[j]);
 
-    if (!geteuid()) {
-        if (chown(sockname, ap_unixd_config.user_id, -1) < 0) {
-            ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server, APLOGNO(01246)
-                         "Couldn't change owner of unix domain socket %s",
-                         sockname);
-            return errno;
+            if (!strncmp(env[i], persist_env_names[j], len)
+                && env[i][len] == '=') {
+                penv[n++] = env[i];
+                break;
+            }
         }
     }
 
-    apr_pool_cleanup_register(pcgi, (void *)((long)sd),
-                              close_unix_socket, close_unix_socket);
+    apr_os_file_put(&listener, &lsd, 0, ptrans);
+    procnew = apr_pcalloc(ptrans, sizeof(*procnew));
+    argv = (const char * const *)create_argv(ptrans, NULL, NULL, NULL,
+                                             argv0, "");
 
-    /* if running as root, switch to configured user/group */
-    if ((rc = ap_run_drop_privileges(pcgi, ap_server_conf)) != 0) {
-        return rc;
+    if (((rc = apr_procattr_create(&procattr, ptrans)) != APR_SUCCESS) ||
+        ((rc = apr_procattr_child_in_set(procattr, listener, NULL)) != APR_SUCCESS) ||
+        ((rc = apr_procattr_child_err_set(procattr, r->server->error_log, NULL)) != APR_SUCCESS) ||
+        ((rc = apr_procattr_dir_set(procattr,
+                              ap_make_dirstr_parent(ptrans, r->filename))) != APR_SUCCESS) ||
+        ((rc = apr_procattr_cmdtype_set(procattr, APR_PROGRAM)) != APR_SUCCESS) ||
+        ((rc = set_script_limits(procattr, req)) != APR_SUCCESS) ||
+        ((rc = apr_procattr_child_errfn_set(procattr, cgid_child_errfn)) != APR_SUCCESS)) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, r->server, APLOGNO(02864)
+                     "couldn't set child process attributes: %s", r->filename);
+        goto fail;
+    }
+
+    apr_pool_userdata_set(r, ERRFN_USERDATA_KEY, apr_pool_cleanup_null, ptrans);
+    if (memcmp(&empty_ugid, &req->ugid, sizeof(empty_ugid))) {
+        rc = ap_os_create_privileged_process(r, procnew, argv0, argv,
+                                             (const char * const *)penv,
+                                             procattr, ptrans);
+    }
+    else {
+        rc = apr_proc_create(procnew, argv0, argv, (const char * const *)penv,
+                             procattr, ptrans);
+    }
+    if (rc != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, r->server, APLOGNO(02858)
+                     "couldn't create persistent script process: %s",
+                     r->filename);
+        goto fail;
     }
 
+    /* left STARTING until the server has checked it speaks FastCGI */
+    slot->pid = procnew->pid;
+    if (apr_atomic_read32(&slot->state) != CGID_PERSIST_STARTING) {
+        /* given up on by the parent, which will stop it */
+        return 0;
+    }
+    return procnew->pid;
+
+fail:
+    if (addr) {
+        unlink(addr->sun_path);
+    }
+    apr_atomic_set32(&slot->active, 0);
+    apr_atomic_set32(&slot->state, CGID_PERSIST_FREE);
+    return 0;
+}
+
+/* Accept requests on the cgid socket and start the scripts, until the
+ * daemon is told to exit.  When there are several spawners, pfds holds
+ * the socket, which is non-blocking, and the pipe which is closed when
+ * the process managing the spawners goes away.
+ */
+static void cgid_spawner(int sd, server_rec *main_server,
+                         cgid_spawner_t *self, apr_pollfd_t *pfds)
+{
+    int sd2, rc;
+    apr_pool_t *ptrans;
+
+    apr_pool_create(&ptrans, pcgi);
+    self->pid = getpid();
+
+    /* the scripts are not waited for */
+    apr_signal(SIGCHLD, SIG_IGN);
+
     while (!daemon_should_exit) {
         int errfileno = STDERR_FILENO;
         char *argv0 = NULL;
@@ -679,12 +949,25 @@ static int cgid_server(void *data)
         apr_file_t *inout;
         cgid_req_t cgid_req;
         apr_status_t stat;
-        void *key;
         apr_socklen_t len;
         struct sockaddr_un unix_addr;
+        apr_time_t accepted, begin;
 
+        self->busy = 0;
         apr_pool_clear(ptrans);
 
+        if (pfds) {
+            apr_int32_t nsds;
+
+            if (apr_poll(pfds, 2, &nsds, -1) != APR_SUCCESS) {
+                continue;
+            }
+            if (pfds[1].rtnevents) {
+                /* the manager is gone, and so should we */
+                break;
+            }
+        }
+
         len = sizeof(unix_addr);
         sd2 = accept(sd, (struct sockaddr *)&unix_addr, &len);
         if (sd2 < 0) {
@@ -694,13 +977,23 @@ static int cgid_server(void *data)
                 ++daemon_should_exit;
             }
 #endif
-            if (errno != EINTR) {
+            /* with several spawners, another one may have been quicker */
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
                 ap_log_error(APLOG_MARK, APLOG_ERR, errno,
-                             (server_rec *)data, APLOGNO(01247)
+                             main_server, APLOGNO(01247)
                              "Error accepting on cgid socket");
             }
             continue;
         }
+        if (pfds) {
+            /* some platforms pass O_NONBLOCK on to the accepted socket,
+             * which the script mustn't see
+             */
+            fcntl(sd2, F_SETFL, fcntl(sd2, F_GETFL, 0) & ~O_NONBLOCK);
+        }
+        apr_atomic_inc32(&cgid_shared->accepted);
+        self->busy = 1;
+        accepted = apr_time_now();
 
         r = apr_pcalloc(ptrans, sizeof(request_rec));
         procnew = apr_pcalloc(ptrans, sizeof(*procnew));
@@ -726,7 +1019,7 @@ static int cgid_server(void *data)
             pid_t pid;
             apr_status_t rv;
 
-            pid = (pid_t)((long)apr_hash_get(script_hash, &cgid_req.conn_id, sizeof(cgid_req.conn_id)));
+            pid = script_pid_get(&cgid_req);
             rv = sock_write(sd2, &pid, sizeof(pid));
             if (rv != APR_SUCCESS) {
                 ap_log_error(APLOG_MARK, APLOG_ERR, rv,
@@ -737,7 +1030,31 @@ static int cgid_server(void *data)
             continue;
         }
 
+        if (accepted > cgid_req.submitted) {
+            apr_uint64_t wait = accepted - cgid_req.submitted;
+
+            self->wait_time += wait;
+            if (wait > self->wait_max) {
+                self->wait_max = wait;
+            }
+        }
+
         apr_os_file_put(&r->server->error_log, &errfileno, 0, r->pool);
+
+        if (cgid_req.req_type == PERSIST_REQ) {
+            pid_t pid = persist_start(r, &cgid_req, argv0, env, ptrans);
+            apr_status_t rv;
+
+            rv = sock_write(sd2, &pid, sizeof(pid));
+            if (rv != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, rv,
+                             main_server, APLOGNO(02865)
+                             "Error writing pid %" APR_PID_T_FMT " to handler", pid);
+            }
+            close(sd2);
+            continue;
+        }
+
         apr_os_file_put(&inout, &sd2, 0, r->pool);
 
         if (cgid_req.req_type == SSI_REQ) {
@@ -769,21 +1086,7 @@ static int cgid_server(void *data)
             ((rc = apr_procattr_dir_set(procattr,
                                   ap_make_dirstr_parent(r->pool, r->filename))) != APR_SUCCESS) ||
             ((rc = apr_procattr_cmdtype_set(procattr, cmd_type)) != APR_SUCCESS) ||
-#ifdef AP_CGID_USE_RLIMIT
-#ifdef RLIMIT_CPU
-        (  (cgid_req.limits.limit_cpu_set) && ((rc = apr_procattr_limit_set(procattr, APR_LIMIT_CPU,
-                                      &cgid_req.limits.limit_cpu)) != APR_SUCCESS)) ||
-#endif
-#if defined(RLIMIT_DATA) || defined(RLIMIT_VMEM) || defined(RLIMIT_AS)
-        ( (cgid_req.limits.limit_mem_set) && ((rc = apr_procattr_limit_set(procattr, APR_LIMIT_MEM,
-                                      &cgid_req.limits.limit_mem)) != APR_SUCCESS)) ||
-#endif
-#ifdef RLIMIT_NPROC
-        ( (cgid_req.limits.limit_nproc_set) && ((rc = apr_procattr_limit_set(procattr, APR_LIMIT_NPROC,
-                                      &cgid_req.limits.limit_nproc)) != APR_SUCCESS)) ||
-#endif
-#endif
-
+            ((rc = set_script_limits(procattr, &cgid_req)) != APR_SUCCESS) ||
             ((rc = apr_procattr_child_errfn_set(procattr, cgid_child_errfn)) != APR_SUCCESS)) {
             /* Something bad happened, tell the world.
              * ap_log_rerror() won't work because the header table used by
@@ -809,6 +1112,7 @@ static int cgid_server(void *data)
             */
             close(sd2);
 
+            begin = apr_time_now();
             if (memcmp(&empty_ugid, &cgid_req.ugid, sizeof(empty_ugid))) {
                 /* We have a valid identity, and can be sure that
                  * cgid_suexec_id_doer will return a valid ugid
@@ -833,31 +1137,212 @@ static int cgid_server(void *data)
 
                 procnew->pid = 0; /* no process to clean up */
             }
+            else {
+                apr_uint64_t spawn = apr_time_now() - begin;
+
+                self->spawn_time += spawn;
+                if (spawn > self->spawn_max) {
+                    self->spawn_max = spawn;
+                }
+            }
+        }
+
+        if (procnew->pid) {
+            self->started++;
+        }
+        else {
+            self->failed++;
         }
 
         /* If the script process was created, remember the pid for
-         * later cleanup.  If the script process wasn't created, clear
-         * out any prior pid with the same key.
-         *
-         * We don't want to leak storage for the key, so only allocate
-         * a key if the key doesn't exist yet in the hash; there are
-         * only a limited number of possible keys (one for each
-         * possible thread in the server), so we can allocate a copy
-         * of the key the first time a thread has a cgid request.
-         * Note that apr_hash_set() only uses the storage passed in
-         * for the key if it is adding the key to the hash for the
-         * first time; new key storage isn't needed for replacing the
-         * existing value of a key.
+         * later cleanup, otherwise forget any prior pid of the
+         * connection.
          */
+        script_pid_set(&cgid_req, procnew->pid);
+    }
+}
+
+/* Start the spawner of a slot, which runs until the daemon exits or the
+ * manager goes away.
+ */
+static void start_spawner(int sd, server_rec *main_server,
+                          cgid_spawner_t *self, apr_pollfd_t *pfds,
+                          apr_file_t *pod_out)
+{
+    pid_t pid;
+
+    if ((pid = fork()) < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server, APLOGNO(02853)
+                     "Couldn't fork cgid spawner process");
+        self->pid = 0;
+        return;
+    }
+    if (pid == 0) {
+        apr_file_close(pod_out);
+        apr_signal(SIGHUP, daemon_signal_handler);
+        cgid_spawner(sd, main_server, self, pfds);
+        exit(0);
+    }
+    self->pid = pid;
+}
+
+/* Run CGIDSpawners spawners sharing the socket, restarting those which die,
+ * until the daemon is told to exit.  The spawners watch the read end of a
+ * pipe which the manager holds open, so that they go away with it whatever
+ * the way the manager is killed.
+ */
+static void cgid_manager(int sd, server_rec *main_server)
+{
+    apr_file_t *pod_in, *pod_out;
+    apr_socket_t *sock;
+    apr_pollfd_t pfds[2];
+    apr_status_t rv;
+    int i;
+
+    rv = apr_file_pipe_create(&pod_in, &pod_out, pcgi);
+    if (rv == APR_SUCCESS) {
+        rv = apr_os_sock_put(&sock, &sd, pcgi);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, main_server, APLOGNO(02851)
+                     "Couldn't set up the cgid spawners, using only one");
+        cgid_shared->num_spawners = 1;
+        cgid_spawner(sd, main_server, &cgid_shared->spawners[0], NULL);
+        return;
+    }
+
+    memset(pfds, 0, sizeof(pfds));
+    pfds[0].p = pcgi;
+    pfds[0].desc_type = APR_POLL_SOCKET;
+    pfds[0].reqevents = APR_POLLIN;
+    pfds[0].desc.s = sock;
+    pfds[1].p = pcgi;
+    pfds[1].desc_type = APR_POLL_FILE;
+    pfds[1].reqevents = APR_POLLIN;
+    pfds[1].desc.f = pod_in;
+
+    /* All the spawners are woken up by a new connection, the ones which
+     * lose the race mustn't block in accept()
+     */
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+
+    /* the spawners are waited for, unlike the scripts */
+    apr_signal(SIGCHLD, SIG_DFL);
+
+    for (i = 0; i < cgid_shared->num_spawners; i++) {
+        start_spawner(sd, main_server, &cgid_shared->spawners[i], pfds,
+                      pod_out);
+    }
+
+    while (!daemon_should_exit) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
 
-        if (apr_hash_get(script_hash, &cgid_req.conn_id, sizeof(cgid_req.conn_id))) {
-            key = &cgid_req.conn_id;
+        if (pid < 0) {
+            if (errno != EINTR) {
+                /* no spawner left, wait for one to be due again */
+                apr_sleep(apr_time_from_sec(1));
+            }
         }
-        else {
-            key = apr_pmemdup(pcgi, &cgid_req.conn_id, sizeof(cgid_req.conn_id));
+        for (i = 0; i < cgid_shared->num_spawners; i++) {
+            cgid_spawner_t *spawner = &cgid_shared->spawners[i];
+
+            if (daemon_should_exit) {
+                break;
+            }
+            if (pid > 0 && spawner->pid == pid) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, main_server,
+                             APLOGNO(02852) "cgid spawner process %"
+                             APR_PID_T_FMT " exited, restarting it", pid);
+                spawner->pid = 0;
+            }
+            if (spawner->pid == 0) {
+                start_spawner(sd, main_server, spawner, pfds, pod_out);
+            }
+        }
+    }
+
+    apr_file_close(pod_out);
+    for (i = 0; i < cgid_shared->num_spawners; i++) {
+        if (cgid_shared->spawners[i].pid > 0) {
+            kill(cgid_shared->spawners[i].pid, SIGHUP);
+        }
+    }
+}
+
+static int cgid_server(void *data)
+{
+    int sd, rc;
+    mode_t omask;
+    server_rec *main_server = data;
+    apr_status_t rv;
+
+    apr_signal(SIGHUP, daemon_signal_handler);
+
+    /* Close our copy of the listening sockets */
+    ap_close_listeners();
+
+    /* cgid should use its own suexec doer */
+    ap_hook_get_suexec_identity(cgid_suexec_id_doer, NULL, NULL,
+                                APR_HOOK_REALLY_FIRST);
+    apr_hook_sort_all();
+
+    if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server, APLOGNO(01242)
+                     "Couldn't create unix domain socket");
+        return errno;
+    }
+
+    omask = umask(0077); /* so that only Apache can use socket */
+    rc = bind(sd, (struct sockaddr *)server_addr, server_addr_len);
+    umask(omask); /* can't fail, so can't clobber errno */
+    if (rc < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server, APLOGNO(01243)
+                     "Couldn't bind unix domain socket %s",
+                     sockname);
+        return errno;
+    }
+
+    /* Not all flavors of unix use the current umask for AF_UNIX perms */
+    rv = apr_file_perms_set(sockname, APR_FPROT_UREAD|APR_FPROT_UWRITE|APR_FPROT_UEXECUTE);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, main_server, APLOGNO(01244)
+                     "Couldn't set permissions on unix domain socket %s",
+                     sockname);
+        return rv;
+    }
+
+    if (listen(sd, DEFAULT_CGID_LISTENBACKLOG) < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server, APLOGNO(01245)
+                     "Couldn't listen on unix domain socket");
+        return errno;
+    }
+
+    if (!geteuid()) {
+        if (chown(sockname, ap_unixd_config.user_id, -1) < 0) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, errno, main_server, APLOGNO(01246)
+                         "Couldn't change owner of unix domain socket %s",
+                         sockname);
+            return errno;
         }
-        apr_hash_set(script_hash, key, sizeof(cgid_req.conn_id),
-                     (void *)((long)procnew->pid));
+    }
+
+    apr_pool_cleanup_register(pcgi, (void *)((long)sd),
+                              close_unix_socket, close_unix_socket);
+
+    /* if running as root, switch to configured user/group */
+    if ((rc = ap_run_drop_privileges(pcgi, ap_server_conf)) != 0) {
+        return rc;
+    }
+
+    /* Connections made to a previous daemon of this generation are gone */
+    cgid_shared->accepted = cgid_shared->connected;
+
+    if (cgid_shared->num_spawners > 1) {
+        cgid_manager(sd, main_server);
+    }
+    else {
+        cgid_spawner(sd, main_server, &cgid_shared->spawners[0], NULL);
     }
     return -1; /* should be <= 0 to distinguish from startup errors */
 }
@@ -887,13 +1372,300 @@ static int cgid_start(apr_pool_t *p, server_rec *main_server,
     return OK;
 }
 
+/* Send a signal to the process of a slot, if it still listens on the
+ * slot's socket.  The scripts are reaped by the spawners as soon as they
+ * exit, so this is how the parent makes sure the pid is still the
+ * script's; connecting is enough, the process isn't sent anything.  A
+ * process which has closed the socket already is left alone.
+ */
+static int persist_signal(int i, int sig)
+{
+    cgid_persist_t *slot = &cgid_persist[i];
+    struct sockaddr_un addr;
+    int sd, listening;
+
+    if (slot->pid <= 0) {
+        return 0;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if ((apr_size_t)apr_snprintf(addr.sun_path, sizeof(addr.sun_path),
+                                 "%s.%d", sockname, i)
+        >= sizeof(addr.sun_path) - 1) {
+        return 0;
+    }
+    if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return 0;
+    }
+    fcntl(sd, F_SETFL, O_NONBLOCK);
+    listening = connect(sd, (struct sockaddr *)&addr, sizeof(addr)) == 0
+                || errno == EAGAIN || errno == EINPROGRESS;
+    close(sd);
+
+    return listening && kill(slot->pid, sig) == 0;
+}
+
+static void persist_unlink(int i)
+{
+    char path[sizeof(server_addr->sun_path)];
+
+    if ((apr_size_t)apr_snprintf(path, sizeof(path), "%s.%d", sockname, i)
+        < sizeof(path) - 1) {
+        unlink(path);
+    }
+}
+
+/* Stop the process of a slot, with SIGKILL if SIGTERM didn't do it.  The
+ * socket is removed once the process is gone.
+ */
+static void persist_stop(int i, int sig)
+{
+    cgid_persist_t *slot = &cgid_persist[i];
+
+    if (persist_signal(i, sig) && sig == SIGTERM) {
+        slot->last_used = apr_time_now();
+        apr_atomic_set32(&slot->state, CGID_PERSIST_STOPPING);
+        return;
+    }
+    persist_unlink(i);
+    apr_atomic_set32(&slot->active, 0);
+    apr_atomic_set32(&slot->state, CGID_PERSIST_FREE);
+}
+
+/* Stop the persistent scripts which are retired or have been idle for
+ * too long, and forget about those which are gone.  Run by the parent,
+ * which can signal the scripts whatever their user.
+ */
+static int cgid_monitor(apr_pool_t *p, server_rec *s)
+{
+    apr_time_t now;
+    int i;
+
+    if (!cgid_persist) {
+        return DECLINED;
+    }
+
+    now = apr_time_now();
+    for (i = 0; i < CGID_PERSIST_SLOTS; i++) {
+        cgid_persist_t *slot = &cgid_persist[i];
+        apr_uint32_t state = apr_atomic_read32(&slot->state);
+
+        switch (state) {
+        case CGID_PERSIST_STARTING:
+            if (now - slot->last_used > CGID_PERSIST_START_TIMEOUT
+                && apr_atomic_cas32(&slot->state, CGID_PERSIST_RETIRED,
+                                    state) == state) {
+                apr_atomic_set32(&slot->active, 0);
+            }
+            break;
+
+        case CGID_PERSIST_READY:
+            if ((slot->pid > 0 && kill(slot->pid, 0) < 0 && errno == ESRCH)
+                || (slot->idle_timeout > 0
+                    && !apr_atomic_read32(&slot->active)
+                    && now - slot->last_used > slot->idle_timeout)) {
+                apr_atomic_cas32(&slot->state, CGID_PERSIST_RETIRED, state);
+            }
+            break;
+
+        case CGID_PERSIST_RETIRED:
+            if (!apr_atomic_read32(&slot->active)) {
+                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(02866)
+                             "stopping persistent script process %"
+                             APR_PID_T_FMT " of %s after %u requests",
+                             slot->pid, slot->script,
+                             apr_atomic_read32(&slot->requests));
+                persist_stop(i, SIGTERM);
+            }
+            break;
+
+        case CGID_PERSIST_STOPPING:
+            persist_stop(i, SIGKILL);
+            break;
+
+        case CGID_PERSIST_REFUSED:
+            /* never sent a request, nothing to wait for */
+            if (slot->pid > 0) {
+                persist_signal(i, SIGKILL);
+                slot->pid = 0;
+            }
+            else if (now - slot->last_used > CGID_PERSIST_REFUSED_TIME) {
+                persist_stop(i, SIGKILL);
+            }
+            break;
+        }
+    }
+
+    return DECLINED;
+}
+
+/* Retire the processes in use by the children of a generation, or of any
+ * generation if gen is negative.  The monitor stops them once they are
+ * not in use anymore.
+ */
+static void persist_retire(ap_generation_t gen)
+{
+    int i;
+
+    for (i = 0; i < CGID_PERSIST_SLOTS; i++) {
+        cgid_persist_t *slot = &cgid_persist[i];
+        apr_uint32_t state = apr_atomic_read32(&slot->state);
+
+        if (gen >= 0 && slot->generation > gen) {
+            continue;
+        }
+        switch (state) {
+        case CGID_PERSIST_STARTING:
+        case CGID_PERSIST_READY:
+            apr_atomic_cas32(&slot->state, CGID_PERSIST_RETIRED, state);
+            break;
+
+        case CGID_PERSIST_RETIRED:
+            if (gen >= 0) {
+                /* no child of the generation is left to release it */
+                apr_atomic_set32(&slot->active, 0);
+            }
+            break;
+        }
+    }
+}
+
+/* The children of the next generation start their own processes, those
+ * of the old one drain theirs, which are stopped once the generation has
+ * ended.  Only when the server stops are they all stopped right away.
+ */
+static apr_status_t persist_cleanup(void *data)
+{
+    int i;
+
+    if (getpid() != parent_pid) {
+        return APR_SUCCESS;
+    }
+    if (ap_state_query(AP_SQ_MAIN_STATE) != AP_SQ_MS_EXITING) {
+        persist_retire(-1);
+        return APR_SUCCESS;
+    }
+    for (i = 0; i < CGID_PERSIST_SLOTS; i++) {
+        if (apr_atomic_read32(&cgid_persist[i].state)
+            != CGID_PERSIST_FREE) {
+            /* no monitor will follow up */
+            persist_stop(i, SIGTERM);
+            persist_unlink(i);
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+static void cgid_end_generation(server_rec *s, ap_generation_t gen)
+{
+    if (cgid_persist && getpid() == parent_pid) {
+        persist_retire(gen);
+    }
+}
+
+/* Find or create the slots of the persistent scripts, which are kept
+ * across restarts in the memory of the process.
+ */
+static void persist_init(apr_pool_t *p, server_rec *main_server)
+{
+    apr_pool_t *pproc = main_server->process->pool;
+    apr_size_t size = CGID_PERSIST_SLOTS * sizeof(cgid_persist_t);
+    const char *fname = NULL;
+    apr_shm_t **retained;
+    apr_status_t rv;
+
+    cgid_persist = NULL;
+
+    retained = ap_retained_data_get(CGID_PERSIST_RETAINED_ID);
+    if (retained == NULL) {
+        retained = ap_retained_data_create(CGID_PERSIST_RETAINED_ID,
+                                           sizeof(*retained));
+    }
+    if (*retained == NULL) {
+        rv = apr_shm_create(retained, size, NULL, pproc);
+        if (APR_STATUS_IS_ENOTIMPL(rv)) {
+            fname = ap_runtime_dir_relative(p, ap_append_pid(p, "cgid_persist",
+                                                             "."));
+            apr_shm_remove(fname, p);
+            rv = apr_shm_create(retained, size, apr_pstrdup(pproc, fname),
+                                pproc);
+        }
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, main_server, APLOGNO(02878)
+                         "could not create shared memory for the persistent "
+                         "scripts%s%s; running them as CGI scripts",
+                         fname ? " at " : "", fname ? fname : "");
+            *retained = NULL;
+            return;
+        }
+        memset(apr_shm_baseaddr_get(*retained), 0, size);
+    }
+
+    cgid_persist = apr_shm_baseaddr_get(*retained);
+    apr_pool_cleanup_register(p, NULL, persist_cleanup, apr_pool_cleanup_null);
+}
+
 static int cgid_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
                            apr_pool_t *ptemp)
 {
     sockname = ap_append_pid(pconf, DEFAULT_SOCKET, ".");
+    cgid_spawners = DEFAULT_CGID_SPAWNERS;
     return OK;
 }
 
+/* Set up the memory shared by the server and the daemon, for the pids of
+ * the scripts and for the figures reported by mod_status.  Without it the
+ * daemon runs a single spawner, using private memory.
+ */
+static void cgid_shared_init(apr_pool_t *p, server_rec *main_server)
+{
+    apr_size_t size;
+    const char *fname = NULL;
+    int daemons, threads;
+    apr_status_t rv;
+
+    ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &daemons);
+    ap_mpm_query(AP_MPMQ_HARD_LIMIT_THREADS, &threads);
+    if (daemons < 1) {
+        daemons = 1;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    size = sizeof(cgid_shared_t)
+           + (apr_size_t)daemons * threads * sizeof(cgid_script_t);
+
+    rv = apr_shm_create(&cgid_shm, size, NULL, p);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        fname = ap_runtime_dir_relative(p, ap_append_pid(p, "cgid_shm", "."));
+        apr_shm_remove(fname, p);
+        rv = apr_shm_create(&cgid_shm, size, fname, p);
+    }
+    if (rv == APR_SUCCESS) {
+        cgid_shared = apr_shm_baseaddr_get(cgid_shm);
+    }
+    else {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, main_server, APLOGNO(02850)
+                     "could not create shared memory for the cgid daemon%s%s; "
+                     "using a single spawner", fname ? " at " : "",
+                     fname ? fname : "");
+        cgid_shm = NULL;
+        cgid_shared = apr_palloc(p, size);
+    }
+
+    memset(cgid_shared, 0, size);
+    cgid_shared->num_spawners = cgid_shm ? cgid_spawners : 1;
+    cgid_shared->num_scripts = (apr_size_t)daemons * threads;
+
+    if (cgid_shm) {
+        persist_init(p, main_server);
+    }
+    else {
+        cgid_persist = NULL;
+    }
+}
+
 static int cgid_init(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp,
                      server_rec *main_server)
 {
@@ -936,6 +1708,8 @@ static int cgid_init(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp,
         server_addr->sun_family = AF_UNIX;
         strcpy(server_addr->sun_path, sockname);
 
+        cgid_shared_init(p, main_server);
+
         ret = cgid_start(p, main_server, procnew);
         if (ret != OK ) {
             return ret;
@@ -975,6 +1749,28 @@ static void *merge_cgid_config(apr_pool_t *p, void *basev, void *overridesv)
 static void *create_cgid_dirconf(apr_pool_t *p, char *dummy)
 {
     cgid_dirconf *c = (cgid_dirconf *) apr_pcalloc(p, sizeof(cgid_dirconf));
+
+    c->persist = -1;
+    c->persist_max_requests = -1;
+    c->persist_idle_timeout = -1;
+    return c;
+}
+
+static void *merge_cgid_dirconf(apr_pool_t *p, void *basev, void *addv)
+{
+    cgid_dirconf *base = (cgid_dirconf *) basev, *add = (cgid_dirconf *) addv;
+    cgid_dirconf *c = (cgid_dirconf *) apr_pcalloc(p, sizeof(cgid_dirconf));
+
+    c->timeout = add->timeout ? add->timeout : base->timeout;
+    c->persist = add->persist != -1 ? add->persist : base->persist;
+    c->persist_processes = add->persist_processes ? add->persist_processes
+                                                  : base->persist_processes;
+    c->persist_max_requests = add->persist_max_requests != -1
+                              ? add->persist_max_requests
+                              : base->persist_max_requests;
+    c->persist_idle_timeout = add->persist_idle_timeout != -1
+                              ? add->persist_idle_timeout
+                              : base->persist_idle_timeout;
     return c;
 }
 
@@ -1010,38 +1806,96 @@ static const char *set_scriptlog_buffer(cmd_parms *cmd, void *dummy, const char
     cgid_server_conf *conf = ap_get_module_config(s->module_config,
                                                   &cgid_module);
 
-    conf->bufbytes = atoi(arg);
+    conf->bufbytes = atoi(arg);
+    return NULL;
+}
+
+static const char *set_script_socket(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL) {
+        return err;
+    }
+
+    /* Make sure the pid is appended to the sockname */
+    sockname = ap_append_pid(cmd->pool, arg, ".");
+    sockname = ap_runtime_dir_relative(cmd->pool, sockname);
+
+    if (!sockname) {
+        return apr_pstrcat(cmd->pool, "Invalid ScriptSock path",
+                           arg, NULL);
+    }
+
+    return NULL;
+}
+static const char *set_script_timeout(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    cgid_dirconf *dc = dummy;
+
+    if (ap_timeout_parameter_parse(arg, &dc->timeout, "s") != APR_SUCCESS) { 
+        return "CGIDScriptTimeout has wrong format";
+    }
+ 
+    return NULL;
+}
+static const char *set_persist(cmd_parms *cmd, void *dummy, int flag)
+{
+    cgid_dirconf *dc = dummy;
+
+    dc->persist = flag;
+    return NULL;
+}
+static const char *set_persist_processes(cmd_parms *cmd, void *dummy,
+                                         const char *arg)
+{
+    cgid_dirconf *dc = dummy;
+
+    dc->persist_processes = atoi(arg);
+    if (dc->persist_processes < 1) {
+        return "CGIDPersistentProcesses must be at least 1";
+    }
+    return NULL;
+}
+static const char *set_persist_max_requests(cmd_parms *cmd, void *dummy,
+                                            const char *arg)
+{
+    cgid_dirconf *dc = dummy;
+
+    dc->persist_max_requests = atoi(arg);
+    if (dc->persist_max_requests < 0) {
+        return "CGIDPersistentMaxRequests must not be negative";
+    }
+    return NULL;
+}
+static const char *set_persist_idle_timeout(cmd_parms *cmd, void *dummy,
+                                            const char *arg)
+{
+    cgid_dirconf *dc = dummy;
+
+    if (ap_timeout_parameter_parse(arg, &dc->persist_idle_timeout, "s")
+        != APR_SUCCESS || dc->persist_idle_timeout < 0) {
+        return "CGIDPersistentIdleTimeout has wrong format";
+    }
     return NULL;
 }
-
-static const char *set_script_socket(cmd_parms *cmd, void *dummy, const char *arg)
+static const char *set_spawners(cmd_parms *cmd, void *dummy, const char *arg)
 {
     const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n;
+
     if (err != NULL) {
         return err;
     }
 
-    /* Make sure the pid is appended to the sockname */
-    sockname = ap_append_pid(cmd->pool, arg, ".");
-    sockname = ap_runtime_dir_relative(cmd->pool, sockname);
-
-    if (!sockname) {
-        return apr_pstrcat(cmd->pool, "Invalid ScriptSock path",
-                           arg, NULL);
+    n = atoi(arg);
+    if (n < 1 || n > CGID_MAX_SPAWNERS) {
+        return apr_psprintf(cmd->pool, "CGIDSpawners must be between 1 "
+                            "and %d", CGID_MAX_SPAWNERS);
     }
+    cgid_spawners = n;
 
     return NULL;
 }
-static const char *set_script_timeout(cmd_parms *cmd, void *dummy, const char *arg)
-{
-    cgid_dirconf *dc = dummy;
-
-    if (ap_timeout_parameter_parse(arg, &dc->timeout, "s") != APR_SUCCESS) { 
-        return "CGIDScriptTimeout has wrong format";
-    }
- 
-    return NULL;
-}
 static const command_rec cgid_cmds[] =
 {
     AP_INIT_TAKE1("ScriptLog", set_scriptlog, NULL, RSRC_CONF,
@@ -1056,6 +1910,22 @@ static const command_rec cgid_cmds[] =
     AP_INIT_TAKE1("CGIDScriptTimeout", set_script_timeout, NULL, RSRC_CONF | ACCESS_CONF,
                   "The amount of time to wait between successful reads from "
                   "the CGI script, in seconds."),
+    AP_INIT_FLAG("CGIDPersistent", set_persist, NULL, RSRC_CONF | ACCESS_CONF,
+                 "On to keep the scripts running as FastCGI applications"),
+    AP_INIT_TAKE1("CGIDPersistentProcesses", set_persist_processes, NULL,
+                  RSRC_CONF | ACCESS_CONF,
+                  "The maximum number of processes of a persistent script"),
+    AP_INIT_TAKE1("CGIDPersistentMaxRequests", set_persist_max_requests, NULL,
+                  RSRC_CONF | ACCESS_CONF,
+                  "The number of requests after which a process of a "
+                  "persistent script is stopped, 0 for no limit"),
+    AP_INIT_TAKE1("CGIDPersistentIdleTimeout", set_persist_idle_timeout, NULL,
+                  RSRC_CONF | ACCESS_CONF,
+                  "The time after which an idle process of a persistent "
+                  "script is stopped, in seconds"),
+    AP_INIT_TAKE1("CGIDSpawners", set_spawners, NULL, RSRC_CONF,
+                  "The number of processes of the cgi daemon accepting "
+                  "requests and starting scripts"),
                   
     {NULL}
 };
@@ -1233,6 +2103,9 @@ static int connect_to_daemon(int *sdptr, request_rec *r,
         else {
             apr_pool_cleanup_register(r->pool, (void *)((long)sd),
                                       close_unix_socket, apr_pool_cleanup_null);
+            if (cgid_shared) {
+                apr_atomic_inc32(&cgid_shared->connected);
+            }
             break; /* we got connected! */
         }
         /* gotta try again, but make sure the cgid daemon is still around */
@@ -1345,6 +2218,7 @@ static apr_status_t cleanup_script(void *vptr)
     req.req_type = GETPID_REQ;
     req.ppid = parent_pid;
     req.conn_id = info->r->connection->id;
+    req.request_time = info->r->request_time;
 
     stat = sock_write(sd, &req, sizeof(req));
     if (stat != APR_SUCCESS) {
@@ -1366,6 +2240,602 @@ static apr_status_t cleanup_script(void *vptr)
     return cleanup_nonchild_process(info->r, pid);
 }
 
+/* A request sent to a persistent script */
+typedef struct {
+    request_rec *r;
+    apr_file_t *file;
+    int slot;
+    apr_size_t remaining;        /* of the content of the STDOUT record */
+    apr_size_t padding;          /* after the content */
+    unsigned char header[AP_FCGI_HEADER_LEN];
+    apr_size_t header_len;       /* of the record header read so far */
+    int ended;                   /* the script is done with the request */
+    int failed;                  /* the script won't be sent more requests */
+} cgid_fcgi_t;
+
+/* Find a process of the script to send the request to, preferring one
+ * which is idle, or reserve a free slot for a new process if the script
+ * has fewer than CGIDPersistentProcesses.  *start is set if the process
+ * has to be started.  Returns -1 if neither can be done for now, or -2 if
+ * the script was lately found not to be a FastCGI application.
+ */
+static int persist_acquire(request_rec *r, cgid_dirconf *dc,
+                           const ap_unix_identity_t *ugid, int *start)
+{
+    int i, count = 0, best = -1, unused = -1;
+    apr_uint32_t best_active = 0;
+    int processes = dc->persist_processes > 0 ? dc->persist_processes
+                                              : DEFAULT_PERSIST_PROCESSES;
+
+    for (i = 0; i < CGID_PERSIST_SLOTS; i++) {
+        cgid_persist_t *slot = &cgid_persist[i];
+        apr_uint32_t state = apr_atomic_read32(&slot->state);
+
+        if (state == CGID_PERSIST_FREE) {
+            if (unused < 0) {
+                unused = i;
+            }
+            continue;
+        }
+        if (slot->uid != ugid->uid || slot->gid != ugid->gid
+            || strcmp(slot->script, r->filename)) {
+            continue;
+        }
+        if (state == CGID_PERSIST_REFUSED) {
+            return -2;
+        }
+        if (state != CGID_PERSIST_STARTING && state != CGID_PERSIST_READY) {
+            continue;
+        }
+        count++;
+        if (state == CGID_PERSIST_READY) {
+            apr_uint32_t active = apr_atomic_read32(&slot->active);
+
+            if (best < 0 || active < best_active) {
+                best = i;
+                best_active = active;
+            }
+        }
+    }
+
+    if (count < processes && unused >= 0 && (best < 0 || best_active)
+        && apr_atomic_cas32(&cgid_persist[unused].state,
+                            CGID_PERSIST_STARTING,
+                            CGID_PERSIST_FREE) == CGID_PERSIST_FREE) {
+        cgid_persist_t *slot = &cgid_persist[unused];
+
+        apr_cpystrn(slot->script, r->filename, sizeof(slot->script));
+        slot->uid = ugid->uid;
+        slot->gid = ugid->gid;
+        slot->pid = 0;
+        ap_mpm_query(AP_MPMQ_GENERATION, &slot->generation);
+        slot->max_requests = dc->persist_max_requests > 0
+                             ? dc->persist_max_requests : 0;
+        slot->idle_timeout = dc->persist_idle_timeout >= 0
+                             ? dc->persist_idle_timeout
+                             : DEFAULT_PERSIST_IDLE_TIMEOUT;
+        slot->last_used = apr_time_now();
+        apr_atomic_set32(&slot->requests, 0);
+        apr_atomic_set32(&slot->active, 1);
+        *start = 1;
+        return unused;
+    }
+
+    if (best >= 0) {
+        cgid_persist_t *slot = &cgid_persist[best];
+
+        /* the parent only stops processes not in use, so recheck */
+        apr_atomic_inc32(&slot->active);
+        if (apr_atomic_read32(&slot->state) == CGID_PERSIST_READY) {
+            *start = 0;
+            return best;
+        }
+        apr_atomic_dec32(&slot->active);
+    }
+
+    return -1;
+}
+
+static apr_status_t persist_release(void *data)
+{
+    cgid_fcgi_t *fcgi = data;
+    cgid_persist_t *slot = &cgid_persist[fcgi->slot];
+    apr_uint32_t requests = apr_atomic_inc32(&slot->requests) + 1;
+
+    slot->last_used = apr_time_now();
+    if (fcgi->failed
+        || (slot->max_requests && requests >= (apr_uint32_t)slot->max_requests)) {
+        apr_atomic_cas32(&slot->state, CGID_PERSIST_RETIRED,
+                         CGID_PERSIST_READY);
+    }
+    apr_atomic_dec32(&slot->active);
+
+    return APR_SUCCESS;
+}
+
+/* Ask the daemon to start the process of a reserved slot */
+static int persist_start_process(request_rec *r, cgid_server_conf *conf,
+                                 char *argv0, char **env, int slot)
+{
+    int sd, retval;
+    pid_t pid = 0;
+    apr_status_t rv;
+
+    if ((retval = connect_to_daemon(&sd, r, conf)) != OK) {
+        /* nothing will pick the slot up */
+        apr_atomic_set32(&cgid_persist[slot].active, 0);
+        apr_atomic_set32(&cgid_persist[slot].state, CGID_PERSIST_FREE);
+        return retval;
+    }
+
+    rv = send_req(sd, r, argv0, env, PERSIST_REQ, slot);
+    if (rv == APR_SUCCESS) {
+        rv = sock_read(sd, &pid, sizeof(pid));
+    }
+    apr_pool_cleanup_run(r->pool, (void *)((long)sd), close_unix_socket);
+
+    if (rv != APR_SUCCESS || pid <= 0) {
+        /* the daemon frees the slot, or the parent does after a while */
+        return log_scripterror(r, conf, HTTP_INTERNAL_SERVER_ERROR, rv,
+                               APLOGNO(02855)
+                               "couldn't start persistent script");
+    }
+
+    return OK;
+}
+
+/* Check that a new process speaks FastCGI, by asking for FCGI_MPXS_CONNS
+ * on the connection the request is to be sent on.  Any FastCGI application
+ * answers, if only that it doesn't know the record, whereas a CGI script
+ * never reads from the socket.
+ */
+static apr_status_t persist_probe(request_rec *r, int sd)
+{
+    static const char query[] = "\017\000FCGI_MPXS_CONNS";
+    ap_fcgi_header header;
+    unsigned char farray[AP_FCGI_HEADER_LEN];
+    unsigned char version, type, padding;
+    apr_uint16_t request_id, clen;
+    struct iovec vec[2];
+    apr_file_t *file;
+    char skip[256];
+    apr_size_t len = 0;
+    apr_status_t rv;
+
+    apr_os_pipe_put_ex(&file, &sd, 0, r->pool);
+    apr_file_pipe_timeout_set(file, CGID_PERSIST_PROBE_TIMEOUT);
+
+    ap_fcgi_fill_in_header(&header, AP_FCGI_GET_VALUES, 0,
+                           sizeof(query) - 1, 0);
+    ap_fcgi_header_to_array(&header, farray);
+    vec[0].iov_base = (void *)farray;
+    vec[0].iov_len = sizeof(farray);
+    vec[1].iov_base = (void *)query;
+    vec[1].iov_len = sizeof(query) - 1;
+    rv = apr_file_writev_full(file, vec, 2, NULL);
+
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_read_full(file, farray, sizeof(farray), NULL);
+    }
+    if (rv == APR_SUCCESS) {
+        ap_fcgi_header_fields_from_array(&version, &type, &request_id,
+                                         &clen, &padding, farray);
+        if (version != AP_FCGI_VERSION_1 || request_id != 0
+            || (type != AP_FCGI_GET_VALUES_RESULT
+                && type != AP_FCGI_UNKNOWN_TYPE)) {
+            rv = APR_EGENERAL;
+        }
+        len = (apr_size_t)clen + padding;
+    }
+    while (rv == APR_SUCCESS && len) {
+        apr_size_t n = len < sizeof(skip) ? len : sizeof(skip);
+
+        rv = apr_file_read_full(file, skip, n, NULL);
+        len -= n;
+    }
+
+    /* back to blocking, the socket is set up again for the request */
+    apr_file_pipe_timeout_set(file, -1);
+
+    return rv;
+}
+
+/* The new process of a slot isn't a FastCGI application: have the parent
+ * stop it, and run the script as a CGI script until the slot is freed.
+ */
+static void persist_refuse(request_rec *r, int slot, apr_status_t rv)
+{
+    cgid_persist_t *ps = &cgid_persist[slot];
+
+    ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(02877)
+                  "persistent script %s doesn't answer as a FastCGI "
+                  "application, running it as a CGI script", r->filename);
+    ps->last_used = apr_time_now();
+    apr_atomic_cas32(&ps->state, CGID_PERSIST_REFUSED, CGID_PERSIST_STARTING);
+    apr_atomic_dec32(&ps->active);
+}
+
+/* Connect to a process of a persistent script, starting one if needed.
+ * *fcgip is left NULL if the script can't be kept running and is to be
+ * run as a CGI script instead.
+ */
+static int persist_connect(request_rec *r, cgid_server_conf *conf,
+                           cgid_dirconf *dc, char *argv0, char **env,
+                           int *sdptr, cgid_fcgi_t **fcgip)
+{
+    ap_unix_identity_t *ugid = ap_run_get_suexec_identity(r);
+    struct sockaddr_un *addr;
+    apr_socklen_t addr_len;
+    apr_interval_time_t sliding_timer = 100000; /* 100 milliseconds */
+    int attempts, slot, start, sd, retval;
+    cgid_fcgi_t *fcgi;
+
+    *fcgip = NULL;
+    if (!cgid_persist) {
+        return OK;
+    }
+    if (strlen(r->filename) >= CGID_PERSIST_PATH_LEN
+        || persist_sockaddr(r->pool, 0, &addr, &addr_len) != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(02854)
+                      "path of script or of ScriptSock too long for "
+                      "CGIDPersistent, running it as a CGI script");
+        return OK;
+    }
+
+    for (attempts = 0; attempts < DEFAULT_CONNECT_ATTEMPTS; attempts++) {
+        slot = persist_acquire(r, dc, ugid ? ugid : &empty_ugid, &start);
+        if (slot == -2) {
+            return OK;
+        }
+        if (slot < 0) {
+            /* all of them busy being started, or no slot left */
+            apr_sleep(sliding_timer);
+            if (sliding_timer < apr_time_from_sec(2)) {
+                sliding_timer *= 2;
+            }
+            continue;
+        }
+
+        if (start
+            && (retval = persist_start_process(r, conf, argv0, env,
+                                               slot)) != OK) {
+            return retval;
+        }
+
+        persist_sockaddr(r->pool, slot, &addr, &addr_len);
+        if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            apr_atomic_dec32(&cgid_persist[slot].active);
+            return log_scripterror(r, conf, HTTP_INTERNAL_SERVER_ERROR, errno,
+                                   APLOGNO(02876) "unable to create socket to "
+                                   "persistent script");
+        }
+        if (connect(sd, (struct sockaddr *)addr, addr_len) < 0) {
+            if (start) {
+                /* exited right away, as a CGI script does */
+                apr_status_t rv = errno;
+
+                close(sd);
+                persist_refuse(r, slot, rv);
+                return OK;
+            }
+            /* the process is gone, have the parent clean up after it */
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, errno, r, APLOGNO(02863)
+                          "connect to persistent script process %" APR_PID_T_FMT
+                          " failed, retiring it",
+                          cgid_persist[slot].pid);
+            close(sd);
+            apr_atomic_cas32(&cgid_persist[slot].state,
+                             CGID_PERSIST_RETIRED, CGID_PERSIST_READY);
+            apr_atomic_dec32(&cgid_persist[slot].active);
+            continue;
+        }
+
+        if (start) {
+            apr_status_t rv = persist_probe(r, sd);
+
+            if (rv != APR_SUCCESS) {
+                close(sd);
+                persist_refuse(r, slot, rv);
+                return OK;
+            }
+            apr_atomic_cas32(&cgid_persist[slot].state, CGID_PERSIST_READY,
+                             CGID_PERSIST_STARTING);
+        }
+
+        apr_pool_cleanup_register(r->pool, (void *)((long)sd),
+                                  close_unix_socket, apr_pool_cleanup_null);
+        fcgi = apr_pcalloc(r->pool, sizeof(*fcgi));
+        fcgi->r = r;
+        fcgi->slot = slot;
+        apr_pool_cleanup_register(r->pool, fcgi, persist_release,
+                                  apr_pool_cleanup_null);
+        *sdptr = sd;
+        *fcgip = fcgi;
+        return OK;
+    }
+
+    return log_scripterror(r, conf, HTTP_SERVICE_UNAVAILABLE, 0, APLOGNO(02856)
+                           "no process of persistent script available");
+}
+
+/* Send data as records of a FastCGI stream.  Without data, send the
+ * empty record which ends the stream.
+ */
+static apr_status_t fcgi_send_stream(cgid_fcgi_t *fcgi, unsigned char type,
+                                     const char *data, apr_size_t len)
+{
+    ap_fcgi_header header;
+    unsigned char farray[AP_FCGI_HEADER_LEN];
+    struct iovec vec[2];
+    apr_status_t rv;
+
+    do {
+        apr_size_t n = len < AP_FCGI_MAX_CONTENT_LEN ? len
+                                                     : AP_FCGI_MAX_CONTENT_LEN;
+
+        ap_fcgi_fill_in_header(&header, type, 1, (apr_uint16_t)n, 0);
+        ap_fcgi_header_to_array(&header, farray);
+        vec[0].iov_base = (void *)farray;
+        vec[0].iov_len = sizeof(farray);
+        vec[1].iov_base = (void *)data;
+        vec[1].iov_len = n;
+
+        rv = apr_file_writev_full(fcgi->file, vec, n ? 2 : 1, NULL);
+        if (n) {
+            data += n;
+            len -= n;
+        }
+    } while (rv == APR_SUCCESS && len);
+
+    return rv;
+}
+
+/* Begin the request and send the CGI environment as its parameters */
+static apr_status_t fcgi_send_params(cgid_fcgi_t *fcgi)
+{
+    request_rec *r = fcgi->r;
+    const apr_array_header_t *envarr = apr_table_elts(r->subprocess_env);
+    const apr_table_entry_t *elts = (const apr_table_entry_t *)envarr->elts;
+    ap_fcgi_header header;
+    ap_fcgi_begin_request_body brb;
+    unsigned char farray[AP_FCGI_HEADER_LEN];
+    unsigned char abrb[AP_FCGI_HEADER_LEN];
+    struct iovec vec[2];
+    int next_elem = 0, starting_elem;
+    apr_status_t rv;
+
+    ap_fcgi_fill_in_header(&header, AP_FCGI_BEGIN_REQUEST, 1, sizeof(abrb), 0);
+    ap_fcgi_fill_in_request_body(&brb, AP_FCGI_RESPONDER, 0);
+    ap_fcgi_header_to_array(&header, farray);
+    ap_fcgi_begin_request_body_to_array(&brb, abrb);
+    vec[0].iov_base = (void *)farray;
+    vec[0].iov_len = sizeof(farray);
+    vec[1].iov_base = (void *)abrb;
+    vec[1].iov_len = sizeof(abrb);
+    rv = apr_file_writev_full(fcgi->file, vec, 2, NULL);
+
+    while (rv == APR_SUCCESS && next_elem < envarr->nelts) {
+        apr_size_t len;
+        void *body;
+
+        starting_elem = next_elem;
+        len = ap_fcgi_encoded_env_len(r->subprocess_env,
+                                      AP_FCGI_MAX_CONTENT_LEN, &next_elem);
+        if (!len) {
+            if (next_elem < envarr->nelts) {
+                ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(02862)
+                              "couldn't encode envvar '%s' for persistent "
+                              "script", elts[next_elem].key);
+                ++next_elem;
+                continue;
+            }
+            break;
+        }
+
+        body = apr_palloc(r->pool, len);
+        ap_fcgi_encode_env(r, r->subprocess_env, body, len, &starting_elem);
+        rv = fcgi_send_stream(fcgi, AP_FCGI_PARAMS, body, len);
+    }
+
+    if (rv == APR_SUCCESS) {
+        rv = fcgi_send_stream(fcgi, AP_FCGI_PARAMS, NULL, 0);
+    }
+    return rv;
+}
+
+static apr_status_t fcgi_read(cgid_fcgi_t *fcgi, void *buf, apr_size_t *len,
+                              apr_read_type_e block)
+{
+    apr_interval_time_t timeout = 0;
+    apr_status_t rv;
+
+    if (block == APR_NONBLOCK_READ) {
+        apr_file_pipe_timeout_get(fcgi->file, &timeout);
+        apr_file_pipe_timeout_set(fcgi->file, 0);
+    }
+    rv = apr_file_read(fcgi->file, buf, len);
+    if (block == APR_NONBLOCK_READ) {
+        apr_file_pipe_timeout_set(fcgi->file, timeout);
+    }
+
+    return rv;
+}
+
+/* Read, or skip if buf is NULL, the content of a record */
+static apr_status_t fcgi_read_content(cgid_fcgi_t *fcgi, char *buf,
+                                      apr_size_t len)
+{
+    char skip[256];
+    apr_status_t rv = APR_SUCCESS;
+
+    if (buf) {
+        return apr_file_read_full(fcgi->file, buf, len, NULL);
+    }
+    while (len && rv == APR_SUCCESS) {
+        apr_size_t n = len < sizeof(skip) ? len : sizeof(skip);
+
+        rv = apr_file_read_full(fcgi->file, skip, n, NULL);
+        len -= n;
+    }
+
+    return rv;
+}
+
+/* Read records until there is output of the script or the request has
+ * ended.  Only the headers of the records are read without blocking if
+ * asked to, the rest of a record follows its header closely.
+ */
+static apr_status_t fcgi_next_output(cgid_fcgi_t *fcgi, apr_read_type_e block)
+{
+    request_rec *r = fcgi->r;
+    apr_status_t rv = APR_SUCCESS;
+
+    while (!fcgi->remaining && !fcgi->ended) {
+        unsigned char version, type, padding;
+        apr_uint16_t request_id, clen;
+        char *msg;
+
+        while (fcgi->header_len < AP_FCGI_HEADER_LEN) {
+            apr_size_t n = AP_FCGI_HEADER_LEN - fcgi->header_len;
+
+            rv = fcgi_read(fcgi, fcgi->header + fcgi->header_len, &n, block);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+            fcgi->header_len += n;
+        }
+        fcgi->header_len = 0;
+
+        ap_fcgi_header_fields_from_array(&version, &type, &request_id,
+                                         &clen, &padding, fcgi->header);
+        if (version != AP_FCGI_VERSION_1) {
+            return APR_EGENERAL;
+        }
+
+        switch (type) {
+        case AP_FCGI_STDOUT:
+            fcgi->remaining = clen;
+            fcgi->padding = padding;
+            if (!clen) {
+                rv = fcgi_read_content(fcgi, NULL, padding);
+            }
+            break;
+
+        case AP_FCGI_STDERR:
+            msg = apr_palloc(r->pool, clen + 1);
+            rv = fcgi_read_content(fcgi, msg, clen);
+            if (rv == APR_SUCCESS) {
+                msg[clen] = '\0';
+                if (clen) {
+                    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02860)
+                                  "%s: %s", r->filename, msg);
+                }
+                rv = fcgi_read_content(fcgi, NULL, padding);
+            }
+            break;
+
+        case AP_FCGI_END_REQUEST:
+            fcgi->ended = 1;
+            /* fall through */
+        default:
+            rv = fcgi_read_content(fcgi, NULL, clen + padding);
+            break;
+        }
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+
+    return rv;
+}
+
+/* A bucket reading the output of a persistent script, as the pipe bucket
+ * does for CGI scripts.  The records of other streams are handled on the
+ * way.
+ */
+static const apr_bucket_type_t bucket_type_fcgi;
+
+static apr_bucket *fcgi_bucket_create(cgid_fcgi_t *fcgi,
+                                      apr_bucket_alloc_t *list)
+{
+    apr_bucket *b = apr_bucket_alloc(sizeof(*b), list);
+
+    APR_BUCKET_INIT(b);
+    b->free = apr_bucket_free;
+    b->list = list;
+    b->type = &bucket_type_fcgi;
+    b->length = (apr_size_t)(-1);
+    b->start = -1;
+    b->data = fcgi;
+    return b;
+}
+
+static apr_status_t fcgi_bucket_read(apr_bucket *b, const char **str,
+                                     apr_size_t *len, apr_read_type_e block)
+{
+    cgid_fcgi_t *fcgi = b->data;
+    char *buf = NULL;
+    apr_status_t rv;
+
+    *str = NULL;
+    *len = 0;
+
+    rv = fcgi_next_output(fcgi, block);
+    if (rv == APR_SUCCESS && fcgi->remaining) {
+        *len = fcgi->remaining < APR_BUCKET_BUFF_SIZE ? fcgi->remaining
+                                                      : APR_BUCKET_BUFF_SIZE;
+        buf = apr_bucket_alloc(APR_BUCKET_BUFF_SIZE, b->list);
+        rv = fcgi_read(fcgi, buf, len, block);
+        if (rv != APR_SUCCESS) {
+            apr_bucket_free(buf);
+            buf = NULL;
+            *len = 0;
+        }
+        else {
+            fcgi->remaining -= *len;
+            if (!fcgi->remaining) {
+                rv = fcgi_read_content(fcgi, NULL, fcgi->padding);
+            }
+        }
+    }
+
+    if (APR_STATUS_IS_EAGAIN(rv) && !buf) {
+        return rv;
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, fcgi->r, APLOGNO(02861)
+                      "error reading the output of persistent script %s",
+                      fcgi->r->filename);
+        fcgi->failed = 1;
+        fcgi->ended = 1;
+    }
+
+    if (buf) {
+        apr_bucket_heap *h;
+
+        b = apr_bucket_heap_make(b, buf, *len, apr_bucket_free);
+        h = b->data;
+        h->alloc_len = APR_BUCKET_BUFF_SIZE; /* note the real buffer size */
+        *str = buf;
+        APR_BUCKET_INSERT_AFTER(b, fcgi_bucket_create(fcgi, b->list));
+    }
+    else {
+        b = apr_bucket_immortal_make(b, "", 0);
+        *str = b->data;
+    }
+
+    return APR_SUCCESS;
+}
+
+static const apr_bucket_type_t bucket_type_fcgi = {
+    "CGID_FCGI", 5, APR_BUCKET_DATA,
+    apr_bucket_destroy_noop,
+    fcgi_bucket_read,
+    apr_bucket_setaside_notimpl,
+    apr_bucket_split_notimpl,
+    apr_bucket_copy_notimpl
+};
+
 static int cgid_handler(request_rec *r)
 {
     int retval, nph, dbpos;
@@ -1381,6 +2851,7 @@ static int cgid_handler(request_rec *r)
     struct cleanup_script_info *info;
     apr_status_t rv;
     cgid_dirconf *dc;
+    cgid_fcgi_t *fcgi = NULL;
 
     if (strcmp(r->handler, CGI_MAGIC_TYPE) && strcmp(r->handler, "cgi-script")) {
         return DECLINED;
@@ -1445,23 +2916,31 @@ static int cgid_handler(request_rec *r)
     ap_add_cgi_vars(r);
     env = ap_create_environment(r->pool, r->subprocess_env);
 
-    if ((retval = connect_to_daemon(&sd, r, conf)) != OK) {
+    if (dc->persist == 1
+        && (retval = persist_connect(r, conf, dc, argv0, env,
+                                     &sd, &fcgi)) != OK) {
         return retval;
     }
 
-    rv = send_req(sd, r, argv0, env, CGI_REQ);
-    if (rv != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01268)
-                     "write to cgi daemon process");
-    }
+    if (!fcgi) {
+        if ((retval = connect_to_daemon(&sd, r, conf)) != OK) {
+            return retval;
+        }
 
-    info = apr_palloc(r->pool, sizeof(struct cleanup_script_info));
-    info->r = r;
-    info->conn_id = r->connection->id;
-    info->conf = conf;
-    apr_pool_cleanup_register(r->pool, info,
-                              cleanup_script,
-                              apr_pool_cleanup_null);
+        rv = send_req(sd, r, argv0, env, CGI_REQ, -1);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01268)
+                         "write to cgi daemon process");
+        }
+
+        info = apr_palloc(r->pool, sizeof(struct cleanup_script_info));
+        info->r = r;
+        info->conn_id = r->connection->id;
+        info->conf = conf;
+        apr_pool_cleanup_register(r->pool, info,
+                                  cleanup_script,
+                                  apr_pool_cleanup_null);
+    }
     /* We are putting the socket discriptor into an apr_file_t so that we can
      * use a pipe bucket to send the data to the client.  APR will create
      * a cleanup for the apr_file_t which will close the socket, so we'll
@@ -1477,6 +2956,18 @@ static int cgid_handler(request_rec *r)
     }
     apr_pool_cleanup_kill(r->pool, (void *)((long)sd), close_unix_socket);
 
+    if (fcgi) {
+        fcgi->file = tempsock;
+        rv = fcgi_send_params(fcgi);
+        if (rv != APR_SUCCESS) {
+            fcgi->failed = 1;
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(02859)
+                          "couldn't send request to persistent script %s",
+                          r->filename);
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+    }
+
     /* Transfer any put/post args, CERN style...
      * Note that we already ignore SIGPIPE in the core server.
      */
@@ -1546,7 +3037,12 @@ static int cgid_handler(request_rec *r)
             /* Keep writing data to the child until done or too much time
              * elapses with no progress or an error occurs.
              */
-            rv = apr_file_write_full(tempsock, data, len, NULL);
+            if (!fcgi) {
+                rv = apr_file_write_full(tempsock, data, len, NULL);
+            }
+            else if (len) {
+                rv = fcgi_send_stream(fcgi, AP_FCGI_STDIN, data, len);
+            }
 
             if (rv != APR_SUCCESS) {
                 /* silly script stopped reading, soak up remaining message */
@@ -1569,7 +3065,13 @@ static int cgid_handler(request_rec *r)
      * force EOF on child's stdin so that the cgi detects end (or
      * absence) of data
      */
-    shutdown(sd, 1);
+    if (!fcgi) {
+        shutdown(sd, 1);
+    }
+    else if (child_stopped_reading
+             || fcgi_send_stream(fcgi, AP_FCGI_STDIN, NULL, 0) != APR_SUCCESS) {
+        fcgi->failed = 1;
+    }
 
     /* Handle script return... */
     if (!nph) {
@@ -1579,7 +3081,12 @@ static int cgid_handler(request_rec *r)
         int ret;
 
         bb = apr_brigade_create(r->pool, c->bucket_alloc);
-        b = apr_bucket_pipe_create(tempsock, c->bucket_alloc);
+        if (fcgi) {
+            b = fcgi_bucket_create(fcgi, c->bucket_alloc);
+        }
+        else {
+            b = apr_bucket_pipe_create(tempsock, c->bucket_alloc);
+        }
         APR_BRIGADE_INSERT_TAIL(bb, b);
         b = apr_bucket_eos_create(c->bucket_alloc);
         APR_BRIGADE_INSERT_TAIL(bb, b);
@@ -1673,7 +3180,12 @@ static int cgid_handler(request_rec *r)
         r->output_filters = r->proto_output_filters = cur;
 
         bb = apr_brigade_create(r->pool, c->bucket_alloc);
-        b = apr_bucket_pipe_create(tempsock, c->bucket_alloc);
+        if (fcgi) {
+            b = fcgi_bucket_create(fcgi, c->bucket_alloc);
+        }
+        else {
+            b = apr_bucket_pipe_create(tempsock, c->bucket_alloc);
+        }
         APR_BRIGADE_INSERT_TAIL(bb, b);
         b = apr_bucket_eos_create(c->bucket_alloc);
         APR_BRIGADE_INSERT_TAIL(bb, b);
@@ -1796,7 +3308,7 @@ static int include_cmd(include_ctx_t *ctx, ap_filter_t *f,
         return retval;
     }
 
-    send_req(sd, r, command, env, SSI_REQ);
+    send_req(sd, r, command, env, SSI_REQ, -1);
 
     info = apr_palloc(r->pool, sizeof(struct cleanup_script_info));
     info->r = r;
@@ -1917,6 +3429,107 @@ static apr_status_t handle_exec(include_ctx_t *ctx, ap_filter_t *f,
  *============================================================================*/
 
 
+/* The figures are updated by the spawners without locking, so what is
+ * shown is approximate.
+ */
+static int cgid_status_hook(request_rec *r, int flags)
+{
+    apr_uint32_t connected, accepted, queued;
+    apr_uint64_t spawn_time = 0, spawn_max = 0, wait_time = 0, wait_max = 0;
+    unsigned long started = 0, failed = 0;
+    int i, busy = 0, persist = 0, persist_busy = 0;
+
+    if (!cgid_shm) {
+        return OK;
+    }
+
+    accepted = apr_atomic_read32(&cgid_shared->accepted);
+    connected = apr_atomic_read32(&cgid_shared->connected);
+    queued = connected - accepted;
+    if ((apr_int32_t)queued < 0) {
+        /* accepted in between the two reads */
+        queued = 0;
+    }
+
+    for (i = 0; i < cgid_shared->num_spawners; i++) {
+        cgid_spawner_t *spawner = &cgid_shared->spawners[i];
+
+        busy += spawner->pid > 0 && spawner->busy;
+        started += spawner->started;
+        failed += spawner->failed;
+        spawn_time += spawner->spawn_time;
+        wait_time += spawner->wait_time;
+        if (spawner->spawn_max > spawn_max) {
+            spawn_max = spawner->spawn_max;
+        }
+        if (spawner->wait_max > wait_max) {
+            wait_max = spawner->wait_max;
+        }
+    }
+    for (i = 0; cgid_persist && i < CGID_PERSIST_SLOTS; i++) {
+        cgid_persist_t *slot = &cgid_persist[i];
+
+        if (apr_atomic_read32(&slot->state) == CGID_PERSIST_READY) {
+            persist++;
+            persist_busy += apr_atomic_read32(&slot->active) != 0;
+        }
+    }
+    if (started) {
+        spawn_time /= started;
+    }
+    if (started + failed) {
+        wait_time /= started + failed;
+    }
+
+    if (flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "CGIDSpawners: %d\n"
+                   "CGIDSpawnersBusy: %d\n"
+                   "CGIDQueueDepth: %u\n"
+                   "CGIDScriptsStarted: %lu\n"
+                   "CGIDScriptsFailed: %lu\n"
+                   "CGIDQueueWaitAvg: %" APR_UINT64_T_FMT "\n"
+                   "CGIDQueueWaitMax: %" APR_UINT64_T_FMT "\n"
+                   "CGIDSpawnTimeAvg: %" APR_UINT64_T_FMT "\n"
+                   "CGIDSpawnTimeMax: %" APR_UINT64_T_FMT "\n"
+                   "CGIDPersistentProcesses: %d\n"
+                   "CGIDPersistentBusy: %d\n",
+                   cgid_shared->num_spawners, busy, queued, started, failed,
+                   wait_time, wait_max, spawn_time, spawn_max,
+                   persist, persist_busy);
+        return OK;
+    }
+
+    ap_rputs("<hr />\n<h2>CGI Daemon</h2>\n", r);
+    ap_rprintf(r, "<dl><dt>%d spawners, %d busy, %u requests queued</dt>\n"
+               "<dt>%lu scripts started, %lu failed</dt>\n"
+               "<dt>queue wait %" APR_UINT64_T_FMT " us average, "
+               "%" APR_UINT64_T_FMT " us max</dt>\n"
+               "<dt>spawn time %" APR_UINT64_T_FMT " us average, "
+               "%" APR_UINT64_T_FMT " us max</dt>\n"
+               "<dt>%d persistent script processes, %d busy</dt></dl>\n",
+               cgid_shared->num_spawners, busy, queued, started, failed,
+               wait_time, wait_max, spawn_time, spawn_max,
+               persist, persist_busy);
+
+    ap_rputs("<table border=\"0\"><tr><th>Spawner</th><th>PID</th>"
+             "<th>Busy</th><th>Started</th><th>Failed</th>"
+             "<th>Max wait (us)</th><th>Max spawn (us)</th></tr>\n", r);
+    for (i = 0; i < cgid_shared->num_spawners; i++) {
+        cgid_spawner_t *spawner = &cgid_shared->spawners[i];
+
+        ap_rprintf(r, "<tr><td>%d</td><td>%" APR_PID_T_FMT "</td>"
+                   "<td>%s</td><td>%u</td><td>%u</td>"
+                   "<td>%" APR_UINT64_T_FMT "</td>"
+                   "<td>%" APR_UINT64_T_FMT "</td></tr>\n",
+                   i, spawner->pid, spawner->busy ? "yes" : "no",
+                   spawner->started, spawner->failed,
+                   spawner->wait_max, spawner->spawn_max);
+    }
+    ap_rputs("</table>\n", r);
+
+    return OK;
+}
+
 static void register_hook(apr_pool_t *p)
 {
     static const char * const aszPre[] = { "mod_include.c", NULL };
@@ -1924,12 +3537,16 @@ static void register_hook(apr_pool_t *p)
     ap_hook_pre_config(cgid_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(cgid_init, aszPre, NULL, APR_HOOK_MIDDLE);
     ap_hook_handler(cgid_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_monitor(cgid_monitor, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_end_generation(cgid_end_generation, NULL, NULL, APR_HOOK_MIDDLE);
+    APR_OPTIONAL_HOOK(ap, status_hook, cgid_status_hook, NULL, NULL,
+                      APR_HOOK_MIDDLE);
 }
 
 AP_DECLARE_MODULE(cgid) = {
     STANDARD20_MODULE_STUFF,
     create_cgid_dirconf, /* dir config creater */
-    NULL, /* dir merger --- default is to override */
+    merge_cgid_dirconf, /* dir merger */
     create_cgid_config, /* server config */
     merge_cgid_config, /* merge server config */
     cgid_cmds, /* command table */
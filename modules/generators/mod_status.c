@@ -126,6 +126,17 @@ static void format_kbyte_out(request_rec *r, apr_off_t kbytes)
         ap_rprintf(r, "%.1f GB", (float) kbytes / MBYTE);
 }
 
+/* Format the share of connections that got a recycled transaction pool */
+static const char *hit_rate(apr_pool_t *p, apr_uint32_t hits,
+                            apr_uint32_t misses)
+{
+    apr_uint64_t total = (apr_uint64_t)hits + misses;
+
+    if (!total)
+        return "-";
+    return apr_psprintf(p, "%u%%", (unsigned int)(hits * 100.0 / total));
+}
+
 static void show_time(request_rec *r, apr_interval_time_t tsecs)
 {
     int days, hrs, mins, secs;
@@ -500,6 +511,8 @@ static int status_handler(request_rec *r)
     if (is_async) {
         int write_completion = 0, lingering_close = 0, keep_alive = 0,
             connections = 0;
+        apr_uint32_t recycled_pools = 0, recycled_pools_peak = 0,
+                     pool_hits = 0, pool_misses = 0, pools_destroyed = 0;
         /*
          * These differ from 'busy' and 'ready' in how gracefully finishing
          * threads are counted. XXX: How to make this clear in the html?
@@ -510,10 +523,13 @@ static int status_handler(request_rec *r)
                      "<tr><th rowspan=\"2\">PID</th>"
                          "<th colspan=\"2\">Connections</th>\n"
                          "<th colspan=\"2\">Threads</th>"
-                         "<th colspan=\"4\">Async connections</th></tr>\n"
+                         "<th colspan=\"4\">Async connections</th>"
+                         "<th colspan=\"3\">Transaction pools</th></tr>\n"
                      "<tr><th>total</th><th>accepting</th>"
                          "<th>busy</th><th>idle</th><th>writing</th>"
-                         "<th>keep-alive</th><th>closing</th></tr>\n", r);
+                         "<th>keep-alive</th><th>closing</th>"
+                         "<th>recycled</th><th>peak</th><th>hits</th>"
+                         "</tr>\n", r);
         for (i = 0; i < server_limit; ++i) {
             ps_record = ap_get_scoreboard_process(i);
             if (ps_record->pid) {
@@ -523,34 +539,57 @@ static int status_handler(request_rec *r)
                 lingering_close  += ps_record->lingering_close;
                 busy_workers     += thread_busy_buffer[i];
                 idle_workers     += thread_idle_buffer[i];
+                recycled_pools      += ps_record->recycled_pools;
+                recycled_pools_peak += ps_record->recycled_pools_peak;
+                pool_hits           += ps_record->pool_hits;
+                pool_misses         += ps_record->pool_misses;
+                pools_destroyed     += ps_record->pools_destroyed;
                 if (!short_report)
                     ap_rprintf(r, "<tr><td>%" APR_PID_T_FMT "</td><td>%u</td>"
                                       "<td>%s</td><td>%u</td><td>%u</td>"
                                       "<td>%u</td><td>%u</td><td>%u</td>"
+                                      "<td>%u</td><td>%u</td><td>%s</td>"
                                       "</tr>\n",
                                ps_record->pid, ps_record->connections,
                                ps_record->not_accepting ? "no" : "yes",
                                thread_busy_buffer[i], thread_idle_buffer[i],
                                ps_record->write_completion,
                                ps_record->keep_alive,
-                               ps_record->lingering_close);
+                               ps_record->lingering_close,
+                               ps_record->recycled_pools,
+                               ps_record->recycled_pools_peak,
+                               hit_rate(r->pool, ps_record->pool_hits,
+                                        ps_record->pool_misses));
             }
         }
         if (!short_report) {
             ap_rprintf(r, "<tr><td>Sum</td><td>%d</td><td>&nbsp;</td><td>%d</td>"
                           "<td>%d</td><td>%d</td><td>%d</td><td>%d</td>"
+                          "<td>%u</td><td>%u</td><td>%s</td>"
                           "</tr>\n</table>\n",
                           connections, busy_workers, idle_workers,
-                          write_completion, keep_alive, lingering_close);
+                          write_completion, keep_alive, lingering_close,
+                          recycled_pools, recycled_pools_peak,
+                          hit_rate(r->pool, pool_hits, pool_misses));
+            if (pools_destroyed) {
+                ap_rprintf(r, "<p>%u transaction pools were destroyed "
+                              "instead of recycled.</p>\n", pools_destroyed);
+            }
 
         }
         else {
             ap_rprintf(r, "ConnsTotal: %d\n"
                           "ConnsAsyncWriting: %d\n"
                           "ConnsAsyncKeepAlive: %d\n"
-                          "ConnsAsyncClosing: %d\n",
+                          "ConnsAsyncClosing: %d\n"
+                          "TransPoolsRecycled: %u\n"
+                          "TransPoolsRecycledPeak: %u\n"
+                          "TransPoolHits: %u\n"
+                          "TransPoolMisses: %u\n"
+                          "TransPoolsDestroyed: %u\n",
                        connections, write_completion, keep_alive,
-                       lingering_close);
+                       lingering_close, recycled_pools, recycled_pools_peak,
+                       pool_hits, pool_misses, pools_destroyed);
         }
     }
 
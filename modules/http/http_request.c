@@ -460,6 +460,7 @@ static request_rec *internal_internal_redirect(const char *new_uri,
     new->proto_num       = r->proto_num;
     new->hostname        = r->hostname;
     new->request_time    = r->request_time;
+    new->timing          = r->timing;
     new->main            = r->main;
 
     new->headers_in      = r->headers_in;
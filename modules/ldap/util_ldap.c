@@ -33,6 +33,8 @@
 #include "util_ldap_cache.h"
 
 #include <apr_strings.h>
+#include <apr_atomic.h>
+#include <apr_thread_proc.h>
 
 #if APR_HAVE_UNISTD_H
 #include <unistd.h>
@@ -73,17 +75,60 @@
 
 module AP_MODULE_DECLARE_DATA ldap_module;
 static const char *ldap_cache_mutex_type = "ldap-cache";
+
+#if APR_HAS_THREADS
+/* The connection each thread used last, tried first on the next lookup */
+static apr_threadkey_t *ldc_affinity_key = NULL;
+#endif
+static apr_uint32_t ldc_affinity_lookups = 0;
+static apr_uint32_t ldc_affinity_hits = 0;
 static apr_status_t uldap_connection_unbind(void *param);
 
-#define LDAP_CACHE_LOCK() do {                                  \
-    if (st->util_ldap_cache_lock)                               \
-        apr_global_mutex_lock(st->util_ldap_cache_lock);        \
-} while (0)
+/*
+ * The caches are sharded (see util_ldap_cache.h); LDAP_CACHE_LOCK() locks
+ * the shard of 'cache' which holds 'key' and evaluates to that shard, to be
+ * passed to LDAP_CACHE_UNLOCK().  Only the entries of that cache with keys
+ * in the same shard may be used while it is held.
+ */
+#define LDAP_CACHE_LOCK(cache, key) uldap_cache_lock(st, (cache), (key))
+#define LDAP_CACHE_UNLOCK(shard)    uldap_cache_unlock(st, (shard))
+
+static unsigned int uldap_cache_lock(util_ldap_state_t *st,
+                                     util_ald_cache_t *cache, void *key)
+{
+    unsigned int shard = util_ald_cache_shard(cache, key);
+
+    if (st->util_ldap_cache_shard_locks) {
+        apr_global_mutex_lock(st->util_ldap_cache_shard_locks[shard]);
+    }
+    return shard;
+}
+
+static void uldap_cache_unlock(util_ldap_state_t *st, unsigned int shard)
+{
+    if (st->util_ldap_cache_shard_locks) {
+        apr_global_mutex_unlock(st->util_ldap_cache_shard_locks[shard]);
+    }
+}
+
+/* Find the cache node of an LDAP URL, creating it if need be */
+static util_url_node_t *uldap_cache_url_node(util_ldap_state_t *st,
+                                             const char *url, int create)
+{
+    util_url_node_t *curl;
+    util_url_node_t curnode;
+    unsigned int shard;
+
+    curnode.url = url;
+    shard = LDAP_CACHE_LOCK(st->util_ldap_cache, &curnode);
+    curl = util_ald_cache_fetch(st->util_ldap_cache, &curnode);
+    if (curl == NULL && create) {
+        curl = util_ald_create_caches(st, url);
+    }
+    LDAP_CACHE_UNLOCK(shard);
 
-#define LDAP_CACHE_UNLOCK() do {                                \
-    if (st->util_ldap_cache_lock)                               \
-        apr_global_mutex_unlock(st->util_ldap_cache_lock);      \
-} while (0)
+    return curl;
+}
 
 static void util_ldap_strdup (char **str, const char *newstr)
 {
@@ -112,6 +157,8 @@ static void util_ldap_strdup (char **str, const char *newstr)
 static int util_ldap_handler(request_rec *r)
 {
     util_ldap_state_t *st;
+    apr_uint32_t lookups, hits;
+    int i;
 
     r->allowed |= (1 << M_GET);
     if (r->method_number != M_GET) {
@@ -135,7 +182,22 @@ static int util_ldap_handler(request_rec *r)
     ap_rputs("<body bgcolor='#ffffff'><h1 align=center>LDAP Cache Information"
              "</h1>\n", r);
 
+    /* the display walks every shard of every cache */
+    for (i = 0; st->util_ldap_cache_shard_locks
+                && i < UTIL_LDAP_CACHE_SHARDS; i++) {
+        apr_global_mutex_lock(st->util_ldap_cache_shard_locks[i]);
+    }
     util_ald_cache_display(r, st);
+    for (i = UTIL_LDAP_CACHE_SHARDS - 1; st->util_ldap_cache_shard_locks
+                                         && i >= 0; i--) {
+        apr_global_mutex_unlock(st->util_ldap_cache_shard_locks[i]);
+    }
+
+    lookups = apr_atomic_read32(&ldc_affinity_lookups);
+    hits = apr_atomic_read32(&ldc_affinity_hits);
+    ap_rprintf(r, "<p>Connections found by thread affinity in this child: "
+               "%u/%u (%.0f%%)</p>\n", hits, lookups,
+               lookups ? (double)hits / (double)lookups * 100.0 : 0.0);
 
     return OK;
 }
@@ -682,6 +744,47 @@ static int compare_client_certs(apr_array_header_t *srcs,
 }
 
 
+/*
+ * Does the connection exactly match the requested parameters?
+ */
+static int uldap_connection_matches(util_ldap_connection_t *l,
+                                    const char *host, int port,
+                                    const char *binddn, const char *bindpw,
+                                    deref_options deref, int secureflag,
+                                    util_ldap_config_t *dc)
+{
+    return (l->port == port) && (strcmp(l->host, host) == 0)
+        && ((!l->binddn && !binddn) || (l->binddn && binddn
+                                         && !strcmp(l->binddn, binddn)))
+        && ((!l->bindpw && !bindpw) || (l->bindpw && bindpw
+                                         && !strcmp(l->bindpw, bindpw)))
+        && (l->deref == deref) && (l->secure == secureflag)
+        && !compare_client_certs(dc->client_certs, l->client_certs);
+}
+
+/*
+ * Unbind a pooled connection that has been idle for longer than
+ * LDAPConnectionPoolTTL, before it is reused.
+ */
+static void uldap_connection_expire(request_rec *r, util_ldap_state_t *st,
+                                    util_ldap_connection_t *l, apr_time_t now,
+                                    const char *how)
+{
+    if (st->connection_pool_ttl > 0) {
+        if (l->bound && (now - l->last_backend_conn) > st->connection_pool_ttl) {
+            ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                          "Removing LDAP connection last used %" APR_TIME_T_FMT " seconds ago",
+                          (now - l->last_backend_conn) / APR_USEC_PER_SEC);
+            l->r = r;
+            uldap_connection_unbind(l);
+            /* Go ahead (by falling through) and use it, so we don't create more just to unbind some other old ones */
+        }
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE5, 0, r,
+                      "Reuse %s LDC %pp%s",
+                      l->bound ? "bound" : "unbound", l, how);
+    }
+}
+
 /*
  * Find an existing ldap connection struct that matches the
  * provided ldap connection parameters.
@@ -689,6 +792,10 @@ static int compare_client_certs(apr_array_header_t *srcs,
  * If not found in the cache, a new ldc structure will be allocated
  * from st->pool and returned to the caller.  If found in the cache,
  * a pointer to the existing ldc structure will be returned.
+ *
+ * Each thread first tries the connection it used last, which avoids
+ * walking the connection list under st->mutex in the common case of a
+ * thread serving the same LDAP URL and bind credentials over and over.
  */
 static util_ldap_connection_t *
             uldap_connection_find(request_rec *r,
@@ -706,15 +813,35 @@ static util_ldap_connection_t *
     util_ldap_config_t *dc =
         (util_ldap_config_t *) ap_get_module_config(r->per_dir_config, &ldap_module);
 
+    if (secure < APR_LDAP_NONE) {
+        secureflag = st->secure;
+    }
+
 #if APR_HAS_THREADS
+    if (ldc_affinity_key) {
+        void *last = NULL;
+
+        apr_atomic_inc32(&ldc_affinity_lookups);
+
+        apr_threadkey_private_get(&last, ldc_affinity_key);
+        l = last;
+        if (l && l->st == st
+            && APR_SUCCESS == apr_thread_mutex_trylock(l->lock)) {
+            if (uldap_connection_matches(l, host, port, binddn, bindpw,
+                                         deref, secureflag, dc)) {
+                uldap_connection_expire(r, st, l, now, " (thread affinity)");
+                apr_atomic_inc32(&ldc_affinity_hits);
+                l->r = r;
+                return l;
+            }
+            apr_thread_mutex_unlock(l->lock);
+        }
+    }
+
     /* mutex lock this function */
     apr_thread_mutex_lock(st->mutex);
 #endif
 
-    if (secure < APR_LDAP_NONE) {
-        secureflag = st->secure;
-    }
-
     /* Search for an exact connection match in the list that is not
      * being used.
      */
@@ -722,27 +849,10 @@ static util_ldap_connection_t *
 #if APR_HAS_THREADS
         if (APR_SUCCESS == apr_thread_mutex_trylock(l->lock)) {
 #endif
-        if (   (l->port == port) && (strcmp(l->host, host) == 0)
-            && ((!l->binddn && !binddn) || (l->binddn && binddn
-                                             && !strcmp(l->binddn, binddn)))
-            && ((!l->bindpw && !bindpw) || (l->bindpw && bindpw
-                                             && !strcmp(l->bindpw, bindpw)))
-            && (l->deref == deref) && (l->secure == secureflag)
-            && !compare_client_certs(dc->client_certs, l->client_certs))
+        if (uldap_connection_matches(l, host, port, binddn, bindpw,
+                                     deref, secureflag, dc))
         {
-            if (st->connection_pool_ttl > 0) {
-                if (l->bound && (now - l->last_backend_conn) > st->connection_pool_ttl) {
-                    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
-                                  "Removing LDAP connection last used %" APR_TIME_T_FMT " seconds ago",
-                                  (now - l->last_backend_conn) / APR_USEC_PER_SEC);
-                    l->r = r;
-                    uldap_connection_unbind(l);
-                    /* Go ahead (by falling through) and use it, so we don't create more just to unbind some other old ones */
-                }
-                ap_log_rerror(APLOG_MARK, APLOG_TRACE5, 0, r, 
-                              "Reuse %s LDC %pp", 
-                              l->bound ? "bound" : "unbound", l);
-            }
+            uldap_connection_expire(r, st, l, now, "");
             break;
         }
 #if APR_HAS_THREADS
@@ -768,19 +878,7 @@ static util_ldap_connection_t *
                 (l->deref == deref) && (l->secure == secureflag) &&
                 !compare_client_certs(dc->client_certs, l->client_certs))
             {
-                if (st->connection_pool_ttl > 0) {
-                    if (l->bound && (now - l->last_backend_conn) > st->connection_pool_ttl) {
-                        ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
-                                "Removing LDAP connection last used %" APR_TIME_T_FMT " seconds ago",
-                                (now - l->last_backend_conn) / APR_USEC_PER_SEC);
-                        l->r = r;
-                        uldap_connection_unbind(l);
-                        /* Go ahead (by falling through) and use it, so we don't create more just to unbind some other old ones */
-                    }
-                    ap_log_rerror(APLOG_MARK, APLOG_TRACE5, 0, r, 
-                                  "Reuse %s LDC %pp (will rebind)", 
-                                   l->bound ? "bound" : "unbound", l);
-                }
+                uldap_connection_expire(r, st, l, now, " (will rebind)");
 
                 /* the bind credentials have changed */
                 l->must_rebind = 1;
@@ -875,6 +973,9 @@ static util_ldap_connection_t *
 
 #if APR_HAS_THREADS
     apr_thread_mutex_unlock(st->mutex);
+    if (ldc_affinity_key) {
+        apr_threadkey_private_set(l, ldc_affinity_key);
+    }
 #endif
     l->r = r;
     return l;
@@ -897,7 +998,7 @@ static int uldap_cache_comparedn(request_rec *r, util_ldap_connection_t *ldc,
 {
     int result = 0;
     util_url_node_t *curl;
-    util_url_node_t curnode;
+    unsigned int shard;
     util_dn_compare_node_t *node;
     util_dn_compare_node_t newnode;
     int failures = 0;
@@ -909,14 +1010,7 @@ static int uldap_cache_comparedn(request_rec *r, util_ldap_connection_t *ldc,
                                                  &ldap_module);
 
     /* get cache entry (or create one) */
-    LDAP_CACHE_LOCK();
-
-    curnode.url = url;
-    curl = util_ald_cache_fetch(st->util_ldap_cache, &curnode);
-    if (curl == NULL) {
-        curl = util_ald_create_caches(st, url);
-    }
-    LDAP_CACHE_UNLOCK();
+    curl = uldap_cache_url_node(st, url, 1);
 
     /* a simple compare? */
     if (!compare_dn_on_server) {
@@ -933,21 +1027,21 @@ static int uldap_cache_comparedn(request_rec *r, util_ldap_connection_t *ldc,
 
     if (curl) {
         /* no - it's a server side compare */
-        LDAP_CACHE_LOCK();
+        newnode.reqdn = (char *)reqdn;
+        shard = LDAP_CACHE_LOCK(curl->dn_compare_cache, &newnode);
 
         /* is it in the compare cache? */
-        newnode.reqdn = (char *)reqdn;
         node = util_ald_cache_fetch(curl->dn_compare_cache, &newnode);
         if (node != NULL) {
             /* If it's in the cache, it's good */
             /* unlock this read lock */
-            LDAP_CACHE_UNLOCK();
+            LDAP_CACHE_UNLOCK(shard);
             ldc->reason = "DN Comparison TRUE (cached)";
             return LDAP_COMPARE_TRUE;
         }
 
         /* unlock this read lock */
-        LDAP_CACHE_UNLOCK();
+        LDAP_CACHE_UNLOCK(shard);
     }
 
 start_over:
@@ -1009,9 +1103,9 @@ start_over:
     else {
         if (curl) {
             /* compare successful - add to the compare cache */
-            LDAP_CACHE_LOCK();
             newnode.reqdn = (char *)reqdn;
             newnode.dn = (char *)dn;
+            shard = LDAP_CACHE_LOCK(curl->dn_compare_cache, &newnode);
 
             node = util_ald_cache_fetch(curl->dn_compare_cache, &newnode);
             if (   (node == NULL)
@@ -1020,7 +1114,7 @@ start_over:
             {
                 util_ald_cache_insert(curl->dn_compare_cache, &newnode);
             }
-            LDAP_CACHE_UNLOCK();
+            LDAP_CACHE_UNLOCK(shard);
         }
         ldc->reason = "DN Comparison TRUE (checked on server)";
         result = LDAP_COMPARE_TRUE;
@@ -1044,7 +1138,7 @@ static int uldap_cache_compare(request_rec *r, util_ldap_connection_t *ldc,
 {
     int result = 0;
     util_url_node_t *curl;
-    util_url_node_t curnode;
+    unsigned int shard;
     util_compare_node_t *compare_nodep;
     util_compare_node_t the_compare_node;
     apr_time_t curtime = 0; /* silence gcc -Wall */
@@ -1055,19 +1149,10 @@ static int uldap_cache_compare(request_rec *r, util_ldap_connection_t *ldc,
                                                  &ldap_module);
 
     /* get cache entry (or create one) */
-    LDAP_CACHE_LOCK();
-    curnode.url = url;
-    curl = util_ald_cache_fetch(st->util_ldap_cache, &curnode);
-    if (curl == NULL) {
-        curl = util_ald_create_caches(st, url);
-    }
-    LDAP_CACHE_UNLOCK();
+    curl = uldap_cache_url_node(st, url, 1);
 
     if (curl) {
         /* make a comparison to the cache */
-        LDAP_CACHE_LOCK();
-        curtime = apr_time_now();
-
         the_compare_node.dn = (char *)dn;
         the_compare_node.attrib = (char *)attrib;
         the_compare_node.value = (char *)value;
@@ -1075,6 +1160,9 @@ static int uldap_cache_compare(request_rec *r, util_ldap_connection_t *ldc,
         the_compare_node.sgl_processed = 0;
         the_compare_node.subgroupList = NULL;
 
+        shard = LDAP_CACHE_LOCK(curl->compare_cache, &the_compare_node);
+        curtime = apr_time_now();
+
         compare_nodep = util_ald_cache_fetch(curl->compare_cache,
                                              &the_compare_node);
 
@@ -1102,12 +1190,12 @@ static int uldap_cache_compare(request_rec *r, util_ldap_connection_t *ldc,
                 /* record the result code to return with the reason... */
                 result = compare_nodep->result;
                 /* and unlock this read lock */
-                LDAP_CACHE_UNLOCK();
+                LDAP_CACHE_UNLOCK(shard);
                 return result;
             }
         }
         /* unlock this read lock */
-        LDAP_CACHE_UNLOCK();
+        LDAP_CACHE_UNLOCK(shard);
     }
 
 start_over:
@@ -1155,7 +1243,7 @@ start_over:
         (LDAP_NO_SUCH_ATTRIBUTE == result)) {
         if (curl) {
             /* compare completed; caching result */
-            LDAP_CACHE_LOCK();
+            shard = LDAP_CACHE_LOCK(curl->compare_cache, &the_compare_node);
             the_compare_node.lastcompare = curtime;
             the_compare_node.result = result;
             the_compare_node.sgl_processed = 0;
@@ -1184,7 +1272,7 @@ start_over:
                 compare_nodep->lastcompare = curtime;
                 compare_nodep->result = result;
             }
-            LDAP_CACHE_UNLOCK();
+            LDAP_CACHE_UNLOCK(shard);
         }
         if (LDAP_COMPARE_TRUE == result) {
             ldc->reason = "Comparison true (adding to cache)";
@@ -1396,7 +1484,7 @@ static int uldap_cache_check_subgroups(request_rec *r,
 {
     int result = LDAP_COMPARE_FALSE;
     util_url_node_t *curl;
-    util_url_node_t curnode;
+    unsigned int shard;
     util_compare_node_t *compare_nodep;
     util_compare_node_t the_compare_node;
     util_compare_subgroup_t *tmp_local_sgl = NULL;
@@ -1442,15 +1530,10 @@ static int uldap_cache_check_subgroups(request_rec *r,
      * 2. Find previously created cache entry and check if there is already a
      *    subgrouplist.
      */
-    LDAP_CACHE_LOCK();
-    curnode.url = url;
-    curl = util_ald_cache_fetch(st->util_ldap_cache, &curnode);
-    LDAP_CACHE_UNLOCK();
+    curl = uldap_cache_url_node(st, url, 0);
 
     if (curl && curl->compare_cache) {
         /* make a comparison to the cache */
-        LDAP_CACHE_LOCK();
-
         the_compare_node.dn = (char *)dn;
         the_compare_node.attrib = (char *)"objectClass";
         the_compare_node.value = (char *)sgc_ents[base_sgcIndex].name;
@@ -1458,6 +1541,8 @@ static int uldap_cache_check_subgroups(request_rec *r,
         the_compare_node.sgl_processed = 0;
         the_compare_node.subgroupList = NULL;
 
+        shard = LDAP_CACHE_LOCK(curl->compare_cache, &the_compare_node);
+
         compare_nodep = util_ald_cache_fetch(curl->compare_cache,
                                              &the_compare_node);
 
@@ -1491,7 +1576,7 @@ static int uldap_cache_check_subgroups(request_rec *r,
                 }
             }
         }
-        LDAP_CACHE_UNLOCK();
+        LDAP_CACHE_UNLOCK(shard);
     }
 
     if (!tmp_local_sgl && !sgl_cached_empty) {
@@ -1510,8 +1595,6 @@ static int uldap_cache_check_subgroups(request_rec *r,
         /*
          * Find the generic group cache entry and add the sgl we just retrieved.
          */
-        LDAP_CACHE_LOCK();
-
         the_compare_node.dn = (char *)dn;
         the_compare_node.attrib = (char *)"objectClass";
         the_compare_node.value = (char *)sgc_ents[base_sgcIndex].name;
@@ -1519,6 +1602,8 @@ static int uldap_cache_check_subgroups(request_rec *r,
         the_compare_node.sgl_processed = 0;
         the_compare_node.subgroupList = NULL;
 
+        shard = LDAP_CACHE_LOCK(curl->compare_cache, &the_compare_node);
+
         compare_nodep = util_ald_cache_fetch(curl->compare_cache,
                                              &the_compare_node);
 
@@ -1575,7 +1660,7 @@ static int uldap_cache_check_subgroups(request_rec *r,
                 }
             }
         }
-        LDAP_CACHE_UNLOCK();
+        LDAP_CACHE_UNLOCK(shard);
       }
     }
 
@@ -1629,6 +1714,36 @@ static int uldap_cache_check_subgroups(request_rec *r,
 }
 
 
+/*
+ * Remember that a search found no entry for the user, so that requests for
+ * unknown users are not all sent to the server (LDAPNegativeCacheTTL).
+ */
+static void uldap_cache_search_notfound(util_ldap_state_t *st,
+                                        util_url_node_t *curl,
+                                        const char *filter)
+{
+    util_search_node_t *search_nodep;
+    util_search_node_t the_search_node;
+    unsigned int shard;
+
+    if (!curl || st->search_cache_negative_ttl <= 0) {
+        return;
+    }
+
+    memset(&the_search_node, 0, sizeof(the_search_node));
+    the_search_node.username = filter;
+    the_search_node.lastbind = apr_time_now();
+
+    shard = LDAP_CACHE_LOCK(curl->search_cache, &the_search_node);
+    search_nodep = util_ald_cache_fetch(curl->search_cache,
+                                        &the_search_node);
+    if (search_nodep) {
+        util_ald_cache_remove(curl->search_cache, search_nodep);
+    }
+    util_ald_cache_insert(curl->search_cache, &the_search_node);
+    LDAP_CACHE_UNLOCK(shard);
+}
+
 static int uldap_cache_checkuserid(request_rec *r, util_ldap_connection_t *ldc,
                                    const char *url, const char *basedn,
                                    int scope, char **attrs, const char *filter,
@@ -1643,7 +1758,7 @@ static int uldap_cache_checkuserid(request_rec *r, util_ldap_connection_t *ldc,
     int count;
     int failures = 0;
     util_url_node_t *curl;              /* Cached URL node */
-    util_url_node_t curnode;
+    unsigned int shard;
     util_search_node_t *search_nodep;   /* Cached search node */
     util_search_node_t the_search_node;
     apr_time_t curtime;
@@ -1653,18 +1768,11 @@ static int uldap_cache_checkuserid(request_rec *r, util_ldap_connection_t *ldc,
         &ldap_module);
 
     /* Get the cache node for this url */
-    LDAP_CACHE_LOCK();
-    curnode.url = url;
-    curl = (util_url_node_t *)util_ald_cache_fetch(st->util_ldap_cache,
-                                                   &curnode);
-    if (curl == NULL) {
-        curl = util_ald_create_caches(st, url);
-    }
-    LDAP_CACHE_UNLOCK();
+    curl = uldap_cache_url_node(st, url, 1);
 
     if (curl) {
-        LDAP_CACHE_LOCK();
         the_search_node.username = filter;
+        shard = LDAP_CACHE_LOCK(curl->search_cache, &the_search_node);
         search_nodep = util_ald_cache_fetch(curl->search_cache,
                                             &the_search_node);
         if (search_nodep != NULL) {
@@ -1678,7 +1786,15 @@ static int uldap_cache_checkuserid(request_rec *r, util_ldap_connection_t *ldc,
              * be removed and readded later if the credentials pass
              * authentication.
              */
-            if ((curtime - search_nodep->lastbind) > st->search_cache_ttl) {
+            if (search_nodep->dn == NULL && (curtime - search_nodep->lastbind)
+                                            <= st->search_cache_negative_ttl) {
+                /* ...and the user is known not to exist */
+                LDAP_CACHE_UNLOCK(shard);
+                ldc->reason = "User not found (cached)";
+                return LDAP_NO_SUCH_OBJECT;
+            }
+            else if (search_nodep->dn == NULL ||
+                     (curtime - search_nodep->lastbind) > st->search_cache_ttl) {
                 /* ...but entry is too old */
                 util_ald_cache_remove(curl->search_cache, search_nodep);
             }
@@ -1695,13 +1811,13 @@ static int uldap_cache_checkuserid(request_rec *r, util_ldap_connection_t *ldc,
                         (*retvals)[i] = apr_pstrdup(r->pool, search_nodep->vals[i]);
                     }
                 }
-                LDAP_CACHE_UNLOCK();
+                LDAP_CACHE_UNLOCK(shard);
                 ldc->reason = "Authentication successful (cached)";
                 return LDAP_SUCCESS;
             }
         }
         /* unlock this read lock */
-        LDAP_CACHE_UNLOCK();
+        LDAP_CACHE_UNLOCK(shard);
     }
 
     /*
@@ -1761,8 +1877,10 @@ start_over:
     count = ldap_count_entries(ldc->ldap, res);
     if (count != 1)
     {
-        if (count == 0 )
+        if (count == 0 ) {
             ldc->reason = "User not found";
+            uldap_cache_search_notfound(st, curl, filter);
+        }
         else
             ldc->reason = "User is not unique (search found two "
                           "or more matches)";
@@ -1860,13 +1978,13 @@ start_over:
      * Add the new username to the search cache.
      */
     if (curl) {
-        LDAP_CACHE_LOCK();
         the_search_node.username = filter;
         the_search_node.dn = *binddn;
         the_search_node.bindpw = bindpw;
         the_search_node.lastbind = apr_time_now();
         the_search_node.vals = vals;
         the_search_node.numvals = numvals;
+        shard = LDAP_CACHE_LOCK(curl->search_cache, &the_search_node);
 
         /* Search again to make sure that another thread didn't ready insert
          * this node into the cache before we got here. If it does exist then
@@ -1874,6 +1992,11 @@ start_over:
          */
         search_nodep = util_ald_cache_fetch(curl->search_cache,
                                             &the_search_node);
+        if (search_nodep && !search_nodep->dn) {
+            /* the user did not exist when we last looked */
+            util_ald_cache_remove(curl->search_cache, search_nodep);
+            search_nodep = NULL;
+        }
         if ((search_nodep == NULL) ||
             (strcmp(*binddn, search_nodep->dn) != 0)) {
 
@@ -1891,7 +2014,7 @@ start_over:
             /* Cache entry is valid, update lastbind */
             search_nodep->lastbind = the_search_node.lastbind;
         }
-        LDAP_CACHE_UNLOCK();
+        LDAP_CACHE_UNLOCK(shard);
     }
     ldap_msgfree(res);
 
@@ -1919,7 +2042,7 @@ static int uldap_cache_getuserdn(request_rec *r, util_ldap_connection_t *ldc,
     int count;
     int failures = 0;
     util_url_node_t *curl;              /* Cached URL node */
-    util_url_node_t curnode;
+    unsigned int shard;
     util_search_node_t *search_nodep;   /* Cached search node */
     util_search_node_t the_search_node;
     apr_time_t curtime;
@@ -1929,18 +2052,11 @@ static int uldap_cache_getuserdn(request_rec *r, util_ldap_connection_t *ldc,
         &ldap_module);
 
     /* Get the cache node for this url */
-    LDAP_CACHE_LOCK();
-    curnode.url = url;
-    curl = (util_url_node_t *)util_ald_cache_fetch(st->util_ldap_cache,
-                                                   &curnode);
-    if (curl == NULL) {
-        curl = util_ald_create_caches(st, url);
-    }
-    LDAP_CACHE_UNLOCK();
+    curl = uldap_cache_url_node(st, url, 1);
 
     if (curl) {
-        LDAP_CACHE_LOCK();
         the_search_node.username = filter;
+        shard = LDAP_CACHE_LOCK(curl->search_cache, &the_search_node);
         search_nodep = util_ald_cache_fetch(curl->search_cache,
                                             &the_search_node);
         if (search_nodep != NULL) {
@@ -1951,7 +2067,15 @@ static int uldap_cache_getuserdn(request_rec *r, util_ldap_connection_t *ldc,
             /*
              * Remove this item from the cache if its expired.
              */
-            if ((curtime - search_nodep->lastbind) > st->search_cache_ttl) {
+            if (search_nodep->dn == NULL && (curtime - search_nodep->lastbind)
+                                            <= st->search_cache_negative_ttl) {
+                /* ...and the user is known not to exist */
+                LDAP_CACHE_UNLOCK(shard);
+                ldc->reason = "User not found (cached)";
+                return LDAP_NO_SUCH_OBJECT;
+            }
+            else if (search_nodep->dn == NULL ||
+                     (curtime - search_nodep->lastbind) > st->search_cache_ttl) {
                 /* ...but entry is too old */
                 util_ald_cache_remove(curl->search_cache, search_nodep);
             }
@@ -1965,13 +2089,13 @@ static int uldap_cache_getuserdn(request_rec *r, util_ldap_connection_t *ldc,
                         (*retvals)[i] = apr_pstrdup(r->pool, search_nodep->vals[i]);
                     }
                 }
-                LDAP_CACHE_UNLOCK();
+                LDAP_CACHE_UNLOCK(shard);
                 ldc->reason = "Search successful (cached)";
                 return LDAP_SUCCESS;
             }
         }
         /* unlock this read lock */
-        LDAP_CACHE_UNLOCK();
+        LDAP_CACHE_UNLOCK(shard);
     }
 
     /*
@@ -2022,8 +2146,10 @@ start_over:
     count = ldap_count_entries(ldc->ldap, res);
     if (count != 1)
     {
-        if (count == 0 )
+        if (count == 0 ) {
             ldc->reason = "User not found";
+            uldap_cache_search_notfound(st, curl, filter);
+        }
         else
             ldc->reason = "User is not unique (search found two "
                           "or more matches)";
@@ -2069,13 +2195,13 @@ start_over:
      * Add the new username to the search cache.
      */
     if (curl) {
-        LDAP_CACHE_LOCK();
         the_search_node.username = filter;
         the_search_node.dn = *binddn;
         the_search_node.bindpw = NULL;
         the_search_node.lastbind = apr_time_now();
         the_search_node.vals = vals;
         the_search_node.numvals = numvals;
+        shard = LDAP_CACHE_LOCK(curl->search_cache, &the_search_node);
 
         /* Search again to make sure that another thread didn't ready insert
          * this node into the cache before we got here. If it does exist then
@@ -2083,6 +2209,11 @@ start_over:
          */
         search_nodep = util_ald_cache_fetch(curl->search_cache,
                                             &the_search_node);
+        if (search_nodep && !search_nodep->dn) {
+            /* the user did not exist when we last looked */
+            util_ald_cache_remove(curl->search_cache, search_nodep);
+            search_nodep = NULL;
+        }
         if ((search_nodep == NULL) ||
             (strcmp(*binddn, search_nodep->dn) != 0)) {
 
@@ -2098,7 +2229,7 @@ start_over:
             /* Cache entry is valid, update lastbind */
             search_nodep->lastbind = the_search_node.lastbind;
         }
-        LDAP_CACHE_UNLOCK();
+        LDAP_CACHE_UNLOCK(shard);
     }
 
     ldap_msgfree(res);
@@ -2194,6 +2325,27 @@ static const char *util_ldap_set_cache_ttl(cmd_parms *cmd, void *dummy,
     return NULL;
 }
 
+static const char *util_ldap_set_negative_cache_ttl(cmd_parms *cmd,
+                                                    void *dummy,
+                                                    const char *ttl)
+{
+    util_ldap_state_t *st =
+        (util_ldap_state_t *)ap_get_module_config(cmd->server->module_config,
+                                                  &ldap_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err != NULL) {
+        return err;
+    }
+
+    st->search_cache_negative_ttl = atol(ttl) * 1000000;
+    if (st->search_cache_negative_ttl < 0) {
+        return "LDAPNegativeCacheTTL must be >= 0";
+    }
+
+    return NULL;
+}
+
 static const char *util_ldap_set_cache_entries(cmd_parms *cmd, void *dummy,
                                                const char *size)
 {
@@ -2842,7 +2994,9 @@ static void *util_ldap_merge_config(apr_pool_t *p, void *basev,
     st->search_cache_size = base->search_cache_size;
     st->compare_cache_ttl = base->compare_cache_ttl;
     st->compare_cache_size = base->compare_cache_size;
+    st->search_cache_negative_ttl = base->search_cache_negative_ttl;
     st->util_ldap_cache_lock = base->util_ldap_cache_lock;
+    st->util_ldap_cache_shard_locks = base->util_ldap_cache_shard_locks;
 
     st->connections = NULL;
     st->ssl_supported = 0; /* not known until post-config and re-merged */
@@ -2910,6 +3064,7 @@ static int util_ldap_post_config(apr_pool_t *p, apr_pool_t *plog,
     apr_status_t result;
     server_rec *s_vhost;
     util_ldap_state_t *st_vhost;
+    int i;
 
     util_ldap_state_t *st = (util_ldap_state_t *)
                             ap_get_module_config(s->module_config,
@@ -2956,6 +3111,19 @@ static int util_ldap_post_config(apr_pool_t *p, apr_pool_t *plog,
         if (result != APR_SUCCESS) {
             return result;
         }
+        util_ald_set_alloc_lock(st->util_ldap_cache_lock);
+
+        st->util_ldap_cache_shard_locks =
+            apr_pcalloc(p, UTIL_LDAP_CACHE_SHARDS * sizeof(apr_global_mutex_t *));
+        for (i = 0; i < UTIL_LDAP_CACHE_SHARDS; i++) {
+            result = ap_global_mutex_create(&st->util_ldap_cache_shard_locks[i],
+                                            NULL, ldap_cache_mutex_type,
+                                            apr_psprintf(ptemp, "shard%d", i),
+                                            s, p, 0);
+            if (result != APR_SUCCESS) {
+                return result;
+            }
+        }
 
         /* merge config in all vhost */
         s_vhost = s->next;
@@ -2969,6 +3137,9 @@ static int util_ldap_post_config(apr_pool_t *p, apr_pool_t *plog,
             st_vhost->cache_rmm = st->cache_rmm;
             st_vhost->cache_file = st->cache_file;
             st_vhost->util_ldap_cache = st->util_ldap_cache;
+            st_vhost->util_ldap_cache_lock = st->util_ldap_cache_lock;
+            st_vhost->util_ldap_cache_shard_locks =
+                st->util_ldap_cache_shard_locks;
             ap_log_error(APLOG_MARK, APLOG_DEBUG, result, s, APLOGNO(01316)
                          "LDAP merging Shared Cache conf: shm=0x%pp rmm=0x%pp "
                          "for VHOST: %s", st->cache_shm, st->cache_rmm,
@@ -3061,9 +3232,16 @@ static int util_ldap_post_config(apr_pool_t *p, apr_pool_t *plog,
 static void util_ldap_child_init(apr_pool_t *p, server_rec *s)
 {
     apr_status_t sts;
+    server_rec *s_vhost;
+    util_ldap_state_t *st_vhost;
+    int i;
     util_ldap_state_t *st = ap_get_module_config(s->module_config,
                                                  &ldap_module);
 
+#if APR_HAS_THREADS
+    apr_threadkey_private_create(&ldc_affinity_key, NULL, p);
+#endif
+
     if (!st->util_ldap_cache_lock) return;
 
     sts = apr_global_mutex_child_init(&st->util_ldap_cache_lock,
@@ -3073,6 +3251,28 @@ static void util_ldap_child_init(apr_pool_t *p, server_rec *s)
                      "Failed to initialise global mutex %s in child process",
                      ldap_cache_mutex_type);
     }
+    util_ald_set_alloc_lock(st->util_ldap_cache_lock);
+
+    for (i = 0; st->util_ldap_cache_shard_locks
+                && i < UTIL_LDAP_CACHE_SHARDS; i++) {
+        apr_global_mutex_t **lock = &st->util_ldap_cache_shard_locks[i];
+
+        sts = apr_global_mutex_child_init(lock,
+                  apr_global_mutex_lockfile(*lock), p);
+        if (sts != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, sts, s, APLOGNO(02837)
+                         "Failed to initialise global mutex %s (shard %d) "
+                         "in child process", ldap_cache_mutex_type, i);
+        }
+    }
+
+    /* the virtual hosts share the locks of the main server, which may
+     * have been replaced above; the shard lock array itself is shared
+     */
+    for (s_vhost = s->next; s_vhost; s_vhost = s_vhost->next) {
+        st_vhost = ap_get_module_config(s_vhost->module_config, &ldap_module);
+        st_vhost->util_ldap_cache_lock = st->util_ldap_cache_lock;
+    }
 }
 
 static const command_rec util_ldap_cmds[] = {
@@ -3097,6 +3297,12 @@ static const command_rec util_ldap_cmds[] = {
                   "cached in the LDAP search cache. Use 0 for no limit. "
                   "(default 600)"),
 
+    AP_INIT_TAKE1("LDAPNegativeCacheTTL", util_ldap_set_negative_cache_ttl,
+                  NULL, RSRC_CONF,
+                  "Set the time (in seconds) that a search which found no "
+                  "such user is cached in the LDAP search cache. "
+                  "(default 0 = off)"),
+
     AP_INIT_TAKE1("LDAPOpCacheEntries", util_ldap_set_opcache_entries,
                   NULL, RSRC_CONF,
                   "Set the maximum number of entries that are possible "
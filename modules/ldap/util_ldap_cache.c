@@ -82,7 +82,9 @@ void util_ldap_url_node_display(request_rec *r, util_ald_cache_t *cache, void *n
     char date_str[APR_CTIME_LEN];
     const char *type_str;
     util_ald_cache_t *cache_node;
-    int x;
+    unsigned long evictions;
+    apr_time_t last_eviction;
+    int x, i;
 
     for (x=0;x<3;x++) {
         switch (x) {
@@ -101,8 +103,16 @@ void util_ldap_url_node_display(request_rec *r, util_ald_cache_t *cache, void *n
                 break;
         }
 
-        if (cache_node->marktime) {
-            apr_ctime(date_str, cache_node->marktime);
+        evictions = 0;
+        last_eviction = 0;
+        for (i = 0; i < UTIL_LDAP_CACHE_SHARDS; i++) {
+            evictions += cache_node->shards[i].evictions;
+            if (cache_node->shards[i].last_eviction > last_eviction) {
+                last_eviction = cache_node->shards[i].last_eviction;
+            }
+        }
+        if (last_eviction) {
+            apr_ctime(date_str, last_eviction);
         }
         else
             date_str[0] = 0;
@@ -120,8 +130,8 @@ void util_ldap_url_node_display(request_rec *r, util_ald_cache_t *cache, void *n
                    type_str,
                    cache_node->size,
                    cache_node->maxentries,
-                   cache_node->numentries,
-                   cache_node->fullmark,
+                   util_ald_cache_numentries(cache_node),
+                   evictions,
                    date_str);
     }
 
@@ -177,7 +187,7 @@ void *util_ldap_search_node_copy(util_ald_cache_t *cache, void *c)
             newnode->vals = NULL;
         }
         if (!(newnode->username = util_ald_strdup(cache, node->username)) ||
-            !(newnode->dn = util_ald_strdup(cache, node->dn)) ) {
+            (node->dn && !(newnode->dn = util_ald_strdup(cache, node->dn)))) {
             util_ldap_search_node_free(cache, newnode);
             return NULL;
         }
@@ -229,7 +239,7 @@ void util_ldap_search_node_display(request_rec *r, util_ald_cache_t *cache, void
                "<td nowrap>%s</td>"
                "</tr>",
                node->username,
-               node->dn,
+               node->dn ? node->dn : "(not found)",
                date_str);
 }
 
@@ -457,6 +467,13 @@ apr_status_t util_ldap_cache_init(apr_pool_t *pool, util_ldap_state_t *st)
                               util_ldap_url_node_copy,
                               util_ldap_url_node_free,
                               util_ldap_url_node_display);
+
+    /* URL nodes own the search and compare caches, which other threads use
+     * without holding the URL node's shard lock; never evict them.
+     */
+    if (st->util_ldap_cache) {
+        ((util_ald_cache_t *)st->util_ldap_cache)->no_evict = 1;
+    }
     return APR_SUCCESS;
 }
 
@@ -32,20 +32,45 @@
 
 #include "util_ldap.h"
 
+/*
+ * Each cache is split into UTIL_LDAP_CACHE_SHARDS shards by the hash bucket
+ * of the key, and each shard is protected by its own global mutex, so that
+ * lookups of different keys rarely wait for each other.  A shard keeps its
+ * entries on an LRU list and evicts the least recently used entry when it
+ * is full or the shared memory is exhausted.
+ */
+#ifndef UTIL_LDAP_CACHE_SHARDS
+#define UTIL_LDAP_CACHE_SHARDS 8
+#endif
+
 typedef struct util_cache_node_t {
     void *payload;              /* Pointer to the payload */
     apr_time_t add_time;        /* Time node was added to cache */
     struct util_cache_node_t *next;
+    struct util_cache_node_t *lru_prev; /* More recently used in the shard */
+    struct util_cache_node_t *lru_next; /* Less recently used in the shard */
 } util_cache_node_t;
 
+typedef struct util_ald_shard_t {
+    util_cache_node_t *lru_head;        /* Most recently used entry */
+    util_cache_node_t *lru_tail;        /* Least recently used entry */
+    unsigned long numentries;           /* Current number of entries */
+
+    unsigned long fetches;      /* Number of fetches */
+    unsigned long hits;         /* Number of cache hits */
+    unsigned long inserts;      /* Number of inserts */
+    unsigned long removes;      /* Number of removes */
+    unsigned long evictions;    /* Number of LRU evictions */
+    apr_time_t last_eviction;   /* Time of the last eviction */
+} util_ald_shard_t;
+
 typedef struct util_ald_cache util_ald_cache_t;
 
 struct util_ald_cache {
     unsigned long size;                 /* Size of cache array */
     unsigned long maxentries;           /* Maximum number of cache entries */
-    unsigned long numentries;           /* Current number of cache entries */
-    unsigned long fullmark;             /* Used to keep track of when cache becomes 3/4 full */
-    apr_time_t marktime;                /* Time that the cache became 3/4 full */
+    unsigned long shardentries;         /* Maximum number of entries per shard */
+    int no_evict;                       /* Entries are never evicted */
     unsigned long (*hash)(void *);      /* Func to hash the payload */
     int (*compare)(void *, void *);     /* Func to compare two payloads */
     void * (*copy)(util_ald_cache_t *cache, void *); /* Func to alloc mem and copy payload to new mem */
@@ -53,17 +78,7 @@ struct util_ald_cache {
     void (*display)(request_rec *r, util_ald_cache_t *cache, void *); /* Func to display the payload contents */
     util_cache_node_t **nodes;
 
-    unsigned long numpurges;    /* No. of times the cache has been purged */
-    double avg_purgetime;       /* Average time to purge the cache */
-    apr_time_t last_purge;      /* Time of the last purge */
-    unsigned long npurged;      /* Number of elements purged in last purge. This is not
-                                   obvious: it won't be 3/4 the size of the cache if
-                                   there were a lot of expired entries. */
-
-    unsigned long fetches;      /* Number of fetches */
-    unsigned long hits;         /* Number of cache hits */
-    unsigned long inserts;      /* Number of inserts */
-    unsigned long removes;      /* Number of removes */
+    util_ald_shard_t shards[UTIL_LDAP_CACHE_SHARDS];
 
 #if APR_HAS_SHARED_MEMORY
     apr_shm_t *shm_addr;
@@ -111,7 +126,8 @@ typedef struct util_compare_subgroup_t {
  */
 typedef struct util_search_node_t {
     const char *username;               /* Cache key */
-    const char *dn;                     /* DN returned from search */
+    const char *dn;                     /* DN returned from search; NULL if
+                                           the search found no such user */
     const char *bindpw;                 /* The most recently used bind password;
                                            NULL if the bind failed */
     apr_time_t lastbind;                /* Time of last successful bind */
@@ -184,7 +200,7 @@ void util_ald_sgl_free(util_ald_cache_t *cache, util_compare_subgroup_t **sgl);
 
 /* Cache managing function */
 unsigned long util_ald_hash_string(int nstr, ...);
-void util_ald_cache_purge(util_ald_cache_t *cache);
+void util_ald_set_alloc_lock(apr_global_mutex_t *lock);
 util_url_node_t *util_ald_create_caches(util_ldap_state_t *s, const char *url);
 util_ald_cache_t *util_ald_create_cache(util_ldap_state_t *st,
                                 long cache_size,
@@ -198,6 +214,8 @@ void util_ald_destroy_cache(util_ald_cache_t *cache);
 void *util_ald_cache_fetch(util_ald_cache_t *cache, void *payload);
 void *util_ald_cache_insert(util_ald_cache_t *cache, void *payload);
 void util_ald_cache_remove(util_ald_cache_t *cache, void *payload);
+unsigned int util_ald_cache_shard(util_ald_cache_t *cache, void *payload);
+unsigned long util_ald_cache_numentries(util_ald_cache_t *cache);
 char *util_ald_cache_display_stats(request_rec *r, util_ald_cache_t *cache, char *name, char *id);
 
 #endif /* APR_HAS_LDAP */
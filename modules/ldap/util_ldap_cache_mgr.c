@@ -26,6 +26,7 @@
 #include "util_ldap.h"
 #include "util_ldap_cache.h"
 #include <apr_strings.h>
+#include <apr_global_mutex.h>
 
 APLOG_USE_MODULE(ldap);
 
@@ -76,13 +77,49 @@ static const unsigned long primes[] =
   0
 };
 
+/*
+ * The shared memory allocator is used by all shards of all caches, so it
+ * is serialized by a lock of its own, which is always taken after (and
+ * released before) the lock of the shard being modified.
+ */
+static apr_global_mutex_t *util_ald_alloc_lock = NULL;
+
+void util_ald_set_alloc_lock(apr_global_mutex_t *lock)
+{
+    util_ald_alloc_lock = lock;
+}
+
+#if APR_HAS_SHARED_MEMORY
+static apr_rmm_off_t util_ald_rmm_calloc(apr_rmm_t *rmm, apr_size_t size)
+{
+    apr_rmm_off_t block;
+
+    if (util_ald_alloc_lock) {
+        apr_global_mutex_lock(util_ald_alloc_lock);
+    }
+    block = apr_rmm_calloc(rmm, size);
+    if (util_ald_alloc_lock) {
+        apr_global_mutex_unlock(util_ald_alloc_lock);
+    }
+
+    return block;
+}
+#endif
+
 void util_ald_free(util_ald_cache_t *cache, const void *ptr)
 {
 #if APR_HAS_SHARED_MEMORY
     if (cache->rmm_addr) {
-        if (ptr)
+        if (ptr) {
             /* Free in shared memory */
+            if (util_ald_alloc_lock) {
+                apr_global_mutex_lock(util_ald_alloc_lock);
+            }
             apr_rmm_free(cache->rmm_addr, apr_rmm_offset_get(cache->rmm_addr, (void *)ptr));
+            if (util_ald_alloc_lock) {
+                apr_global_mutex_unlock(util_ald_alloc_lock);
+            }
+        }
     }
     else {
         if (ptr)
@@ -102,7 +139,7 @@ void *util_ald_alloc(util_ald_cache_t *cache, unsigned long size)
 #if APR_HAS_SHARED_MEMORY
     if (cache->rmm_addr) {
         /* allocate from shared memory */
-        apr_rmm_off_t block = apr_rmm_calloc(cache->rmm_addr, size);
+        apr_rmm_off_t block = util_ald_rmm_calloc(cache->rmm_addr, size);
         return block ? (void *)apr_rmm_addr_get(cache->rmm_addr, block) : NULL;
     }
     else {
@@ -119,7 +156,7 @@ const char *util_ald_strdup(util_ald_cache_t *cache, const char *s)
 #if APR_HAS_SHARED_MEMORY
     if (cache->rmm_addr) {
         /* allocate from shared memory */
-        apr_rmm_off_t block = apr_rmm_calloc(cache->rmm_addr, strlen(s)+1);
+        apr_rmm_off_t block = util_ald_rmm_calloc(cache->rmm_addr, strlen(s)+1);
         char *buf = block ? (char *)apr_rmm_addr_get(cache->rmm_addr, block) : NULL;
         if (buf) {
             strcpy(buf, s);
@@ -223,48 +260,77 @@ unsigned long util_ald_hash_string(int nstr, ...)
 }
 
 
-/*
-  Purges a cache that has gotten full. We keep track of the time that we
-  added the entry that made the cache 3/4 full, then delete all entries
-  that were added before that time. It's pretty simplistic, but time to
-  purge is only O(n), which is more important.
-*/
-void util_ald_cache_purge(util_ald_cache_t *cache)
+/* The shard that holds the hash bucket of a payload */
+unsigned int util_ald_cache_shard(util_ald_cache_t *cache, void *payload)
 {
-    unsigned long i;
-    util_cache_node_t *p, *q, **pp;
-    apr_time_t t;
+    if (cache == NULL)
+        return 0;
 
-    if (!cache)
-        return;
+    return ((*cache->hash)(payload) % cache->size) % UTIL_LDAP_CACHE_SHARDS;
+}
 
-    cache->last_purge = apr_time_now();
-    cache->npurged = 0;
-    cache->numpurges++;
+unsigned long util_ald_cache_numentries(util_ald_cache_t *cache)
+{
+    unsigned long n = 0;
+    int i;
 
-    for (i=0; i < cache->size; ++i) {
-        pp = cache->nodes + i;
-        p = *pp;
-        while (p != NULL) {
-            if (p->add_time < cache->marktime) {
-                q = p->next;
-                (*cache->free)(cache, p->payload);
-                util_ald_free(cache, p);
-                cache->numentries--;
-                cache->npurged++;
-                p = *pp = q;
-            }
-            else {
-                pp = &(p->next);
-                p = *pp;
-            }
-        }
+    for (i = 0; i < UTIL_LDAP_CACHE_SHARDS; i++) {
+        n += cache->shards[i].numentries;
     }
 
-    t = apr_time_now();
-    cache->avg_purgetime =
-         ((t - cache->last_purge) + (cache->avg_purgetime * (cache->numpurges-1))) /
-         cache->numpurges;
+    return n;
+}
+
+static void lru_unlink(util_ald_shard_t *shard, util_cache_node_t *node)
+{
+    if (node->lru_prev)
+        node->lru_prev->lru_next = node->lru_next;
+    else
+        shard->lru_head = node->lru_next;
+    if (node->lru_next)
+        node->lru_next->lru_prev = node->lru_prev;
+    else
+        shard->lru_tail = node->lru_prev;
+    node->lru_prev = node->lru_next = NULL;
+}
+
+static void lru_push(util_ald_shard_t *shard, util_cache_node_t *node)
+{
+    node->lru_prev = NULL;
+    node->lru_next = shard->lru_head;
+    if (shard->lru_head)
+        shard->lru_head->lru_prev = node;
+    else
+        shard->lru_tail = node;
+    shard->lru_head = node;
+}
+
+/*
+ * Evicts the least recently used entry of a shard. The caller must hold
+ * the shard's lock. Returns zero if there was nothing to evict.
+ */
+static int util_ald_shard_evict(util_ald_cache_t *cache, unsigned int s)
+{
+    util_ald_shard_t *shard = &cache->shards[s];
+    util_cache_node_t *node = shard->lru_tail, **pp;
+
+    if (node == NULL || cache->no_evict)
+        return 0;
+
+    for (pp = cache->nodes + (*cache->hash)(node->payload) % cache->size;
+         *pp && *pp != node;
+         pp = &(*pp)->next) ;
+    if (*pp)
+        *pp = node->next;
+
+    lru_unlink(shard, node);
+    (*cache->free)(cache, node->payload);
+    util_ald_free(cache, node);
+    shard->numentries--;
+    shard->evictions++;
+    shard->last_eviction = apr_time_now();
+
+    return 1;
 }
 
 
@@ -343,7 +409,7 @@ util_ald_cache_t *util_ald_create_cache(util_ldap_state_t *st,
         cache = (util_ald_cache_t *)calloc(sizeof(util_ald_cache_t), 1);
     }
     else {
-        block = apr_rmm_calloc(st->cache_rmm, sizeof(util_ald_cache_t));
+        block = util_ald_rmm_calloc(st->cache_rmm, sizeof(util_ald_cache_t));
         cache = block ? (util_ald_cache_t *)apr_rmm_addr_get(st->cache_rmm, block) : NULL;
     }
 #else
@@ -357,7 +423,8 @@ util_ald_cache_t *util_ald_create_cache(util_ldap_state_t *st,
     cache->shm_addr = st->cache_shm;
 #endif
     cache->maxentries = cache_size;
-    cache->numentries = 0;
+    cache->shardentries = (cache_size + UTIL_LDAP_CACHE_SHARDS - 1)
+                          / UTIL_LDAP_CACHE_SHARDS;
     cache->size = cache_size / 3;
     if (cache->size < 64)
         cache->size = 64;
@@ -381,17 +448,7 @@ util_ald_cache_t *util_ald_create_cache(util_ldap_state_t *st,
     cache->free = freefunc;
     cache->display = displayfunc;
 
-    cache->fullmark = cache->maxentries / 4 * 3;
-    cache->marktime = 0;
-    cache->avg_purgetime = 0.0;
-    cache->numpurges = 0;
-    cache->last_purge = 0;
-    cache->npurged = 0;
-
-    cache->fetches = 0;
-    cache->hits = 0;
-    cache->inserts = 0;
-    cache->removes = 0;
+    /* the cache was allocated zeroed, so are the shards */
 
     return cache;
 }
@@ -421,21 +478,26 @@ void util_ald_destroy_cache(util_ald_cache_t *cache)
 void *util_ald_cache_fetch(util_ald_cache_t *cache, void *payload)
 {
     unsigned long hashval;
+    util_ald_shard_t *shard;
     util_cache_node_t *p;
 
     if (cache == NULL)
         return NULL;
 
-    cache->fetches++;
-
     hashval = (*cache->hash)(payload) % cache->size;
+    shard = &cache->shards[hashval % UTIL_LDAP_CACHE_SHARDS];
+    shard->fetches++;
 
     for (p = cache->nodes[hashval];
          p && !(*cache->compare)(p->payload, payload);
          p = p->next) ;
 
     if (p != NULL) {
-        cache->hits++;
+        shard->hits++;
+        if (shard->lru_head != p) {
+            lru_unlink(shard, p);
+            lru_push(shard, p);
+        }
         return p->payload;
     }
     else {
@@ -450,6 +512,8 @@ void *util_ald_cache_fetch(util_ald_cache_t *cache, void *payload)
 void *util_ald_cache_insert(util_ald_cache_t *cache, void *payload)
 {
     unsigned long hashval;
+    unsigned int s;
+    util_ald_shard_t *shard;
     void *tmp_payload;
     util_cache_node_t *node;
 
@@ -458,38 +522,34 @@ void *util_ald_cache_insert(util_ald_cache_t *cache, void *payload)
         return NULL;
     }
 
-    /* check if we are full - if so, try purge */
-    if (cache->numentries >= cache->maxentries) {
-        util_ald_cache_purge(cache);
-        if (cache->numentries >= cache->maxentries) {
-            /* if the purge was not effective, we leave now to avoid an overflow */
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, NULL, APLOGNO(01323)
-                         "Purge of LDAP cache failed");
-            return NULL;
-        }
+    hashval = (*cache->hash)(payload) % cache->size;
+    s = hashval % UTIL_LDAP_CACHE_SHARDS;
+    shard = &cache->shards[s];
+
+    /* check if the shard is full - if so, make room */
+    if (shard->numentries >= cache->shardentries
+        && !util_ald_shard_evict(cache, s)) {
+        /* nothing could be evicted, we leave now to avoid an overflow */
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, NULL, APLOGNO(01323)
+                     "LDAP cache is full and no entry can be evicted");
+        return NULL;
     }
 
     node = (util_cache_node_t *)util_ald_alloc(cache,
                                                sizeof(util_cache_node_t));
     if (node == NULL) {
         /*
-         * XXX: The cache management should be rewritten to work
-         * properly when LDAPSharedCacheSize is too small.
+         * The shared memory is used by all caches; evicting from this
+         * shard is not guaranteed to make room, but it is the only
+         * memory we may touch with the lock we hold.
          */
         ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, APLOGNO(01324)
                      "LDAPSharedCacheSize is too small. Increase it or "
                      "reduce LDAPCacheEntries/LDAPOpCacheEntries!");
-        if (cache->numentries < cache->fullmark) {
-            /*
-             * We have not even reached fullmark, trigger a complete purge.
-             * This is still better than not being able to add new entries
-             * at all.
-             */
-            cache->marktime = apr_time_now();
+        while (node == NULL && util_ald_shard_evict(cache, s)) {
+            node = (util_cache_node_t *)util_ald_alloc(cache,
+                                                       sizeof(util_cache_node_t));
         }
-        util_ald_cache_purge(cache);
-        node = (util_cache_node_t *)util_ald_alloc(cache,
-                                                   sizeof(util_cache_node_t));
         if (node == NULL) {
             ap_log_error(APLOG_MARK, APLOG_ERR, 0, NULL, APLOGNO(01325)
                          "Could not allocate memory for LDAP cache entry");
@@ -500,23 +560,12 @@ void *util_ald_cache_insert(util_ald_cache_t *cache, void *payload)
     /* Take a copy of the payload before proceeeding. */
     tmp_payload = (*cache->copy)(cache, payload);
     if (tmp_payload == NULL) {
-        /*
-         * XXX: The cache management should be rewritten to work
-         * properly when LDAPSharedCacheSize is too small.
-         */
         ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, APLOGNO(01326)
                      "LDAPSharedCacheSize is too small. Increase it or "
                      "reduce LDAPCacheEntries/LDAPOpCacheEntries!");
-        if (cache->numentries < cache->fullmark) {
-            /*
-             * We have not even reached fullmark, trigger a complete purge.
-             * This is still better than not being able to add new entries
-             * at all.
-             */
-            cache->marktime = apr_time_now();
+        while (tmp_payload == NULL && util_ald_shard_evict(cache, s)) {
+            tmp_payload = (*cache->copy)(cache, payload);
         }
-        util_ald_cache_purge(cache);
-        tmp_payload = (*cache->copy)(cache, payload);
         if (tmp_payload == NULL) {
             ap_log_error(APLOG_MARK, APLOG_ERR, 0, NULL, APLOGNO(01327)
                          "Could not allocate memory for LDAP cache value");
@@ -527,19 +576,13 @@ void *util_ald_cache_insert(util_ald_cache_t *cache, void *payload)
     payload = tmp_payload;
 
     /* populate the entry */
-    cache->inserts++;
-    hashval = (*cache->hash)(payload) % cache->size;
+    shard->inserts++;
     node->add_time = apr_time_now();
     node->payload = payload;
     node->next = cache->nodes[hashval];
     cache->nodes[hashval] = node;
-
-    /* if we reach the full mark, note the time we did so
-     * for the benefit of the purge function
-     */
-    if (++cache->numentries == cache->fullmark) {
-        cache->marktime=apr_time_now();
-    }
+    lru_push(shard, node);
+    shard->numentries++;
 
     return node->payload;
 }
@@ -547,13 +590,15 @@ void *util_ald_cache_insert(util_ald_cache_t *cache, void *payload)
 void util_ald_cache_remove(util_ald_cache_t *cache, void *payload)
 {
     unsigned long hashval;
+    util_ald_shard_t *shard;
     util_cache_node_t *p, *q;
 
     if (cache == NULL)
         return;
 
-    cache->removes++;
     hashval = (*cache->hash)(payload) % cache->size;
+    shard = &cache->shards[hashval % UTIL_LDAP_CACHE_SHARDS];
+    shard->removes++;
     for (p = cache->nodes[hashval], q=NULL;
          p && !(*cache->compare)(p->payload, payload);
          p = p->next) {
@@ -572,9 +617,10 @@ void util_ald_cache_remove(util_ald_cache_t *cache, void *payload)
         /* We found the node and it's not the first in the list */
         q->next = p->next;
     }
+    lru_unlink(shard, p);
     (*cache->free)(cache, p->payload);
     util_ald_free(cache, p);
-    cache->numentries--;
+    shard->numentries--;
 }
 
 char *util_ald_cache_display_stats(request_rec *r, util_ald_cache_t *cache, char *name, char *id)
@@ -586,11 +632,31 @@ char *util_ald_cache_display_stats(request_rec *r, util_ald_cache_t *cache, char
     util_cache_node_t *n;
     char *buf, *buf2;
     apr_pool_t *p = r->pool;
+    util_ald_shard_t total;
+    unsigned long maxshard = 0;
 
     if (cache == NULL) {
         return "";
     }
 
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < UTIL_LDAP_CACHE_SHARDS; ++i) {
+        util_ald_shard_t *shard = &cache->shards[i];
+
+        total.numentries += shard->numentries;
+        total.fetches += shard->fetches;
+        total.hits += shard->hits;
+        total.inserts += shard->inserts;
+        total.removes += shard->removes;
+        total.evictions += shard->evictions;
+        if (shard->last_eviction > total.last_eviction) {
+            total.last_eviction = shard->last_eviction;
+        }
+        if (shard->numentries > maxshard) {
+            maxshard = shard->numentries;
+        }
+    }
+
     for (i=0; i < cache->size; ++i) {
         if (cache->nodes[i] != NULL) {
             nchains++;
@@ -623,25 +689,25 @@ char *util_ald_cache_display_stats(request_rec *r, util_ald_cache_t *cache, char
              "<td align='right'>%.0f%%</td>"
              "<td align='right'>%lu/%lu</td>",
          buf2,
-         cache->numentries,
-         (double)cache->numentries / (double)cache->maxentries * 100.0,
+         total.numentries,
+         (double)total.numentries / (double)cache->maxentries * 100.0,
          chainlen,
-         cache->hits,
-         cache->fetches,
-         (cache->fetches > 0 ? (double)(cache->hits) / (double)(cache->fetches) * 100.0 : 100.0),
-         cache->inserts,
-         cache->removes);
+         total.hits,
+         total.fetches,
+         (total.fetches > 0 ? (double)(total.hits) / (double)(total.fetches) * 100.0 : 100.0),
+         total.inserts,
+         total.removes);
 
-    if (cache->numpurges) {
+    if (total.evictions) {
         char str_ctime[APR_CTIME_LEN];
 
-        apr_ctime(str_ctime, cache->last_purge);
+        apr_ctime(str_ctime, total.last_eviction);
         buf = apr_psprintf(p,
                  "%s"
                  "<td align='right'>%lu</td>\n"
                  "<td align='right' nowrap>%s</td>\n",
              buf,
-             cache->numpurges,
+             total.evictions,
              str_ctime);
     }
     else {
@@ -650,7 +716,8 @@ char *util_ald_cache_display_stats(request_rec *r, util_ald_cache_t *cache, char
              buf);
     }
 
-    buf = apr_psprintf(p, "%s<td align='right'>%.2gms</td>\n</tr>", buf, cache->avg_purgetime);
+    buf = apr_psprintf(p, "%s<td align='right'>%lu/%lu</td>\n</tr>",
+                       buf, maxshard, cache->shardentries);
 
     return buf;
 }
@@ -677,7 +744,6 @@ char *util_ald_cache_display(request_rec *r, util_ldap_state_t *st)
     if (r->args && strlen(r->args)) {
         char cachetype[5], lint[2];
         unsigned int id, off;
-        char date_str[APR_CTIME_LEN];
 
         if ((3 == sscanf(r->args, scanfmt, cachetype, &id, &off, lint)) &&
             (id < util_ldap_cache->size)) {
@@ -705,12 +771,6 @@ char *util_ald_cache_display(request_rec *r, util_ldap_state_t *st)
 
             switch (cachetype[0]) {
                 case 'm':
-                    if (util_ldap_cache->marktime) {
-                        apr_ctime(date_str, util_ldap_cache->marktime);
-                    }
-                    else
-                        date_str[0] = 0;
-
                     ap_rprintf(r,
                                "<p>\n"
                                "<table border='0'>\n"
@@ -727,19 +787,19 @@ char *util_ald_cache_display(request_rec *r, util_ldap_state_t *st)
                                "<td bgcolor='#ffffff'><font size='-1' face='Arial,Helvetica' color='#000000'><b>%ld</b></font></td>"
                                "</tr>\n"
                                "<tr>\n"
-                               "<td bgcolor='#000000'><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Full Mark:</b></font></td>"
-                               "<td bgcolor='#ffffff'><font size='-1' face='Arial,Helvetica' color='#000000'><b>%ld</b></font></td>"
+                               "<td bgcolor='#000000'><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Shards:</b></font></td>"
+                               "<td bgcolor='#ffffff'><font size='-1' face='Arial,Helvetica' color='#000000'><b>%d</b></font></td>"
                                "</tr>\n"
                                "<tr>\n"
-                               "<td bgcolor='#000000'><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Full Mark Time:</b></font></td>"
-                               "<td bgcolor='#ffffff'><font size='-1' face='Arial,Helvetica' color='#000000'><b>%s</b></font></td>"
+                               "<td bgcolor='#000000'><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Max Entries per Shard:</b></font></td>"
+                               "<td bgcolor='#ffffff'><font size='-1' face='Arial,Helvetica' color='#000000'><b>%ld</b></font></td>"
                                "</tr>\n"
                                "</table>\n</p>\n",
                                util_ldap_cache->size,
                                util_ldap_cache->maxentries,
-                               util_ldap_cache->numentries,
-                               util_ldap_cache->fullmark,
-                               date_str);
+                               util_ald_cache_numentries(util_ldap_cache),
+                               UTIL_LDAP_CACHE_SHARDS,
+                               util_ldap_cache->shardentries);
 
                     ap_rputs("<p>\n"
                              "<table border='0'>\n"
@@ -748,8 +808,8 @@ char *util_ald_cache_display(request_rec *r, util_ldap_state_t *st)
                              "<td><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Size</b></font></td>"
                              "<td><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Max Entries</b></font></td>"
                              "<td><font size='-1' face='Arial,Helvetica' color='#ffffff'><b># Entries</b></font></td>"
-                             "<td><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Full Mark</b></font></td>"
-                             "<td><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Full Mark Time</b></font></td>"
+                             "<td><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Evictions</b></font></td>"
+                             "<td><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Last Eviction</b></font></td>"
                              "</tr>\n", r
                             );
                     for (i=0; i < util_ldap_cache->size; ++i) {
@@ -840,8 +900,8 @@ char *util_ald_cache_display(request_rec *r, util_ldap_state_t *st)
                  "<td><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Avg. Chain Len.</b></font></td>"
                  "<td colspan='2'><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Hits</b></font></td>"
                  "<td><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Ins/Rem</b></font></td>"
-                 "<td colspan='2'><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Purges</b></font></td>"
-                 "<td><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Avg Purge Time</b></font></td>"
+                 "<td colspan='2'><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Evictions</b></font></td>"
+                 "<td><font size='-1' face='Arial,Helvetica' color='#ffffff'><b>Fullest Shard</b></font></td>"
                  "</tr>\n", r
                 );
 
@@ -159,7 +159,9 @@
 #include "http_core.h"          /* For REMOTE_NAME */
 #include "http_log.h"
 #include "http_protocol.h"
+#include "http_request.h"
 #include "util_time.h"
+#include "util_headers.h"
 #include "ap_mpm.h"
 
 #if APR_HAVE_UNISTD_H
@@ -274,6 +276,8 @@ typedef struct {
  */
 typedef struct {
     apr_time_t request_end_time;
+    ap_headers_t *headers_in;
+    ap_headers_t *headers_out;
 } log_request_state;
 
 /*
@@ -427,9 +431,36 @@ static const char *log_bytes_sent(request_rec *r, char *a)
 }
 
 
+static log_request_state *get_log_request_state(request_rec *r)
+{
+    log_request_state *state = (log_request_state *)ap_get_module_config(r->request_config,
+                                                                         &log_config_module);
+    if (!state) {
+        state = apr_pcalloc(r->pool, sizeof(log_request_state));
+        ap_set_module_config(r->request_config, &log_config_module, state);
+    }
+    return state;
+}
+
+/*
+ * The header tables are indexed once per request, so that each format
+ * item naming a well-known header finds it without scanning the table.
+ */
+static ap_headers_t *get_log_headers(request_rec *r, ap_headers_t **h,
+                                     apr_table_t *t)
+{
+    if (!*h || ap_headers_table(*h) != t) {
+        *h = ap_headers_make(r->pool, t);
+    }
+    return *h;
+}
+
 static const char *log_header_in(request_rec *r, char *a)
 {
-    return ap_escape_logitem(r->pool, apr_table_get(r->headers_in, a));
+    log_request_state *state = get_log_request_state(r);
+    ap_headers_t *h = get_log_headers(r, &state->headers_in, r->headers_in);
+
+    return ap_escape_logitem(r->pool, ap_headers_get(h, a));
 }
 
 static const char *log_trailer_in(request_rec *r, char *a)
@@ -515,7 +546,11 @@ static const char *log_header_out(request_rec *r, char *a)
         cp = find_multiple_headers(r->pool, r->headers_out, a);
     }
     else {
-        cp = apr_table_get(r->headers_out, a);
+        log_request_state *state = get_log_request_state(r);
+        ap_headers_t *h = get_log_headers(r, &state->headers_out,
+                                          r->headers_out);
+
+        cp = ap_headers_get(h, a);
     }
 
     return ap_escape_logitem(r->pool, cp);
@@ -538,6 +573,8 @@ static const char *log_env_var(request_rec *r, char *a)
 static const char *log_cookie(request_rec *r, char *a)
 {
     const char *cookies_entry;
+    log_request_state *state = get_log_request_state(r);
+    ap_headers_t *h = get_log_headers(r, &state->headers_in, r->headers_in);
 
     /*
      * This supports Netscape version 0 cookies while being tolerant to
@@ -549,7 +586,7 @@ static const char *log_cookie(request_rec *r, char *a)
      * - commas to separate cookies
      */
 
-    if ((cookies_entry = apr_table_get(r->headers_in, "Cookie"))) {
+    if ((cookies_entry = ap_headers_get_id(h, AP_HEADER_COOKIE))) {
         char *cookie, *last1, *last2;
         char *cookies = apr_pstrdup(r->pool, cookies_entry);
 
@@ -618,12 +655,8 @@ static cached_request_time request_time_cache[TIME_CACHE_SIZE];
 
 static apr_time_t get_request_end_time(request_rec *r)
 {
-    log_request_state *state = (log_request_state *)ap_get_module_config(r->request_config,
-                                                                         &log_config_module);
-    if (!state) {
-        state = apr_pcalloc(r->pool, sizeof(log_request_state));
-        ap_set_module_config(r->request_config, &log_config_module, state);
-    }
+    log_request_state *state = get_log_request_state(r);
+
     if (state->request_end_time == 0) {
         state->request_end_time = apr_time_now();
     }
@@ -766,9 +799,83 @@ static const char *log_request_time(request_rec *r, char *a)
     }
 }
 
+/* %{phase}T, %{phases}T, %{hooks}T and %{filters}T, see RequestTiming */
+static const char *log_request_timing(request_rec *r, const char *a)
+{
+    ap_request_timing_t *t = r->timing;
+    apr_array_header_t *items;
+    const char *name;
+    int i;
+
+    if (!t) {
+        return "-";
+    }
+
+    if (!strcasecmp(a, "phases")) {
+        items = apr_array_make(r->pool, AP_REQUEST_PHASES, sizeof(char *));
+        for (i = 0; i < AP_REQUEST_PHASES; i++) {
+            if (t->phase[i]) {
+                APR_ARRAY_PUSH(items, char *) =
+                    apr_psprintf(r->pool, "%s=%" APR_TIME_T_FMT,
+                                 ap_request_phase_name(i), t->phase[i]);
+            }
+        }
+    }
+    else if (!strcasecmp(a, "hooks")) {
+        ap_request_timing_hook_t *h;
+
+        if (!t->detail) {
+            return "-";
+        }
+        h = (ap_request_timing_hook_t *)t->hooks->elts;
+        items = apr_array_make(r->pool, t->hooks->nelts, sizeof(char *));
+        for (i = 0; i < t->hooks->nelts; i++) {
+            APR_ARRAY_PUSH(items, char *) =
+                apr_psprintf(r->pool, "%s:%s=%" APR_TIME_T_FMT,
+                             h[i].module, h[i].hook, h[i].time);
+        }
+    }
+    else if (!strcasecmp(a, "filters")) {
+        ap_request_timing_filter_t *tf;
+
+        if (!t->detail) {
+            return "-";
+        }
+        tf = (ap_request_timing_filter_t *)t->filters->elts;
+        items = apr_array_make(r->pool, t->filters->nelts, sizeof(char *));
+        for (i = 0; i < t->filters->nelts; i++) {
+            APR_ARRAY_PUSH(items, char *) =
+                apr_psprintf(r->pool, "%s%s=%" APR_TIME_T_FMT
+                             "/%" APR_TIME_T_FMT,
+                             tf[i].input ? "in:" : "", tf[i].frec->name,
+                             tf[i].self, tf[i].time);
+        }
+    }
+    else {
+        for (i = 0; (name = ap_request_phase_name(i)) != NULL; i++) {
+            if (!strcasecmp(a, name)) {
+                return apr_psprintf(r->pool, "%" APR_TIME_T_FMT,
+                                    t->phase[i]);
+            }
+        }
+        return "-";
+    }
+
+    if (!items->nelts) {
+        return "-";
+    }
+    return apr_array_pstrcat(r->pool, items, ' ');
+}
+
 static const char *log_request_duration(request_rec *r, char *a)
 {
-    apr_time_t duration = get_request_end_time(r) - r->request_time;
+    apr_time_t duration;
+
+    if (a && *a) {
+        return log_request_timing(r, a);
+    }
+
+    duration = get_request_end_time(r) - r->request_time;
     return apr_psprintf(r->pool, "%" APR_TIME_T_FMT, apr_time_sec(duration));
 }
 
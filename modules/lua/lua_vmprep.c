@@ -19,6 +19,7 @@
 #include "apr_uuid.h"
 #include "lua_config.h"
 #include "apr_file_info.h"
+#include "apr_atomic.h"
 #include "mod_auth.h"
 
 APLOG_USE_MODULE(lua);
@@ -39,7 +40,61 @@ APLOG_USE_MODULE(lua);
     apr_thread_mutex_t *ap_lua_mutex;
 #endif
 extern apr_global_mutex_t *lua_ivm_mutex;
-    
+
+#if LUA_VERSION_NUM > 501
+#define AP_LUA_SEARCHERS "searchers"
+#else
+#define AP_LUA_SEARCHERS "loaders"
+#endif
+
+/*
+ * Compiled chunks of the Lua files loaded by this child, keyed by file
+ * name.  Every lua_State of a request, connection or thread scope loads its
+ * handler file (and whatever it requires) afresh, so without this cache each
+ * new state pays for parsing and compiling the same sources again.
+ */
+typedef struct {
+    apr_time_t mtime;
+    apr_off_t  size;
+    char      *code;        /* malloc()ed, replaced when the file changes */
+    apr_size_t len;
+} bytecode_entry;
+
+static apr_pool_t *bytecode_pool;
+static apr_hash_t *bytecode_cache;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *bytecode_mutex;
+#endif
+
+static ap_lua_vm_stats vm_stats;
+
+static apr_status_t bytecode_cache_cleanup(void *data)
+{
+    apr_hash_index_t *hi;
+
+    for (hi = apr_hash_first(NULL, bytecode_cache); hi; hi = apr_hash_next(hi)) {
+        void *val;
+        bytecode_entry *e;
+
+        apr_hash_this(hi, NULL, NULL, &val);
+        e = val;
+        free(e->code);
+        e->code = NULL;
+    }
+    bytecode_cache = NULL;
+    return APR_SUCCESS;
+}
+
+void ap_lua_vm_stats_get(ap_lua_vm_stats *stats)
+{
+    stats->vms_created = apr_atomic_read32(&vm_stats.vms_created);
+    stats->vms_closed = apr_atomic_read32(&vm_stats.vms_closed);
+    stats->bytecode_hits = apr_atomic_read32(&vm_stats.bytecode_hits);
+    stats->bytecode_misses = apr_atomic_read32(&vm_stats.bytecode_misses);
+    stats->bytecode_entries = apr_atomic_read32(&vm_stats.bytecode_entries);
+    stats->bytecode_bytes = apr_atomic_read32(&vm_stats.bytecode_bytes);
+}
+
 void ap_lua_init_mutex(apr_pool_t *pool, server_rec *s) 
 {
     apr_status_t rv;
@@ -57,7 +112,209 @@ void ap_lua_init_mutex(apr_pool_t *pool, server_rec *s)
     /* Server pool mutex */
 #if APR_HAS_THREADS
     apr_thread_mutex_create(&ap_lua_mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+    if (apr_thread_mutex_create(&bytecode_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                pool) != APR_SUCCESS) {
+        /* run without the bytecode cache rather than unlocked */
+        return;
+    }
 #endif
+
+    bytecode_pool = pool;
+    bytecode_cache = apr_hash_make(pool);
+    apr_pool_cleanup_register(pool, NULL, bytecode_cache_cleanup,
+                              apr_pool_cleanup_null);
+}
+
+typedef struct {
+    char      *buf;
+    apr_size_t len;
+    apr_size_t size;
+} dump_buffer;
+
+static int dump_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+    dump_buffer *b = ud;
+
+    (void) L;
+    if (b->len + sz > b->size) {
+        apr_size_t size = b->size ? b->size * 2 : 4096;
+        char *buf;
+
+        while (size < b->len + sz) {
+            size *= 2;
+        }
+        if ((buf = realloc(b->buf, size)) == NULL) {
+            return 1;
+        }
+        b->buf = buf;
+        b->size = size;
+    }
+    memcpy(b->buf + b->len, p, sz);
+    b->len += sz;
+    return 0;
+}
+
+static const apr_finfo_t *stat_file(apr_finfo_t *finfo, const char *file,
+                                    apr_pool_t *pool)
+{
+    if (apr_stat(finfo, file, APR_FINFO_MTIME|APR_FINFO_SIZE|APR_FINFO_TYPE,
+                 pool) != APR_SUCCESS || finfo->filetype != APR_REG) {
+        return NULL;
+    }
+    return finfo;
+}
+
+/*
+ * Like luaL_loadfile(), but take the chunk from the bytecode cache if the
+ * file is unchanged since it was compiled (or at all with LuaCodeCache
+ * forever).  finfo is the file's current stat information; without it, or
+ * with LuaCodeCache never, the file is always compiled from source.
+ */
+static int load_file_cached(lua_State *L, const char *file,
+                            const apr_finfo_t *finfo, int codecache)
+{
+    bytecode_entry *e;
+    dump_buffer b;
+    const char *chunkname;
+    int rc;
+
+    if (!bytecode_cache || !finfo || codecache == AP_LUA_CACHE_NEVER) {
+        return luaL_loadfile(L, file);
+    }
+
+    chunkname = lua_pushfstring(L, "@%s", file);
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(bytecode_mutex);
+#endif
+    e = apr_hash_get(bytecode_cache, file, APR_HASH_KEY_STRING);
+    if (e && e->code && (codecache == AP_LUA_CACHE_FOREVER
+                         || (e->mtime == finfo->mtime
+                             && e->size == finfo->size))) {
+        /* undumping is cheap, and the buffer may be replaced once unlocked */
+        rc = luaL_loadbuffer(L, e->code, e->len, chunkname);
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(bytecode_mutex);
+#endif
+        lua_remove(L, -2);
+        if (rc == 0) {
+            apr_atomic_inc32(&vm_stats.bytecode_hits);
+        }
+        return rc;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(bytecode_mutex);
+#endif
+    lua_pop(L, 1);
+
+    apr_atomic_inc32(&vm_stats.bytecode_misses);
+    if ((rc = luaL_loadfile(L, file)) != 0) {
+        return rc;
+    }
+
+    memset(&b, 0, sizeof(b));
+    if (lua_dump(L, dump_writer, &b) != 0) {
+        /* out of memory; the chunk is loaded, it just isn't cached */
+        free(b.buf);
+        return 0;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(bytecode_mutex);
+#endif
+    e = apr_hash_get(bytecode_cache, file, APR_HASH_KEY_STRING);
+    if (e == NULL) {
+        e = apr_pcalloc(bytecode_pool, sizeof(*e));
+        apr_hash_set(bytecode_cache, apr_pstrdup(bytecode_pool, file),
+                     APR_HASH_KEY_STRING, e);
+        apr_atomic_inc32(&vm_stats.bytecode_entries);
+    }
+    apr_atomic_add32(&vm_stats.bytecode_bytes, (apr_uint32_t)b.len);
+    apr_atomic_sub32(&vm_stats.bytecode_bytes, (apr_uint32_t)e->len);
+    free(e->code);
+    e->code = b.buf;
+    e->len = b.len;
+    e->mtime = finfo->mtime;
+    e->size = finfo->size;
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(bytecode_mutex);
+#endif
+
+    return 0;
+}
+
+/*
+ * Replacement for Lua's own searcher of Lua modules along package.path,
+ * so that require() also loads from the bytecode cache.  The search and
+ * its error messages are the same; the LuaCodeCache mode is upvalue 1.
+ */
+static int cached_searcher(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    int codecache = (int)lua_tointeger(L, lua_upvalueindex(1));
+    const char *path, *end;
+    apr_pool_t *pool;
+    int nmsg = 0;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "Apache2.Wombat.pool");
+    pool = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (pool == NULL) {
+        return luaL_error(L, "no pool registered for this lua_State, "
+                          "cannot search for module '%s'", name);
+    }
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "path");
+    path = lua_tostring(L, -1);
+    if (path == NULL) {
+        return luaL_error(L, "'package.path' must be a string");
+    }
+    name = luaL_gsub(L, name, ".", LUA_DIRSEP);
+
+    /* stack: package, path, name, then one message per file tried */
+    for (; *path; path = *end ? end + 1 : end) {
+        apr_finfo_t finfo;
+        const char *filename;
+
+        end = strchr(path, ';');
+        if (end == NULL) {
+            end = path + strlen(path);
+        }
+        if (end == path) {
+            continue;
+        }
+        luaL_checkstack(L, 3, "too many package.path entries");
+        lua_pushlstring(L, path, end - path);
+        filename = luaL_gsub(L, lua_tostring(L, -1), "?", name);
+        lua_remove(L, -2);
+        if (stat_file(&finfo, filename, pool)) {
+            if (load_file_cached(L, filename, &finfo, codecache) != 0) {
+                return luaL_error(L, "error loading module '%s' from file "
+                                  "'%s':\n\t%s", lua_tostring(L, 1),
+                                  filename, lua_tostring(L, -1));
+            }
+            lua_pushstring(L, filename);
+            return 2;
+        }
+        lua_pushfstring(L, "\n\tno file '%s'", filename);
+        lua_remove(L, -2);
+        nmsg++;
+    }
+
+    lua_concat(L, nmsg);
+    return 1;
+}
+
+static void install_cached_searcher(lua_State *L, int codecache)
+{
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, AP_LUA_SEARCHERS);
+    if (lua_istable(L, -1)) {
+        lua_pushinteger(L, codecache);
+        lua_pushcclosure(L, cached_searcher, 1);
+        lua_rawseti(L, -2, 2);
+    }
+    lua_pop(L, 2);
 }
 
 /* forward dec'l from this file */
@@ -235,6 +492,7 @@ static apr_status_t cleanup_lua(void *l)
 {
     AP_DEBUG_ASSERT(l != NULL);
     lua_close((lua_State *) l);
+    apr_atomic_inc32(&vm_stats.vms_closed);
     return APR_SUCCESS;
 }
 
@@ -244,6 +502,7 @@ static apr_status_t server_cleanup_lua(void *resource)
     AP_DEBUG_ASSERT(spec != NULL);
     if (spec->L != NULL) {
         lua_close((lua_State *) spec->L);
+        apr_atomic_inc32(&vm_stats.vms_closed);
     }
     return APR_SUCCESS;
 }
@@ -334,6 +593,9 @@ static apr_status_t vm_construct(lua_State **vm, void *params, apr_pool_t *lifec
     luaopen_jit(L);
 #endif
     luaL_openlibs(L);
+    /* set early, the file and modules it requires may need the pool */
+    lua_pushlightuserdata(L, lifecycle_pool);
+    lua_setfield(L, LUA_REGISTRYINDEX, "Apache2.Wombat.pool");
     if (spec->package_paths) {
         munge_path(L, 
                    "path", "?.lua", "./?.lua", 
@@ -348,6 +610,9 @@ static apr_status_t vm_construct(lua_State **vm, void *params, apr_pool_t *lifec
                    spec->package_cpaths,
                    spec->file);
     }
+    if (spec->codecache != AP_LUA_CACHE_NEVER) {
+        install_cached_searcher(L, spec->codecache);
+    }
 
     if (spec->cb) {
         spec->cb(L, lifecycle_pool, spec->cb_arg);
@@ -359,10 +624,13 @@ static apr_status_t vm_construct(lua_State **vm, void *params, apr_pool_t *lifec
         lua_pcall(L, 0, LUA_MULTRET, 0);
     }
     else {
+        apr_finfo_t finfo;
         int rc;
         ap_log_perror(APLOG_MARK, APLOG_DEBUG, 0, lifecycle_pool, APLOGNO(01481)
             "loading lua file %s", spec->file);
-        rc = luaL_loadfile(L, spec->file);
+        rc = load_file_cached(L, spec->file,
+                              stat_file(&finfo, spec->file, lifecycle_pool),
+                              spec->codecache);
         if (rc != 0) {
             ap_log_perror(APLOG_MARK, APLOG_ERR, 0, lifecycle_pool, APLOGNO(01482)
                           "Error loading %s: %s", spec->file,
@@ -381,8 +649,7 @@ static apr_status_t vm_construct(lua_State **vm, void *params, apr_pool_t *lifec
 #ifdef AP_ENABLE_LUAJIT
     loadjitmodule(L, lifecycle_pool);
 #endif
-    lua_pushlightuserdata(L, lifecycle_pool);
-    lua_setfield(L, LUA_REGISTRYINDEX, "Apache2.Wombat.pool");
+    apr_atomic_inc32(&vm_stats.vms_created);
     *vm = L;
 
     return APR_SUCCESS;
@@ -431,6 +698,8 @@ lua_State *ap_lua_get_lua_state(apr_pool_t *lifecycle_pool,
 {
     lua_State *L = NULL;
     ap_lua_finfo *cache_info = NULL;
+    apr_finfo_t lua_finfo;
+    const apr_finfo_t *finfo = NULL;
     int tryCache = 0;
     
     if (spec->scope == AP_LUA_SCOPE_SERVER) {
@@ -504,8 +773,7 @@ lua_State *ap_lua_get_lua_state(apr_pool_t *lifecycle_pool,
             }
         }
         if (spec->codecache == AP_LUA_CACHE_STAT) {
-            apr_finfo_t lua_finfo;
-            apr_stat(&lua_finfo, spec->file, APR_FINFO_MTIME|APR_FINFO_SIZE, lifecycle_pool);
+            finfo = stat_file(&lua_finfo, spec->file, lifecycle_pool);
 
             /* On first visit, modified will be zero, but that's fine - The file is 
             loaded in the vm_construct function.
@@ -527,7 +795,7 @@ lua_State *ap_lua_get_lua_state(apr_pool_t *lifecycle_pool,
         int rc;
         ap_log_perror(APLOG_MARK, APLOG_DEBUG, 0, lifecycle_pool, APLOGNO(02332)
             "(re)loading lua file %s", spec->file);
-        rc = luaL_loadfile(L, spec->file);
+        rc = load_file_cached(L, spec->file, finfo, spec->codecache);
         if (rc != 0) {
             ap_log_perror(APLOG_MARK, APLOG_ERR, 0, lifecycle_pool, APLOGNO(02333)
                           "Error loading %s: %s", spec->file,
@@ -115,6 +115,16 @@ typedef struct {
     ap_lua_finfo* finfo;
 } ap_lua_server_spec;
 
+/* lua_State and bytecode cache counters of this child process */
+typedef struct {
+    apr_uint32_t vms_created;
+    apr_uint32_t vms_closed;
+    apr_uint32_t bytecode_hits;
+    apr_uint32_t bytecode_misses;
+    apr_uint32_t bytecode_entries;
+    apr_uint32_t bytecode_bytes;
+} ap_lua_vm_stats;
+
 /**
  * Fake out addition of the "apache2" module
  */
@@ -144,4 +154,10 @@ lua_State *ap_lua_get_lua_state(apr_pool_t *lifecycle_pool,
 void ap_lua_init_mutex(apr_pool_t *pool, server_rec *s);
 #endif
 
+/*
+ * Take a snapshot of the lua_State and bytecode cache counters.
+ * @stats filled in with the current values
+ */
+void ap_lua_vm_stats_get(ap_lua_vm_stats *stats);
+
 #endif
@@ -26,6 +26,7 @@
 #include "apr_optional.h"
 #include "mod_ssl.h"
 #include "mod_auth.h"
+#include "mod_status.h"
 #include "util_mutex.h"
 
 
@@ -2083,6 +2084,35 @@ static void *merge_dir_config(apr_pool_t *p, void *basev, void *overridesv)
     return a;
 }
 
+static int lua_status_hook(request_rec *r, int flags)
+{
+    ap_lua_vm_stats st;
+
+    ap_lua_vm_stats_get(&st);
+
+    if (flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "LuaStatesCreated: %u\n"
+                   "LuaStatesClosed: %u\n"
+                   "LuaBytecodeHits: %u\n"
+                   "LuaBytecodeMisses: %u\n"
+                   "LuaBytecodeEntries: %u\n"
+                   "LuaBytecodeBytes: %u\n",
+                   st.vms_created, st.vms_closed, st.bytecode_hits,
+                   st.bytecode_misses, st.bytecode_entries,
+                   st.bytecode_bytes);
+        return OK;
+    }
+
+    ap_rputs("<hr />\n<h2>Lua (this child)</h2>\n", r);
+    ap_rprintf(r, "<dl><dt>%u lua_States created, %u closed, %u open</dt>\n"
+               "<dt>%u bytecode cache hits, %u misses, "
+               "%u files in %u bytes</dt></dl>\n",
+               st.vms_created, st.vms_closed, st.vms_created - st.vms_closed,
+               st.bytecode_hits, st.bytecode_misses, st.bytecode_entries,
+               st.bytecode_bytes);
+    return OK;
+}
+
 static void lua_register_hooks(apr_pool_t *p)
 {
     /* ap_register_output_filter("luahood", luahood, NULL, AP_FTYPE_RESOURCE); */
@@ -2140,6 +2170,8 @@ static void lua_register_hooks(apr_pool_t *p)
 
     APR_OPTIONAL_HOOK(ap_lua, lua_request, lua_request_hook, NULL, NULL,
                       APR_HOOK_REALLY_FIRST);
+    APR_OPTIONAL_HOOK(ap, status_hook, lua_status_hook, NULL, NULL,
+                      APR_HOOK_MIDDLE);
     ap_hook_handler(lua_map_handler, NULL, NULL, AP_LUA_HOOK_FIRST);
     
     /* Hook this right before FallbackResource kicks in */
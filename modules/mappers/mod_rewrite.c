@@ -105,7 +105,7 @@
 #include "util_charset.h"
 #endif
 
-static ap_dbd_t *(*dbd_acquire)(request_rec*) = NULL;
+static APR_OPTIONAL_FN_TYPE(ap_dbd_cached_select) *dbd_select = NULL;
 static void (*dbd_prepare)(server_rec*, const char*, const char*) = NULL;
 static const char* really_last_key = "rewrite_really_last";
 
@@ -1357,42 +1357,34 @@ static char *lookup_map_dbmfile(request_rec *r, const char *file,
 static char *lookup_map_dbd(request_rec *r, char *key, const char *label)
 {
     apr_status_t rv;
-    apr_dbd_prepared_t *stmt;
     const char *errmsg;
-    apr_dbd_results_t *res = NULL;
-    apr_dbd_row_t *row = NULL;
+    const char *args[1];
+    ap_dbd_result_t *res;
     const char *ret = NULL;
-    int n = 0;
-    ap_dbd_t *db = dbd_acquire(r);
-
-    stmt = apr_hash_get(db->prepared, label, APR_HASH_KEY_STRING);
+    int n;
 
-    rv = apr_dbd_pvselect(db->driver, r->pool, db->handle, &res,
-                          stmt, 0, key, NULL);
-    if (rv != 0) {
-        errmsg = apr_dbd_error(db->driver, db->handle, rv);
+    /* the result may come from mod_dbd's DBDResultCacheTimeout cache */
+    args[0] = key;
+    rv = dbd_select(r, label, 1, args, &res, &errmsg);
+    if (rv == APR_INCOMPLETE) {
+        /* use the rows we got before the error */
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(00658)
+                      "rewritemap: error %s looking up %s", errmsg, key);
+    }
+    else if (rv != APR_SUCCESS) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(00657)
                       "rewritemap: error %s querying for %s", errmsg, key);
         return NULL;
     }
-    while ((rv = apr_dbd_get_row(db->driver, r->pool, res, &row, -1)) == 0) {
-        ++n;
-        if (ret == NULL) {
-            ret = apr_dbd_get_entry(db->driver, row, 0);
-        }
-        else {
-            /* randomise crudely amongst multiple results */
-            if ((double)rand() < (double)RAND_MAX/(double)n) {
-                ret = apr_dbd_get_entry(db->driver, row, 0);
-            }
+    for (n = 1; n <= res->rows->nelts; ++n) {
+        const char **row = APR_ARRAY_IDX(res->rows, n - 1, const char **);
+
+        /* randomise crudely amongst multiple results */
+        if (ret == NULL || (double)rand() < (double)RAND_MAX/(double)n) {
+            ret = row[0];
         }
     }
-    if (rv != -1) {
-        errmsg = apr_dbd_error(db->driver, db->handle, rv);
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(00658)
-                      "rewritemap: error %s looking up %s", errmsg, key);
-    }
-    switch (n) {
+    switch (res->rows->nelts) {
     case 0:
         return NULL;
     case 1:
@@ -4426,7 +4418,7 @@ static int pre_config(apr_pool_t *pconf,
         map_pfn_register("escape", rewrite_mapfunc_escape);
         map_pfn_register("unescape", rewrite_mapfunc_unescape);
     }
-    dbd_acquire = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_acquire);
+    dbd_select = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_cached_select);
     dbd_prepare = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_prepare);
     return OK;
 }
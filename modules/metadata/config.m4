@@ -5,7 +5,15 @@ dnl APACHE_MODULE(name, helptext[, objects[, structname[, default[, config]]]])
 APACHE_MODPATH_INIT(metadata)
 
 APACHE_MODULE(env, clearing/setting of ENV vars, , , yes)
-APACHE_MODULE(mime_magic, automagically determining MIME type)
+APACHE_MODULE(mime_magic, automagically determining MIME type, , , , [
+  AC_CHECK_HEADERS(zlib.h, [
+    AC_CHECK_LIB(z, inflateInit2_, [
+      APR_ADDTO(MOD_MIME_MAGIC_LDADD, [-lz])
+      AC_DEFINE(HAVE_MIME_MAGIC_ZLIB, 1,
+                [Define if mod_mime_magic can uncompress with zlib])
+    ])
+  ])
+])
 APACHE_MODULE(cern_meta, CERN-type meta files, , , no)
 APACHE_MODULE(expires, Expires header control, , , most)
 APACHE_MODULE(headers, HTTP header control, , , yes)
@@ -81,6 +81,7 @@
 #include "http_log.h"
 #include "util_filter.h"
 #include "http_protocol.h"
+#include "util_headers.h"
 #include "ap_expr.h"
 
 #include "mod_ssl.h" /* for the ssl_var_lookup optional function defn */
@@ -128,6 +129,7 @@ static const char* condition_early = "early";
 typedef struct {
     hdr_actions action;
     const char *header;
+    int id;                   /* ap_header_id() of header */
     apr_array_header_t *ta;   /* Array of format_tag structs */
     ap_regex_t *regex;
     const char *condition_var;
@@ -553,6 +555,7 @@ static APR_INLINE const char *header_inout_cmd(cmd_parms *cmd,
     }
 
     new->header = hdr;
+    new->id = ap_header_id(hdr);
     new->condition_var = condition_var;
     new->expr = expr;
 
@@ -697,12 +700,26 @@ static int add_them_all(void *v, const char *key, const char *val)
     return 1;
 }
 
+static const char *get_header(ap_headers_t *h, header_entry *hdr)
+{
+    if (hdr->id != AP_HEADER_UNKNOWN) {
+        return ap_headers_get_id(h, hdr->id);
+    }
+    return apr_table_get(ap_headers_table(h), hdr->header);
+}
+
 static int do_headers_fixup(request_rec *r, apr_table_t *headers,
                              apr_array_header_t *fixup, int early)
 {
     echo_do v;
     int i;
     const char *val;
+    ap_headers_t *h;
+
+    if (!fixup->nelts) {
+        return 1;
+    }
+    h = ap_headers_make(r->pool, headers);
 
     for (i = 0; i < fixup->nelts; ++i) {
         header_entry *hdr = &((header_entry *) (fixup->elts))[i];
@@ -743,15 +760,15 @@ static int do_headers_fixup(request_rec *r, apr_table_t *headers,
 
         switch (hdr->action) {
         case hdr_add:
-            apr_table_addn(headers, hdr->header, process_tags(hdr, r));
+            ap_headers_addn(h, hdr->header, process_tags(hdr, r));
             break;
         case hdr_append:
-            apr_table_mergen(headers, hdr->header, process_tags(hdr, r));
+            ap_headers_mergen(h, hdr->header, process_tags(hdr, r));
             break;
         case hdr_merge:
-            val = apr_table_get(headers, hdr->header);
+            val = get_header(h, hdr);
             if (val == NULL) {
-                apr_table_addn(headers, hdr->header, process_tags(hdr, r));
+                ap_headers_addn(h, hdr->header, process_tags(hdr, r));
             } else {
                 char *new_val = process_tags(hdr, r);
                 apr_size_t new_val_len = strlen(new_val);
@@ -784,26 +801,26 @@ static int do_headers_fixup(request_rec *r, apr_table_t *headers,
                 }
 
                 if (!tok_found) {
-                    apr_table_mergen(headers, hdr->header, new_val);
+                    ap_headers_mergen(h, hdr->header, new_val);
                 }
             }
             break;
         case hdr_set:
-            if (!strcasecmp(hdr->header, "Content-Type")) {
+            if (hdr->id == AP_HEADER_CONTENT_TYPE) {
                  ap_set_content_type(r, process_tags(hdr, r));
             }
-            apr_table_setn(headers, hdr->header, process_tags(hdr, r));
+            ap_headers_setn(h, hdr->header, process_tags(hdr, r));
             break;
         case hdr_setifempty:
-            if (NULL == apr_table_get(headers, hdr->header)) {
-                if (!strcasecmp(hdr->header, "Content-Type")) {
+            if (NULL == get_header(h, hdr)) {
+                if (hdr->id == AP_HEADER_CONTENT_TYPE) {
                     ap_set_content_type(r, process_tags(hdr, r));
                 }
-                apr_table_setn(headers, hdr->header, process_tags(hdr, r));
+                ap_headers_setn(h, hdr->header, process_tags(hdr, r));
             }
             break;
         case hdr_unset:
-            apr_table_unset(headers, hdr->header);
+            ap_headers_unset(h, hdr->header);
             break;
         case hdr_echo:
             v.r = r;
@@ -813,13 +830,13 @@ static int do_headers_fixup(request_rec *r, apr_table_t *headers,
             break;
         case hdr_edit:
         case hdr_edit_r:
-            if (!strcasecmp(hdr->header, "Content-Type") && r->content_type) {
+            if (hdr->id == AP_HEADER_CONTENT_TYPE && r->content_type) {
                 const char *repl = process_regexp(hdr, r->content_type, r);
                 if (repl == NULL)
                     return 0;
                 ap_set_content_type(r, repl);
             }
-            if (apr_table_get(headers, hdr->header)) {
+            if (get_header(h, hdr)) {
                 edit_do ed;
 
                 ed.r = r;
@@ -828,12 +845,12 @@ static int do_headers_fixup(request_rec *r, apr_table_t *headers,
                 if (!apr_table_do(edit_header, (void *) &ed, headers,
                                   hdr->header, NULL))
                     return 0;
-                apr_table_unset(headers, hdr->header);
+                ap_headers_unset(h, hdr->header);
                 apr_table_do(add_them_all, (void *) headers, ed.t, NULL);
             }
             break;
         case hdr_note:
-            apr_table_setn(r->notes, process_tags(hdr, r), apr_table_get(headers, hdr->header));
+            apr_table_setn(r->notes, process_tags(hdr, r), get_header(h, hdr));
             break;
  
         }
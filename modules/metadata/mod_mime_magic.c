@@ -101,6 +101,14 @@
 #include "http_protocol.h"
 #include "util_script.h"
 
+#if APR_HAS_THREADS
+#include "apr_thread_mutex.h"
+#endif
+
+#ifdef HAVE_MIME_MAGIC_ZLIB
+#include "zlib.h"
+#endif
+
 /* ### this isn't set by configure? does anybody set this? */
 #ifdef HAVE_UTIME_H
 #include <utime.h>
@@ -229,7 +237,7 @@ static int mget(request_rec *, union VALUETYPE *, unsigned char *,
 static int mcheck(request_rec *, union VALUETYPE *, struct magic *);
 static void mprint(request_rec *, union VALUETYPE *, struct magic *);
 
-static int uncompress(request_rec *, int,
+static int uncompress(request_rec *, int, unsigned char *, apr_size_t,
                       unsigned char **, apr_size_t);
 static long from_oct(int, char *);
 static int fsmagic(request_rec *r, const char *fn);
@@ -451,11 +459,23 @@ typedef struct magic_rsl_s {
  * Apache module configuration structures
  */
 
+/* a top-level entry of the magic list, with the byte that must be found
+ * at its offset for it to match, or -1 if it cannot be told in advance
+ */
+typedef struct {
+    struct magic *m;
+    long offset;
+    int byte;
+} magic_index;
+
 /* per-server info */
 typedef struct {
     const char *magicfile;    /* where magic be found */
     struct magic *magic;      /* head of magic config list */
     struct magic *last;
+    magic_index *index;       /* the top-level entries, in order */
+    int nindex;
+    int cache_entries;        /* size of the result cache, -1 if unset */
 } magic_server_config_rec;
 
 /* per-request info */
@@ -474,7 +494,11 @@ module AP_MODULE_DECLARE_DATA mime_magic_module;
 static void *create_magic_server_config(apr_pool_t *p, server_rec *d)
 {
     /* allocate the config - use pcalloc because it needs to be zeroed */
-    return apr_pcalloc(p, sizeof(magic_server_config_rec));
+    magic_server_config_rec *conf =
+        apr_pcalloc(p, sizeof(magic_server_config_rec));
+
+    conf->cache_entries = -1;
+    return conf;
 }
 
 static void *merge_magic_server_config(apr_pool_t *p, void *basev, void *addv)
@@ -487,6 +511,9 @@ static void *merge_magic_server_config(apr_pool_t *p, void *basev, void *addv)
     new->magicfile = add->magicfile ? add->magicfile : base->magicfile;
     new->magic = NULL;
     new->last = NULL;
+    new->index = NULL;
+    new->nindex = 0;
+    new->cache_entries = base->cache_entries;
     return new;
 }
 
@@ -503,6 +530,28 @@ static const char *set_magicfile(cmd_parms *cmd, void *dummy, const char *arg)
     return NULL;
 }
 
+static const char *set_cache_entries(cmd_parms *cmd, void *dummy,
+                                     const char *arg)
+{
+    magic_server_config_rec *conf = (magic_server_config_rec *)
+    ap_get_module_config(cmd->server->module_config,
+                      &mime_magic_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    char *end;
+    long n;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    n = strtol(arg, &end, 10);
+    if (*end || n < 0 || n > 1048576) {
+        return "MimeMagicCacheEntries must be a number between 0 and 1048576";
+    }
+    conf->cache_entries = (int)n;
+    return NULL;
+}
+
 /*
  * configuration file commands - exported to Apache API
  */
@@ -511,6 +560,8 @@ static const command_rec mime_magic_cmds[] =
 {
     AP_INIT_TAKE1("MimeMagicFile", set_magicfile, NULL, RSRC_CONF,
      "Path to MIME Magic file (in file(1) format)"),
+    AP_INIT_TAKE1("MimeMagicCacheEntries", set_cache_entries, NULL, RSRC_CONF,
+     "Number of results each child remembers, 0 to disable"),
     {NULL}
 };
 
@@ -1538,6 +1589,7 @@ static int match(request_rec *r, unsigned char *s, apr_size_t nbytes)
     magic_server_config_rec *conf = (magic_server_config_rec *)
                 ap_get_module_config(r->server->module_config, &mime_magic_module);
     struct magic *m;
+    int i;
 
 #if MIME_MAGIC_DEBUG
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(01529)
@@ -1567,7 +1619,19 @@ static int match(request_rec *r, unsigned char *s, apr_size_t nbytes)
     }
 #endif
 
-    for (m = conf->magic; m; m = m->next) {
+    /*
+     * Only the main entries are walked; the continuations of an entry that
+     * doesn't match are never looked at.
+     */
+    for (i = 0; i < conf->nindex; i++) {
+        const magic_index *x = &conf->index[i];
+
+        /* most entries are ruled out by a single byte */
+        if (x->byte >= 0 && ((apr_size_t)x->offset >= nbytes
+                             || s[x->offset] != x->byte)) {
+            continue;
+        }
+        m = x->m;
 #if MIME_MAGIC_DEBUG
         rule_counter++;
         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(01531)
@@ -1577,32 +1641,6 @@ static int match(request_rec *r, unsigned char *s, apr_size_t nbytes)
         /* check if main entry matches */
         if (!mget(r, &p, s, m, nbytes) ||
             !mcheck(r, &p, m)) {
-            struct magic *m_cont;
-
-            /*
-             * main entry didn't match, flush its continuations
-             */
-            if (!m->next || (m->next->cont_level == 0)) {
-                continue;
-            }
-
-            m_cont = m->next;
-            while (m_cont && (m_cont->cont_level != 0)) {
-#if MIME_MAGIC_DEBUG
-                rule_counter++;
-                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(01532)
-                        MODNAME ": line=%d mc=%x mc->next=%x cont=%d desc=%s",
-                            m_cont->lineno, m_cont,
-                            m_cont->next, m_cont->cont_level,
-                            m_cont->desc);
-#endif
-                /*
-                 * this trick allows us to keep *m in sync when the continue
-                 * advances the pointer
-                 */
-                m = m_cont;
-                m_cont = m_cont->next;
-            }
             continue;
         }
 
@@ -2050,6 +2088,7 @@ static struct {
     char *argv[3];
     int silent;
     char *encoding;  /* MUST be lowercase */
+    int zlib;        /* can be uncompressed with zlib */
 } compr[] = {
 
     /* we use gzip here rather than uncompress because we have to pass
@@ -2059,12 +2098,12 @@ static struct {
     {
         "\037\235", 2, {
             "gzip", "-dcq", NULL
-        }, 0, "x-compress"
+        }, 0, "x-compress", 0
     },
     {
         "\037\213", 2, {
             "gzip", "-dcq", NULL
-        }, 1, "x-gzip"
+        }, 1, "x-gzip", 1
     },
     /*
      * XXX pcat does not work, cause I don't know how to make it read stdin,
@@ -2073,7 +2112,7 @@ static struct {
     {
         "\037\036", 2, {
             "gzip", "-dcq", NULL
-        }, 0, "x-gzip"
+        }, 0, "x-gzip", 0
     },
 };
 
@@ -2095,7 +2134,8 @@ static int zmagic(request_rec *r, unsigned char *buf, apr_size_t nbytes)
     if (i == ncompr)
         return 0;
 
-    if ((newsize = uncompress(r, i, &newbuf, HOWMANY)) > 0) {
+    /* the data handed to uncompress() leaves out the terminating '\0' */
+    if ((newsize = uncompress(r, i, buf, nbytes - 1, &newbuf, HOWMANY)) > 0) {
         /* set encoding type in the request record */
         r->content_encoding = compr[i].encoding;
 
@@ -2165,7 +2205,50 @@ static int create_uncompress_child(struct uncompress_parms *parm, apr_pool_t *cn
     return (rc);
 }
 
+#ifdef HAVE_MIME_MAGIC_ZLIB
+/*
+ * Uncompress the start of a gzip file from the data already read, rather
+ * than running gzip on the whole file.  Only the start of the uncompressed
+ * data is looked at, so running out of input is not an error.
+ */
+static int uncompress_zlib(request_rec *r, unsigned char *old,
+                           apr_size_t nold, unsigned char **newch,
+                           apr_size_t n)
+{
+    z_stream zs;
+    const char *msg;
+    apr_size_t len;
+
+    memset(&zs, 0, sizeof(zs));
+    /* adding 16 to the window bits makes zlib expect a gzip header */
+    if (inflateInit2(&zs, MAX_WBITS + 16) != Z_OK) {
+        return -1;
+    }
+
+    /* leave room for the '\0' the caller puts at the end */
+    *newch = (unsigned char *) apr_palloc(r->pool, n);
+    zs.next_in = old;
+    zs.avail_in = (uInt) nold;
+    zs.next_out = *newch;
+    zs.avail_out = (uInt) (n - 1);
+
+    (void) inflate(&zs, Z_SYNC_FLUSH);
+    len = (n - 1) - zs.avail_out;
+    msg = zs.msg;
+    inflateEnd(&zs);
+
+    if (len == 0) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02848)
+                      MODNAME ": can't uncompress %s: %s", r->filename,
+                      msg ? msg : "no data");
+        return -1;
+    }
+    return (int) len + 1;
+}
+#endif
+
 static int uncompress(request_rec *r, int method,
+                      unsigned char *old, apr_size_t nold,
                       unsigned char **newch, apr_size_t n)
 {
     struct uncompress_parms parm;
@@ -2173,6 +2256,12 @@ static int uncompress(request_rec *r, int method,
     apr_pool_t *sub_context;
     apr_status_t rv;
 
+#ifdef HAVE_MIME_MAGIC_ZLIB
+    if (compr[method].zlib) {
+        return uncompress_zlib(r, old, nold, newch, n);
+    }
+#endif
+
     parm.r = r;
     parm.method = method;
 
@@ -2353,6 +2442,75 @@ static int revision_suffix(request_rec *r)
     return result;
 }
 
+/*
+ * The byte that must be found at the offset of a main entry for it to
+ * match, or -1 if there's no such byte.  Only the plain equality tests are
+ * considered, which covers nearly all of the entries of a magic file.
+ */
+static int magic_first_byte(const struct magic *m)
+{
+    unsigned short h;
+
+    if ((m->flag & INDIR) || m->offset < 0 || m->reln != '='
+        || m->mask != ~0UL
+        /* mcheck() accepts anything for these */
+        || (m->value.s[0] == 'x' && m->value.s[1] == '\0')) {
+        return -1;
+    }
+
+    switch (m->type) {
+    case BYTE:
+    case LESHORT:
+    case LELONG:
+        return (int) (m->value.l & 0xff);
+    case BESHORT:
+        return (int) ((m->value.l >> 8) & 0xff);
+    case BELONG:
+        return (int) ((m->value.l >> 24) & 0xff);
+    case SHORT:
+        h = (unsigned short) m->value.l;
+        return ((unsigned char *) &h)[0];
+    case STRING:
+        /* mconvert() turns a newline into the end of the string */
+        if (m->vallen < 1 || m->value.s[0] == '\0'
+            || m->value.s[0] == '\n') {
+            return -1;
+        }
+        return (unsigned char) m->value.s[0];
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Build the index of the main entries that match() walks, so that it
+ * neither steps over the continuations of entries that don't match nor
+ * fetches the data for entries ruled out by their first byte.
+ */
+static void magic_build_index(apr_pool_t *p, magic_server_config_rec *conf)
+{
+    struct magic *m;
+    int n = 0;
+
+    for (m = conf->magic; m; m = m->next) {
+        if (m->cont_level == 0 || m == conf->magic) {
+            n++;
+        }
+    }
+
+    conf->index = apr_palloc(p, n * sizeof(magic_index));
+    conf->nindex = 0;
+    for (m = conf->magic; m; m = m->next) {
+        if (m->cont_level == 0 || m == conf->magic) {
+            magic_index *x = &conf->index[conf->nindex++];
+
+            x->m = m;
+            x->offset = m->offset;
+            x->byte = magic_first_byte(m);
+        }
+    }
+}
+
 /*
  * initialize the module
  */
@@ -2377,6 +2535,7 @@ static int magic_init(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp, server
             result = apprentice(s, p);
             if (result == -1)
                 return OK;
+            magic_build_index(p, conf);
 #if MIME_MAGIC_DEBUG
             prevm = 0;
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(01558)
@@ -2404,6 +2563,160 @@ static int magic_init(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp, server
     return OK;
 }
 
+/*
+ * Result cache
+ *
+ * Each child remembers the results for the last files it looked at, by
+ * their device, inode, modification time and size, so that a file which is
+ * requested again is neither read nor run through the magic entries
+ * again.  The table has MimeMagicCacheEntries slots, and a new result
+ * simply takes the place of the one in its slot.
+ */
+
+#define MAGIC_CACHE_DEFAULT_ENTRIES 512
+#define MAGIC_CACHE_TYPE_LEN 96
+#define MAGIC_CACHE_ENCODING_LEN 32
+#define MAGIC_CACHE_FINFO \
+    (APR_FINFO_DEV | APR_FINFO_INODE | APR_FINFO_MTIME | APR_FINFO_SIZE)
+
+typedef struct {
+    const struct magic *magic;  /* the magic list used, NULL if unused */
+    apr_dev_t device;
+    apr_ino_t inode;
+    apr_time_t mtime;
+    apr_off_t size;
+    int result;
+    char type[MAGIC_CACHE_TYPE_LEN];
+    char encoding[MAGIC_CACHE_ENCODING_LEN];
+} magic_cache_entry;
+
+static magic_cache_entry *magic_cache;
+static int magic_cache_entries;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *magic_cache_mutex;
+#endif
+
+static magic_cache_entry *magic_cache_slot(request_rec *r)
+{
+    apr_uint64_t h;
+
+    if (!magic_cache || r->finfo.filetype != APR_REG
+        || (r->finfo.valid & MAGIC_CACHE_FINFO) != MAGIC_CACHE_FINFO) {
+        return NULL;
+    }
+
+    h = (apr_uint64_t) r->finfo.inode * APR_UINT64_C(0x9E3779B97F4A7C15);
+    h ^= (apr_uint64_t) r->finfo.device;
+    return &magic_cache[(h ^ (h >> 32)) % magic_cache_entries];
+}
+
+static int magic_cache_lookup(request_rec *r, magic_server_config_rec *conf,
+                              int *result)
+{
+    magic_cache_entry *e = magic_cache_slot(r);
+    magic_cache_entry found;
+    int hit = 0;
+
+    if (!e) {
+        return 0;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(magic_cache_mutex);
+#endif
+    if (e->magic == conf->magic
+        && e->inode == r->finfo.inode && e->device == r->finfo.device
+        && e->mtime == r->finfo.mtime && e->size == r->finfo.size) {
+        found = *e;
+        hit = 1;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(magic_cache_mutex);
+#endif
+
+    if (!hit) {
+        return 0;
+    }
+
+    if (found.encoding[0]) {
+        r->content_encoding = apr_pstrdup(r->pool, found.encoding);
+    }
+    if (found.type[0]) {
+        ap_set_content_type(r, apr_pstrdup(r->pool, found.type));
+    }
+    *result = found.result;
+    return 1;
+}
+
+static void magic_cache_store(request_rec *r, magic_server_config_rec *conf,
+                              int result)
+{
+    magic_cache_entry *e = magic_cache_slot(r);
+    const char *type = r->content_type ? r->content_type : "";
+    const char *encoding = r->content_encoding ? r->content_encoding : "";
+
+    if (!e || (result != OK && result != DECLINED)
+        || strlen(type) >= MAGIC_CACHE_TYPE_LEN
+        || strlen(encoding) >= MAGIC_CACHE_ENCODING_LEN) {
+        return;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(magic_cache_mutex);
+#endif
+    e->magic = conf->magic;
+    e->device = r->finfo.device;
+    e->inode = r->finfo.inode;
+    e->mtime = r->finfo.mtime;
+    e->size = r->finfo.size;
+    e->result = result;
+    apr_cpystrn(e->type, type, sizeof(e->type));
+    apr_cpystrn(e->encoding, encoding, sizeof(e->encoding));
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(magic_cache_mutex);
+#endif
+}
+
+static void magic_child_init(apr_pool_t *p, server_rec *main_server)
+{
+    magic_server_config_rec *conf;
+    server_rec *s;
+    int n;
+
+    magic_cache = NULL;
+
+    /* no cache unless some server uses a magic file */
+    for (s = main_server; s; s = s->next) {
+        conf = ap_get_module_config(s->module_config, &mime_magic_module);
+        if (conf->magic) {
+            break;
+        }
+    }
+    if (!s) {
+        return;
+    }
+
+    conf = ap_get_module_config(main_server->module_config,
+                                &mime_magic_module);
+    n = conf->cache_entries < 0 ? MAGIC_CACHE_DEFAULT_ENTRIES
+                                : conf->cache_entries;
+    if (n == 0) {
+        return;
+    }
+
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&magic_cache_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                p) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, main_server, APLOGNO(02849)
+                     MODNAME ": can't create the cache mutex, "
+                     "results won't be cached");
+        return;
+    }
+#endif
+    magic_cache = apr_pcalloc(p, n * sizeof(magic_cache_entry));
+    magic_cache_entries = n;
+}
+
 /*
  * Find the Content-Type from any resource this module has available
  */
@@ -2434,15 +2747,25 @@ static int magic_find_ct(request_rec *r)
     }
 
     /* try excluding file-revision suffixes */
-    if (revision_suffix(r) != 1) {
-        /* process it based on the file contents */
-        if ((result = magic_process(r)) != OK) {
-            return result;
-        }
+    if (revision_suffix(r) == 1) {
+        return magic_rsl_to_request(r);
+    }
+
+    /* maybe the file has been looked at already */
+    if (magic_cache_lookup(r, conf, &result)) {
+        return result;
+    }
+
+    /* process it based on the file contents */
+    if ((result = magic_process(r)) != OK) {
+        return result;
     }
 
     /* if we have any results, put them in the request structure */
-    return magic_rsl_to_request(r);
+    result = magic_rsl_to_request(r);
+    magic_cache_store(r, conf, result);
+
+    return result;
 }
 
 static void register_hooks(apr_pool_t *p)
@@ -2453,6 +2776,7 @@ static void register_hooks(apr_pool_t *p)
 
     ap_hook_type_checker(magic_find_ct, aszPre, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(magic_init, NULL, NULL, APR_HOOK_FIRST);
+    ap_hook_child_init(magic_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 /*
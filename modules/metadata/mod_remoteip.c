@@ -26,14 +26,17 @@
 #define APR_WANT_BYTEFUNC
 #include "apr_want.h"
 #include "apr_network_io.h"
+#include "util_iptrie.h"
 
 module AP_MODULE_DECLARE_DATA remoteip_module;
 
 typedef struct {
-    /** A proxy IP mask to match */
+    /** A proxy IP mask to match, NULL for the entries held in the trie */
     apr_ipsubnet_t *ip;
     /** Flagged if internal, otherwise an external trusted proxy */
     void  *internal;
+    /** The position of the entry in the configuration */
+    int order;
 } remoteip_proxymatch_t;
 
 typedef struct {
@@ -44,10 +47,16 @@ typedef struct {
      * from the proxy-via IP header value list)
      */
     const char *proxies_header_name;
-    /** A list of trusted proxies, ideally configured
-     *  with the most commonly encountered listed first
+    /** The trusted proxies, each mapped to its remoteip_proxymatch_t;
+     *  where networks overlap, the one configured first wins
+     */
+    ap_iptrie_t *proxymatch_trie;
+    /** The trusted proxies given with a non-contiguous netmask, which
+     *  cannot be held in the trie and are matched one by one
      */
     apr_array_header_t *proxymatch_ip;
+    /** The number of trusted proxy entries configured so far */
+    int proxymatch_count;
 } remoteip_config_t;
 
 typedef struct {
@@ -82,9 +91,16 @@ static void *merge_remoteip_server_config(apr_pool_t *p, void *globalv,
     config->proxies_header_name = server->proxies_header_name
                                 ? server->proxies_header_name
                                 : global->proxies_header_name;
-    config->proxymatch_ip = server->proxymatch_ip
-                          ? server->proxymatch_ip
-                          : global->proxymatch_ip;
+    if (server->proxymatch_trie) {
+        config->proxymatch_trie = server->proxymatch_trie;
+        config->proxymatch_ip = server->proxymatch_ip;
+        config->proxymatch_count = server->proxymatch_count;
+    }
+    else {
+        config->proxymatch_trie = global->proxymatch_trie;
+        config->proxymatch_ip = global->proxymatch_ip;
+        config->proxymatch_count = global->proxymatch_count;
+    }
     return config;
 }
 
@@ -121,12 +137,36 @@ static int looks_like_ip(const char *ipstr)
     return (*ipstr == '\0');
 }
 
+static apr_status_t proxymatch_add(cmd_parms *cmd, remoteip_config_t *config,
+                                   char *ip, char *mask)
+{
+    remoteip_proxymatch_t *match;
+    apr_status_t rv;
+
+    match = apr_pcalloc(cmd->pool, sizeof(*match));
+    match->internal = cmd->info;
+    match->order = config->proxymatch_count++;
+
+    rv = ap_iptrie_add(config->proxymatch_trie, ip, mask, match);
+    if (rv != APR_EBADMASK || !mask) {
+        return rv;
+    }
+
+    /* possibly a non-contiguous netmask, which APR still handles */
+    if (!config->proxymatch_ip) {
+        config->proxymatch_ip = apr_array_make(cmd->pool, 1, sizeof(*match));
+    }
+    match = (remoteip_proxymatch_t *) apr_array_push(config->proxymatch_ip);
+    match->internal = cmd->info;
+    match->order = config->proxymatch_count - 1;
+    return apr_ipsubnet_create(&match->ip, ip, mask, cmd->pool);
+}
+
 static const char *proxies_set(cmd_parms *cmd, void *cfg,
                                const char *arg)
 {
     remoteip_config_t *config = ap_get_module_config(cmd->server->module_config,
                                                      &remoteip_module);
-    remoteip_proxymatch_t *match;
     apr_status_t rv;
     char *ip = apr_pstrdup(cmd->temp_pool, arg);
     char *s = ap_strchr(ip, '/');
@@ -134,15 +174,13 @@ static const char *proxies_set(cmd_parms *cmd, void *cfg,
         *s++ = '\0';
     }
 
-    if (!config->proxymatch_ip) {
-        config->proxymatch_ip = apr_array_make(cmd->pool, 1, sizeof(*match));
+    if (!config->proxymatch_trie) {
+        config->proxymatch_trie = ap_iptrie_make(cmd->pool);
     }
-    match = (remoteip_proxymatch_t *) apr_array_push(config->proxymatch_ip);
-    match->internal = cmd->info;
 
     if (looks_like_ip(ip)) {
         /* Note s may be null, that's fine (explicit host) */
-        rv = apr_ipsubnet_create(&match->ip, ip, s, cmd->pool);
+        rv = proxymatch_add(cmd, config, ip, s);
     }
     else
     {
@@ -159,13 +197,10 @@ static const char *proxies_set(cmd_parms *cmd, void *cfg,
         while (rv == APR_SUCCESS)
         {
             apr_sockaddr_ip_get(&ip, temp_sa);
-            rv = apr_ipsubnet_create(&match->ip, ip, NULL, cmd->pool);
+            rv = proxymatch_add(cmd, config, ip, NULL);
             if (!(temp_sa = temp_sa->next)) {
                 break;
             }
-            match = (remoteip_proxymatch_t *)
-                    apr_array_push(config->proxymatch_ip);
-            match->internal = cmd->info;
         }
     }
 
@@ -241,7 +276,7 @@ static int remoteip_modify_request(request_rec *r)
         return DECLINED;
     }
  
-    if (config->proxymatch_ip) {
+    if (config->proxymatch_trie) {
         /* This indicates that a RemoteIPInternalProxy, RemoteIPInternalProxyList, RemoteIPTrustedProxy
            or RemoteIPTrustedProxyList directive is configured.
            In this case, default to internal proxy.
@@ -261,25 +296,38 @@ static int remoteip_modify_request(request_rec *r)
 
         /* verify user agent IP against the trusted proxy list
          */
-        if (config->proxymatch_ip) {
-            int i;
-            remoteip_proxymatch_t *match;
-            match = (remoteip_proxymatch_t *)config->proxymatch_ip->elts;
-            for (i = 0; i < config->proxymatch_ip->nelts; ++i) {
-                if (apr_ipsubnet_test(match[i].ip, temp_sa)) {
-                    if (internal) {
-                        /* Allow an internal proxy to present an external proxy,
-                           but do not allow an external proxy to present an internal proxy.
-                           In this case, the presented internal proxy will be considered external.
-                         */
-                        internal = match[i].internal;
+        if (config->proxymatch_trie) {
+            remoteip_proxymatch_t *match = NULL;
+            void *found;
+
+            if (ap_iptrie_match(config->proxymatch_trie, temp_sa, &found)) {
+                match = found;
+            }
+            if (config->proxymatch_ip) {
+                /* the entry configured first wins, wherever it is held */
+                int i;
+                remoteip_proxymatch_t *ipmatch;
+                ipmatch = (remoteip_proxymatch_t *)config->proxymatch_ip->elts;
+                for (i = 0; i < config->proxymatch_ip->nelts; ++i) {
+                    if (match && ipmatch[i].order > match->order) {
+                        break;
+                    }
+                    if (apr_ipsubnet_test(ipmatch[i].ip, temp_sa)) {
+                        match = &ipmatch[i];
+                        break;
                     }
-                    break;
                 }
             }
-            if (i && i >= config->proxymatch_ip->nelts) {
+            if (!match) {
                 break;
             }
+            if (internal) {
+                /* Allow an internal proxy to present an external proxy,
+                   but do not allow an external proxy to present an internal proxy.
+                   In this case, the presented internal proxy will be considered external.
+                 */
+                internal = match->internal;
+            }
         }
 
         if ((parse_remote = strrchr(remote, ',')) == NULL) {
@@ -81,8 +81,12 @@
  */
 
 #include "apr.h"
+#include "apr_lib.h"
 #include "apr_strings.h"
 #include "apr_strmatch.h"
+#if APR_HAS_THREADS
+#include "apr_thread_mutex.h"
+#endif
 
 #define APR_WANT_STRFUNC
 #include "apr_want.h"
@@ -103,6 +107,49 @@ enum special {
     SPECIAL_REQUEST_PROTOCOL,
     SPECIAL_SERVER_ADDR
 };
+/*
+ * Consecutive entries testing the same header form a run.  As all entries
+ * of a run see the same value, their matches are decided together: every
+ * entry whose pattern or regex contains a literal of at least
+ * SEI_PREFILTER_LEN characters is first checked with a single pass over
+ * the value which looks for all of those literals at once, and only the
+ * entries whose literal was found need to run their regex.
+ */
+#define SEI_RUN_MIN         4       /* shorter runs are matched one by one */
+#define SEI_PREFILTER_LEN   3
+#define SEI_BUCKETS         1024    /* power of 2 */
+#define SEI_LRU_SIZE        16      /* values remembered per run */
+#define SEI_LRU_MAXLEN      256     /* longer values are not remembered */
+
+#define SEI_HASH(s) \
+    (((apr_tolower((s)[0]) << 10) ^ (apr_tolower((s)[1]) << 5) \
+      ^ apr_tolower((s)[2])) & (SEI_BUCKETS - 1))
+
+typedef struct sei_literal {
+    const char *str;
+    apr_size_t len;
+    int idx;                        /* index of the entry in the run */
+    struct sei_literal *next;
+} sei_literal;
+
+typedef struct {
+    char value[SEI_LRU_MAXLEN];
+    apr_size_t len;                 /* 0 for an unused slot */
+    apr_uint32_t used;
+    unsigned char *matched;
+} sei_lru_slot;
+
+typedef struct {
+    int nelts;                      /* number of entries in the run */
+    sei_literal **buckets;          /* prefilter literals by SEI_HASH */
+    sei_lru_slot *lru;              /* per-child memo, NULL in .htaccess */
+    int lru_cap;                    /* entries the memo has room for */
+    apr_uint32_t clock;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lru_mutex;  /* protects lru and clock */
+#endif
+} sei_run;
+
 typedef struct {
     char *name;                 /* header name */
     ap_regex_t *pnamereg;       /* compiled header name regex */
@@ -113,6 +160,9 @@ typedef struct {
     apr_table_t *features;      /* env vars to set (or unset) */
     enum special special_type;  /* is it a "special" header ? */
     int icase;                  /* ignoring case? */
+    sei_run *run;               /* run this entry belongs to */
+    int run_idx;                /* index of this entry in the run */
+    int prefiltered;            /* literal added to the run's prefilter */
 } sei_entry;
 
 typedef struct {
@@ -246,6 +296,193 @@ static const char *non_regex_pattern(apr_pool_t *p, const char *s)
     }
 }
 
+/* Return the longest literal which any string matching the regex must
+ * contain, or NULL if none could be determined.  This errs on the side
+ * of returning NULL: alternations, groups, inline options and escapes
+ * other than of punctuation characters are not analysed, and characters
+ * under a quantifier which allows zero repetitions are never included.
+ */
+static const char *required_literal(apr_pool_t *p, const char *regex)
+{
+    const char *src = regex, *best = NULL;
+    apr_size_t best_len = 0, len = 0;
+    char *cur = apr_palloc(p, strlen(regex) + 1);
+    int depth = 0;
+
+    if (ap_strchr_c(regex, '|') || strstr(regex, "(?")) {
+        return NULL;
+    }
+
+#define END_LITERAL() \
+    do { if (len > best_len) { best = apr_pstrmemdup(p, cur, len); \
+                               best_len = len; } \
+         len = 0; } while (0)
+
+    while (*src) {
+        char c = *src++;
+
+        switch (c) {
+        case '(':
+            depth++;
+            END_LITERAL();
+            break;
+        case ')':
+            if (depth) {
+                depth--;
+            }
+            END_LITERAL();
+            break;
+        case '[':
+            END_LITERAL();
+            /* skip the class, "]" is literal right after "[" or "[^" */
+            if (*src == '^') {
+                src++;
+            }
+            if (*src == ']') {
+                src++;
+            }
+            while (*src && *src != ']') {
+                if (*src == '[' && (src[1] == ':' || src[1] == '.'
+                                    || src[1] == '=')) {
+                    /* [:class:], [.coll.] or [=equiv=], ']' included */
+                    const char *end = strchr(src + 2, src[1]);
+
+                    while (end && end[1] != ']') {
+                        end = strchr(end + 1, src[1]);
+                    }
+                    if (!end) {
+                        return NULL;
+                    }
+                    src = end + 2;
+                    continue;
+                }
+                if (*src == '\\' && src[1]) {
+                    src++;
+                }
+                src++;
+            }
+            if (*src) {
+                src++;
+            }
+            break;
+        case '{':
+            END_LITERAL();
+            while (*src && *src++ != '}')
+                ;
+            break;
+        case '?':
+        case '*':
+        case '+':
+        case '.':
+        case '^':
+        case '$':
+            END_LITERAL();
+            break;
+        default:
+            if (c == '\\') {
+                if (!apr_ispunct(*src)) {
+                    /* a character class, anchor, back reference or an
+                     * escape such as \x20, \0nn or \cX, which may span
+                     * several characters; don't guess at any of them
+                     */
+                    return NULL;
+                }
+                c = *src++;
+            }
+            if (depth) {
+                break;
+            }
+            if (*src == '?' || *src == '*' || *src == '{') {
+                /* may be absent */
+                END_LITERAL();
+            }
+            else if (*src == '+') {
+                /* present, but may be followed by itself */
+                cur[len++] = c;
+                END_LITERAL();
+            }
+            else {
+                cur[len++] = c;
+            }
+            break;
+        }
+    }
+    END_LITERAL();
+#undef END_LITERAL
+
+    return best;
+}
+
+static void add_to_run(cmd_parms *cmd, sei_cfg_rec *sconf, sei_entry *new,
+                       const char *literal)
+{
+    sei_entry *prev = NULL;
+    sei_run *run;
+
+    if (sconf->conditionals->nelts > 1) {
+        prev = &((sei_entry *)sconf->conditionals->elts)
+                                            [sconf->conditionals->nelts - 2];
+    }
+    if (prev && !prev->expr && prev->name == new->name && prev->run) {
+        run = prev->run;
+    }
+    else {
+        run = apr_pcalloc(cmd->pool, sizeof(*run));
+    }
+    new->run = run;
+    new->run_idx = run->nelts++;
+    new->prefiltered = 0;
+
+    if (literal && strlen(literal) >= SEI_PREFILTER_LEN) {
+        sei_literal *lit = apr_palloc(cmd->pool, sizeof(*lit));
+        unsigned int hash = SEI_HASH(literal);
+
+        if (!run->buckets) {
+            run->buckets = apr_pcalloc(cmd->pool,
+                                       SEI_BUCKETS * sizeof(*run->buckets));
+        }
+        lit->str = literal;
+        lit->len = strlen(literal);
+        lit->idx = new->run_idx;
+        lit->next = run->buckets[hash];
+        run->buckets[hash] = lit;
+        new->prefiltered = 1;
+    }
+}
+
+/* Give every run that has become long enough a memo of recent results,
+ * unless it only lives for the request (.htaccess).
+ */
+static void setup_run_lru(cmd_parms *cmd, sei_run *run)
+{
+    int i;
+
+    if (run->nelts < SEI_RUN_MIN || run->nelts <= run->lru_cap
+        || cmd->pool != cmd->server->process->pconf) {
+        return;
+    }
+    if (!run->lru) {
+#if APR_HAS_THREADS
+        /* each run has its own lock, which the children inherit unlocked */
+        apr_status_t rv = apr_thread_mutex_create(&run->lru_mutex,
+                                                  APR_THREAD_MUTEX_DEFAULT,
+                                                  cmd->pool);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, cmd->server,
+                         APLOGNO(02830) "could not create mutex, results "
+                         "will not be cached");
+            return;
+        }
+#endif
+        run->lru = apr_pcalloc(cmd->pool, SEI_LRU_SIZE * sizeof(*run->lru));
+    }
+    /* grow the result arrays by doubling as the run gets longer */
+    run->lru_cap = run->lru_cap ? run->lru_cap * 2 : SEI_RUN_MIN * 4;
+    for (i = 0; i < SEI_LRU_SIZE; i++) {
+        run->lru[i].matched = apr_palloc(cmd->pool, run->lru_cap);
+    }
+}
+
 static const char *add_envvars(cmd_parms *cmd, const char *args, sei_entry *new)
 {
     const char *feature;
@@ -287,6 +524,7 @@ static const char *add_setenvif_core(cmd_parms *cmd, void *mconfig,
     sei_cfg_rec *sconf;
     sei_entry *new;
     sei_entry *entries;
+    const char *literal;
     int i;
     int icase;
 
@@ -343,6 +581,7 @@ static const char *add_setenvif_core(cmd_parms *cmd, void *mconfig,
                                    " pattern could not be compiled.", NULL);
             }
             new->preg = NULL;
+            literal = simple_pattern;
         }
         else {
             new->preg = ap_pregcomp(cmd->pool, regex,
@@ -352,8 +591,12 @@ static const char *add_setenvif_core(cmd_parms *cmd, void *mconfig,
                                    " regex could not be compiled.", NULL);
             }
             new->pattern = NULL;
+            literal = required_literal(cmd->pool, regex);
         }
+        new->expr = NULL;
         new->features = apr_table_make(cmd->pool, 2);
+        add_to_run(cmd, sconf, new, literal);
+        setup_run_lru(cmd, new->run);
 
         if (!strcasecmp(fname, "remote_addr")) {
             new->special_type = SPECIAL_REMOTE_ADDR;
@@ -445,6 +688,7 @@ static const char *add_setenvifexpr(cmd_parms *cmd, void *mconfig,
     new->regex = NULL;
     new->pattern = NULL;
     new->preg = NULL;
+    new->run = NULL;
     new->expr = ap_expr_parse_cmd(cmd, expr, 0, &err, NULL);
     if (err)
         return apr_psprintf(cmd->pool, "Could not parse expression \"%s\": %s",
@@ -479,6 +723,88 @@ static const command_rec setenvif_module_cmds[] =
     { NULL },
 };
 
+/*
+ * Decide which entries of the run starting at entries[0] match the value,
+ * returning an array with one flag per entry.
+ */
+static const unsigned char *match_run(request_rec *r, const sei_entry *entries,
+                                      const char *val, apr_size_t val_len)
+{
+    sei_run *run = entries[0].run;
+    unsigned char *matched = apr_pcalloc(r->pool, run->nelts);
+    unsigned char *found;
+    apr_size_t pos;
+    int i;
+
+    if (run->lru && val_len < SEI_LRU_MAXLEN) {
+        int hit = 0;
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(run->lru_mutex);
+#endif
+        for (i = 0; i < SEI_LRU_SIZE; i++) {
+            sei_lru_slot *slot = &run->lru[i];
+            if (slot->len == val_len + 1
+                && !memcmp(slot->value, val, val_len)) {
+                memcpy(matched, slot->matched, run->nelts);
+                slot->used = ++run->clock;
+                hit = 1;
+                break;
+            }
+        }
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(run->lru_mutex);
+#endif
+        if (hit) {
+            return matched;
+        }
+    }
+
+    /* one pass over the value for the literals of all entries */
+    found = apr_pcalloc(r->pool, run->nelts);
+    if (run->buckets) {
+        for (pos = 0; pos + SEI_PREFILTER_LEN <= val_len; pos++) {
+            const sei_literal *lit = run->buckets[SEI_HASH(val + pos)];
+            for (; lit; lit = lit->next) {
+                if (!found[lit->idx] && lit->len <= val_len - pos
+                    && !strncasecmp(val + pos, lit->str, lit->len)) {
+                    found[lit->idx] = 1;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < run->nelts; i++) {
+        const sei_entry *b = &entries[i];
+
+        if (b->prefiltered && !found[i]) {
+            continue;
+        }
+        matched[i] = (b->pattern && apr_strmatch(b->pattern, val, val_len))
+                     || (b->preg && !ap_regexec(b->preg, val, 0, NULL, 0));
+    }
+
+    if (run->lru && val_len < SEI_LRU_MAXLEN) {
+        sei_lru_slot *slot = &run->lru[0];
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(run->lru_mutex);
+#endif
+        for (i = 1; i < SEI_LRU_SIZE && slot->len; i++) {
+            if (!run->lru[i].len || run->lru[i].used < slot->used) {
+                slot = &run->lru[i];
+            }
+        }
+        memcpy(slot->value, val, val_len);
+        slot->len = val_len + 1;
+        memcpy(slot->matched, matched, run->nelts);
+        slot->used = ++run->clock;
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(run->lru_mutex);
+#endif
+    }
+
+    return matched;
+}
+
 /*
  * This routine gets called at two different points in request processing:
  * once before the URI has been translated (during the post-read-request
@@ -495,8 +821,9 @@ static int match_headers(request_rec *r)
     const apr_table_entry_t *elts;
     const char *val, *err;
     apr_size_t val_len = 0;
-    int i, j;
+    int i, j, match;
     char *last_name;
+    const unsigned char *run_matched = NULL;
     ap_regmatch_t regm[AP_MAX_REG_MATCH];
 
     if (!ap_get_module_config(r->request_config, &setenvif_module)) {
@@ -586,9 +913,22 @@ static int match_headers(request_rec *r)
             val_len = 0;
         }
 
-        if ((b->pattern && apr_strmatch(b->pattern, val, val_len)) ||
-            (b->preg && !ap_regexec(b->preg, val, AP_MAX_REG_MATCH, regm, 0)) ||
-            (b->expr && ap_expr_exec_re(r, b->expr, AP_MAX_REG_MATCH, regm, &val, &err) > 0))
+        if (b->run && b->run->nelts >= SEI_RUN_MIN) {
+            if (b->run_idx == 0) {
+                run_matched = match_run(r, b, val, val_len);
+            }
+            /* regex matches are run again for the back-references */
+            match = run_matched[b->run_idx]
+                    && (b->pattern
+                        || !ap_regexec(b->preg, val, AP_MAX_REG_MATCH, regm, 0));
+        }
+        else {
+            match = (b->pattern && apr_strmatch(b->pattern, val, val_len)) ||
+                    (b->preg && !ap_regexec(b->preg, val, AP_MAX_REG_MATCH, regm, 0)) ||
+                    (b->expr && ap_expr_exec_re(r, b->expr, AP_MAX_REG_MATCH, regm, &val, &err) > 0);
+        }
+
+        if (match)
         {
             const apr_array_header_t *arr = apr_table_elts(b->features);
             elts = (const apr_table_entry_t *) arr->elts;
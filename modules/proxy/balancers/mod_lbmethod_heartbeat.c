@@ -18,6 +18,7 @@
 #include "scoreboard.h"
 #include "ap_mpm.h"
 #include "apr_version.h"
+#include "apr_atomic.h"
 #include "ap_hooks.h"
 #include "ap_slotmem.h"
 #include "heartbeat.h"
@@ -36,6 +37,22 @@ static int (*ap_proxy_retry_worker_fn)(const char *proxy_function,
 
 static const ap_slotmem_provider_t *storage = NULL;
 static ap_slotmem_instance_t *hm_serversmem = NULL;
+static ap_slotmem_instance_t *hm_snapmem = NULL;
+static hm_snapshot_t *hm_snapshot = NULL;
+
+/* Keeps the reads of the snapshot's table between the two reads of its
+ * generation; apr_atomic_read32() is a plain load, which the compiler and
+ * the CPU may reorder with the others.
+ */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#define hb_read_barrier() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#elif defined(__GNUC__)
+#define hb_read_barrier() __sync_synchronize()
+#else
+static apr_uint32_t hb_barrier;
+/* a locked read-modify-write, which APR implements with a full barrier */
+#define hb_read_barrier() ((void)apr_atomic_add32(&hb_barrier, 0))
+#endif
 
 /*
  * configuration structure
@@ -256,6 +273,106 @@ static apr_status_t read_heartbeats(const char *path, apr_hash_t *servers,
     return rv;
 }
 
+/* binary search of the (sorted) snapshot table */
+static const hm_snapshot_server_t *snapshot_find(
+    const hm_snapshot_server_t *table, unsigned int num, const char *ip)
+{
+    unsigned int lo = 0, hi = num;
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        int cmp = strncmp(ip, table[mid].ip, MAXIPSIZE);
+
+        if (cmp == 0) {
+            return &table[mid];
+        }
+        if (cmp < 0) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Select a worker from the snapshot published by mod_heartmonitor,
+ * without reading the heartbeats or allocating anything.  Each usable
+ * worker is chosen with a probability proportional to its ready count,
+ * in a single pass (weighted reservoir sampling).
+ */
+static proxy_worker *find_best_hb_snapshot(proxy_balancer *balancer,
+                                           request_rec *r)
+{
+    apr_time_t now = apr_time_now();
+    proxy_worker *mycandidate = NULL;
+    int i, tries;
+
+    /* the table of a generation is only rewritten two updates later,
+     * retrying is rarely needed */
+    for (tries = 0; tries < 3; tries++) {
+        apr_uint32_t gen = apr_atomic_read32(&hm_snapshot->generation);
+        const hm_snapshot_server_t *table;
+        unsigned int num;
+        apr_uint32_t openslots = 0;
+
+        hb_read_barrier();
+        table = HM_SNAPSHOT_TABLE(hm_snapshot, gen);
+        num = hm_snapshot->num[gen & 1];
+
+        if (num > hm_snapshot->max) {
+            continue;
+        }
+        mycandidate = NULL;
+
+        for (i = 0; i < balancer->workers->nelts; i++) {
+            proxy_worker *worker = APR_ARRAY_IDX(balancer->workers, i,
+                                                 proxy_worker *);
+            const hm_snapshot_server_t *server;
+            int ready;
+
+            server = snapshot_find(table, num, worker->s->hostname);
+            if (!server) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02873)
+                              "lb_heartbeat: No server for worker %s",
+                              worker->s->name);
+                continue;
+            }
+
+            if (!PROXY_WORKER_IS_USABLE(worker)) {
+                ap_proxy_retry_worker_fn("BALANCER", worker, r->server);
+            }
+            if (!PROXY_WORKER_IS_USABLE(worker)
+                || apr_time_sec(now - server->seen)
+                   >= LBM_HEARTBEAT_MAX_LASTSEEN) {
+                continue;
+            }
+
+            ready = server->ready;
+            if (server->busy == 0 && ready != 0) {
+                /* likely just started up, see readfile_heartbeats() */
+                ready = ready / 4;
+            }
+            if (ready <= 0) {
+                continue;
+            }
+
+            openslots += ready;
+            if (ap_random_pick(1, openslots) <= (apr_uint32_t)ready) {
+                mycandidate = worker;
+            }
+        }
+
+        hb_read_barrier();
+        if (apr_atomic_read32(&hm_snapshot->generation) == gen) {
+            break;
+        }
+    }
+
+    return mycandidate;
+}
+
 static proxy_worker *find_best_hb(proxy_balancer *balancer,
                                   request_rec *r)
 {
@@ -282,6 +399,11 @@ static proxy_worker *find_best_hb(proxy_balancer *balancer,
         }
     }
 
+    /* nothing published yet, read the servers' state instead */
+    if (hm_snapshot && apr_atomic_read32(&hm_snapshot->generation)) {
+        return find_best_hb_snapshot(balancer, r);
+    }
+
     apr_pool_create(&tpool, r->pool);
 
     servers = apr_hash_make(tpool);
@@ -373,6 +495,8 @@ static int lb_hb_init(apr_pool_t *p, apr_pool_t *plog,
     if (ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_CREATE_PRE_CONFIG)
         return OK;
 
+    hm_snapshot = NULL;
+
     storage = ap_lookup_provider(AP_SLOTMEM_PROVIDER_GROUP, "shm",
                                  AP_SLOTMEM_PROVIDER_VERSION);
     if (!storage) {
@@ -383,6 +507,20 @@ static int lb_hb_init(apr_pool_t *p, apr_pool_t *plog,
         return OK;
     }
 
+    /* Prefer the snapshot published by mod_heartmonitor */
+    storage->attach(&hm_snapmem, HM_SNAPSHOT_SLOTMEM, &size, &num, p);
+    if (hm_snapmem
+        && storage->dptr(hm_snapmem, 0, (void **)&hm_snapshot) == APR_SUCCESS
+        && size != HM_SNAPSHOT_SIZE(hm_snapshot->max)) {
+        hm_snapshot = NULL;
+    }
+    if (hm_snapshot) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, APLOGNO(02843)
+                     "Using the snapshot from mod_heartmonitor");
+        ctx->path = "(slotmem)";
+        return OK;
+    }
+
     /* Try to use a slotmem created by mod_heartmonitor */
     storage->attach(&hm_serversmem, "mod_heartmonitor", &size, &num, p);
     if (!hm_serversmem)
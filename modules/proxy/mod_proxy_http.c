@@ -18,6 +18,7 @@
 
 #include "mod_proxy.h"
 #include "ap_regex.h"
+#include "util_headers.h"
 
 module AP_MODULE_DECLARE_DATA proxy_http_module;
 
@@ -1032,36 +1033,23 @@ static request_rec *make_fake_req(conn_rec *c, request_rec *r)
 static void process_proxy_header(request_rec *r, proxy_dir_conf *c,
                                  const char *key, const char *value)
 {
-    static const char *date_hdrs[]
-        = { "Date", "Expires", "Last-Modified", NULL };
-    static const struct {
-        const char *name;
-        ap_proxy_header_reverse_map_fn func;
-    } transform_hdrs[] = {
-        { "Location", ap_proxy_location_reverse_map },
-        { "Content-Location", ap_proxy_location_reverse_map },
-        { "URI", ap_proxy_location_reverse_map },
-        { "Destination", ap_proxy_location_reverse_map },
-        { "Set-Cookie", ap_proxy_cookie_reverse_map },
-        { NULL, NULL }
-    };
-    int i;
-    for (i = 0; date_hdrs[i]; ++i) {
-        if (!strcasecmp(date_hdrs[i], key)) {
-            apr_table_add(r->headers_out, key,
-                          date_canon(r->pool, value));
-            return;
-        }
-    }
-    for (i = 0; transform_hdrs[i].name; ++i) {
-        if (!strcasecmp(transform_hdrs[i].name, key)) {
-            apr_table_add(r->headers_out, key,
-                          (*transform_hdrs[i].func)(r, c, value));
-            return;
-       }
+    switch (ap_header_id(key)) {
+    case AP_HEADER_DATE:
+    case AP_HEADER_EXPIRES:
+    case AP_HEADER_LAST_MODIFIED:
+        value = date_canon(r->pool, value);
+        break;
+    case AP_HEADER_LOCATION:
+    case AP_HEADER_CONTENT_LOCATION:
+    case AP_HEADER_URI:
+    case AP_HEADER_DESTINATION:
+        value = ap_proxy_location_reverse_map(r, c, value);
+        break;
+    case AP_HEADER_SET_COOKIE:
+        value = ap_proxy_cookie_reverse_map(r, c, value);
+        break;
     }
     apr_table_add(r->headers_out, key, value);
-    return;
 }
 
 /*
@@ -1245,9 +1233,12 @@ int ap_proxy_http_process_response(apr_pool_t * p, request_rec *r,
     int pread_len = 0;
     apr_table_t *save_table;
     int backend_broke = 0;
-    static const char *hop_by_hop_hdrs[] =
-        {"Keep-Alive", "Proxy-Authenticate", "TE", "Trailer", "Upgrade", NULL};
-    int i;
+    static const ap_header_set_t hop_by_hop_hdrs =
+        AP_HEADER_BIT(AP_HEADER_KEEP_ALIVE)
+        | AP_HEADER_BIT(AP_HEADER_PROXY_AUTHENTICATE)
+        | AP_HEADER_BIT(AP_HEADER_TE)
+        | AP_HEADER_BIT(AP_HEADER_TRAILER)
+        | AP_HEADER_BIT(AP_HEADER_UPGRADE);
     const char *te = NULL;
     int original_status = r->status;
     int proxy_status = OK;
@@ -1494,9 +1485,7 @@ int ap_proxy_http_process_response(apr_pool_t * p, request_rec *r,
             }
 
             /* Clear hop-by-hop headers */
-            for (i=0; hop_by_hop_hdrs[i]; ++i) {
-                apr_table_unset(r->headers_out, hop_by_hop_hdrs[i]);
-            }
+            ap_headers_strip(r->headers_out, hop_by_hop_hdrs);
 
             /* Delete warnings with wrong date */
             r->headers_out = ap_proxy_clean_warnings(p, r->headers_out);
@@ -23,6 +23,8 @@
 #include "proxy_util.h"
 #include "ajp.h"
 #include "scgi.h"
+#include "ap_usdt.h"
+#include "util_headers.h"
 
 #if APR_HAVE_UNISTD_H
 #include <unistd.h>         /* for getpid() */
@@ -2174,6 +2176,8 @@ PROXY_DECLARE(int) ap_proxy_acquire_connection(const char *proxy_function,
 {
     apr_status_t rv;
 
+    AP_USDT_PROBE2(proxy__acquire__entry, worker->s->name, worker);
+
     if (!PROXY_WORKER_IS_USABLE(worker)) {
         /* Retry the worker */
         ap_proxy_retry_worker(proxy_function, worker, s);
@@ -2182,6 +2186,8 @@ PROXY_DECLARE(int) ap_proxy_acquire_connection(const char *proxy_function,
             ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(00940)
                          "%s: disabled connection for (%s)",
                          proxy_function, worker->s->hostname);
+            AP_USDT_PROBE3(proxy__acquire__return, worker->s->name, NULL,
+                           HTTP_SERVICE_UNAVAILABLE);
             return HTTP_SERVICE_UNAVAILABLE;
         }
     }
@@ -2205,6 +2211,8 @@ PROXY_DECLARE(int) ap_proxy_acquire_connection(const char *proxy_function,
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(00941)
                      "%s: failed to acquire connection for (%s)",
                      proxy_function, worker->s->hostname);
+        AP_USDT_PROBE3(proxy__acquire__return, worker->s->name, NULL,
+                       HTTP_SERVICE_UNAVAILABLE);
         return HTTP_SERVICE_UNAVAILABLE;
     }
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00942)
@@ -2215,6 +2223,7 @@ PROXY_DECLARE(int) ap_proxy_acquire_connection(const char *proxy_function,
     (*conn)->close  = 0;
     (*conn)->inreslist = 0;
 
+    AP_USDT_PROBE3(proxy__acquire__return, worker->s->name, *conn, OK);
     return OK;
 }
 
@@ -2225,6 +2234,7 @@ PROXY_DECLARE(int) ap_proxy_release_connection(const char *proxy_function,
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00943)
                 "%s: has released connection for (%s)",
                 proxy_function, conn->worker->s->hostname);
+    AP_USDT_PROBE2(proxy__release, conn->worker->s->name, conn);
     connection_cleanup(conn);
 
     return OK;
@@ -2704,6 +2714,9 @@ PROXY_DECLARE(int) ap_proxy_connect_backend(const char *proxy_function,
     proxy_server_conf *conf =
         (proxy_server_conf *) ap_get_module_config(sconf, &proxy_module);
 
+    AP_USDT_PROBE3(proxy__connect__entry, worker->s->name, conn,
+                   conn->sock != NULL);
+
     if (conn->sock) {
         if (!(connected = ap_proxy_is_socket_connected(conn->sock))) {
             socket_cleanup(conn);
@@ -2913,6 +2926,7 @@ PROXY_DECLARE(int) ap_proxy_connect_backend(const char *proxy_function,
         worker->s->error_time = 0;
         worker->s->retries = 0;
     }
+    AP_USDT_PROBE3(proxy__connect__return, worker->s->name, conn, connected);
     return connected ? OK : DECLINED;
 }
 
@@ -3325,6 +3339,7 @@ PROXY_DECLARE(int) ap_proxy_create_hdrbrgd(apr_pool_t *p,
     const apr_array_header_t *headers_in_array;
     const apr_table_entry_t *headers_in;
     apr_table_t *saved_headers_in;
+    ap_headers_t *headers;
     apr_bucket *e;
     int do_100_continue;
     conn_rec *origin = p_conn->connection;
@@ -3405,8 +3420,10 @@ PROXY_DECLARE(int) ap_proxy_create_hdrbrgd(apr_pool_t *p,
      * we will apply proxy purpose only modifications (eg. clearing hop-by-hop
      * headers, add Via or X-Forwarded-* or Expect...), whereas the originals
      * will be needed later to prepare the correct response and logging.
+     * The copy is always made, the fixups and ap_proxy_clear_connection()
+     * below change it anyway; it is indexed for the lookups made here.
      *
-     * Note: We need to take r->pool for apr_table_copy as the key / value
+     * Note: We need to take r->pool for the copy as the key / value
      * pairs in r->headers_in have been created out of r->pool and
      * p might be (and actually is) a longer living pool.
      * This would trigger the bad pool ancestry abort in apr_table_copy if
@@ -3414,11 +3431,14 @@ PROXY_DECLARE(int) ap_proxy_create_hdrbrgd(apr_pool_t *p,
      */
     saved_headers_in = r->headers_in;
     r->headers_in = apr_table_copy(r->pool, saved_headers_in);
+    headers = ap_headers_make(r->pool, r->headers_in);
 
     /* handle Via */
     if (conf->viaopt == via_block) {
         /* Block all outgoing Via: headers */
-        apr_table_unset(r->headers_in, "Via");
+        if (ap_headers_get_id(headers, AP_HEADER_VIA)) {
+            ap_headers_unset(headers, "Via");
+        }
     } else if (conf->viaopt != via_off) {
         const char *server_name = ap_get_server_name(r);
         /* If USE_CANONICAL_NAME_OFF was configured for the proxy virtual host,
@@ -3430,7 +3450,7 @@ PROXY_DECLARE(int) ap_proxy_create_hdrbrgd(apr_pool_t *p,
             server_name = r->server->server_hostname;
         /* Create a "Via:" request header entry and merge it */
         /* Generate outgoing Via: header with/without server comment: */
-        apr_table_mergen(r->headers_in, "Via",
+        ap_headers_mergen(headers, "Via",
                          (conf->viaopt == via_full)
                          ? apr_psprintf(p, "%d.%d %s%s (%s)",
                                         HTTP_VERSION_MAJOR(r->proto_num),
@@ -3459,10 +3479,10 @@ PROXY_DECLARE(int) ap_proxy_create_hdrbrgd(apr_pool_t *p,
         }
 
         /* Add the Expect header if not already there. */
-        if (((val = apr_table_get(r->headers_in, "Expect")) == NULL)
+        if (((val = ap_headers_get_id(headers, AP_HEADER_EXPECT)) == NULL)
                 || (strcasecmp(val, "100-Continue") != 0 /* fast path */
                     && !ap_find_token(r->pool, val, "100-Continue"))) {
-            apr_table_mergen(r->headers_in, "Expect", "100-Continue");
+            ap_headers_mergen(headers, "Expect", "100-Continue");
         }
     }
 
@@ -3493,22 +3513,22 @@ PROXY_DECLARE(int) ap_proxy_create_hdrbrgd(apr_pool_t *p,
             /* Add X-Forwarded-For: so that the upstream has a chance to
              * determine, where the original request came from.
              */
-            apr_table_mergen(r->headers_in, "X-Forwarded-For",
-                             r->useragent_ip);
+            ap_headers_mergen(headers, "X-Forwarded-For",
+                              r->useragent_ip);
 
             /* Add X-Forwarded-Host: so that upstream knows what the
              * original request hostname was.
              */
-            if ((buf = apr_table_get(r->headers_in, "Host"))) {
-                apr_table_mergen(r->headers_in, "X-Forwarded-Host", buf);
+            if ((buf = ap_headers_get_id(headers, AP_HEADER_HOST))) {
+                ap_headers_mergen(headers, "X-Forwarded-Host", buf);
             }
 
             /* Add X-Forwarded-Server: so that upstream knows what the
              * name of this proxy server is (if there are more than one)
              * XXX: This duplicates Via: - do we strictly need it?
              */
-            apr_table_mergen(r->headers_in, "X-Forwarded-Server",
-                             r->server->server_hostname);
+            ap_headers_mergen(headers, "X-Forwarded-Server",
+                              r->server->server_hostname);
         }
     }
 
@@ -3522,55 +3542,54 @@ PROXY_DECLARE(int) ap_proxy_create_hdrbrgd(apr_pool_t *p,
     headers_in = (const apr_table_entry_t *) headers_in_array->elts;
     for (counter = 0; counter < headers_in_array->nelts; counter++) {
         if (headers_in[counter].key == NULL
-            || headers_in[counter].val == NULL
-
-            /* Already sent */
-            || !strcasecmp(headers_in[counter].key, "Host")
-
-            /* Clear out hop-by-hop request headers not to send
-             * RFC2616 13.5.1 says we should strip these headers
-             */
-            || !strcasecmp(headers_in[counter].key, "Keep-Alive")
-            || !strcasecmp(headers_in[counter].key, "TE")
-            || !strcasecmp(headers_in[counter].key, "Trailer")
-            || !strcasecmp(headers_in[counter].key, "Upgrade")
-
-            ) {
+            || headers_in[counter].val == NULL) {
             continue;
         }
+
+        switch (ap_header_id(headers_in[counter].key)) {
+        /* Already sent */
+        case AP_HEADER_HOST:
+        /* Clear out hop-by-hop request headers not to send
+         * RFC2616 13.5.1 says we should strip these headers
+         */
+        case AP_HEADER_KEEP_ALIVE:
+        case AP_HEADER_TE:
+        case AP_HEADER_TRAILER:
+        case AP_HEADER_UPGRADE:
+            continue;
+
         /* Do we want to strip Proxy-Authorization ?
          * If we haven't used it, then NO
          * If we have used it then MAYBE: RFC2616 says we MAY propagate it.
          * So let's make it configurable by env.
          */
-        if (!strcasecmp(headers_in[counter].key,"Proxy-Authorization")) {
+        case AP_HEADER_PROXY_AUTHORIZATION:
             if (r->user != NULL) { /* we've authenticated */
                 if (!apr_table_get(r->subprocess_env, "Proxy-Chain-Auth")) {
                     continue;
                 }
             }
-        }
+            break;
 
         /* Skip Transfer-Encoding and Content-Length for now.
          */
-        if (!strcasecmp(headers_in[counter].key, "Transfer-Encoding")) {
+        case AP_HEADER_TRANSFER_ENCODING:
             *old_te_val = headers_in[counter].val;
             continue;
-        }
-        if (!strcasecmp(headers_in[counter].key, "Content-Length")) {
+        case AP_HEADER_CONTENT_LENGTH:
             *old_cl_val = headers_in[counter].val;
             continue;
-        }
 
         /* for sub-requests, ignore freshness/expiry headers */
-        if (r->main) {
-            if (   !strcasecmp(headers_in[counter].key, "If-Match")
-                || !strcasecmp(headers_in[counter].key, "If-Modified-Since")
-                || !strcasecmp(headers_in[counter].key, "If-Range")
-                || !strcasecmp(headers_in[counter].key, "If-Unmodified-Since")
-                || !strcasecmp(headers_in[counter].key, "If-None-Match")) {
+        case AP_HEADER_IF_MATCH:
+        case AP_HEADER_IF_MODIFIED_SINCE:
+        case AP_HEADER_IF_RANGE:
+        case AP_HEADER_IF_UNMODIFIED_SINCE:
+        case AP_HEADER_IF_NONE_MATCH:
+            if (r->main) {
                 continue;
             }
+            break;
         }
 
         buf = apr_pstrcat(p, headers_in[counter].key, ": ",
@@ -18,7 +18,10 @@
 #include "apu_version.h"
 #include "apr_base64.h"                /* for apr_base64_decode et al */
 #include "apr_lib.h"
+#include "apr_sha1.h"
 #include "apr_strings.h"
+#include "apr_thread_mutex.h"
+#include "apr_uuid.h"
 #include "http_log.h"
 #include "http_core.h"
 
@@ -36,6 +39,22 @@
 
 #define CRYPTO_KEY "session_crypto_context"
 
+/* sessions are written as this prefix and the base64 encoded envelope */
+#define SESSION_CRYPTO_PREFIX "v2:"
+#define SESSION_CRYPTO_PREFIX_LEN 3
+
+/* length of the key id in the envelope */
+#define SESSION_CRYPTO_KID_LEN 4
+
+/* length of the key of the HMAC-SHA1 ending the envelope, and of the HMAC */
+#define SESSION_CRYPTO_MAC_KEY_LEN 32
+#define SESSION_CRYPTO_MAC_LEN APR_SHA1_DIGESTSIZE
+
+/* number of keys derived from foreign salts that each child keeps */
+#ifndef SESSION_CRYPTO_FOREIGN_KEYS
+#define SESSION_CRYPTO_FOREIGN_KEYS 32
+#endif
+
 module AP_MODULE_DECLARE_DATA session_crypto_module;
 
 /**
@@ -115,24 +134,343 @@ static apr_status_t crypt_init(request_rec *r,
 }
 
 /**
- * Encrypt the string given as per the current config.
+ * A key derived from a passphrase and a salt, shared by the threads of
+ * a child process.
+ */
+typedef struct session_crypto_key {
+    apr_pool_t *pool;
+    const char *id;                     /* salt, cipher and passphrase */
+    apr_size_t idlen;
+    const apr_crypto_key_t *key;
+    apr_size_t ivSize;
+    unsigned char kid[SESSION_CRYPTO_KID_LEN];
+    unsigned char mackey[SESSION_CRYPTO_MAC_KEY_LEN];
+    int refs;
+    int evicted;
+} session_crypto_key;
+
+/* the salt of the keys used for encryption, kept across restarts */
+static apr_uuid_t *server_salt;
+
+/* keys derived in this child, keyed by id */
+static apr_hash_t *key_cache;
+static apr_pool_t *key_cache_pool;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *key_cache_mutex;
+#endif
+
+/* keys derived from the salts of other servers or earlier runs, which are
+ * evicted in turn so that forged envelopes cannot grow the cache
+ */
+static session_crypto_key *foreign_keys[SESSION_CRYPTO_FOREIGN_KEYS];
+static int foreign_keys_next;
+
+static void key_cache_lock(void)
+{
+#if APR_HAS_THREADS
+    if (key_cache_mutex) {
+        apr_thread_mutex_lock(key_cache_mutex);
+    }
+#endif
+}
+
+static void key_cache_unlock(void)
+{
+#if APR_HAS_THREADS
+    if (key_cache_mutex) {
+        apr_thread_mutex_unlock(key_cache_mutex);
+    }
+#endif
+}
+
+/**
+ * Encrypt the block given with a zero iv, and copy the start of the
+ * result to out.
  *
  * Returns APR_SUCCESS if successful.
  */
-static apr_status_t encrypt_string(request_rec * r, const apr_crypto_t *f,
-        session_crypto_dir_conf *dconf, const char *in, char **out)
+static apr_status_t encrypt_constant(const apr_crypto_key_t *key,
+        apr_size_t ivSize, const unsigned char *in, apr_size_t inlen,
+        unsigned char *out, apr_size_t outlen, apr_pool_t *p)
+{
+    apr_status_t res;
+    apr_crypto_block_t *block = NULL;
+    const unsigned char *iv = apr_pcalloc(p, ivSize);
+    unsigned char *encrypt = NULL;
+    apr_size_t encryptlen, tlen, blockSize = 0;
+
+    res = apr_crypto_block_encrypt_init(&block, &iv, key, &blockSize, p);
+    if (APR_SUCCESS == res) {
+        res = apr_crypto_block_encrypt(&encrypt, &encryptlen, in, inlen,
+                block);
+    }
+    if (APR_SUCCESS == res) {
+        res = apr_crypto_block_encrypt_finish(encrypt + encryptlen, &tlen,
+                block);
+    }
+    if (APR_SUCCESS != res) {
+        return res;
+    }
+    memcpy(out, encrypt, outlen);
+    apr_crypto_block_cleanup(block);
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Derive the key for a passphrase and salt, its key id: the start of a
+ * zero block encrypted with a zero iv, and the key of the HMAC of the
+ * envelope: a constant block encrypted likewise.  Finding the key id of
+ * a passphrase costs the full key derivation, so it reveals no more than
+ * the encrypted session itself.
+ *
+ * Returns APR_SUCCESS if successful.
+ */
+static apr_status_t derive_key(const apr_crypto_t *f,
+        apr_crypto_block_key_type_e *cipher, const char *passphrase,
+        const unsigned char *salt, session_crypto_key *k, apr_pool_t *p)
 {
+    static const unsigned char zero[16] = { 0 };
+    static const unsigned char mac[SESSION_CRYPTO_MAC_KEY_LEN] =
+            "mod_session_crypto envelope mac";
     apr_status_t res;
     apr_crypto_key_t *key = NULL;
-    apr_size_t ivSize = 0;
+
+    res = apr_crypto_passphrase(&key, &k->ivSize, passphrase,
+            strlen(passphrase), salt, sizeof(apr_uuid_t),
+            *cipher, APR_MODE_CBC, 1, 4096, f, p);
+    if (APR_SUCCESS != res) {
+        return res;
+    }
+
+    res = encrypt_constant(key, k->ivSize, zero, sizeof(zero), k->kid,
+            SESSION_CRYPTO_KID_LEN, p);
+    if (APR_SUCCESS == res) {
+        res = encrypt_constant(key, k->ivSize, mac, sizeof(mac), k->mackey,
+                SESSION_CRYPTO_MAC_KEY_LEN, p);
+    }
+    if (APR_SUCCESS != res) {
+        return res;
+    }
+
+    k->key = key;
+    return APR_SUCCESS;
+}
+
+/**
+ * Look up the key for a passphrase and salt, deriving it on first use in
+ * this child.  The key must be released with put_key().
+ *
+ * Returns APR_SUCCESS if successful.
+ */
+static apr_status_t get_key(request_rec *r, const apr_crypto_t *f,
+        apr_crypto_block_key_type_e *cipher, session_crypto_dir_conf *dconf,
+        const char *passphrase, const unsigned char *salt,
+        session_crypto_key **out)
+{
+    apr_status_t res;
+    apr_size_t clen = strlen(dconf->cipher), plen = strlen(passphrase);
+    apr_size_t idlen = sizeof(apr_uuid_t) + clen + 1 + plen;
+    char *id = apr_palloc(r->pool, idlen);
+    session_crypto_key *k;
+    apr_pool_t *p;
+    int local = !memcmp(salt, server_salt, sizeof(apr_uuid_t));
+
+    memcpy(id, salt, sizeof(apr_uuid_t));
+    memcpy(id + sizeof(apr_uuid_t), dconf->cipher, clen + 1);
+    memcpy(id + sizeof(apr_uuid_t) + clen + 1, passphrase, plen);
+
+    if (!key_cache) {
+        /* not running in a child, don't cache */
+        k = apr_pcalloc(r->pool, sizeof(*k));
+        k->id = id;
+        k->idlen = idlen;
+        res = derive_key(f, cipher, passphrase, salt, k, r->pool);
+        *out = k;
+        return res;
+    }
+
+    key_cache_lock();
+    k = apr_hash_get(key_cache, id, idlen);
+    if (k) {
+        k->refs++;
+        key_cache_unlock();
+        *out = k;
+        return APR_SUCCESS;
+    }
+    apr_pool_create(&p, key_cache_pool);
+    key_cache_unlock();
+
+    /* derive without holding the lock, the lookups of other threads must
+     * not wait for this
+     */
+    k = apr_pcalloc(p, sizeof(*k));
+    res = derive_key(f, cipher, passphrase, salt, k, p);
+
+    key_cache_lock();
+    if (APR_SUCCESS != res) {
+        apr_pool_destroy(p);
+        key_cache_unlock();
+        return res;
+    }
+    *out = apr_hash_get(key_cache, id, idlen);
+    if (*out) {
+        /* another thread was quicker */
+        (*out)->refs++;
+        apr_pool_destroy(p);
+        key_cache_unlock();
+        return APR_SUCCESS;
+    }
+    k->pool = p;
+    k->id = apr_pmemdup(p, id, idlen);
+    k->idlen = idlen;
+    k->refs = 1;
+    apr_hash_set(key_cache, k->id, k->idlen, k);
+    if (!local) {
+        session_crypto_key *old = foreign_keys[foreign_keys_next];
+        if (old) {
+            apr_hash_set(key_cache, old->id, old->idlen, NULL);
+            old->evicted = 1;
+            if (!old->refs) {
+                apr_pool_destroy(old->pool);
+            }
+        }
+        foreign_keys[foreign_keys_next] = k;
+        foreign_keys_next = (foreign_keys_next + 1) % SESSION_CRYPTO_FOREIGN_KEYS;
+    }
+    key_cache_unlock();
+
+    *out = k;
+    return APR_SUCCESS;
+}
+
+/**
+ * Release a key returned by get_key().
+ */
+static void put_key(session_crypto_key *k)
+{
+    if (!k->pool) {
+        return;
+    }
+
+    key_cache_lock();
+    if (!--k->refs && k->evicted) {
+        apr_pool_destroy(k->pool);
+    }
+    key_cache_unlock();
+}
+
+/**
+ * HMAC-SHA1 (RFC 2104) of the data given with the mac key of the key given.
+ */
+static void envelope_mac(const session_crypto_key *k, const unsigned char *in,
+        apr_size_t len, unsigned char *out)
+{
+    apr_sha1_ctx_t ctx;
+    unsigned char pad[64];
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    apr_size_t i;
+
+    /* SESSION_CRYPTO_MAC_KEY_LEN is shorter than the SHA-1 block size */
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, k->mackey, SESSION_CRYPTO_MAC_KEY_LEN);
+    for (i = 0; i < sizeof(pad); i++) {
+        pad[i] ^= 0x36;
+    }
+    apr_sha1_init(&ctx);
+    apr_sha1_update_binary(&ctx, pad, sizeof(pad));
+    apr_sha1_update_binary(&ctx, in, len);
+    apr_sha1_final(digest, &ctx);
+
+    for (i = 0; i < sizeof(pad); i++) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    apr_sha1_init(&ctx);
+    apr_sha1_update_binary(&ctx, pad, sizeof(pad));
+    apr_sha1_update_binary(&ctx, digest, sizeof(digest));
+    apr_sha1_final(out, &ctx);
+}
+
+/**
+ * Encrypt the string given with the key given, and return the envelope:
+ * the prefix, followed by the base64 encoded salt, key id, iv, ciphertext
+ * and the HMAC of all of these.
+ *
+ * Returns APR_SUCCESS if successful.
+ */
+static apr_status_t encrypt_envelope(request_rec *r, session_crypto_key *k,
+        const char *in, char **out)
+{
+    apr_status_t res;
     apr_crypto_block_t *block = NULL;
     unsigned char *encrypt = NULL;
-    unsigned char *combined = NULL;
-    apr_size_t encryptlen, tlen;
-    char *base64;
+    unsigned char *combined, *slider;
+    apr_size_t encryptlen, tlen, combinedlen;
     apr_size_t blockSize = 0;
     const unsigned char *iv = NULL;
-    apr_uuid_t salt;
+    char *base64;
+
+    res = apr_crypto_block_encrypt_init(&block, &iv, k->key, &blockSize,
+            r->pool);
+    if (APR_SUCCESS != res) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, res, r, APLOGNO(01829)
+                "apr_crypto_block_encrypt_init failed");
+        return res;
+    }
+
+    /* encrypt the given string */
+    res = apr_crypto_block_encrypt(&encrypt, &encryptlen, (unsigned char *)in,
+            strlen(in), block);
+    if (APR_SUCCESS != res) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, res, r, APLOGNO(01830)
+                "apr_crypto_block_encrypt failed");
+        return res;
+    }
+    res = apr_crypto_block_encrypt_finish(encrypt + encryptlen, &tlen, block);
+    if (APR_SUCCESS != res) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, res, r, APLOGNO(01831)
+                "apr_crypto_block_encrypt_finish failed");
+        return res;
+    }
+    encryptlen += tlen;
+
+    /* prepend the salt, the key id and the iv to the result, and append
+     * the HMAC
+     */
+    combinedlen = sizeof(apr_uuid_t) + SESSION_CRYPTO_KID_LEN + k->ivSize
+            + encryptlen + SESSION_CRYPTO_MAC_LEN;
+    combined = slider = apr_palloc(r->pool, combinedlen);
+    memcpy(slider, k->id, sizeof(apr_uuid_t));
+    slider += sizeof(apr_uuid_t);
+    memcpy(slider, k->kid, SESSION_CRYPTO_KID_LEN);
+    slider += SESSION_CRYPTO_KID_LEN;
+    memcpy(slider, iv, k->ivSize);
+    slider += k->ivSize;
+    memcpy(slider, encrypt, encryptlen);
+    slider += encryptlen;
+    envelope_mac(k, combined, slider - combined, slider);
+
+    /* base64 encode the result behind the prefix */
+    base64 = apr_palloc(r->pool, SESSION_CRYPTO_PREFIX_LEN
+            + apr_base64_encode_len(combinedlen));
+    memcpy(base64, SESSION_CRYPTO_PREFIX, SESSION_CRYPTO_PREFIX_LEN);
+    apr_base64_encode(base64 + SESSION_CRYPTO_PREFIX_LEN,
+            (const char *) combined, combinedlen);
+    *out = base64;
+
+    return res;
+}
+
+/**
+ * Encrypt the string given as per the current config.
+ *
+ * Returns APR_SUCCESS if successful.
+ */
+static apr_status_t encrypt_string(request_rec * r, const apr_crypto_t *f,
+        session_crypto_dir_conf *dconf, const char *in, char **out)
+{
+    apr_status_t res;
+    session_crypto_key *k = NULL;
     apr_crypto_block_key_type_e *cipher;
     const char *passphrase;
 
@@ -144,19 +482,17 @@ static apr_status_t encrypt_string(request_rec * r, const apr_crypto_t *f,
         return APR_SUCCESS;
     }
 
-    /* use a uuid as a salt value, and prepend it to our result */
-    apr_uuid_get(&salt);
     res = crypt_init(r, f, &cipher, dconf);
     if (res != APR_SUCCESS) {
         return res;
     }
 
-    /* encrypt using the first passphrase in the list */
+    /* encrypt using the first passphrase in the list, with the key derived
+     * from it and the salt of this server
+     */
     passphrase = APR_ARRAY_IDX(dconf->passphrases, 0, char *);
-    res = apr_crypto_passphrase(&key, &ivSize, passphrase,
-            strlen(passphrase),
-            (unsigned char *) (&salt), sizeof(apr_uuid_t),
-            *cipher, APR_MODE_CBC, 1, 4096, f, r->pool);
+    res = get_key(r, f, cipher, dconf, passphrase,
+            (const unsigned char *)server_salt, &k);
     if (APR_STATUS_IS_ENOKEY(res)) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, res, r, APLOGNO(01825)
                 "the passphrase '%s' was empty", passphrase);
@@ -175,88 +511,170 @@ static apr_status_t encrypt_string(request_rec * r, const apr_crypto_t *f,
         return res;
     }
 
-    res = apr_crypto_block_encrypt_init(&block, &iv, key, &blockSize, r->pool);
+    res = encrypt_envelope(r, k, in, out);
+    put_key(k);
+
+    return res;
+
+}
+
+/**
+ * Decrypt the ciphertext given, which starts with the iv, with the key
+ * given.
+ *
+ * Returns APR_SUCCESS if successful.
+ */
+static apr_status_t decrypt_block(request_rec *r, const apr_crypto_key_t *key,
+        apr_size_t ivSize, const char *in, apr_size_t len, char **out)
+{
+    apr_status_t res;
+    apr_crypto_block_t *block = NULL;
+    unsigned char *decrypted = NULL;
+    apr_size_t decryptedlen, tlen;
+    apr_size_t blockSize = 0;
+
+    res = apr_crypto_block_decrypt_init(&block, &blockSize,
+            (const unsigned char *)in, key, r->pool);
     if (APR_SUCCESS != res) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, res, r, APLOGNO(01829)
-                "apr_crypto_block_encrypt_init failed");
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, res, r, APLOGNO(01837)
+                "apr_crypto_block_decrypt_init failed");
         return res;
     }
 
-    /* encrypt the given string */
-    res = apr_crypto_block_encrypt(&encrypt, &encryptlen, (unsigned char *)in,
-            strlen(in), block);
+    /* decrypt the given string, after the iv */
+    res = apr_crypto_block_decrypt(&decrypted, &decryptedlen,
+            (const unsigned char *)in + ivSize, len - ivSize, block);
     if (APR_SUCCESS != res) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, res, r, APLOGNO(01830)
-                "apr_crypto_block_encrypt failed");
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, res, r, APLOGNO(01838)
+                "apr_crypto_block_decrypt failed");
         return res;
     }
-    res = apr_crypto_block_encrypt_finish(encrypt + encryptlen, &tlen, block);
+
+    res = apr_crypto_block_decrypt_finish(decrypted + decryptedlen, &tlen,
+            block);
     if (APR_SUCCESS != res) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, res, r, APLOGNO(01831)
-                "apr_crypto_block_encrypt_finish failed");
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, res, r, APLOGNO(01839)
+                "apr_crypto_block_decrypt_finish failed");
         return res;
     }
-    encryptlen += tlen;
+    decryptedlen += tlen;
+    decrypted[decryptedlen] = 0;
+    *out = (char *) decrypted;
 
-    /* prepend the salt and the iv to the result */
-    combined = apr_palloc(r->pool, ivSize + encryptlen + sizeof(apr_uuid_t));
-    memcpy(combined, &salt, sizeof(apr_uuid_t));
-    memcpy(combined + sizeof(apr_uuid_t), iv, ivSize);
-    memcpy(combined + sizeof(apr_uuid_t) + ivSize, encrypt, encryptlen);
-
-    /* base64 encode the result */
-    base64 = apr_palloc(r->pool, apr_base64_encode_len(ivSize + encryptlen +
-                    sizeof(apr_uuid_t) + 1)
-            * sizeof(char));
-    apr_base64_encode(base64, (const char *) combined,
-            ivSize + encryptlen + sizeof(apr_uuid_t));
-    *out = base64;
+    return APR_SUCCESS;
+}
 
-    return res;
+/**
+ * Decrypt an envelope made by encrypt_envelope(), using the passphrase
+ * whose key id matches the one in the envelope, once its HMAC is verified.
+ *
+ * Returns APR_SUCCESS if successful.
+ */
+static apr_status_t decrypt_envelope(request_rec *r, const apr_crypto_t *f,
+        session_crypto_dir_conf *dconf, apr_crypto_block_key_type_e *cipher,
+        const char *in, char **out)
+{
+    apr_status_t res = APR_ENOKEY;
+    apr_size_t decodedlen;
+    char *decoded;
+    const unsigned char *salt, *kid;
+    unsigned char mac[SESSION_CRYPTO_MAC_LEN];
+    int i;
+
+    /* strip base64 from the string */
+    decoded = apr_palloc(r->pool, apr_base64_decode_len(in));
+    decodedlen = apr_base64_decode(decoded, in);
+
+    if (decodedlen < sizeof(apr_uuid_t) + SESSION_CRYPTO_KID_LEN) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r, APLOGNO(02845)
+                "too short to decrypt");
+        return APR_ECRYPT;
+    }
+    salt = (const unsigned char *)decoded;
+    kid = salt + sizeof(apr_uuid_t);
+    decoded += sizeof(apr_uuid_t) + SESSION_CRYPTO_KID_LEN;
+    decodedlen -= sizeof(apr_uuid_t) + SESSION_CRYPTO_KID_LEN;
+
+    for (i = 0; i < dconf->passphrases->nelts; i++) {
+        const char *passphrase = APR_ARRAY_IDX(dconf->passphrases, i, char *);
+        session_crypto_key *k = NULL;
+
+        res = get_key(r, f, cipher, dconf, passphrase, salt, &k);
+        if (APR_SUCCESS != res) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, res, r, APLOGNO(02846)
+                    "key for passphrase %d could not be derived", i + 1);
+            continue;
+        }
+
+        if (memcmp(k->kid, kid, SESSION_CRYPTO_KID_LEN)) {
+            put_key(k);
+            res = APR_ENOKEY;
+            continue;
+        }
 
+        if (decodedlen < k->ivSize + SESSION_CRYPTO_MAC_LEN) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                    APLOGNO(02847) "too short to decrypt");
+            res = APR_ECRYPT;
+        }
+        else {
+            const unsigned char *given;
+            unsigned char diff = 0;
+            apr_size_t j;
+
+            /* compare in constant time, before anything is decrypted */
+            decodedlen -= SESSION_CRYPTO_MAC_LEN;
+            given = (const unsigned char *)decoded + decodedlen;
+            envelope_mac(k, salt, given - salt, mac);
+            for (j = 0; j < SESSION_CRYPTO_MAC_LEN; j++) {
+                diff |= mac[j] ^ given[j];
+            }
+            if (diff) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                        APLOGNO(02875) "HMAC of the session did not match");
+                res = APR_ECRYPT;
+            }
+            else {
+                res = decrypt_block(r, k->key, k->ivSize, decoded,
+                        decodedlen, out);
+            }
+        }
+        put_key(k);
+        break;
+    }
+
+    return res;
 }
 
 /**
- * Decrypt the string given as per the current config.
+ * Decrypt a session written before the envelope was introduced: the key
+ * was derived from a salt of its own at the start of the session, and
+ * there is no key id, so each passphrase is tried in turn.
  *
  * Returns APR_SUCCESS if successful.
  */
-static apr_status_t decrypt_string(request_rec * r, const apr_crypto_t *f,
-        session_crypto_dir_conf *dconf, const char *in, char **out)
+static apr_status_t decrypt_legacy(request_rec *r, const apr_crypto_t *f,
+        session_crypto_dir_conf *dconf, apr_crypto_block_key_type_e *cipher,
+        const char *in, char **out)
 {
     apr_status_t res;
-    apr_crypto_key_t *key = NULL;
-    apr_size_t ivSize = 0;
-    apr_crypto_block_t *block = NULL;
-    unsigned char *decrypted = NULL;
-    apr_size_t decryptedlen, tlen;
     apr_size_t decodedlen;
     char *decoded;
-    apr_size_t blockSize = 0;
-    apr_crypto_block_key_type_e *cipher;
     int i = 0;
 
     /* strip base64 from the string */
     decoded = apr_palloc(r->pool, apr_base64_decode_len(in));
     decodedlen = apr_base64_decode(decoded, in);
-    decoded[decodedlen] = '\0';
-
-    res = crypt_init(r, f, &cipher, dconf);
-    if (res != APR_SUCCESS) {
-        return res;
-    }
 
     /* try each passphrase in turn */
-    for (; i < dconf->passphrases->nelts; i++) {
+    res = APR_ECRYPT;
+    for (; decodedlen >= sizeof(apr_uuid_t)
+           && i < dconf->passphrases->nelts; i++) {
         const char *passphrase = APR_ARRAY_IDX(dconf->passphrases, i, char *);
-        apr_size_t len = decodedlen;
-        char *slider = decoded;
-
-        /* encrypt using the first passphrase in the list */
-        res = apr_crypto_passphrase(&key, &ivSize, passphrase,
-                strlen(passphrase),
-                (unsigned char *)decoded, sizeof(apr_uuid_t),
-                *cipher, APR_MODE_CBC, 1, 4096, f, r->pool);
+        session_crypto_key *k = NULL;
+
+        res = get_key(r, f, cipher, dconf, passphrase,
+                (const unsigned char *)decoded, &k);
         if (APR_STATUS_IS_ENOKEY(res)) {
             ap_log_rerror(APLOG_MARK, APLOG_DEBUG, res, r, APLOGNO(01832)
                     "the passphrase '%s' was empty", passphrase);
@@ -279,49 +697,49 @@ static apr_status_t decrypt_string(request_rec * r, const apr_crypto_t *f,
         }
 
         /* sanity check - decoded too short? */
-        if (decodedlen < (sizeof(apr_uuid_t) + ivSize)) {
+        if (decodedlen < (sizeof(apr_uuid_t) + k->ivSize)) {
             ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r, APLOGNO(01836)
                     "too short to decrypt, skipping");
+            put_key(k);
             res = APR_ECRYPT;
             continue;
         }
 
         /* bypass the salt at the start of the decoded block */
-        slider += sizeof(apr_uuid_t);
-        len -= sizeof(apr_uuid_t);
-
-        res = apr_crypto_block_decrypt_init(&block, &blockSize, (unsigned char *)slider, key,
-                r->pool);
-        if (APR_SUCCESS != res) {
-            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, res, r, APLOGNO(01837)
-                    "apr_crypto_block_decrypt_init failed");
-            continue;
+        res = decrypt_block(r, k->key, k->ivSize,
+                decoded + sizeof(apr_uuid_t),
+                decodedlen - sizeof(apr_uuid_t), out);
+        put_key(k);
+        if (APR_SUCCESS == res) {
+            break;
         }
+    }
 
-        /* bypass the iv at the start of the decoded block */
-        slider += ivSize;
-        len -= ivSize;
+    return res;
+}
 
-        /* decrypt the given string */
-        res = apr_crypto_block_decrypt(&decrypted, &decryptedlen,
-                (unsigned char *)slider, len, block);
-        if (res) {
-            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, res, r, APLOGNO(01838)
-                    "apr_crypto_block_decrypt failed");
-            continue;
-        }
-        *out = (char *) decrypted;
+/**
+ * Decrypt the string given as per the current config.
+ *
+ * Returns APR_SUCCESS if successful.
+ */
+static apr_status_t decrypt_string(request_rec * r, const apr_crypto_t *f,
+        session_crypto_dir_conf *dconf, const char *in, char **out)
+{
+    apr_status_t res;
+    apr_crypto_block_key_type_e *cipher;
 
-        res = apr_crypto_block_decrypt_finish(decrypted + decryptedlen, &tlen, block);
-        if (APR_SUCCESS != res) {
-            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, res, r, APLOGNO(01839)
-                    "apr_crypto_block_decrypt_finish failed");
-            continue;
-        }
-        decryptedlen += tlen;
-        decrypted[decryptedlen] = 0;
+    res = crypt_init(r, f, &cipher, dconf);
+    if (res != APR_SUCCESS) {
+        return res;
+    }
 
-        break;
+    if (!strncmp(in, SESSION_CRYPTO_PREFIX, SESSION_CRYPTO_PREFIX_LEN)) {
+        res = decrypt_envelope(r, f, dconf, cipher,
+                in + SESSION_CRYPTO_PREFIX_LEN, out);
+    }
+    else {
+        res = decrypt_legacy(r, f, dconf, cipher, in, out);
     }
 
     if (APR_SUCCESS != res) {
@@ -407,6 +825,17 @@ static int session_crypto_init(apr_pool_t *p, apr_pool_t *plog,
     session_crypto_conf *conf = ap_get_module_config(s->module_config,
             &session_crypto_module);
 
+    /* the salt of the keys used for encryption only changes when the
+     * server is stopped, so that sessions written before a restart can be
+     * read with keys derived for it once
+     */
+    server_salt = ap_retained_data_get("mod_session_crypto_salt");
+    if (!server_salt) {
+        server_salt = ap_retained_data_create("mod_session_crypto_salt",
+                sizeof(apr_uuid_t));
+        apr_uuid_get(server_salt);
+    }
+
     if (conf->library) {
 
         const apu_err_t *err = NULL;
@@ -464,6 +893,18 @@ static int session_crypto_init(apr_pool_t *p, apr_pool_t *plog,
     return OK;
 }
 
+/**
+ * Set up the cache of derived keys in the child.
+ */
+static void session_crypto_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_pool_create(&key_cache_pool, p);
+    key_cache = apr_hash_make(key_cache_pool);
+#if APR_HAS_THREADS
+    apr_thread_mutex_create(&key_cache_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+}
+
 static void *create_session_crypto_config(apr_pool_t * p, server_rec *s)
 {
     session_crypto_conf *new =
@@ -626,6 +1067,7 @@ static void register_hooks(apr_pool_t * p)
     ap_hook_session_encode(session_crypto_encode, NULL, NULL, APR_HOOK_LAST);
     ap_hook_session_decode(session_crypto_decode, NULL, NULL, APR_HOOK_FIRST);
     ap_hook_post_config(session_crypto_init, NULL, NULL, APR_HOOK_LAST);
+    ap_hook_child_init(session_crypto_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 AP_DECLARE_MODULE(session_crypto) =
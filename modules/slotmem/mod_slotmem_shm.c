@@ -30,6 +30,7 @@
 #endif
 #include "apr_version.h"
 #include "apr_hash.h"
+#include "apr_atomic.h"
 
 #if APR_HAVE_UNISTD_H
 #include <unistd.h>         /* for getpid() */
@@ -56,8 +57,32 @@ typedef struct {
     ap_slotmem_type_t type;      /* type-specific flags */
 } sharedslotdesc_t;
 
-#define AP_SLOTMEM_OFFSET (APR_ALIGN_DEFAULT(sizeof(sharedslotdesc_t)))
-#define AP_UNSIGNEDINT_OFFSET (APR_ALIGN_DEFAULT(sizeof(unsigned int)))
+/* The shared allocation state, updated with atomic operations only */
+typedef struct {
+    apr_uint32_t num_free;       /* slot free count */
+    apr_uint32_t hint;           /* inuse word to start looking for a free slot */
+} sharedslothdr_t;
+
+/* Slots start on a cache line of their own, so that processes updating
+ * neighbouring slots (or the allocation state) don't contend for it */
+#define AP_SLOTMEM_CACHELINE 64
+#define AP_SLOTMEM_ALIGN(size) \
+    (((size) + AP_SLOTMEM_CACHELINE - 1) & ~((apr_size_t)AP_SLOTMEM_CACHELINE - 1))
+
+/* The base address of a segment needn't be on a cache line (anonymous
+ * shm keeps its size in front of it), so the part after the desc is
+ * aligned in memory, and the segment has room for the padding */
+#define AP_SLOTMEM_OFFSET (sizeof(sharedslotdesc_t) + AP_SLOTMEM_CACHELINE - 1)
+#define AP_SLOTMEM_PERSIST_PTR(base) \
+    ((char *)AP_SLOTMEM_ALIGN((apr_uintptr_t)(base) + sizeof(sharedslotdesc_t)))
+#define AP_SLOTMEM_HDR_OFFSET (AP_SLOTMEM_ALIGN(sizeof(sharedslothdr_t)))
+#define AP_SLOTMEM_STRIDE(size) (AP_SLOTMEM_ALIGN(size))
+#define AP_SLOTMEM_INUSE_WORDS(num) (((num) + 31) / 32)
+
+/* size of the persisted part of the segment, everything but the desc */
+#define AP_SLOTMEM_PERSIST_SIZE(size, num) \
+    (AP_SLOTMEM_HDR_OFFSET + AP_SLOTMEM_STRIDE(size) * (num) + \
+     AP_SLOTMEM_INUSE_WORDS(num) * sizeof(apr_uint32_t))
 
 struct ap_slotmem_instance_t {
     char                 *name;       /* per segment name */
@@ -65,21 +90,94 @@ struct ap_slotmem_instance_t {
     void                 *shm;        /* ptr to memory segment (apr_shm_t *) */
     void                 *base;       /* data set start */
     apr_pool_t           *gpool;      /* per segment global pool */
-    char                 *inuse;      /* in-use flag table*/
-    unsigned int         *num_free;   /* slot free count for this instance */
+    apr_uint32_t         *inuse;      /* in-use bitmap */
+    apr_uint32_t         *num_free;   /* slot free count for this instance */
+    apr_uint32_t         *hint;       /* where grab starts looking */
     void                 *persist;    /* persist dataset start */
+    apr_size_t           stride;      /* distance between slots */
     sharedslotdesc_t     desc;        /* per slot desc */
     struct ap_slotmem_instance_t  *next;       /* location of next allocated segment */
 };
 
 /*
  * Memory layout:
- *     sharedslotdesc_t | num_free | slots | isuse array |
- *                      ^          ^
- *                      |          . base
- *                      . persist (also num_free)
+ *     sharedslotdesc_t | sharedslothdr_t | slots | inuse bitmap |
+ *                      ^                 ^
+ *                      |                 . base
+ *                      . persist
+ *
+ * Each part starts on a cache line, and so does each slot.  The inuse
+ * bitmap has one bit per slot, in 32 bit words which are updated with
+ * compare-and-swap, so that grabbing and releasing slots needs no lock.
  */
 
+#define SLOT_WORD(id) ((id) >> 5)
+#define SLOT_BIT(id)  ((apr_uint32_t)1 << ((id) & 31))
+
+/* index of the lowest zero bit of w, which must not be all ones */
+static APR_INLINE unsigned int slotmem_ffz(apr_uint32_t w)
+{
+#if defined(__GNUC__) && (__GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4))
+    return (unsigned int)__builtin_ctz(~w);
+#else
+    unsigned int n = 0;
+    while (w & 1) {
+        w >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+static APR_INLINE unsigned int slotmem_popcount(apr_uint32_t w)
+{
+#if defined(__GNUC__) && (__GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4))
+    return (unsigned int)__builtin_popcount(w);
+#else
+    unsigned int n = 0;
+    while (w) {
+        w &= w - 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+static APR_INLINE int slotmem_isinuse(ap_slotmem_instance_t *slot,
+                                      unsigned int id)
+{
+    return (apr_atomic_read32(&slot->inuse[SLOT_WORD(id)]) & SLOT_BIT(id))
+           != 0;
+}
+
+/* atomically set the inuse bit of id, returns whether it was clear */
+static int slotmem_setinuse(ap_slotmem_instance_t *slot, unsigned int id)
+{
+    apr_uint32_t *word = &slot->inuse[SLOT_WORD(id)];
+    apr_uint32_t old;
+
+    do {
+        old = apr_atomic_read32(word);
+        if (old & SLOT_BIT(id)) {
+            return 0;
+        }
+    } while (apr_atomic_cas32(word, old | SLOT_BIT(id), old) != old);
+
+    return 1;
+}
+
+/* Point the instance into the segment, ptr being just past the desc */
+static void slotmem_map(ap_slotmem_instance_t *res, char *ptr)
+{
+    res->persist = (void *)ptr;
+    res->num_free = &((sharedslothdr_t *)ptr)->num_free;
+    res->hint = &((sharedslothdr_t *)ptr)->hint;
+    res->stride = AP_SLOTMEM_STRIDE(res->desc.size);
+    ptr += AP_SLOTMEM_HDR_OFFSET;
+    res->base = (void *)ptr;
+    res->inuse = (apr_uint32_t *)(ptr + res->stride * res->desc.num);
+}
+
 /* global pool and list of slotmem we are handling */
 static struct ap_slotmem_instance_t *globallistmem = NULL;
 static apr_pool_t *gpool = NULL;
@@ -124,18 +222,16 @@ static const char *slotmem_filename(apr_pool_t *pool, const char *slotmemname,
 static void slotmem_clearinuse(ap_slotmem_instance_t *slot)
 {
     unsigned int i;
-    char *inuse;
-    
+    apr_uint32_t old;
+
     if (!slot) {
         return;
     }
-    
-    inuse = slot->inuse;
-    
-    for (i = 0; i < slot->desc.num; i++, inuse++) {
-        if (*inuse) {
-            *inuse = 0;
-            (*slot->num_free)++;
+
+    for (i = 0; i < AP_SLOTMEM_INUSE_WORDS(slot->desc.num); i++) {
+        old = apr_atomic_xchg32(&slot->inuse[i], 0);
+        if (old) {
+            apr_atomic_add32(slot->num_free, slotmem_popcount(old));
         }
     }
 }
@@ -167,8 +263,8 @@ static void store_slotmem(ap_slotmem_instance_t *slotmem)
         if (AP_SLOTMEM_IS_CLEARINUSE(slotmem)) {
             slotmem_clearinuse(slotmem);
         }
-        nbytes = (slotmem->desc.size * slotmem->desc.num) +
-                 (slotmem->desc.num * sizeof(char)) + AP_UNSIGNEDINT_OFFSET;
+        nbytes = AP_SLOTMEM_PERSIST_SIZE(slotmem->desc.size,
+                                         slotmem->desc.num);
         apr_md5(digest, slotmem->persist, nbytes);
         rv = apr_file_write_full(fp, slotmem->persist, nbytes, NULL);
         if (rv == APR_SUCCESS) {
@@ -269,25 +365,40 @@ static apr_status_t slotmem_doall(ap_slotmem_instance_t *mem,
                                   ap_slotmem_callback_fn_t *func,
                                   void *data, apr_pool_t *pool)
 {
-    unsigned int i;
+    unsigned int i, w;
     char *ptr;
-    char *inuse;
+    apr_uint32_t bits;
     apr_status_t retval = APR_SUCCESS;
 
     if (!mem) {
         return APR_ENOSHMAVAIL;
     }
 
-    ptr = (char *)mem->base;
-    inuse = mem->inuse;
-    for (i = 0; i < mem->desc.num; i++, inuse++) {
-        if (!AP_SLOTMEM_IS_PREGRAB(mem) ||
-           (AP_SLOTMEM_IS_PREGRAB(mem) && *inuse)) {
+    if (!AP_SLOTMEM_IS_PREGRAB(mem)) {
+        ptr = (char *)mem->base;
+        for (i = 0; i < mem->desc.num; i++) {
             retval = func((void *) ptr, data, pool);
             if (retval != APR_SUCCESS)
                 break;
+            ptr += mem->stride;
+        }
+        return retval;
+    }
+
+    /* only visit the grabbed slots, skipping free words as a whole */
+    for (w = 0; w < AP_SLOTMEM_INUSE_WORDS(mem->desc.num); w++) {
+        bits = apr_atomic_read32(&mem->inuse[w]);
+        while (bits) {
+            i = w * 32 + slotmem_ffz(~bits);
+            bits &= bits - 1;
+            if (i >= mem->desc.num) {
+                break;
+            }
+            ptr = (char *)mem->base + mem->stride * i;
+            retval = func((void *) ptr, data, pool);
+            if (retval != APR_SUCCESS)
+                return retval;
         }
-        ptr += mem->desc.size;
     }
     return retval;
 }
@@ -306,9 +417,8 @@ static apr_status_t slotmem_create(ap_slotmem_instance_t **new,
     ap_slotmem_instance_t *next = globallistmem;
     const char *fname;
     apr_shm_t *shm;
-    apr_size_t basesize = (item_size * item_num);
-    apr_size_t size = AP_SLOTMEM_OFFSET + AP_UNSIGNEDINT_OFFSET +
-                      (item_num * sizeof(char)) + basesize;
+    apr_size_t size = AP_SLOTMEM_OFFSET +
+                      AP_SLOTMEM_PERSIST_SIZE(item_size, item_num);
     apr_status_t rv;
 
     if (gpool == NULL) {
@@ -371,10 +481,10 @@ static apr_status_t slotmem_create(ap_slotmem_instance_t **new,
                          fname);
             return APR_EINVAL;
         }
-        ptr += AP_SLOTMEM_OFFSET;
+        ptr = AP_SLOTMEM_PERSIST_PTR(ptr);
     }
     else {
-        apr_size_t dsize = size - AP_SLOTMEM_OFFSET;
+        apr_size_t dsize = AP_SLOTMEM_PERSIST_SIZE(item_size, item_num);
         if (fbased) {
             apr_shm_remove(fname, gpool);
             rv = apr_shm_create(&shm, size, fname, gpool);
@@ -395,7 +505,7 @@ static apr_status_t slotmem_create(ap_slotmem_instance_t **new,
         desc.num = item_num;
         desc.type = type;
         memcpy(ptr, &desc, sizeof(desc));
-        ptr += AP_SLOTMEM_OFFSET;
+        ptr = AP_SLOTMEM_PERSIST_PTR(ptr);
         memset(ptr, 0, dsize);
         /*
          * TODO: Error check the below... What error makes
@@ -421,17 +531,13 @@ static apr_status_t slotmem_create(ap_slotmem_instance_t **new,
     res->name = apr_pstrdup(gpool, fname);
     res->fbased = fbased;
     res->shm = shm;
-    res->num_free = (unsigned int *)ptr;
+    res->desc = desc;
+    slotmem_map(res, ptr);
     if (!restored) {
-        *res->num_free = item_num;
+        apr_atomic_set32(res->num_free, item_num);
     }
-    res->persist = (void *)ptr;
-    ptr += AP_UNSIGNEDINT_OFFSET;
-    res->base = (void *)ptr;
-    res->desc = desc;
     res->gpool = gpool;
     res->next = NULL;
-    res->inuse = ptr + basesize;
     if (globallistmem == NULL) {
         globallistmem = res;
     }
@@ -497,7 +603,7 @@ static apr_status_t slotmem_attach(ap_slotmem_instance_t **new,
     /* Read the description of the slotmem */
     ptr = (char *)apr_shm_baseaddr_get(shm);
     memcpy(&desc, ptr, sizeof(desc));
-    ptr += AP_SLOTMEM_OFFSET;
+    ptr = AP_SLOTMEM_PERSIST_PTR(ptr);
 
     /* For the chained slotmem stuff */
     res = (ap_slotmem_instance_t *) apr_pcalloc(gpool,
@@ -505,13 +611,9 @@ static apr_status_t slotmem_attach(ap_slotmem_instance_t **new,
     res->name = apr_pstrdup(gpool, fname);
     res->fbased = 1;
     res->shm = shm;
-    res->num_free = (unsigned int *)ptr;
-    res->persist = (void *)ptr;
-    ptr += AP_UNSIGNEDINT_OFFSET;
-    res->base = (void *)ptr;
     res->desc = desc;
+    slotmem_map(res, ptr);
     res->gpool = gpool;
-    res->inuse = ptr + (desc.size * desc.num);
     res->next = NULL;
     if (globallistmem == NULL) {
         globallistmem = res;
@@ -542,7 +644,7 @@ static apr_status_t slotmem_dptr(ap_slotmem_instance_t *slot,
         return APR_EINVAL;
     }
 
-    ptr = (char *)slot->base + slot->desc.size * id;
+    ptr = (char *)slot->base + slot->stride * id;
     if (!ptr) {
         return APR_ENOSHMAVAIL;
     }
@@ -554,25 +656,23 @@ static apr_status_t slotmem_get(ap_slotmem_instance_t *slot, unsigned int id,
                                 unsigned char *dest, apr_size_t dest_len)
 {
     void *ptr;
-    char *inuse;
     apr_status_t ret;
 
     if (!slot) {
         return APR_ENOSHMAVAIL;
     }
 
-    inuse = slot->inuse + id;
     if (id >= slot->desc.num) {
         return APR_EINVAL;
     }
-    if (AP_SLOTMEM_IS_PREGRAB(slot) && !*inuse) {
+    if (AP_SLOTMEM_IS_PREGRAB(slot) && !slotmem_isinuse(slot, id)) {
         return APR_NOTFOUND;
     }
     ret = slotmem_dptr(slot, id, &ptr);
     if (ret != APR_SUCCESS) {
         return ret;
     }
-    *inuse = 1;
+    slotmem_setinuse(slot, id);
     memcpy(dest, ptr, dest_len); /* bounds check? */
     return APR_SUCCESS;
 }
@@ -581,25 +681,23 @@ static apr_status_t slotmem_put(ap_slotmem_instance_t *slot, unsigned int id,
                                 unsigned char *src, apr_size_t src_len)
 {
     void *ptr;
-    char *inuse;
     apr_status_t ret;
 
     if (!slot) {
         return APR_ENOSHMAVAIL;
     }
 
-    inuse = slot->inuse + id;
     if (id >= slot->desc.num) {
         return APR_EINVAL;
     }
-    if (AP_SLOTMEM_IS_PREGRAB(slot) && !*inuse) {
+    if (AP_SLOTMEM_IS_PREGRAB(slot) && !slotmem_isinuse(slot, id)) {
         return APR_NOTFOUND;
     }
     ret = slotmem_dptr(slot, id, &ptr);
     if (ret != APR_SUCCESS) {
         return ret;
     }
-    *inuse=1;
+    slotmem_setinuse(slot, id);
     memcpy(ptr, src, src_len); /* bounds check? */
     return APR_SUCCESS;
 }
@@ -612,13 +710,11 @@ static unsigned int slotmem_num_slots(ap_slotmem_instance_t *slot)
 static unsigned int slotmem_num_free_slots(ap_slotmem_instance_t *slot)
 {
     if (AP_SLOTMEM_IS_PREGRAB(slot))
-        return *slot->num_free;
+        return apr_atomic_read32(slot->num_free);
     else {
-        unsigned int i, counter=0;
-        char *inuse = slot->inuse;
-        for (i=0; i<slot->desc.num; i++, inuse++) {
-            if (!*inuse)
-                counter++;
+        unsigned int i, counter = slot->desc.num;
+        for (i = 0; i < AP_SLOTMEM_INUSE_WORDS(slot->desc.num); i++) {
+            counter -= slotmem_popcount(apr_atomic_read32(&slot->inuse[i]));
         }
         return counter;
     }
@@ -631,37 +727,50 @@ static apr_size_t slotmem_slot_size(ap_slotmem_instance_t *slot)
 
 static apr_status_t slotmem_grab(ap_slotmem_instance_t *slot, unsigned int *id)
 {
-    unsigned int i;
-    char *inuse;
+    unsigned int nwords, start, n, w, i;
+    apr_uint32_t old;
 
     if (!slot) {
         return APR_ENOSHMAVAIL;
     }
 
-    inuse = slot->inuse;
-
-    for (i = 0; i < slot->desc.num; i++, inuse++) {
-        if (!*inuse) {
-            break;
+    /* Start at the word where the last grab succeeded, any process'; the
+     * words before it are likely to be full.  A word whose lowest free
+     * bit is taken under our feet is simply tried again. */
+    nwords = AP_SLOTMEM_INUSE_WORDS(slot->desc.num);
+    start = apr_atomic_read32(slot->hint);
+    for (n = 0; n < nwords; n++) {
+        w = (start + n) % nwords;
+        for (;;) {
+            old = apr_atomic_read32(&slot->inuse[w]);
+            if (old == 0xFFFFFFFF) {
+                break;
+            }
+            i = w * 32 + slotmem_ffz(old);
+            if (i >= slot->desc.num) {
+                break;
+            }
+            if (apr_atomic_cas32(&slot->inuse[w], old | SLOT_BIT(i),
+                                 old) == old) {
+                apr_atomic_dec32(slot->num_free);
+                if (w != start) {
+                    apr_atomic_set32(slot->hint, w);
+                }
+                *id = i;
+                return APR_SUCCESS;
+            }
         }
     }
-    if (i >= slot->desc.num) {
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, ap_server_conf, APLOGNO(02293)
-                     "slotmem(%s) grab failed. Num %u/num_free %u",
-                     slot->name, slotmem_num_slots(slot),
-                     slotmem_num_free_slots(slot));
-        return APR_EINVAL;
-    }
-    *inuse = 1;
-    *id = i;
-    (*slot->num_free)--;
-    return APR_SUCCESS;
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, ap_server_conf, APLOGNO(02293)
+                 "slotmem(%s) grab failed. Num %u/num_free %u",
+                 slot->name, slotmem_num_slots(slot),
+                 slotmem_num_free_slots(slot));
+    return APR_EINVAL;
 }
 
 static apr_status_t slotmem_fgrab(ap_slotmem_instance_t *slot, unsigned int id)
 {
-    char *inuse;
-    
     if (!slot) {
         return APR_ENOSHMAVAIL;
     }
@@ -673,11 +782,9 @@ static apr_status_t slotmem_fgrab(ap_slotmem_instance_t *slot, unsigned int id)
                      slotmem_num_free_slots(slot));
         return APR_EINVAL;
     }
-    inuse = slot->inuse + id;
 
-    if (!*inuse) {
-        *inuse = 1;
-        (*slot->num_free)--;
+    if (slotmem_setinuse(slot, id)) {
+        apr_atomic_dec32(slot->num_free);
     }
     return APR_SUCCESS;
 }
@@ -685,27 +792,34 @@ static apr_status_t slotmem_fgrab(ap_slotmem_instance_t *slot, unsigned int id)
 static apr_status_t slotmem_release(ap_slotmem_instance_t *slot,
                                     unsigned int id)
 {
-    char *inuse;
+    apr_uint32_t *word;
+    apr_uint32_t old = 0;
 
     if (!slot) {
         return APR_ENOSHMAVAIL;
     }
 
-    inuse = slot->inuse;
+    if (id < slot->desc.num) {
+        word = &slot->inuse[SLOT_WORD(id)];
+        do {
+            old = apr_atomic_read32(word);
+            if (!(old & SLOT_BIT(id))) {
+                break;
+            }
+        } while (apr_atomic_cas32(word, old & ~SLOT_BIT(id), old) != old);
+    }
 
-    if (id >= slot->desc.num || !inuse[id] ) {
+    if (!(old & SLOT_BIT(id))) {
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, ap_server_conf, APLOGNO(02294)
-                     "slotmem(%s) release failed. Num %u/inuse[%u] %d",
-                     slot->name, slotmem_num_slots(slot),
-                     id, (int)inuse[id]);
+                     "slotmem(%s) release failed. Num %u/inuse[%u] 0",
+                     slot->name, slotmem_num_slots(slot), id);
         if (id >= slot->desc.num) {
             return APR_EINVAL;
         } else {
             return APR_NOTFOUND;
         }
     }
-    inuse[id] = 0;
-    (*slot->num_free)++;
+    apr_atomic_inc32(slot->num_free);
     return APR_SUCCESS;
 }
 
@@ -0,0 +1,172 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * mod_dbd_test runs statements prepared with DBDPrepareSQL and writes
+ * their results as text, so that mod_dbd can be tested against a scratch
+ * database such as SQLite.  The query string is the label of the
+ * statement followed by its arguments, separated by '&'.  The dbd-test
+ * handler uses ap_dbd_cached_select, dbd-test-async uses
+ * ap_dbd_select_async, e.g.
+ *
+ *   DBDriver sqlite3
+ *   DBDParams /tmp/test.db
+ *   DBDPrepareSQL "SELECT value FROM t WHERE name = %s" byname
+ *   <Location /dbd>
+ *       SetHandler dbd-test-async
+ *   </Location>
+ *
+ *   GET /dbd?byname&foo
+ *
+ * The first line of the response is "sync" or "async", for the way the
+ * query actually ran, then "ok", "incomplete" or "error" and the error
+ * message.  One line of tab separated values per row follows, with SQL
+ * NULL written as \N.  test/dbd-test.sh runs it against SQLite.
+ */
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_protocol.h"
+#include "http_request.h"
+
+#include "apr_strings.h"
+
+#include "mod_dbd.h"
+
+module AP_MODULE_DECLARE_DATA dbd_test_module;
+
+static APR_OPTIONAL_FN_TYPE(ap_dbd_cached_select) *dbd_select = NULL;
+static APR_OPTIONAL_FN_TYPE(ap_dbd_select_async) *dbd_select_async = NULL;
+
+static int dbd_test_write(request_rec *r, apr_status_t rv,
+                          ap_dbd_result_t *res, const char *errmsg,
+                          void *baton)
+{
+    int i, j;
+
+    ap_set_content_type(r, "text/plain");
+    ap_rprintf(r, "%s %s%s%s\n", (const char *)baton,
+               rv == APR_SUCCESS ? "ok" :
+               rv == APR_INCOMPLETE ? "incomplete" : "error",
+               errmsg ? " " : "", errmsg ? errmsg : "");
+    if (res == NULL) {
+        return OK;
+    }
+    for (j = 0; j < res->rows->nelts; ++j) {
+        const char **row = APR_ARRAY_IDX(res->rows, j, const char **);
+
+        for (i = 0; i < res->ncols; ++i) {
+            if (i) {
+                ap_rputc('\t', r);
+            }
+            ap_rputs(row[i] ? row[i] : "\\N", r);
+        }
+        ap_rputc('\n', r);
+    }
+
+    return OK;
+}
+
+static int dbd_test_handler(request_rec *r)
+{
+    apr_array_header_t *vals;
+    ap_dbd_result_t *res = NULL;
+    const char *errmsg = NULL;
+    char *qs, *val, *last;
+    apr_status_t rv;
+    int async;
+
+    if (!r->handler) {
+        return DECLINED;
+    }
+    if (!strcmp(r->handler, "dbd-test")) {
+        async = 0;
+    }
+    else if (!strcmp(r->handler, "dbd-test-async")) {
+        async = 1;
+    }
+    else {
+        return DECLINED;
+    }
+    if (r->method_number != M_GET) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+    if (dbd_select == NULL) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02871)
+                      "dbd_test: mod_dbd is not loaded");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    if (r->args == NULL) {
+        return HTTP_BAD_REQUEST;
+    }
+
+    /* the label, then the arguments */
+    vals = apr_array_make(r->pool, 4, sizeof(const char *));
+    qs = apr_pstrdup(r->pool, r->args);
+    while ((val = apr_strtok(qs, "&", &last)) != NULL) {
+        qs = NULL;
+        if (ap_unescape_url(val) != OK) {
+            return HTTP_BAD_REQUEST;
+        }
+        APR_ARRAY_PUSH(vals, const char *) = val;
+    }
+    if (vals->nelts == 0) {
+        return HTTP_BAD_REQUEST;
+    }
+
+    if (async && dbd_select_async) {
+        rv = dbd_select_async(r, APR_ARRAY_IDX(vals, 0, const char *),
+                              vals->nelts - 1, (const char **)vals->elts + 1,
+                              dbd_test_write, (void *)"async");
+        if (rv == APR_SUCCESS) {
+            return SUSPENDED;
+        }
+        if (rv != APR_ENOTIMPL) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(02872)
+                          "dbd_test: failed to start asynchronous query");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    rv = dbd_select(r, APR_ARRAY_IDX(vals, 0, const char *),
+                    vals->nelts - 1, (const char **)vals->elts + 1,
+                    &res, &errmsg);
+    return dbd_test_write(r, rv, res, errmsg, (void *)"sync");
+}
+
+static void dbd_test_optional_fn_retrieve(void)
+{
+    dbd_select = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_cached_select);
+    dbd_select_async = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_select_async);
+}
+
+static void dbd_test_register_hooks(apr_pool_t *p)
+{
+    ap_hook_handler(dbd_test_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_optional_fn_retrieve(dbd_test_optional_fn_retrieve,
+                                 NULL, NULL, APR_HOOK_MIDDLE);
+}
+
+AP_DECLARE_MODULE(dbd_test) = {
+    STANDARD20_MODULE_STUFF,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    dbd_test_register_hooks
+};
@@ -19,7 +19,11 @@
 #include "apreq_error.h"
 #include "apreq_util.h"
 #include "apr_strings.h"
-#include "apr_strmatch.h"
+
+#if defined(__GNUC__) && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+#define MFD_SIMD
+#endif
 
 #ifndef CRLF
 #define CRLF    "\015\012"
@@ -45,7 +49,6 @@ struct mfd_ctx {
     apr_bucket_brigade          *bb;
     apreq_parser_t              *hdr_parser;
     apreq_parser_t              *next_parser;
-    const apr_strmatch_pattern  *pattern;
     char                        *bdry;
     enum {
         MFD_INIT,
@@ -109,9 +112,94 @@ static apr_status_t brigade_start_string(apr_bucket_brigade *bb,
 }
 
 
+/* Returns the offset of the first occurrence of bdry in buf, or else of
+ * a prefix of bdry at the very end of buf, or -1 if there is neither.
+ * This is apreq_index(buf, len, bdry, blen, APREQ_MATCH_PARTIAL), but
+ * the vector loops test a block of candidate positions at once against
+ * both the first and the last byte of bdry, so that memcmp() is hardly
+ * ever called on the file data between two boundaries.  bdry is at
+ * least two bytes long.
+ */
+static apr_ssize_t find_bdry(const char *buf, apr_size_t len,
+                             const char *bdry, apr_size_t blen)
+{
+    const char *p = buf, *end = buf + len;
+
+    if (len >= blen) {
+        /* the last position at which a complete match can start */
+        const char *last = end - blen;
+
+#ifdef MFD_SIMD
+#ifdef __AVX2__
+        const __m256i first32 = _mm256_set1_epi8(bdry[0]);
+        const __m256i final32 = _mm256_set1_epi8(bdry[blen - 1]);
+
+        while (last - p >= 31) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)p);
+            __m256i b = _mm256_loadu_si256((const __m256i *)(p + blen - 1));
+            unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(a, first32),
+                                 _mm256_cmpeq_epi8(b, final32)));
+
+            while (mask) {
+                int i = __builtin_ctz(mask);
+
+                if (memcmp(p + i + 1, bdry + 1, blen - 2) == 0)
+                    return p + i - buf;
+                mask &= mask - 1;
+            }
+            p += 32;
+        }
+#endif
+#ifdef __SSE2__
+        {
+            const __m128i first16 = _mm_set1_epi8(bdry[0]);
+            const __m128i final16 = _mm_set1_epi8(bdry[blen - 1]);
+
+            while (last - p >= 15) {
+                __m128i a = _mm_loadu_si128((const __m128i *)p);
+                __m128i b = _mm_loadu_si128((const __m128i *)(p + blen - 1));
+                unsigned int mask = (unsigned int)_mm_movemask_epi8(
+                    _mm_and_si128(_mm_cmpeq_epi8(a, first16),
+                                  _mm_cmpeq_epi8(b, final16)));
+
+                while (mask) {
+                    int i = __builtin_ctz(mask);
+
+                    if (memcmp(p + i + 1, bdry + 1, blen - 2) == 0)
+                        return p + i - buf;
+                    mask &= mask - 1;
+                }
+                p += 16;
+            }
+        }
+#endif
+#endif /* MFD_SIMD */
+
+        while (p <= last) {
+            p = memchr(p, bdry[0], last - p + 1);
+            if (p == NULL)
+                break;
+            if (memcmp(p, bdry, blen) == 0)
+                return p - buf;
+            ++p;
+        }
+        p = last + 1;
+    }
+
+    /* no complete match, so look for one cut off by the end of buf */
+    while (p < end && (p = memchr(p, bdry[0], end - p)) != NULL) {
+        if (memcmp(p, bdry, end - p) == 0)
+            return p - buf;
+        ++p;
+    }
+
+    return -1;
+}
+
+
 static apr_status_t split_on_bdry(apr_bucket_brigade *out,
                                   apr_bucket_brigade *in,
-                                  const apr_strmatch_pattern *pattern,
                                   const char *bdry)
 {
     apr_bucket *e = APR_BRIGADE_FIRST(in);
@@ -178,19 +266,7 @@ static apr_status_t split_on_bdry(apr_bucket_brigade *out,
             goto look_for_boundary_up_front;
         }
 
-        if (pattern != NULL && len >= blen) {
-            const char *match = apr_strmatch(pattern, buf, len);
-            if (match != NULL)
-                idx = match - buf;
-            else {
-                idx = apreq_index(buf + len-blen, blen, bdry, blen,
-                                  APREQ_MATCH_PARTIAL);
-                if (idx >= 0)
-                    idx += len-blen;
-            }
-        }
-        else
-            idx = apreq_index(buf, len, bdry, blen, APREQ_MATCH_PARTIAL);
+        idx = find_bdry(buf, len, bdry, blen);
 
         /* Theoretically idx should never be 0 here, because we
          * already tested the front of the brigade for a potential match.
@@ -242,7 +318,6 @@ struct mfd_ctx * create_multipart_context(const char *content_type,
     *--ctx->bdry = '\r';
 
     ctx->status = MFD_INIT;
-    ctx->pattern = apr_strmatch_precompile(pool, ctx->bdry, 1);
     ctx->hdr_parser = apreq_parser_make(pool, ba, "",
                                         apreq_parse_headers,
                                         brigade_limit,
@@ -287,7 +362,7 @@ APREQ_DECLARE_PARSER(apreq_parse_multipart)
 
     case MFD_INIT:
         {
-            s = split_on_bdry(ctx->bb, ctx->in, NULL, ctx->bdry + 2);
+            s = split_on_bdry(ctx->bb, ctx->in, ctx->bdry + 2);
             if (s != APR_SUCCESS) {
                 apreq_brigade_setaside(ctx->in, pool);
                 apreq_brigade_setaside(ctx->bb, pool);
@@ -302,7 +377,7 @@ APREQ_DECLARE_PARSER(apreq_parse_multipart)
 
     case MFD_NEXTLINE:
         {
-            s = split_on_bdry(ctx->bb, ctx->in, NULL, CRLF);
+            s = split_on_bdry(ctx->bb, ctx->in, CRLF);
             if (s == APR_EOF) {
                 ctx->status = MFD_COMPLETE;
                 return APR_SUCCESS;
@@ -530,7 +605,7 @@ APREQ_DECLARE_PARSER(apreq_parse_multipart)
             apr_size_t len;
             apr_off_t off;
 
-            s = split_on_bdry(ctx->bb, ctx->in, ctx->pattern, ctx->bdry);
+            s = split_on_bdry(ctx->bb, ctx->in, ctx->bdry);
 
             switch (s) {
 
@@ -585,7 +660,7 @@ APREQ_DECLARE_PARSER(apreq_parse_multipart)
         {
             apreq_param_t *param = ctx->upload;
 
-            s = split_on_bdry(ctx->bb, ctx->in, ctx->pattern, ctx->bdry);
+            s = split_on_bdry(ctx->bb, ctx->in, ctx->bdry);
             switch (s) {
 
             case APR_INCOMPLETE:
@@ -597,11 +672,15 @@ APREQ_DECLARE_PARSER(apreq_parse_multipart)
                     }
                 }
                 apreq_brigade_setaside(ctx->bb, pool);
-                apreq_brigade_setaside(ctx->in, pool);
                 s = apreq_brigade_concat(pool, parser->temp_dir,
                                          parser->brigade_limit,
                                          param->upload, ctx->bb);
-                return (s == APR_SUCCESS) ? APR_INCOMPLETE : s;
+                if (s != APR_SUCCESS) {
+                    ctx->status = MFD_ERROR;
+                    return s;
+                }
+                apreq_brigade_setaside(ctx->in, pool);
+                return APR_INCOMPLETE;
 
             case APR_SUCCESS:
                 if (parser->hook != NULL) {
@@ -618,9 +697,10 @@ APREQ_DECLARE_PARSER(apreq_parse_multipart)
                 s = apreq_brigade_concat(pool, parser->temp_dir,
                                          parser->brigade_limit,
                                          param->upload, ctx->bb);
-
-                if (s != APR_SUCCESS)
+                if (s != APR_SUCCESS) {
+                    ctx->status = MFD_ERROR;
                     return s;
+                }
 
                 ctx->status = MFD_NEXTLINE;
                 goto mfd_parse_brigade;
@@ -430,7 +430,7 @@ AP_CORE_DECLARE(int) ap_invoke_handler(request_rec *r)
         r->handler = handler;
     }
 
-    result = ap_run_handler(r);
+    result = AP_RUN_REQUEST_HOOK(r, AP_REQUEST_PHASE_HANDLER, handler, 0);
 
     r->handler = old_handler;
 
@@ -41,6 +41,7 @@
 #include "apr_buckets.h"
 #include "util_filter.h"
 #include "util_ebcdic.h"
+#include "util_headers.h"
 #include "util_mutex.h"
 #include "util_time.h"
 #include "mpm_common.h"
@@ -529,6 +530,9 @@ static void *merge_core_server_configs(apr_pool_t *p, void *basev, void *virtv)
     if (virt->http_expect_strict != AP_HTTP_EXPECT_STRICT_UNSET)
         conf->http_expect_strict = virt->http_expect_strict;
 
+    if (virt->request_timing != AP_REQUEST_TIMING_UNSET)
+        conf->request_timing = virt->request_timing;
+
     /* no action for virt->accf_map, not allowed per-vhost */
 
     if (virt->protocol)
@@ -3753,6 +3757,28 @@ static const char *set_trace_enable(cmd_parms *cmd, void *dummy,
     return NULL;
 }
 
+static const char *set_request_timing(cmd_parms *cmd, void *dummy,
+                                      const char *arg1)
+{
+    core_server_config *conf =
+        ap_get_core_module_config(cmd->server->module_config);
+
+    if (strcasecmp(arg1, "on") == 0) {
+        conf->request_timing = AP_REQUEST_TIMING_ON;
+    }
+    else if (strcasecmp(arg1, "off") == 0) {
+        conf->request_timing = AP_REQUEST_TIMING_OFF;
+    }
+    else if (strcasecmp(arg1, "detail") == 0) {
+        conf->request_timing = AP_REQUEST_TIMING_DETAIL;
+    }
+    else {
+        return "RequestTiming must be one of 'on', 'off', or 'detail'";
+    }
+
+    return NULL;
+}
+
 static const char *set_http_protocol(cmd_parms *cmd, void *dummy,
                                      const char *arg)
 {
@@ -4389,6 +4415,9 @@ AP_INIT_TAKE1("EnableExceptionHook", ap_mpm_set_exception_hook, NULL, RSRC_CONF,
 #endif
 AP_INIT_TAKE1("TraceEnable", set_trace_enable, NULL, RSRC_CONF,
               "'on' (default), 'off' or 'extended' to trace request body content"),
+AP_INIT_TAKE1("RequestTiming", set_request_timing, NULL, RSRC_CONF,
+              "'off' (default), 'on' to time the request processing phases, "
+              "or 'detail' to time hooks and filters too"),
 AP_INIT_FLAG("MergeTrailers", set_merge_trailers, NULL, RSRC_CONF,
               "merge request trailers into request headers or not"),
 AP_INIT_ITERATE("HttpProtocol", set_http_protocol, NULL, RSRC_CONF,
@@ -4740,6 +4769,7 @@ static int core_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptem
                               apr_pool_cleanup_null);
 
     mpm_common_pre_config(pconf);
+    ap_header_init();
 
     return OK;
 }
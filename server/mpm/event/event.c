@@ -166,6 +166,9 @@
 #define DEFAULT_WORKER_FACTOR 2
 #endif
 #define WORKER_FACTOR_SCALE   16  /* scale factor to allow fractional values */
+
+/* Size of the block a transaction pool keeps when it is cleared */
+#define TRANS_POOL_BLOCK (8 * 1024)
 static unsigned int worker_factor = DEFAULT_WORKER_FACTOR * WORKER_FACTOR_SCALE;
 
 static int threads_per_child = 0;   /* Worker threads per child */
@@ -176,6 +179,8 @@ static int ap_daemons_limit = 0;
 static int max_workers = 0;
 static int server_limit = 0;
 static int thread_limit = 0;
+static apr_size_t max_mem_recycled = 0; /* MaxMemRecycled, 0 if unset */
+static apr_uint32_t ptrans_max_free = 0; /* allocator limit of ptrans */
 static int had_healthy_child = 0;
 static int dying = 0;
 static int workers_may_exit = 0;
@@ -1902,7 +1907,7 @@ static void * APR_THREAD_FUNC listener_thread(apr_thread_t * thd, void *dummy)
 
                         apr_allocator_create(&allocator);
                         apr_allocator_max_free_set(allocator,
-                                                   ap_max_mem_free);
+                                                   ptrans_max_free);
                         apr_pool_create_ex(&ptrans, pconf, NULL, allocator);
                         apr_allocator_owner_set(allocator, ptrans);
                         if (ptrans == NULL) {
@@ -2032,6 +2037,11 @@ static void * APR_THREAD_FUNC listener_thread(apr_thread_t * thd, void *dummy)
             ps->connections = apr_atomic_read32(&connection_count);
             ps->suspended = apr_atomic_read32(&suspended_count);
             ps->lingering_close = apr_atomic_read32(&lingering_count);
+            ap_queue_info_get_pool_stats(worker_queue_info,
+                                         &ps->recycled_pools,
+                                         &ps->recycled_pools_peak,
+                                         &ps->pool_hits, &ps->pool_misses,
+                                         &ps->pools_destroyed);
         }
         if (listeners_disabled && !workers_were_busy
             && ((c_count = apr_atomic_read32(&connection_count))
@@ -2226,10 +2236,41 @@ static void *APR_THREAD_FUNC start_threads(apr_thread_t * thd, void *dummy)
         clean_child_exit(APEXIT_CHILDFATAL);
     }
 
-    if (ap_max_mem_free != APR_ALLOCATOR_MAX_FREE_UNLIMITED) {
+    ptrans_max_free = ap_max_mem_free;
+    if (max_mem_recycled) {
+        /* A cleared transaction pool keeps its first block, and its
+         * allocator keeps at most ptrans_max_free bytes of free blocks,
+         * however large the requests it served were.  Charge every
+         * recycled pool that much and keep as many as MaxMemRecycled
+         * allows; the others are destroyed when they are returned.
+         */
+        apr_size_t pool_cost;
+
+        if (ptrans_max_free == APR_ALLOCATOR_MAX_FREE_UNLIMITED) {
+            /* Without MaxMemFree the free lists are unbounded, so limit
+             * them to an even share of the budget.
+             */
+            apr_size_t share = max_mem_recycled / threads_per_child;
+
+            if (share < TRANS_POOL_BLOCK) {
+                share = TRANS_POOL_BLOCK;
+            }
+            else if (share > APR_UINT32_MAX) {
+                share = APR_UINT32_MAX;
+            }
+            ptrans_max_free = (apr_uint32_t)share;
+        }
+        pool_cost = (apr_size_t)ptrans_max_free + TRANS_POOL_BLOCK;
+        if (max_mem_recycled / pool_cost < (apr_size_t)threads_per_child) {
+            max_recycled_pools = max_mem_recycled / pool_cost;
+        }
+        else {
+            max_recycled_pools = threads_per_child;
+        }
+    }
+    else if (ap_max_mem_free != APR_ALLOCATOR_MAX_FREE_UNLIMITED) {
         /* If we want to conserve memory, let's not keep an unlimited number of
          * pools & allocators.
-         * XXX: This should probably be a separate config directive
          */
         max_recycled_pools = threads_per_child * 3 / 4 ;
     }
@@ -3349,6 +3390,7 @@ static int event_pre_config(apr_pool_t * pconf, apr_pool_t * plog,
     max_spare_threads = DEFAULT_MAX_FREE_DAEMON * DEFAULT_THREADS_PER_CHILD;
     server_limit = DEFAULT_SERVER_LIMIT;
     thread_limit = DEFAULT_THREAD_LIMIT;
+    max_mem_recycled = 0;
     ap_daemons_limit = server_limit;
     threads_per_child = DEFAULT_THREADS_PER_CHILD;
     max_workers = ap_daemons_limit * threads_per_child;
@@ -3734,6 +3776,27 @@ static const char *set_worker_factor(cmd_parms * cmd, void *dummy,
 }
 
 
+static const char *set_max_mem_recycled(cmd_parms * cmd, void *dummy,
+                                        const char *arg)
+{
+    long val;
+    char *endptr;
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL) {
+        return err;
+    }
+
+    errno = 0;
+    val = strtol(arg, &endptr, 10);
+    if (*endptr || val < 0 || errno == ERANGE) {
+        return apr_pstrcat(cmd->pool, "Invalid MaxMemRecycled value: ",
+                           arg, NULL);
+    }
+
+    max_mem_recycled = (apr_size_t)val * 1024;
+    return NULL;
+}
+
 static const command_rec event_cmds[] = {
     LISTEN_COMMANDS,
     AP_INIT_TAKE1("StartServers", set_daemons_to_start, NULL, RSRC_CONF,
@@ -3756,6 +3819,9 @@ static const command_rec event_cmds[] = {
     AP_INIT_TAKE1("AsyncRequestWorkerFactor", set_worker_factor, NULL, RSRC_CONF,
                   "How many additional connects will be accepted per idle "
                   "worker thread"),
+    AP_INIT_TAKE1("MaxMemRecycled", set_max_mem_recycled, NULL, RSRC_CONF,
+                  "Maximum amount of memory in KBytes each child process "
+                  "keeps in transaction pools for reuse"),
     AP_GRACEFUL_SHUTDOWN_TIMEOUT_COMMAND,
     {NULL}
 };
@@ -15,6 +15,7 @@
  */
 
 #include "fdqueue.h"
+#include "ap_usdt.h"
 #include "apr_atomic.h"
 
 static const apr_uint32_t zero_pt = APR_UINT32_MAX/2;
@@ -38,6 +39,11 @@ struct fd_queue_info_t
     int max_idlers;
     int max_recycled_pools;
     apr_uint32_t recycled_pools_count;
+    apr_uint32_t recycled_pools_peak;
+    apr_uint32_t pools_destroyed;
+    /* only updated by the single thread calling ap_pop_pool() */
+    apr_uint32_t pool_hits;
+    apr_uint32_t pool_misses;
     struct recycled_pool *recycled_pools;
 };
 
@@ -213,19 +219,33 @@ void ap_push_pool(fd_queue_info_t * queue_info,
                                     apr_pool_t * pool_to_recycle)
 {
     struct recycled_pool *new_recycle;
+    apr_uint32_t cnt;
+
     /* If we have been given a pool to recycle, atomically link
      * it into the queue_info's list of recycled pools
      */
     if (!pool_to_recycle)
         return;
 
-    if (queue_info->max_recycled_pools >= 0) {
-        apr_uint32_t cnt = apr_atomic_read32(&queue_info->recycled_pools_count);
-        if (cnt >= queue_info->max_recycled_pools) {
-            apr_pool_destroy(pool_to_recycle);
-            return;
+    cnt = apr_atomic_read32(&queue_info->recycled_pools_count);
+    if (queue_info->max_recycled_pools >= 0
+        && cnt >= queue_info->max_recycled_pools) {
+        /* Over the child's budget: give the pool's memory, including
+         * whatever its allocator kept from the largest request it served,
+         * back to the system.
+         */
+        apr_pool_destroy(pool_to_recycle);
+        apr_atomic_inc32(&queue_info->pools_destroyed);
+        return;
+    }
+    cnt = apr_atomic_inc32(&queue_info->recycled_pools_count) + 1;
+    for (;;) {
+        apr_uint32_t peak = apr_atomic_read32(&queue_info->recycled_pools_peak);
+        if (cnt <= peak
+            || apr_atomic_cas32(&queue_info->recycled_pools_peak,
+                                cnt, peak) == peak) {
+            break;
         }
-        apr_atomic_inc32(&queue_info->recycled_pools_count);
     }
 
     apr_pool_clear(pool_to_recycle);
@@ -270,11 +290,31 @@ void ap_pop_pool(apr_pool_t ** recycled_pool, fd_queue_info_t * queue_info)
             ((void*) &(queue_info->recycled_pools),
              first_pool->next, first_pool) == first_pool) {
             *recycled_pool = first_pool->pool;
-            if (queue_info->max_recycled_pools >= 0)
-                apr_atomic_dec32(&queue_info->recycled_pools_count);
+            apr_atomic_dec32(&queue_info->recycled_pools_count);
             break;
         }
     }
+
+    if (*recycled_pool) {
+        queue_info->pool_hits++;
+    }
+    else {
+        queue_info->pool_misses++;
+    }
+}
+
+void ap_queue_info_get_pool_stats(fd_queue_info_t * queue_info,
+                                  apr_uint32_t *recycled,
+                                  apr_uint32_t *peak,
+                                  apr_uint32_t *hits,
+                                  apr_uint32_t *misses,
+                                  apr_uint32_t *destroyed)
+{
+    *recycled = apr_atomic_read32(&queue_info->recycled_pools_count);
+    *peak = apr_atomic_read32(&queue_info->recycled_pools_peak);
+    *hits = queue_info->pool_hits;
+    *misses = queue_info->pool_misses;
+    *destroyed = apr_atomic_read32(&queue_info->pools_destroyed);
 }
 
 apr_status_t ap_queue_info_term(fd_queue_info_t * queue_info)
@@ -381,6 +421,7 @@ apr_status_t ap_queue_push(fd_queue_t * queue, apr_socket_t * sd,
     elem->ecs = ecs;
     elem->p = p;
     queue->nelts++;
+    AP_USDT_PROBE2(mpm__queue__push, sd, queue->nelts);
 
     apr_thread_cond_signal(queue->not_empty);
 
@@ -464,6 +505,7 @@ apr_status_t ap_queue_pop_something(fd_queue_t * queue, apr_socket_t ** sd,
         *sd = elem->sd;
         *ecs = elem->ecs;
         *p = elem->p;
+        AP_USDT_PROBE2(mpm__queue__pop, elem->sd, queue->nelts);
 #ifdef AP_DEBUG
         elem->sd = NULL;
         elem->p = NULL;
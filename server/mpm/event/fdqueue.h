@@ -89,6 +89,12 @@ typedef struct fd_queue_t fd_queue_t;
 void ap_pop_pool(apr_pool_t ** recycled_pool, fd_queue_info_t * queue_info);
 void ap_push_pool(fd_queue_info_t * queue_info,
                                     apr_pool_t * pool_to_recycle);
+void ap_queue_info_get_pool_stats(fd_queue_info_t * queue_info,
+                                  apr_uint32_t *recycled,
+                                  apr_uint32_t *peak,
+                                  apr_uint32_t *hits,
+                                  apr_uint32_t *misses,
+                                  apr_uint32_t *destroyed);
 
 apr_status_t ap_queue_init(fd_queue_t * queue, int queue_capacity,
                            apr_pool_t * a);
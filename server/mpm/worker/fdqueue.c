@@ -15,6 +15,7 @@
  */
 
 #include "fdqueue.h"
+#include "ap_usdt.h"
 #include "apr_atomic.h"
 
 typedef struct recycled_pool {
@@ -311,6 +312,7 @@ apr_status_t ap_queue_push(fd_queue_t *queue, apr_socket_t *sd, apr_pool_t *p)
     elem->sd = sd;
     elem->p = p;
     queue->nelts++;
+    AP_USDT_PROBE2(mpm__queue__push, sd, queue->nelts);
 
     apr_thread_cond_signal(queue->not_empty);
 
@@ -363,6 +365,7 @@ apr_status_t ap_queue_pop(fd_queue_t *queue, apr_socket_t **sd, apr_pool_t **p)
     queue->nelts--;
     *sd = elem->sd;
     *p = elem->p;
+    AP_USDT_PROBE2(mpm__queue__pop, elem->sd, queue->nelts);
 #ifdef AP_DEBUG
     elem->sd = NULL;
     elem->p = NULL;
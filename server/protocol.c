@@ -1179,6 +1179,8 @@ request_rec *ap_read_request(conn_rec *conn)
     /* we may have switched to another server */
     r->per_dir_config = r->server->lookup_defaults;
 
+    ap_request_timing_init(r);
+
     if ((!r->hostname && (r->proto_num >= HTTP_VERSION(1, 1)))
         || ((r->proto_num == HTTP_VERSION(1, 1))
             && !apr_table_get(r->headers_in, "Host"))) {
@@ -1206,7 +1208,8 @@ request_rec *ap_read_request(conn_rec *conn)
                                NULL, r, r->connection);
 
     if (access_status != HTTP_OK
-        || (access_status = ap_run_post_read_request(r))) {
+        || (access_status = AP_RUN_REQUEST_HOOK(r, AP_REQUEST_PHASE_POST_READ,
+                                                post_read_request, 1))) {
         ap_die(access_status, r);
         ap_update_child_status(conn->sbh, SERVER_BUSY_LOG, r);
         ap_run_log_transaction(r);
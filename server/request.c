@@ -118,6 +118,140 @@ static int decl_die(int status, const char *phase, request_rec *r)
     }
 }
 
+static const char * const request_phase_names[AP_REQUEST_PHASES] = {
+    "read",
+    "post_read",
+    "walk",
+    "translate",
+    "map_to_storage",
+    "header_parser",
+    "auth",
+    "type",
+    "fixups",
+    "handler"
+};
+
+/* Same layout as the ap_LINK_<hook>_t of each hook which takes only the
+ * request, as mod_info also assumes.
+ */
+typedef struct {
+    int (*pFunc)(request_rec *r);
+    const char *szName;
+    const char * const *aszPredecessors;
+    const char * const *aszSuccessors;
+    int nOrder;
+} request_hook_t;
+
+AP_DECLARE(void) ap_request_timing_init(request_rec *r)
+{
+    core_server_config *conf;
+    ap_request_timing_t *t;
+
+    conf = ap_get_core_module_config(r->server->module_config);
+    if (conf->request_timing != AP_REQUEST_TIMING_ON
+        && conf->request_timing != AP_REQUEST_TIMING_DETAIL) {
+        return;
+    }
+
+    t = apr_pcalloc(r->pool, sizeof(*t));
+    t->phase[AP_REQUEST_PHASE_READ] = apr_time_now() - r->request_time;
+    if (conf->request_timing == AP_REQUEST_TIMING_DETAIL) {
+        t->detail = 1;
+        t->hooks = apr_array_make(r->pool, 16,
+                                  sizeof(ap_request_timing_hook_t));
+        t->filters = apr_array_make(r->pool, 8,
+                                    sizeof(ap_request_timing_filter_t));
+    }
+    r->timing = t;
+}
+
+AP_DECLARE(const char *) ap_request_phase_name(int phase)
+{
+    if (phase < 0 || phase >= AP_REQUEST_PHASES) {
+        return NULL;
+    }
+    return request_phase_names[phase];
+}
+
+static void add_hook_time(ap_request_timing_t *t, const char *hook,
+                          const char *module, apr_interval_time_t time)
+{
+    ap_request_timing_hook_t *h = (ap_request_timing_hook_t *)t->hooks->elts;
+    int i;
+
+    for (i = 0; i < t->hooks->nelts; i++) {
+        if (h[i].module == module
+            && (h[i].hook == hook || !strcmp(h[i].hook, hook))) {
+            h[i].time += time;
+            h[i].calls++;
+            return;
+        }
+    }
+
+    h = apr_array_push(t->hooks);
+    h->hook = hook;
+    h->module = module;
+    h->time = time;
+    h->calls = 1;
+}
+
+AP_CORE_DECLARE(int) ap_run_timed_request_hook(request_rec *r, int phase,
+                                               const char *hook,
+                                               apr_array_header_t *hooks,
+                                               int run_all)
+{
+    ap_request_timing_t *t = r->timing;
+    request_hook_t *h;
+    int i, rv;
+
+    if (!hooks) {
+        return run_all ? OK : DECLINED;
+    }
+
+    h = (request_hook_t *)hooks->elts;
+    for (i = 0; i < hooks->nelts; i++) {
+        apr_interval_time_t outer = t->nested, spent;
+        apr_time_t start = apr_time_now();
+
+        /* whatever an internal redirect accounts meanwhile is its own */
+        t->nested = 0;
+        rv = h[i].pFunc(r);
+        spent = apr_time_now() - start;
+        t->phase[phase] += spent - t->nested;
+        if (t->detail) {
+            add_hook_time(t, hook, h[i].szName, spent - t->nested);
+        }
+        t->nested = outer + spent;
+
+        if (rv != DECLINED && (!run_all || rv != OK)) {
+            return rv;
+        }
+    }
+
+    return run_all ? OK : DECLINED;
+}
+
+/* The <Location> and <If> walks */
+static int location_if_walk(request_rec *r)
+{
+    ap_request_timing_t *t = r->timing;
+    apr_time_t start = t ? apr_time_now() : 0;
+    int access_status;
+
+    if (!(access_status = ap_location_walk(r))) {
+        access_status = ap_if_walk(r);
+    }
+
+    if (t) {
+        apr_interval_time_t spent = apr_time_now() - start;
+
+        t->phase[AP_REQUEST_PHASE_WALK] += spent;
+        t->nested += spent;
+    }
+
+    return access_status;
+}
+
 /* This is the master logic for processing requests.  Do NOT duplicate
  * this logic elsewhere, or the security model will be broken by future
  * API changes.  Each phase must be individually optimized to pick up
@@ -158,10 +292,7 @@ AP_DECLARE(int) ap_process_request_internal(request_rec *r)
      * otherwise let translate_name kill the request.
      */
     if (!file_req) {
-        if ((access_status = ap_location_walk(r))) {
-            return access_status;
-        }
-        if ((access_status = ap_if_walk(r))) {
+        if ((access_status = location_if_walk(r))) {
             return access_status;
         }
 
@@ -172,7 +303,9 @@ AP_DECLARE(int) ap_process_request_internal(request_rec *r)
                 r->log = d->log;
         }
 
-        if ((access_status = ap_run_translate_name(r))) {
+        if ((access_status = AP_RUN_REQUEST_HOOK(r,
+                                 AP_REQUEST_PHASE_TRANSLATE,
+                                 translate_name, 0))) {
             return decl_die(access_status, "translate", r);
         }
     }
@@ -181,17 +314,16 @@ AP_DECLARE(int) ap_process_request_internal(request_rec *r)
      */
     r->per_dir_config = r->server->lookup_defaults;
 
-    if ((access_status = ap_run_map_to_storage(r))) {
+    if ((access_status = AP_RUN_REQUEST_HOOK(r,
+                             AP_REQUEST_PHASE_MAP_TO_STORAGE,
+                             map_to_storage, 0))) {
         /* This request wasn't in storage (e.g. TRACE) */
         return access_status;
     }
 
     /* Rerun the location walk, which overrides any map_to_storage config.
      */
-    if ((access_status = ap_location_walk(r))) {
-        return access_status;
-    }
-    if ((access_status = ap_if_walk(r))) {
+    if ((access_status = location_if_walk(r))) {
         return access_status;
     }
 
@@ -208,7 +340,9 @@ AP_DECLARE(int) ap_process_request_internal(request_rec *r)
 
     /* Only on the main request! */
     if (r->main == NULL) {
-        if ((access_status = ap_run_header_parser(r))) {
+        if ((access_status = AP_RUN_REQUEST_HOOK(r,
+                                 AP_REQUEST_PHASE_HEADER_PARSER,
+                                 header_parser, 1))) {
             return access_status;
         }
     }
@@ -230,12 +364,15 @@ AP_DECLARE(int) ap_process_request_internal(request_rec *r)
         switch (ap_satisfies(r)) {
         case SATISFY_ALL:
         case SATISFY_NOSPEC:
-            if ((access_status = ap_run_access_checker(r)) != OK) {
+            if ((access_status = AP_RUN_REQUEST_HOOK(r,
+                                     AP_REQUEST_PHASE_AUTH,
+                                     access_checker, 1)) != OK) {
                 return decl_die(access_status,
                                 "check access (with Satisfy All)", r);
             }
 
-            access_status = ap_run_access_checker_ex(r);
+            access_status = AP_RUN_REQUEST_HOOK(r, AP_REQUEST_PHASE_AUTH,
+                                                access_checker_ex, 0);
             if (access_status == OK) {
                 ap_log_rerror(APLOG_MARK, APLOG_TRACE3, 0, r,
                               "request authorized without authentication by "
@@ -245,7 +382,9 @@ AP_DECLARE(int) ap_process_request_internal(request_rec *r)
                 return decl_die(access_status, "check access", r);
             }
             else {
-                if ((access_status = ap_run_check_user_id(r)) != OK) {
+                if ((access_status = AP_RUN_REQUEST_HOOK(r,
+                                         AP_REQUEST_PHASE_AUTH,
+                                         check_user_id, 0)) != OK) {
                     return decl_die(access_status, "check user", r);
                 }
                 if (r->user == NULL) {
@@ -258,13 +397,17 @@ AP_DECLARE(int) ap_process_request_internal(request_rec *r)
                     access_status = HTTP_INTERNAL_SERVER_ERROR;
                     return decl_die(access_status, "check user", r);
                 }
-                if ((access_status = ap_run_auth_checker(r)) != OK) {
+                if ((access_status = AP_RUN_REQUEST_HOOK(r,
+                                         AP_REQUEST_PHASE_AUTH,
+                                         auth_checker, 0)) != OK) {
                     return decl_die(access_status, "check authorization", r);
                 }
             }
             break;
         case SATISFY_ANY:
-            if ((access_status = ap_run_access_checker(r)) == OK) {
+            if ((access_status = AP_RUN_REQUEST_HOOK(r,
+                                     AP_REQUEST_PHASE_AUTH,
+                                     access_checker, 1)) == OK) {
                 ap_log_rerror(APLOG_MARK, APLOG_TRACE3, 0, r,
                               "request authorized without authentication by "
                               "access_checker hook and 'Satisfy any': %s",
@@ -272,7 +415,8 @@ AP_DECLARE(int) ap_process_request_internal(request_rec *r)
                 break;
             }
 
-            access_status = ap_run_access_checker_ex(r);
+            access_status = AP_RUN_REQUEST_HOOK(r, AP_REQUEST_PHASE_AUTH,
+                                                access_checker_ex, 0);
             if (access_status == OK) {
                 ap_log_rerror(APLOG_MARK, APLOG_TRACE3, 0, r,
                               "request authorized without authentication by "
@@ -282,7 +426,9 @@ AP_DECLARE(int) ap_process_request_internal(request_rec *r)
                 return decl_die(access_status, "check access", r);
             }
             else {
-                if ((access_status = ap_run_check_user_id(r)) != OK) {
+                if ((access_status = AP_RUN_REQUEST_HOOK(r,
+                                         AP_REQUEST_PHASE_AUTH,
+                                         check_user_id, 0)) != OK) {
                     return decl_die(access_status, "check user", r);
                 }
                 if (r->user == NULL) {
@@ -295,7 +441,9 @@ AP_DECLARE(int) ap_process_request_internal(request_rec *r)
                     access_status = HTTP_INTERNAL_SERVER_ERROR;
                     return decl_die(access_status, "check user", r);
                 }
-                if ((access_status = ap_run_auth_checker(r)) != OK) {
+                if ((access_status = AP_RUN_REQUEST_HOOK(r,
+                                         AP_REQUEST_PHASE_AUTH,
+                                         auth_checker, 0)) != OK) {
                     return decl_die(access_status, "check authorization", r);
                 }
             }
@@ -306,11 +454,13 @@ AP_DECLARE(int) ap_process_request_internal(request_rec *r)
      * in mod-proxy for r->proxyreq && r->parsed_uri.scheme
      *                              && !strcmp(r->parsed_uri.scheme, "http")
      */
-    if ((access_status = ap_run_type_checker(r)) != OK) {
+    if ((access_status = AP_RUN_REQUEST_HOOK(r, AP_REQUEST_PHASE_TYPE,
+                                             type_checker, 0)) != OK) {
         return decl_die(access_status, "find types", r);
     }
 
-    if ((access_status = ap_run_fixups(r)) != OK) {
+    if ((access_status = AP_RUN_REQUEST_HOOK(r, AP_REQUEST_PHASE_FIXUPS,
+                                             fixups, 1)) != OK) {
         ap_log_rerror(APLOG_MARK, APLOG_TRACE3, 0, r, "fixups hook gave %d: %s",
                       access_status, r->uri);
         return access_status;
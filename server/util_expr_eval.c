@@ -63,6 +63,9 @@ static const char *ap_expr_eval_var(ap_expr_eval_ctx_t *ctx,
                                     ap_expr_var_func_t *func,
                                     const void *data);
 
+static const ap_expr_t *expr_fold(ap_expr_parse_ctx_t *ctx,
+                                  const ap_expr_t *root);
+
 /* define AP_EXPR_DEBUG to log the parse tree when parsing an expression */
 #ifdef AP_EXPR_DEBUG
 static void expr_dump_tree(const ap_expr_t *e, const server_rec *s,
@@ -408,6 +411,9 @@ AP_DECLARE(const char *) ap_expr_parse(apr_pool_t *pool, apr_pool_t *ptemp,
     if (rc) /* XXX can this happen? */
         return "syntax error";
 
+    if (ctx.expr)
+        ctx.expr = (ap_expr_t *)expr_fold(&ctx, ctx.expr);
+
 #ifdef AP_EXPR_DEBUG
     if (ctx.expr)
         expr_dump_tree(ctx.expr, NULL, APLOG_NOTICE, 2);
@@ -1340,6 +1346,60 @@ static int op_file_subr(ap_expr_eval_ctx_t *ctx, const void *data, const char *a
 }
 
 
+/*
+ * Per-request memo of values which are costly to derive, shared by all
+ * expressions evaluated for the same request.  Each value is stored with
+ * the input it was derived from and only reused while that input is
+ * unchanged, so the memo never returns a stale result.
+ */
+typedef struct {
+    apr_time_t      now_sec;
+    apr_time_exp_t  now;
+    apr_time_t      mtime;
+    const char     *mtime_str;
+    apr_uid_t       uid;
+    char           *uid_name;
+    apr_gid_t       gid;
+    char           *gid_name;
+} expr_request_memo;
+
+#define EXPR_MEMO_KEY "ap_expr_request_memo"
+
+static expr_request_memo *expr_memo_get(ap_expr_eval_ctx_t *ctx)
+{
+    void *memo;
+
+    if (!ctx->r)
+        return NULL;
+
+    apr_pool_userdata_get(&memo, EXPR_MEMO_KEY, ctx->r->pool);
+    if (!memo) {
+        expr_request_memo *m = apr_pcalloc(ctx->r->pool, sizeof(*m));
+        m->now_sec = -1;
+        m->mtime = -1;
+        apr_pool_userdata_setn(m, EXPR_MEMO_KEY, NULL, ctx->r->pool);
+        memo = m;
+    }
+    return memo;
+}
+
+/* The current local time, exploded at most once per second and request */
+static void expr_time_now(ap_expr_eval_ctx_t *ctx, apr_time_exp_t *tm)
+{
+    expr_request_memo *memo = expr_memo_get(ctx);
+    apr_time_t now = apr_time_now();
+
+    if (!memo) {
+        apr_time_exp_lt(tm, now);
+        return;
+    }
+    if (memo->now_sec != apr_time_sec(now)) {
+        apr_time_exp_lt(&memo->now, apr_time_from_sec(apr_time_sec(now)));
+        memo->now_sec = apr_time_sec(now);
+    }
+    *tm = memo->now;
+}
+
 APR_DECLARE_OPTIONAL_FN(int, ssl_is_https, (conn_rec *));
 static APR_OPTIONAL_FN_TYPE(ssl_is_https) *is_https = NULL;
 
@@ -1420,6 +1480,7 @@ static const char *request_var_names[] = {
     "SERVER_PROTOCOL_VERSION",  /* 29 */
     "SERVER_PROTOCOL_VERSION_MAJOR",  /* 30 */
     "SERVER_PROTOCOL_VERSION_MINOR",  /* 31 */
+    "REQUEST_DURATION",         /* 32 */
     NULL
 };
 
@@ -1476,28 +1537,51 @@ static const char *request_var_fn(ap_expr_eval_ctx_t *ctx, const void *data)
         return r->log_id;
     case 21:
         {
+            expr_request_memo *memo = expr_memo_get(ctx);
             char *result = "";
-            if (r->finfo.valid & APR_FINFO_USER)
-                apr_uid_name_get(&result, r->finfo.user, ctx->p);
+            if (!(r->finfo.valid & APR_FINFO_USER))
+                return result;
+            if (memo->uid_name && memo->uid == r->finfo.user)
+                return memo->uid_name;
+            if (apr_uid_name_get(&result, r->finfo.user, r->pool)
+                == APR_SUCCESS) {
+                memo->uid = r->finfo.user;
+                memo->uid_name = result;
+            }
             return result;
         }
     case 22:
         {
+            expr_request_memo *memo = expr_memo_get(ctx);
             char *result = "";
-            if (r->finfo.valid & APR_FINFO_USER)
-                apr_gid_name_get(&result, r->finfo.group, ctx->p);
+            if (!(r->finfo.valid & APR_FINFO_USER))
+                return result;
+            if (memo->gid_name && memo->gid == r->finfo.group)
+                return memo->gid_name;
+            if (apr_gid_name_get(&result, r->finfo.group, r->pool)
+                == APR_SUCCESS) {
+                memo->gid = r->finfo.group;
+                memo->gid_name = result;
+            }
             return result;
         }
     case 23:
         return r->uri;
     case 24:
         {
+            expr_request_memo *memo = expr_memo_get(ctx);
             apr_time_exp_t tm;
+            if (memo->mtime_str && memo->mtime == r->mtime)
+                return memo->mtime_str;
             apr_time_exp_lt(&tm, r->mtime);
-            return apr_psprintf(ctx->p, "%02d%02d%02d%02d%02d%02d%02d",
-                                (tm.tm_year / 100) + 19, (tm.tm_year % 100),
-                                tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min,
-                                tm.tm_sec);
+            memo->mtime = r->mtime;
+            memo->mtime_str = apr_psprintf(r->pool,
+                                           "%02d%02d%02d%02d%02d%02d%02d",
+                                           (tm.tm_year / 100) + 19,
+                                           (tm.tm_year % 100),
+                                           tm.tm_mon+1, tm.tm_mday,
+                                           tm.tm_hour, tm.tm_min, tm.tm_sec);
+            return memo->mtime_str;
         }
     case 25:
         return ap_context_prefix(r);
@@ -1527,6 +1611,9 @@ static const char *request_var_fn(ap_expr_eval_ctx_t *ctx, const void *data)
         case 9:     return "9";
         }
         return apr_psprintf(ctx->p, "%d", HTTP_VERSION_MINOR(r->proto_num));
+    case 32:
+        return apr_psprintf(ctx->p, "%" APR_TIME_T_FMT,
+                            apr_time_now() - r->request_time);
     default:
         ap_assert(0);
         return NULL;
@@ -1587,7 +1674,16 @@ static const char *misc_var_fn(ap_expr_eval_ctx_t *ctx, const void *data)
 {
     apr_time_exp_t tm;
     int index = ((const char **)data - misc_var_names);
-    apr_time_exp_lt(&tm, apr_time_now());
+
+    switch (index) {
+    case 8:
+        return ap_get_server_banner();
+    case 9:
+        return apr_itoa(ctx->p, MODULE_MAGIC_NUMBER_MAJOR);
+    }
+
+    /* the rest are all derived from the current time */
+    expr_time_now(ctx, &tm);
 
     switch (index) {
     case 0:
@@ -1610,10 +1706,6 @@ static const char *misc_var_fn(ap_expr_eval_ctx_t *ctx, const void *data)
                             (tm.tm_year / 100) + 19, (tm.tm_year % 100),
                             tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min,
                             tm.tm_sec);
-    case 8:
-        return ap_get_server_banner();
-    case 9:
-        return apr_itoa(ctx->p, MODULE_MAGIC_NUMBER_MAJOR);
     default:
         ap_assert(0);
     }
@@ -1791,6 +1883,266 @@ static const struct expr_provider_single binary_op_providers[] = {
     { NULL, NULL, NULL }
 };
 
+/*
+ * Constant folding, done once when an expression is parsed: sub-trees
+ * which do not depend on the request are evaluated at configuration time
+ * and replaced by their result.  Provider functions are only called if
+ * they are known to be free of side effects and to not need a request.
+ * Sub-trees are never dropped if evaluating them could have an effect
+ * (adding to Vary or setting regex back-references) which the original
+ * short-circuit evaluation would have had.
+ */
+typedef struct {
+    ap_expr_parse_ctx_t *parse;
+    ap_expr_eval_ctx_t   eval;
+    ap_expr_info_t       info;
+    const char          *err;
+} expr_fold_ctx;
+
+#define IS_CONST_WORD(node) \
+    ((node)->node_op == op_String || (node)->node_op == op_Digit)
+#define IS_CONST_COND(node) \
+    ((node)->node_op == op_True || (node)->node_op == op_False)
+
+static int expr_fold_pure_func(const void *func)
+{
+    return func == (const void *)tolower_func
+        || func == (const void *)toupper_func
+        || func == (const void *)escape_func
+        || func == (const void *)base64_func
+        || func == (const void *)unbase64_func
+        || func == (const void *)sha1_func
+        || func == (const void *)md5_func
+#if APR_VERSION_AT_LEAST(1,6,0)
+        || func == (const void *)ldap_func
+#endif
+        || func == (const void *)op_nz
+        || func == (const void *)op_fnmatch
+        || func == (const void *)op_strmatch
+        || func == (const void *)op_strcmatch;
+}
+
+static int expr_fold_const_var(const void *func, const void *data)
+{
+    /* API_VERSION; the server banner may still change during startup */
+    return func == (const void *)misc_var_fn
+        && data == (const void *)&misc_var_names[9];
+}
+
+static const ap_expr_t *expr_fold_string(expr_fold_ctx *fc, const char *str)
+{
+    return ap_expr_make(op_String, str ? str : "", NULL, fc->parse);
+}
+
+static const ap_expr_t *expr_fold_bool(expr_fold_ctx *fc, int val)
+{
+    return ap_expr_make(val ? op_True : op_False, NULL, NULL, fc->parse);
+}
+
+static const ap_expr_t *expr_fold_word(expr_fold_ctx *fc,
+                                       const ap_expr_t *node);
+
+static const ap_expr_t *expr_fold_list(expr_fold_ctx *fc,
+                                       const ap_expr_t *node)
+{
+    const ap_expr_t *val, *next = NULL;
+
+    if (node->node_op != op_ListElement)
+        return expr_fold_word(fc, node);
+
+    val = expr_fold_word(fc, node->node_arg1);
+    if (node->node_arg2)
+        next = expr_fold_list(fc, node->node_arg2);
+    if (val == node->node_arg1 && next == node->node_arg2)
+        return node;
+    return ap_expr_make(op_ListElement, val, next, fc->parse);
+}
+
+static const ap_expr_t *expr_fold_word(expr_fold_ctx *fc,
+                                       const ap_expr_t *node)
+{
+    switch (node->node_op) {
+    case op_Var:
+        if (expr_fold_const_var(node->node_arg1, node->node_arg2))
+            return expr_fold_string(fc, ap_expr_eval_var(&fc->eval,
+                                        (ap_expr_var_func_t *)node->node_arg1,
+                                        node->node_arg2));
+        break;
+    case op_Concat: {
+        const ap_expr_t *a1 = expr_fold_word(fc, node->node_arg1);
+        const ap_expr_t *a2 = expr_fold_word(fc, node->node_arg2);
+        const ap_expr_t *l = a1->node_op == op_Concat ? a1->node_arg2 : NULL;
+        const ap_expr_t *r = a2->node_op == op_Concat ? a2->node_arg1 : NULL;
+
+        if (IS_CONST_WORD(a1) && IS_CONST_WORD(a2))
+            return expr_fold_string(fc, apr_pstrcat(fc->parse->pool,
+                                                    a1->node_arg1,
+                                                    a2->node_arg1, NULL));
+        /* merge adjacent constants of a concatenation chain */
+        if (IS_CONST_WORD(a2) && l && IS_CONST_WORD(l)) {
+            a2 = expr_fold_string(fc, apr_pstrcat(fc->parse->pool,
+                                                  l->node_arg1,
+                                                  a2->node_arg1, NULL));
+            a1 = a1->node_arg1;
+        }
+        else if (IS_CONST_WORD(a1) && r && IS_CONST_WORD(r)) {
+            a1 = expr_fold_string(fc, apr_pstrcat(fc->parse->pool,
+                                                  a1->node_arg1,
+                                                  r->node_arg1, NULL));
+            a2 = a2->node_arg2;
+        }
+        if (a1 != node->node_arg1 || a2 != node->node_arg2)
+            return ap_expr_make(op_Concat, a1, a2, fc->parse);
+        break;
+    }
+    case op_StringFuncCall: {
+        const ap_expr_t *info = node->node_arg1;
+        const ap_expr_t *arg = expr_fold_list(fc, node->node_arg2);
+
+        if (arg->node_op != op_ListElement && IS_CONST_WORD(arg)
+            && expr_fold_pure_func(info->node_arg1)) {
+            ap_expr_string_func_t *func =
+                (ap_expr_string_func_t *)info->node_arg1;
+            const char *result = (*func)(&fc->eval, info->node_arg2,
+                                         arg->node_arg1);
+            if (!fc->err)
+                return expr_fold_string(fc, result);
+            fc->err = NULL;
+        }
+        if (arg != node->node_arg2)
+            return ap_expr_make(op_StringFuncCall, info, arg, fc->parse);
+        break;
+    }
+    default:
+        break;
+    }
+    return node;
+}
+
+static const ap_expr_t *expr_fold_cond(expr_fold_ctx *fc,
+                                       const ap_expr_t *node)
+{
+    switch (node->node_op) {
+    case op_Not: {
+        const ap_expr_t *e1 = expr_fold_cond(fc, node->node_arg1);
+
+        if (IS_CONST_COND(e1))
+            return expr_fold_bool(fc, e1->node_op == op_False);
+        if (e1->node_op == op_Not)
+            return e1->node_arg1;
+        if (e1 != node->node_arg1)
+            return ap_expr_make(op_Not, e1, NULL, fc->parse);
+        break;
+    }
+    case op_Or:
+    case op_And: {
+        /* the value which decides the result without looking further */
+        ap_expr_node_op_e decisive = node->node_op == op_Or ? op_True
+                                                            : op_False;
+        const ap_expr_t *e1 = expr_fold_cond(fc, node->node_arg1);
+        const ap_expr_t *e2 = expr_fold_cond(fc, node->node_arg2);
+
+        if (IS_CONST_COND(e1))
+            return e1->node_op == decisive ? e1 : e2;
+        if (IS_CONST_COND(e2) && e2->node_op != decisive)
+            return e1;
+        if (e1 != node->node_arg1 || e2 != node->node_arg2)
+            return ap_expr_make(node->node_op, e1, e2, fc->parse);
+        break;
+    }
+    case op_UnaryOpCall: {
+        const ap_expr_t *info = node->node_arg1;
+        const ap_expr_t *arg = expr_fold_word(fc, node->node_arg2);
+
+        if (IS_CONST_WORD(arg) && expr_fold_pure_func(info->node_arg1)) {
+            ap_expr_op_unary_t *op_func =
+                (ap_expr_op_unary_t *)info->node_arg1;
+            return expr_fold_bool(fc, (*op_func)(&fc->eval, info->node_arg2,
+                                                 arg->node_arg1));
+        }
+        if (arg != node->node_arg2)
+            return ap_expr_make(op_UnaryOpCall, info, arg, fc->parse);
+        break;
+    }
+    case op_BinaryOpCall: {
+        const ap_expr_t *info = node->node_arg1;
+        const ap_expr_t *args = node->node_arg2;
+        const ap_expr_t *a1 = expr_fold_word(fc, args->node_arg1);
+        const ap_expr_t *a2 = expr_fold_word(fc, args->node_arg2);
+
+        if (IS_CONST_WORD(a1) && IS_CONST_WORD(a2)
+            && expr_fold_pure_func(info->node_arg1)) {
+            ap_expr_op_binary_t *op_func =
+                (ap_expr_op_binary_t *)info->node_arg1;
+            return expr_fold_bool(fc, (*op_func)(&fc->eval, info->node_arg2,
+                                                 a1->node_arg1,
+                                                 a2->node_arg1));
+        }
+        if (a1 != args->node_arg1 || a2 != args->node_arg2) {
+            args = ap_expr_make(op_BinaryOpArgs, a1, a2, fc->parse);
+            return ap_expr_make(op_BinaryOpCall, info, args, fc->parse);
+        }
+        break;
+    }
+    case op_Comp: {
+        const ap_expr_t *comp = node->node_arg1;
+        const ap_expr_t *e1 = expr_fold_word(fc, comp->node_arg1);
+        const ap_expr_t *e2 = comp->node_arg2;
+
+        switch (comp->node_op) {
+        case op_REG:
+        case op_NRE:
+            /* matching sets the back-references, keep it */
+            break;
+        case op_IN:
+            e2 = expr_fold_list(fc, e2);
+            break;
+        default:
+            e2 = expr_fold_word(fc, e2);
+            if (IS_CONST_WORD(e1) && IS_CONST_WORD(e2)) {
+                ap_expr_t folded;
+                folded.node_op = comp->node_op;
+                folded.node_arg1 = e1;
+                folded.node_arg2 = e2;
+                if (fc->info.flags & AP_EXPR_FLAG_SSL_EXPR_COMPAT)
+                    return expr_fold_bool(fc, ssl_expr_eval_comp(&fc->eval,
+                                                                 &folded));
+                return expr_fold_bool(fc, ap_expr_eval_comp(&fc->eval,
+                                                            &folded));
+            }
+            break;
+        }
+        if (e1 != comp->node_arg1 || e2 != comp->node_arg2) {
+            comp = ap_expr_make(comp->node_op, e1, e2, fc->parse);
+            return ap_expr_make(op_Comp, comp, NULL, fc->parse);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    return node;
+}
+
+static const ap_expr_t *expr_fold(ap_expr_parse_ctx_t *ctx,
+                                  const ap_expr_t *root)
+{
+    expr_fold_ctx fc;
+
+    memset(&fc, 0, sizeof(fc));
+    fc.parse = ctx;
+    fc.info.flags = ctx->flags;
+    fc.info.filename = "(constant folding)";
+    fc.eval.p = ctx->pool;
+    fc.eval.err = &fc.err;
+    fc.eval.info = &fc.info;
+
+    if (ctx->flags & AP_EXPR_FLAG_STRING_RESULT)
+        return expr_fold_word(&fc, root);
+    else
+        return expr_fold_cond(&fc, root);
+}
+
 static int core_expr_lookup(ap_expr_lookup_parms *parms)
 {
     switch (parms->type) {
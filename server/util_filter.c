@@ -24,7 +24,9 @@
 #include "http_config.h"
 #include "http_core.h"
 #include "http_log.h"
+#include "http_request.h"
 #include "util_filter.h"
+#include "ap_usdt.h"
 
 /* NOTE: Apache's current design doesn't allow a pool to be passed thru,
    so we depend on a global to hold the correct pool
@@ -536,6 +538,71 @@ AP_DECLARE(apr_status_t) ap_remove_output_filter_byhandle(ap_filter_t *next,
 }
 
 
+/* Filters of requests timed with RequestTiming Detail */
+#define FILTER_IS_TIMED(f) ((f)->r && (f)->r->timing && (f)->r->timing->detail)
+
+static void add_filter_time(ap_request_timing_t *t, ap_filter_t *f,
+                            int input, apr_interval_time_t time,
+                            apr_interval_time_t self)
+{
+    ap_request_timing_filter_t *tf;
+    int i;
+
+    tf = (ap_request_timing_filter_t *)t->filters->elts;
+    for (i = 0; i < t->filters->nelts; i++) {
+        if (tf[i].frec == f->frec) {
+            tf[i].time += time;
+            tf[i].self += self;
+            tf[i].calls++;
+            return;
+        }
+    }
+
+    tf = apr_array_push(t->filters);
+    tf->frec = f->frec;
+    tf->input = input;
+    tf->time = time;
+    tf->self = self;
+    tf->calls = 1;
+}
+
+static apr_status_t timed_get_brigade(ap_filter_t *next,
+                                      apr_bucket_brigade *bb,
+                                      ap_input_mode_t mode,
+                                      apr_read_type_e block,
+                                      apr_off_t readbytes)
+{
+    ap_request_timing_t *t = next->r->timing;
+    apr_interval_time_t outer = t->filter_nested, spent;
+    apr_time_t start = apr_time_now();
+    apr_status_t rv;
+
+    t->filter_nested = 0;
+    rv = next->frec->filter_func.in_func(next, bb, mode, block, readbytes);
+    spent = apr_time_now() - start;
+    add_filter_time(t, next, 1, spent, spent - t->filter_nested);
+    t->filter_nested = outer + spent;
+
+    return rv;
+}
+
+static apr_status_t timed_pass_brigade(ap_filter_t *next,
+                                       apr_bucket_brigade *bb)
+{
+    ap_request_timing_t *t = next->r->timing;
+    apr_interval_time_t outer = t->filter_nested, spent;
+    apr_time_t start = apr_time_now();
+    apr_status_t rv;
+
+    t->filter_nested = 0;
+    rv = next->frec->filter_func.out_func(next, bb);
+    spent = apr_time_now() - start;
+    add_filter_time(t, next, 0, spent, spent - t->filter_nested);
+    t->filter_nested = outer + spent;
+
+    return rv;
+}
+
 /*
  * Read data from the next filter in the filter stack.  Data should be
  * modified in the bucket brigade that is passed in.  The core allocates the
@@ -550,8 +617,19 @@ AP_DECLARE(apr_status_t) ap_get_brigade(ap_filter_t *next,
                                         apr_off_t readbytes)
 {
     if (next) {
-        return next->frec->filter_func.in_func(next, bb, mode, block,
-                                               readbytes);
+        apr_status_t rv;
+
+        AP_USDT_PROBE4(filter__input__entry, next->frec->name, next->c,
+                       (int)mode, readbytes);
+        if (FILTER_IS_TIMED(next)) {
+            rv = timed_get_brigade(next, bb, mode, block, readbytes);
+        }
+        else {
+            rv = next->frec->filter_func.in_func(next, bb, mode, block,
+                                                 readbytes);
+        }
+        AP_USDT_PROBE3(filter__input__return, next->frec->name, next->c, rv);
+        return rv;
     }
     return AP_NOBODY_READ;
 }
@@ -566,6 +644,8 @@ AP_DECLARE(apr_status_t) ap_pass_brigade(ap_filter_t *next,
 {
     if (next) {
         apr_bucket *e;
+        apr_status_t rv;
+
         if ((e = APR_BRIGADE_LAST(bb)) && APR_BUCKET_IS_EOS(e) && next->r) {
             /* This is only safe because HTTP_HEADER filter is always in
              * the filter stack.   This ensures that there is ALWAYS a
@@ -587,7 +667,15 @@ AP_DECLARE(apr_status_t) ap_pass_brigade(ap_filter_t *next,
                 }
             }
         }
-        return next->frec->filter_func.out_func(next, bb);
+        AP_USDT_PROBE3(filter__output__entry, next->frec->name, next->c, bb);
+        if (FILTER_IS_TIMED(next)) {
+            rv = timed_pass_brigade(next, bb);
+        }
+        else {
+            rv = next->frec->filter_func.out_func(next, bb);
+        }
+        AP_USDT_PROBE3(filter__output__return, next->frec->name, next->c, rv);
+        return rv;
     }
     return AP_NOBODY_WROTE;
 }
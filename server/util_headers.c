@@ -0,0 +1,422 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apr_strings.h"
+
+#define APR_WANT_STRFUNC
+#include "apr_want.h"
+
+#include "httpd.h"
+#include "util_headers.h"
+
+/* Indexed by ap_header_e */
+static const char *const header_names[AP_HEADER_MAX] = {
+    NULL,
+    "Accept",
+    "Accept-Charset",
+    "Accept-Encoding",
+    "Accept-Language",
+    "Accept-Ranges",
+    "Age",
+    "Allow",
+    "Authorization",
+    "Cache-Control",
+    "Connection",
+    "Content-Disposition",
+    "Content-Encoding",
+    "Content-Language",
+    "Content-Length",
+    "Content-Location",
+    "Content-MD5",
+    "Content-Range",
+    "Content-Type",
+    "Cookie",
+    "Date",
+    "Destination",
+    "ETag",
+    "Expect",
+    "Expires",
+    "Forwarded",
+    "From",
+    "Host",
+    "If-Match",
+    "If-Modified-Since",
+    "If-None-Match",
+    "If-Range",
+    "If-Unmodified-Since",
+    "Keep-Alive",
+    "Last-Modified",
+    "Link",
+    "Location",
+    "Max-Forwards",
+    "Origin",
+    "Pragma",
+    "Proxy-Authenticate",
+    "Proxy-Authorization",
+    "Proxy-Connection",
+    "Range",
+    "Referer",
+    "Retry-After",
+    "Server",
+    "Set-Cookie",
+    "Set-Cookie2",
+    "TE",
+    "Trailer",
+    "Trailers",
+    "Transfer-Encoding",
+    "Upgrade",
+    "URI",
+    "User-Agent",
+    "Vary",
+    "Via",
+    "Warning",
+    "WWW-Authenticate",
+    "X-Forwarded-For",
+    "X-Forwarded-Host",
+    "X-Forwarded-Server"
+};
+
+/* Open addressing table of header identifiers, 0 marking a free slot.
+ * It is kept at most a quarter full so that probe sequences stay short.
+ */
+#define HEADER_SLOTS 256
+
+static unsigned char header_slots[HEADER_SLOTS];
+static apr_size_t header_lens[AP_HEADER_MAX];
+static int header_slots_ready;
+
+/* FNV-1a of the name with ASCII letters folded to lower case; the folding
+ * also merges a few punctuation characters, which the final comparison
+ * tells apart.
+ */
+static apr_uint32_t hash_name(const char *name, apr_size_t *len)
+{
+    const unsigned char *s = (const unsigned char *)name;
+    apr_uint32_t h = 2166136261U;
+
+    for (; *s; s++) {
+        h = (h ^ (*s | 0x20)) * 16777619U;
+    }
+    *len = s - (const unsigned char *)name;
+
+    return h;
+}
+
+AP_DECLARE(void) ap_header_init(void)
+{
+    int id;
+
+    if (header_slots_ready) {
+        return;
+    }
+
+    AP_DEBUG_ASSERT(AP_HEADER_MAX <= sizeof(ap_header_set_t) * 8);
+    AP_DEBUG_ASSERT(header_names[AP_HEADER_MAX - 1] != NULL);
+
+    for (id = AP_HEADER_UNKNOWN + 1; id < AP_HEADER_MAX; id++) {
+        apr_uint32_t i = hash_name(header_names[id], &header_lens[id]);
+
+        while (header_slots[i % HEADER_SLOTS]) {
+            i++;
+        }
+        header_slots[i % HEADER_SLOTS] = (unsigned char)id;
+    }
+    header_slots_ready = 1;
+}
+
+AP_DECLARE(int) ap_header_id(const char *name)
+{
+    apr_size_t len;
+    apr_uint32_t i;
+    int id;
+
+    /* The core sets the table up before any threads are started; this
+     * is for programs which use the function without the core.
+     */
+    if (!header_slots_ready) {
+        ap_header_init();
+    }
+
+    i = hash_name(name, &len);
+    while ((id = header_slots[i % HEADER_SLOTS]) != 0) {
+        if (header_lens[id] == len && !strcasecmp(name, header_names[id])) {
+            return id;
+        }
+        i++;
+    }
+
+    return AP_HEADER_UNKNOWN;
+}
+
+AP_DECLARE(const char *) ap_header_name(int id)
+{
+    if (id <= AP_HEADER_UNKNOWN || id >= AP_HEADER_MAX) {
+        return NULL;
+    }
+    return header_names[id];
+}
+
+AP_DECLARE(int) ap_headers_strip(apr_table_t *t, ap_header_set_t set)
+{
+    const apr_array_header_t *arr = apr_table_elts(t);
+    const apr_table_entry_t *elts = (const apr_table_entry_t *)arr->elts;
+    ap_header_set_t found = 0;
+    int i, id, removed = 0;
+
+    /* apr_table_unset() compacts the entries, so first find out which of
+     * the headers are present and then remove each of them once
+     */
+    for (i = 0; i < arr->nelts; i++) {
+        if (elts[i].key) {
+            id = ap_header_id(elts[i].key);
+            if (id != AP_HEADER_UNKNOWN && AP_HEADER_IN_SET(set, id)) {
+                found |= AP_HEADER_BIT(id);
+            }
+        }
+    }
+
+    for (id = AP_HEADER_UNKNOWN + 1; found; id++) {
+        if (AP_HEADER_IN_SET(found, id)) {
+            apr_table_unset(t, header_names[id]);
+            found &= ~AP_HEADER_BIT(id);
+            removed++;
+        }
+    }
+
+    return removed;
+}
+
+struct ap_headers_t {
+    apr_pool_t *pool;
+    apr_table_t *table;
+    /* the table is shared with a clone, or with the collection cloned */
+    int shared;
+    /* the entries of the table when the index was last brought up to date */
+    const apr_table_entry_t *elts;
+    int nelts;
+    const char *last;
+    /* one more than the position of the first entry of each well-known
+     * header, or 0 if there is none
+     */
+    int first[AP_HEADER_MAX];
+};
+
+static void headers_stamp(ap_headers_t *h)
+{
+    const apr_array_header_t *arr = apr_table_elts(h->table);
+
+    h->elts = (const apr_table_entry_t *)arr->elts;
+    h->nelts = arr->nelts;
+    h->last = arr->nelts ? h->elts[arr->nelts - 1].key : NULL;
+}
+
+/* Entries are only ever appended to a table, or removed from it, which
+ * moves the entries after them; either changes the number of entries or
+ * the last one, unless the table was both added to and removed from.
+ */
+static int headers_current(const ap_headers_t *h)
+{
+    const apr_array_header_t *arr = apr_table_elts(h->table);
+
+    return (const apr_table_entry_t *)arr->elts == h->elts
+           && arr->nelts == h->nelts
+           && (!arr->nelts || h->elts[arr->nelts - 1].key == h->last);
+}
+
+static void headers_reindex(ap_headers_t *h)
+{
+    int i, id;
+
+    headers_stamp(h);
+    memset(h->first, 0, sizeof(h->first));
+    for (i = 0; i < h->nelts; i++) {
+        if (h->elts[i].key
+            && (id = ap_header_id(h->elts[i].key)) != AP_HEADER_UNKNOWN
+            && !h->first[id]) {
+            h->first[id] = i + 1;
+        }
+    }
+}
+
+static void headers_index(ap_headers_t *h)
+{
+    if (!headers_current(h)) {
+        headers_reindex(h);
+    }
+}
+
+/* Make the collection the only user of its table, and its index current,
+ * before a change.
+ */
+static void headers_prepare(ap_headers_t *h)
+{
+    headers_index(h);
+    if (h->shared) {
+        /* the copy has the same entries in the same positions */
+        h->table = apr_table_copy(h->pool, h->table);
+        h->shared = 0;
+        headers_stamp(h);
+    }
+}
+
+/* Bring the index up to date after a change to the header given */
+static void headers_update(ap_headers_t *h, int id)
+{
+    const apr_array_header_t *arr = apr_table_elts(h->table);
+
+    if (arr->nelts == h->nelts + 1) {
+        /* an entry was appended, possibly to a reallocated array */
+        if (id != AP_HEADER_UNKNOWN && !h->first[id]) {
+            h->first[id] = arr->nelts;
+        }
+        headers_stamp(h);
+    }
+    /* else an entry was changed in place, which the index does not
+     * depend on, or entries were removed and the index is rebuilt on the
+     * next lookup
+     */
+}
+
+/* The interned name of a well-known header spelt the canonical way, or
+ * NULL; names spelt otherwise are kept as given.
+ */
+static const char *headers_key(const char *name, int id)
+{
+    if (id != AP_HEADER_UNKNOWN && !strcmp(name, header_names[id])) {
+        return header_names[id];
+    }
+    return NULL;
+}
+
+AP_DECLARE(ap_headers_t *) ap_headers_make(apr_pool_t *p, apr_table_t *t)
+{
+    ap_headers_t *h = apr_pcalloc(p, sizeof(*h));
+
+    h->pool = p;
+    h->table = t;
+
+    return h;
+}
+
+AP_DECLARE(ap_headers_t *) ap_headers_clone(apr_pool_t *p, ap_headers_t *h)
+{
+    ap_headers_t *c = apr_palloc(p, sizeof(*c));
+
+    headers_index(h);
+    memcpy(c, h, sizeof(*c));
+    c->pool = p;
+    c->shared = h->shared = 1;
+
+    return c;
+}
+
+AP_DECLARE(const apr_table_t *) ap_headers_table(const ap_headers_t *h)
+{
+    return h->table;
+}
+
+AP_DECLARE(apr_table_t *) ap_headers_writable(ap_headers_t *h)
+{
+    headers_prepare(h);
+    return h->table;
+}
+
+AP_DECLARE(const char *) ap_headers_get_id(ap_headers_t *h, int id)
+{
+    const apr_table_entry_t *e;
+
+    if (id <= AP_HEADER_UNKNOWN || id >= AP_HEADER_MAX) {
+        return NULL;
+    }
+
+    headers_index(h);
+    if (!h->first[id]) {
+        return NULL;
+    }
+    e = &h->elts[h->first[id] - 1];
+    if (e->key != header_names[id] && strcasecmp(e->key, header_names[id])) {
+        /* the table was both added to and removed from */
+        headers_reindex(h);
+        if (!h->first[id]) {
+            return NULL;
+        }
+        e = &h->elts[h->first[id] - 1];
+    }
+
+    return e->val;
+}
+
+AP_DECLARE(const char *) ap_headers_get(ap_headers_t *h, const char *name)
+{
+    int id = ap_header_id(name);
+
+    if (id == AP_HEADER_UNKNOWN) {
+        return apr_table_get(h->table, name);
+    }
+    return ap_headers_get_id(h, id);
+}
+
+AP_DECLARE(void) ap_headers_set(ap_headers_t *h, const char *name,
+                                const char *val)
+{
+    int id = ap_header_id(name);
+    const char *key = headers_key(name, id);
+
+    headers_prepare(h);
+    apr_table_setn(h->table, key ? key : apr_pstrdup(h->pool, name),
+                   apr_pstrdup(h->pool, val));
+    headers_update(h, id);
+}
+
+AP_DECLARE(void) ap_headers_setn(ap_headers_t *h, const char *name,
+                                 const char *val)
+{
+    int id = ap_header_id(name);
+    const char *key = headers_key(name, id);
+
+    headers_prepare(h);
+    apr_table_setn(h->table, key ? key : name, val);
+    headers_update(h, id);
+}
+
+AP_DECLARE(void) ap_headers_addn(ap_headers_t *h, const char *name,
+                                 const char *val)
+{
+    int id = ap_header_id(name);
+    const char *key = headers_key(name, id);
+
+    headers_prepare(h);
+    apr_table_addn(h->table, key ? key : name, val);
+    headers_update(h, id);
+}
+
+AP_DECLARE(void) ap_headers_mergen(ap_headers_t *h, const char *name,
+                                   const char *val)
+{
+    int id = ap_header_id(name);
+    const char *key = headers_key(name, id);
+
+    headers_prepare(h);
+    apr_table_mergen(h->table, key ? key : name, val);
+    headers_update(h, id);
+}
+
+AP_DECLARE(void) ap_headers_unset(ap_headers_t *h, const char *name)
+{
+    headers_prepare(h);
+    apr_table_unset(h->table, name);
+    /* the index is rebuilt on the next lookup if entries were removed */
+}
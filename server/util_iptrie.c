@@ -0,0 +1,404 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apr_lib.h"
+#include "apr_strings.h"
+
+#define APR_WANT_STRFUNC
+#define APR_WANT_MEMFUNC
+#include "apr_want.h"
+
+#include "httpd.h"
+#include "util_iptrie.h"
+
+#define IPTRIE_MAXBYTES 16
+
+typedef struct iptrie_node_t iptrie_node_t;
+
+/*
+ * Each node holds a prefix of 'bits' bits, stored masked.  Nodes without
+ * a value only exist to join two subtrees whose keys differ at 'bits'.
+ * Children always have strictly longer prefixes than their parent, so the
+ * depth of the trie is bounded by the address length.
+ */
+struct iptrie_node_t {
+    iptrie_node_t *child[2];
+    void *value;
+    /* insertion order of the network, 0 for a joining node */
+    int seq;
+    int bits;
+    unsigned char key[IPTRIE_MAXBYTES];
+};
+
+struct ap_iptrie_t {
+    apr_pool_t *pool;
+    iptrie_node_t *root4;
+    iptrie_node_t *root6;
+    int count;
+};
+
+#define KEY_BIT(key, i) (((key)[(i) >> 3] >> (7 - ((i) & 7))) & 1)
+
+/* Number of leading bits that a and b have in common, up to maxbits */
+static int common_bits(const unsigned char *a, const unsigned char *b,
+                       int maxbits)
+{
+    int i = 0;
+
+    while (i < maxbits) {
+        unsigned char x = a[i >> 3] ^ b[i >> 3];
+        if (!x) {
+            i += 8;
+            continue;
+        }
+        while (!(x & (0x80 >> (i & 7)))) {
+            i++;
+        }
+        break;
+    }
+
+    return i < maxbits ? i : maxbits;
+}
+
+static void mask_key(unsigned char *key, int bits, int nbytes)
+{
+    int i = bits >> 3;
+
+    if (bits & 7) {
+        key[i] &= (unsigned char)(0xff << (8 - (bits & 7)));
+        i++;
+    }
+    for (; i < nbytes; i++) {
+        key[i] = 0;
+    }
+}
+
+/* Same syntax as APR's legacy network parser: "a", "a.b.", ... "a.b.c.d" */
+static apr_status_t parse_ipv4(const char *s, unsigned char *addr, int *bits)
+{
+    int n = 0;
+
+    memset(addr, 0, 4);
+    while (*s) {
+        int octet = 0, digits = 0;
+
+        if (n == 4) {
+            return APR_EBADIP;
+        }
+        while (apr_isdigit(*s)) {
+            octet = octet * 10 + (*s++ - '0');
+            if (++digits > 3) {
+                return APR_EBADIP;
+            }
+        }
+        if (!digits || octet > 255) {
+            return APR_EBADIP;
+        }
+        if (*s == '.') {
+            s++;
+        }
+        else if (*s) {
+            return APR_EBADIP;
+        }
+        addr[n++] = (unsigned char)octet;
+    }
+    if (!n) {
+        return APR_EBADIP;
+    }
+
+    *bits = n * 8;
+    return APR_SUCCESS;
+}
+
+/* RFC 4291 text representation, including a trailing dotted quad */
+static apr_status_t parse_ipv6(const char *s, unsigned char *addr)
+{
+    unsigned char tmp[16], *tp = tmp, *endp = tmp + 16, *colonp = NULL;
+    const char *curtok;
+    int saw_xdigit = 0, digits = 0;
+    unsigned int val = 0;
+    int ch;
+
+    memset(tmp, 0, sizeof(tmp));
+    if (*s == ':' && *++s != ':') {
+        return APR_EBADIP;
+    }
+    curtok = s;
+    while ((ch = *s++) != '\0') {
+        if (apr_isxdigit(ch)) {
+            if (++digits > 4) {
+                return APR_EBADIP;
+            }
+            val = (val << 4) | (apr_isdigit(ch) ? ch - '0'
+                                                : apr_tolower(ch) - 'a' + 10);
+            saw_xdigit = 1;
+            continue;
+        }
+        if (ch == ':') {
+            curtok = s;
+            if (!saw_xdigit) {
+                if (colonp) {
+                    return APR_EBADIP;
+                }
+                colonp = tp;
+                continue;
+            }
+            if (*s == '\0' || tp + 2 > endp) {
+                return APR_EBADIP;
+            }
+            *tp++ = (unsigned char)(val >> 8);
+            *tp++ = (unsigned char)val;
+            saw_xdigit = 0;
+            digits = 0;
+            val = 0;
+            continue;
+        }
+        if (ch == '.' && tp + 4 <= endp) {
+            int bits;
+            if (parse_ipv4(curtok, tp, &bits) != APR_SUCCESS || bits != 32) {
+                return APR_EBADIP;
+            }
+            tp += 4;
+            saw_xdigit = 0;
+            break;
+        }
+        return APR_EBADIP;
+    }
+    if (saw_xdigit) {
+        if (tp + 2 > endp) {
+            return APR_EBADIP;
+        }
+        *tp++ = (unsigned char)(val >> 8);
+        *tp++ = (unsigned char)val;
+    }
+    if (colonp) {
+        int i, n = tp - colonp;
+
+        if (tp == endp) {
+            return APR_EBADIP;
+        }
+        for (i = 1; i <= n; i++) {
+            endp[-i] = colonp[n - i];
+            colonp[n - i] = 0;
+        }
+        tp = endp;
+    }
+    if (tp != endp) {
+        return APR_EBADIP;
+    }
+
+    memcpy(addr, tmp, sizeof(tmp));
+    return APR_SUCCESS;
+}
+
+static int is_v4mapped(const unsigned char *addr)
+{
+    static const unsigned char prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 0, 0xff, 0xff };
+
+    return !memcmp(addr, prefix, sizeof(prefix));
+}
+
+static iptrie_node_t *make_node(ap_iptrie_t *t, const unsigned char *key,
+                                int bits)
+{
+    iptrie_node_t *n = apr_pcalloc(t->pool, sizeof(*n));
+
+    memcpy(n->key, key, IPTRIE_MAXBYTES);
+    mask_key(n->key, bits, IPTRIE_MAXBYTES);
+    n->bits = bits;
+
+    return n;
+}
+
+static void insert(ap_iptrie_t *t, iptrie_node_t **pp,
+                   const unsigned char *key, int bits, void *value)
+{
+    iptrie_node_t *n, *leaf;
+    int common;
+
+    while ((n = *pp) != NULL) {
+        common = common_bits(n->key, key, n->bits < bits ? n->bits : bits);
+        if (common < n->bits) {
+            /* the new network diverges inside this node's prefix */
+            leaf = make_node(t, key, bits);
+            leaf->value = value;
+            leaf->seq = ++t->count;
+            if (common == bits) {
+                /* ...and contains it */
+                leaf->child[KEY_BIT(n->key, bits)] = n;
+                *pp = leaf;
+            }
+            else {
+                iptrie_node_t *join = make_node(t, key, common);
+                join->child[KEY_BIT(n->key, common)] = n;
+                join->child[KEY_BIT(key, common)] = leaf;
+                *pp = join;
+            }
+            return;
+        }
+        if (n->bits == bits) {
+            if (!n->seq) {
+                n->value = value;
+                n->seq = ++t->count;
+            }
+            return;
+        }
+        pp = &n->child[KEY_BIT(key, n->bits)];
+    }
+
+    leaf = make_node(t, key, bits);
+    leaf->value = value;
+    leaf->seq = ++t->count;
+    *pp = leaf;
+}
+
+AP_DECLARE(ap_iptrie_t *) ap_iptrie_make(apr_pool_t *p)
+{
+    ap_iptrie_t *t = apr_pcalloc(p, sizeof(*t));
+
+    t->pool = p;
+
+    return t;
+}
+
+AP_DECLARE(apr_status_t) ap_iptrie_add(ap_iptrie_t *t, const char *ipstr,
+                                       const char *mask_or_numbits,
+                                       void *value)
+{
+    unsigned char key[IPTRIE_MAXBYTES];
+    int is_v6, maxbits, bits;
+    const char *c;
+    apr_status_t rv;
+
+    /* anything that isn't digits and dots or has a colon is a hostname,
+     * matching the behaviour of apr_ipsubnet_create()
+     */
+    for (c = ipstr; *c == '.' || apr_isdigit(*c); c++)
+        ;
+    is_v6 = (ap_strchr_c(ipstr, ':') != NULL);
+    if (!*ipstr || (*c && !is_v6)) {
+        return APR_EINVAL;
+    }
+
+    memset(key, 0, sizeof(key));
+    if (is_v6) {
+        if ((rv = parse_ipv6(ipstr, key)) != APR_SUCCESS) {
+            return rv;
+        }
+        /* as with apr_ipsubnet_create(), IPv4-mapped networks are not
+         * supported; configure the IPv4 network instead
+         */
+        if (is_v4mapped(key)) {
+            return APR_EBADIP;
+        }
+        maxbits = bits = 128;
+    }
+    else {
+        if ((rv = parse_ipv4(ipstr, key, &bits)) != APR_SUCCESS) {
+            return rv;
+        }
+        maxbits = 32;
+    }
+
+    if (mask_or_numbits) {
+        unsigned char mask[4];
+        char *endptr;
+        long nbits = strtol(mask_or_numbits, &endptr, 10);
+        int mbits;
+
+        if (*endptr == '\0' && nbits > 0 && nbits <= maxbits) {
+            bits = (int)nbits;
+        }
+        else if (!is_v6
+                 && parse_ipv4(mask_or_numbits, mask, &mbits) == APR_SUCCESS
+                 && mbits == 32) {
+            apr_uint32_t m = ((apr_uint32_t)mask[0] << 24)
+                             | ((apr_uint32_t)mask[1] << 16)
+                             | ((apr_uint32_t)mask[2] << 8)
+                             | (apr_uint32_t)mask[3];
+
+            /* only contiguous netmasks can be stored as a prefix */
+            if ((~m + 1) & ~m) {
+                return APR_EBADMASK;
+            }
+            for (bits = 0; bits < 32 && (m & (0x80000000UL >> bits)); bits++)
+                ;
+        }
+        else {
+            return APR_EBADMASK;
+        }
+    }
+
+    mask_key(key, bits, IPTRIE_MAXBYTES);
+    insert(t, is_v6 ? &t->root6 : &t->root4, key, bits, value);
+
+    return APR_SUCCESS;
+}
+
+AP_DECLARE(int) ap_iptrie_match(const ap_iptrie_t *t,
+                                const apr_sockaddr_t *sa, void **value)
+{
+    const iptrie_node_t *n, *found = NULL;
+    const unsigned char *addr;
+    int maxbits;
+
+    if (sa->family == APR_INET) {
+        addr = (const unsigned char *)&sa->sa.sin.sin_addr;
+        n = t->root4;
+        maxbits = 32;
+    }
+#if APR_HAVE_IPV6
+    else if (sa->family == APR_INET6) {
+        addr = (const unsigned char *)&sa->sa.sin6.sin6_addr;
+        if (is_v4mapped(addr)) {
+            addr += 12;
+            n = t->root4;
+            maxbits = 32;
+        }
+        else {
+            n = t->root6;
+            maxbits = 128;
+        }
+    }
+#endif
+    else {
+        return 0;
+    }
+
+    while (n && common_bits(n->key, addr, n->bits) == n->bits) {
+        if (n->seq && (!found || n->seq < found->seq)) {
+            found = n;
+        }
+        if (n->bits >= maxbits) {
+            break;
+        }
+        n = n->child[KEY_BIT(addr, n->bits)];
+    }
+
+    if (!found) {
+        return 0;
+    }
+    if (value) {
+        *value = found->value;
+    }
+    return 1;
+}
+
+AP_DECLARE(int) ap_iptrie_count(const ap_iptrie_t *t)
+{
+    return t->count;
+}
@@ -84,6 +84,11 @@
    ** Version 2.3
    **     SIGINT now triggers output_results().
    **     Contributed by colm, March 30, 2006
+   **
+   **     Multiple worker threads, each with its own pollset (-W), an open
+   **     loop mode sending requests at a constant rate (-R), lists of paths
+   **     or access logs to replay (-L), and fixed size latency histograms
+   **     in place of the per request data array.
    **/
 
 /* Note: this version string should start with \d+[\d\.]* and be a valid
@@ -107,6 +112,9 @@
  *   responses
  * - (performance problem) heavy use of strstr shows up top in profile
  *   only an issue for loopback usage
+ * - SSL with several threads (-W) needs the locking callbacks of OpenSSL
+ *   releases before 1.1.0, which are installed; on EBCDIC systems the
+ *   character set translation is not thread safe
  */
 
 /*  -------------------------------------------------------------------- */
@@ -134,6 +142,12 @@
 #include "apr_portable.h"
 #include "ap_release.h"
 #include "apr_poll.h"
+#include "apr_tables.h"
+#include "apr_atomic.h"
+#if APR_HAS_THREADS
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#endif
 
 #define APR_WANT_STRFUNC
 #include "apr_want.h"
@@ -222,7 +236,16 @@ typedef enum {
 
 #define CBUFFSIZE (8192)
 
+struct worker;
+
+/* a request ready to be sent, without its body */
+struct request_buf {
+    char *buf;
+    apr_size_t len;
+};
+
 struct connection {
+    struct worker *w;           /* the worker owning this connection */
     apr_pool_t *ctx;
     apr_socket_t *aprsock;
     apr_pollfd_t pollfd;
@@ -244,6 +267,10 @@ struct connection {
                done;            /* Connection closed */
 
     int socknum;
+    const struct request_buf *req; /* the request being sent */
+    apr_time_t due;             /* open loop: when the request was due, or 0
+                                 * if the connection has none yet */
+    struct connection *next;    /* open loop: next parked connection */
 #ifdef USE_SSL
     SSL *ssl;
 #endif
@@ -256,6 +283,84 @@ struct data {
     apr_interval_time_t time;     /* time for connection */
 };
 
+/*
+ * Latency histogram of a fixed size, whatever the number of requests.
+ * Values (in usec) below 2 * HIST_SUB are counted exactly; above, each
+ * power of two is split into HIST_SUB buckets, so that a value read back
+ * is within 1% of the one recorded.  Values of more than 2^(HIST_MAGS + 8)
+ * usec (12 days) all go to the last bucket.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAGS 32
+#define HIST_SIZE ((HIST_MAGS + 2) * HIST_SUB)
+
+struct histogram {
+    int n;
+    apr_interval_time_t min, max;
+    apr_time_t total;
+    double sumsq;                 /* for the standard deviation */
+    int count[HIST_SIZE];
+};
+
+/* the histograms kept for each request */
+enum {
+    HIST_CONNECT = 0,             /* time to connect */
+    HIST_PROCESSING,              /* time after connecting */
+    HIST_WAITING,                 /* between request and reading response */
+    HIST_TOTAL,                   /* time for connection */
+    HIST_COUNT
+};
+
+/*
+ * A worker drives its share of the connections and requests from its own
+ * pollset, in its own thread when there are several (-W); worker 0 runs in
+ * the main thread.  All that is counted while testing is kept here, and
+ * only added up when the results are output.
+ */
+struct worker {
+    int id;
+    apr_pool_t *pool;
+    apr_pollset_t *pollset;
+    struct connection *con;       /* connection array */
+    int concurrency;              /* size of con */
+    int requests;                 /* number of requests to make */
+    apr_sockaddr_t *destsa;
+    int requests_initialized;
+    int nextreq;                  /* next request of the list to send */
+    struct data *stats;           /* data for each request, for -g only */
+    struct histogram hist[HIST_COUNT];
+
+    /* open loop mode */
+    apr_time_t first_send;        /* when the first request is due */
+    apr_time_t next_send;         /* when the next request is due */
+    double interval;              /* usec between requests */
+    apr_int64_t scheduled;        /* number of requests scheduled */
+    struct connection *parked;    /* connections waiting for a request */
+
+    apr_time_t lasttime;
+    apr_size_t doclen;            /* the length the document should be */
+    apr_int64_t totalread;        /* total number of bytes read */
+    apr_int64_t totalbread;       /* totoal amount of entity body read */
+    apr_int64_t totalposted;      /* total number of bytes posted */
+    int started;                  /* number of requests started */
+    int done;                     /* number of requests we have done */
+    int doneka;                   /* number of keep alive connections done */
+    int good, bad;                /* number of good and bad requests */
+    int epipe;                    /* number of broken pipe writes */
+    int err_length;               /* failed due to response length */
+    int err_conn;                 /* failed due to connection drop */
+    int err_recv;                 /* failed due to broken read */
+    int err_except;               /* failed due to exception */
+    int err_response;             /* invalid or non-200 response */
+
+    /* a throw-away buffer to read stuff into */
+    char buffer[8192];
+#if APR_HAS_THREADS
+    apr_thread_t *thread;
+#endif
+};
+
 #define ap_min(a,b) (((a)<(b))?(a):(b))
 #define ap_max(a,b) (((a)>(b))?(a):(b))
 #define ap_round_ms(a) ((apr_time_t)((a) + 500)/1000)
@@ -272,6 +377,9 @@ int send_body = 0;      /* non-zero if sending body with request */
 int requests = 1;       /* Number of requests to make */
 int heartbeatres = 100; /* How often do we say we're alive */
 int concurrency = 1;    /* Number of multiple requests to make */
+int threads = 1;        /* Number of worker threads */
+double rate = 0;        /* Requests per second in open loop mode, or 0 */
+const char *urlfile;    /* File with the paths to request */
 int percentile = 1;     /* Show percentile served */
 int nolength = 0;       /* Accept variable document length */
 int confidence = 1;     /* Show confidence estimator and warnings */
@@ -314,6 +422,7 @@ const char *tablestring;
 const char *trstring;
 const char *tdstring;
 
+/* the totals of all workers, when the results are output */
 apr_size_t doclen = 0;     /* the length the document should be */
 apr_int64_t totalread = 0;    /* total number of bytes read */
 apr_int64_t totalbread = 0;   /* totoal amount of entity body read */
@@ -328,6 +437,10 @@ int err_conn = 0;          /* requests failed due to connection drop */
 int err_recv = 0;          /* requests failed due to broken read */
 int err_except = 0;        /* requests failed due to exception */
 int err_response = 0;      /* requests with invalid or non-200 response */
+struct histogram hist[HIST_COUNT];
+
+/* number of requests completed by all workers, for progress reports */
+apr_uint32_t completed = 0;
 
 #ifdef USE_SSL
 int is_ssl;
@@ -339,24 +452,17 @@ BIO *bio_out,*bio_err;
 
 apr_time_t start, lasttime, stoptime;
 
-/* global request (and its length) */
-char _request[8192];
-char *request = _request;
-apr_size_t reqlen;
-int requests_initialized = 0;
-
-/* one global throw-away buffer to read stuff into */
-char buffer[8192];
+/* the requests to send in turn (and their number) */
+#define REQBUFFSIZE (8192)
+struct request_buf *reqs;
+int nreqs = 1;
 
 /* interesting percentiles */
 int percs[] = {50, 66, 75, 80, 90, 95, 98, 99, 100};
 
-struct connection *con;     /* connection array */
-struct data *stats;         /* data for each request */
+struct worker *workers;     /* worker array */
 apr_pool_t *cntxt;
 
-apr_pollset_t *readbits;
-
 apr_sockaddr_t *mysa;
 apr_sockaddr_t *destsa;
 
@@ -373,9 +479,11 @@ static void close_connection(struct connection * c);
 
 static void err(const char *s)
 {
+    apr_uint32_t n = apr_atomic_read32(&completed);
+
     fprintf(stderr, "%s\n", s);
-    if (done)
-        printf("Total of %d requests completed\n" , done);
+    if (n)
+        printf("Total of %u requests completed\n" , n);
     exit(1);
 }
 
@@ -384,12 +492,13 @@ static void err(const char *s)
 static void apr_err(const char *s, apr_status_t rv)
 {
     char buf[120];
+    apr_uint32_t n = apr_atomic_read32(&completed);
 
     fprintf(stderr,
         "%s: %s (%d)\n",
         s, apr_strerror(rv, buf, sizeof buf), rv);
-    if (done)
-        printf("Total of %d requests completed\n" , done);
+    if (n)
+        printf("Total of %u requests completed\n" , n);
     exit(rv);
 }
 
@@ -441,15 +550,15 @@ static void set_polled_events(struct connection *c, apr_int16_t new_reqevents)
 
     if (c->pollfd.reqevents != new_reqevents) {
         if (c->pollfd.reqevents != 0) {
-            rv = apr_pollset_remove(readbits, &c->pollfd);
+            rv = apr_pollset_remove(c->w->pollset, &c->pollfd);
             if (rv != APR_SUCCESS) {
                 apr_err("apr_pollset_remove()", rv);
             }
         }
 
+        c->pollfd.reqevents = new_reqevents;
         if (new_reqevents != 0) {
-            c->pollfd.reqevents = new_reqevents;
-            rv = apr_pollset_add(readbits, &c->pollfd);
+            rv = apr_pollset_add(c->w->pollset, &c->pollfd);
             if (rv != APR_SUCCESS) {
                 apr_err("apr_pollset_add()", rv);
             }
@@ -655,7 +764,7 @@ static void ssl_proceed_handshake(struct connection *c)
         case SSL_ERROR_NONE:
             if (verbosity >= 2)
                 ssl_print_info(c);
-            if (ssl_info == NULL) {
+            if (ssl_info == NULL && c->w->id == 0) {
                 AB_SSL_CIPHER_CONST SSL_CIPHER *ci;
                 X509 *cert;
                 int sk_bits, pk_bits, swork;
@@ -698,11 +807,202 @@ static void ssl_proceed_handshake(struct connection *c)
     }
 }
 
+#if APR_HAS_THREADS && OPENSSL_VERSION_NUMBER < 0x10100000L
+/* older OpenSSL releases are only thread safe with locking callbacks */
+static apr_thread_mutex_t **ssl_locks;
+
+static void ssl_lock_cb(int mode, int n, const char *file, int line)
+{
+    if (mode & CRYPTO_LOCK)
+        apr_thread_mutex_lock(ssl_locks[n]);
+    else
+        apr_thread_mutex_unlock(ssl_locks[n]);
+}
+
+static void ssl_thread_setup(apr_pool_t *p)
+{
+    int i, n = CRYPTO_num_locks();
+
+    ssl_locks = apr_palloc(p, n * sizeof(*ssl_locks));
+    for (i = 0; i < n; i++) {
+        apr_status_t rv;
+
+        rv = apr_thread_mutex_create(&ssl_locks[i],
+                                     APR_THREAD_MUTEX_DEFAULT, p);
+        if (rv != APR_SUCCESS) {
+            apr_err("apr_thread_mutex_create()", rv);
+        }
+    }
+    CRYPTO_set_locking_callback(ssl_lock_cb);
+}
+#endif
 #endif /* USE_SSL */
 
+/* --------------------------------------------------------- */
+
+/* latency histograms */
+
+static int hist_index(apr_interval_time_t v)
+{
+    int mag = 0;
+
+    if (v < 2 * HIST_SUB)
+        return v < 0 ? 0 : (int)v;
+    while ((v >> mag) >= 2 * HIST_SUB)
+        mag++;
+    if (mag > HIST_MAGS)
+        return HIST_SIZE - 1;
+    return (mag + 1) * HIST_SUB + (int)(v >> mag) - HIST_SUB;
+}
+
+/* the value in the middle of bucket i */
+static apr_interval_time_t hist_value(int i)
+{
+    int mag;
+
+    if (i < 2 * HIST_SUB)
+        return i;
+    mag = i / HIST_SUB - 1;
+    return ((apr_interval_time_t)(i % HIST_SUB + HIST_SUB) << mag)
+           + (((apr_interval_time_t)1 << mag) / 2);
+}
+
+static void hist_add(struct histogram *h, apr_interval_time_t v)
+{
+    if (h->n == 0 || v < h->min)
+        h->min = v;
+    if (h->n == 0 || v > h->max)
+        h->max = v;
+    h->n++;
+    h->total += v;
+    h->sumsq += (double)v * v;
+    h->count[hist_index(v)]++;
+}
+
+static void hist_merge(struct histogram *h, const struct histogram *from)
+{
+    int i;
+
+    if (!from->n)
+        return;
+    if (h->n == 0 || from->min < h->min)
+        h->min = from->min;
+    if (h->n == 0 || from->max > h->max)
+        h->max = from->max;
+    h->n += from->n;
+    h->total += from->total;
+    h->sumsq += from->sumsq;
+    for (i = 0; i < HIST_SIZE; i++)
+        h->count[i] += from->count[i];
+}
+
+/* the value of the i-th smallest of the recorded values, counting from 0 */
+static apr_interval_time_t hist_at(const struct histogram *h, apr_int64_t i)
+{
+    apr_int64_t seen = 0;
+    int b;
+
+    if (i <= 0)
+        return h->min;
+    if (i >= h->n - 1)
+        return h->max;
+    for (b = 0; b < HIST_SIZE; b++) {
+        seen += h->count[b];
+        if (seen > i) {
+            apr_interval_time_t v = hist_value(b);
+            return ap_min(ap_max(v, h->min), h->max);
+        }
+    }
+    return h->max;
+}
+
+/* the sample standard deviation */
+static double hist_sd(const struct histogram *h)
+{
+    double var;
+
+    if (h->n < 2)
+        return 0;
+    var = (h->sumsq - (double)h->total * h->total / h->n) / (h->n - 1);
+    return var > 0 ? sqrt(var) : 0;
+}
+
+/* --------------------------------------------------------- */
+
+/* save the times of the request just completed on a connection */
+
+static void save_stats(struct connection *c)
+{
+    struct worker *w = c->w;
+    apr_interval_time_t ctime, ttime, waittime;
+    apr_uint32_t n;
+
+    c->done = w->lasttime = apr_time_now();
+    ctime    = ap_max(0, c->connect - c->start);
+    ttime    = ap_max(0, c->done - c->start);
+    waittime = ap_max(0, c->beginread - c->endwrite);
+
+    if (w->stats) {
+        struct data *s = &w->stats[w->done];
+        s->starttime = c->start;
+        s->ctime     = ctime;
+        s->time      = ttime;
+        s->waittime  = waittime;
+    }
+    hist_add(&w->hist[HIST_CONNECT], ctime);
+    hist_add(&w->hist[HIST_PROCESSING], ttime - ctime);
+    hist_add(&w->hist[HIST_WAITING], waittime);
+    hist_add(&w->hist[HIST_TOTAL], ttime);
+    w->done++;
+    c->due = 0;
+
+    n = apr_atomic_inc32(&completed) + 1;
+    if (heartbeatres && !(n % heartbeatres)) {
+        fprintf(stderr, "Completed %u requests\n", n);
+        fflush(stderr);
+    }
+}
+
+/* --------------------------------------------------------- */
+
+/* open loop mode: keep a connection back until its next request is due,
+ * returns non-zero if the connection has been parked */
+
+static int pace(struct connection *c)
+{
+    struct worker *w = c->w;
+
+    if (!rate || c->due) {
+        return 0;
+    }
+    if (apr_time_now() < w->next_send) {
+        c->next = w->parked;
+        w->parked = c;
+        return 1;
+    }
+
+    /* times are measured from when the request was due, so that requests
+     * held up by slow responses are not reported faster than they were
+     */
+    c->due = w->next_send;
+    w->scheduled++;
+    w->next_send = w->first_send + (apr_time_t)(w->scheduled * w->interval);
+    return 0;
+}
+
+/* --------------------------------------------------------- */
+
 static void write_request(struct connection * c)
 {
-    if (started >= requests) {
+    struct worker *w = c->w;
+
+    if (w->started >= w->requests) {
+        return;
+    }
+
+    if (c->rwrite == 0 && pace(c)) {
+        /* an idle keep-alive connection: nothing to poll for */
+        set_polled_events(c, 0);
         return;
     }
 
@@ -711,7 +1011,7 @@ static void write_request(struct connection * c)
         apr_size_t l = c->rwrite;
         apr_status_t e = APR_SUCCESS; /* prevent gcc warning */
 
-        tnow = lasttime = apr_time_now();
+        tnow = w->lasttime = apr_time_now();
 
         /*
          * First time round ?
@@ -719,8 +1019,11 @@ static void write_request(struct connection * c)
         if (c->rwrite == 0) {
             apr_socket_timeout_set(c->aprsock, 0);
             c->connect = tnow;
+            if (c->due)
+                c->start = c->due;
+            c->req = &reqs[w->nextreq++ % nreqs];
             c->rwrote = 0;
-            c->rwrite = reqlen;
+            c->rwrite = c->req->len;
             if (send_body)
                 c->rwrite += postlen;
             l = c->rwrite;
@@ -734,7 +1037,7 @@ static void write_request(struct connection * c)
 #ifdef USE_SSL
         if (c->ssl) {
             apr_size_t e_ssl;
-            e_ssl = SSL_write(c->ssl,request + c->rwrote, l);
+            e_ssl = SSL_write(c->ssl, c->req->buf + c->rwrote, l);
             if (e_ssl != l) {
                 BIO_printf(bio_err, "SSL write failed - closing connection\n");
                 ERR_print_errors(bio_err);
@@ -746,21 +1049,21 @@ static void write_request(struct connection * c)
         }
         else
 #endif
-            e = apr_socket_send(c->aprsock, request + c->rwrote, &l);
+            e = apr_socket_send(c->aprsock, c->req->buf + c->rwrote, &l);
 
         if (e != APR_SUCCESS && !APR_STATUS_IS_EAGAIN(e)) {
-            epipe++;
+            w->epipe++;
             printf("Send request failed!\n");
             close_connection(c);
             return;
         }
-        totalposted += l;
+        w->totalposted += l;
         c->rwrote += l;
         c->rwrite -= l;
     } while (c->rwrite);
 
-    c->endwrite = lasttime = apr_time_now();
-    started++;
+    c->endwrite = w->lasttime = apr_time_now();
+    w->started++;
     set_conn_state(c, STATE_READ);
 }
 
@@ -768,15 +1071,6 @@ static void write_request(struct connection * c)
 
 /* calculate and output results */
 
-static int compradre(struct data * a, struct data * b)
-{
-    if ((a->ctime) < (b->ctime))
-        return -1;
-    if ((a->ctime) > (b->ctime))
-        return +1;
-    return 0;
-}
-
 static int comprando(struct data * a, struct data * b)
 {
     if ((a->time) < (b->time))
@@ -786,24 +1080,38 @@ static int comprando(struct data * a, struct data * b)
     return 0;
 }
 
-static int compri(struct data * a, struct data * b)
-{
-    apr_interval_time_t p = a->time - a->ctime;
-    apr_interval_time_t q = b->time - b->ctime;
-    if (p < q)
-        return -1;
-    if (p > q)
-        return +1;
-    return 0;
-}
-
-static int compwait(struct data * a, struct data * b)
+/* add up the counts of all workers */
+static void collect_results(void)
 {
-    if ((a->waittime) < (b->waittime))
-        return -1;
-    if ((a->waittime) > (b->waittime))
-        return 1;
-    return 0;
+    int i, j;
+
+    doclen = workers[0].doclen;
+    totalread = totalbread = totalposted = 0;
+    done = doneka = good = bad = epipe = 0;
+    err_length = err_conn = err_recv = err_except = err_response = 0;
+    memset(hist, 0, sizeof(hist));
+
+    for (i = 0; i < threads; i++) {
+        struct worker *w = &workers[i];
+
+        totalread += w->totalread;
+        totalbread += w->totalbread;
+        totalposted += w->totalposted;
+        done += w->done;
+        doneka += w->doneka;
+        good += w->good;
+        bad += w->bad;
+        epipe += w->epipe;
+        err_length += w->err_length;
+        err_conn += w->err_conn;
+        err_recv += w->err_recv;
+        err_except += w->err_except;
+        err_response += w->err_response;
+        lasttime = ap_max(lasttime, w->lasttime);
+        for (j = 0; j < HIST_COUNT; j++) {
+            hist_merge(&hist[j], &w->hist[j]);
+        }
+    }
 }
 
 static void output_results(int sig)
@@ -811,6 +1119,7 @@ static void output_results(int sig)
     double timetaken;
 
     if (sig) {
+        collect_results();
         lasttime = apr_time_now();  /* record final time if interrupted */
     }
     timetaken = (double) (lasttime - start) / APR_USEC_PER_SEC;
@@ -825,13 +1134,20 @@ static void output_results(int sig)
     }
 #endif
     printf("\n");
-    printf("Document Path:          %s\n", path);
+    if (urlfile)
+        printf("Document Paths:         %d from %s\n", nreqs, urlfile);
+    else
+        printf("Document Path:          %s\n", path);
     if (nolength)
         printf("Document Length:        Variable\n");
     else
         printf("Document Length:        %" APR_SIZE_T_FMT " bytes\n", doclen);
     printf("\n");
     printf("Concurrency Level:      %d\n", concurrency);
+    if (threads > 1)
+        printf("Threads:                %d\n", threads);
+    if (rate)
+        printf("Target request rate:    %.2f [#/sec]\n", rate);
     printf("Time taken for tests:   %.3f seconds\n", timetaken);
     printf("Complete requests:      %d\n", done);
     printf("Failed requests:        %d\n", bad);
@@ -871,88 +1187,41 @@ static void output_results(int sig)
     if (done > 0) {
         /* work out connection times */
         int i;
-        apr_time_t totalcon = 0, total = 0, totald = 0, totalwait = 0;
+        const struct histogram *hcon = &hist[HIST_CONNECT],
+                               *hd = &hist[HIST_PROCESSING],
+                               *hwait = &hist[HIST_WAITING],
+                               *htot = &hist[HIST_TOTAL];
         apr_time_t meancon, meantot, meand, meanwait;
-        apr_interval_time_t mincon = AB_MAX, mintot = AB_MAX, mind = AB_MAX,
-                            minwait = AB_MAX;
-        apr_interval_time_t maxcon = 0, maxtot = 0, maxd = 0, maxwait = 0;
-        apr_interval_time_t mediancon = 0, mediantot = 0, mediand = 0, medianwait = 0;
-        double sdtot = 0, sdcon = 0, sdd = 0, sdwait = 0;
-
-        for (i = 0; i < done; i++) {
-            struct data *s = &stats[i];
-            mincon = ap_min(mincon, s->ctime);
-            mintot = ap_min(mintot, s->time);
-            mind = ap_min(mind, s->time - s->ctime);
-            minwait = ap_min(minwait, s->waittime);
-
-            maxcon = ap_max(maxcon, s->ctime);
-            maxtot = ap_max(maxtot, s->time);
-            maxd = ap_max(maxd, s->time - s->ctime);
-            maxwait = ap_max(maxwait, s->waittime);
-
-            totalcon += s->ctime;
-            total += s->time;
-            totald += s->time - s->ctime;
-            totalwait += s->waittime;
-        }
-        meancon = totalcon / done;
-        meantot = total / done;
-        meand = totald / done;
-        meanwait = totalwait / done;
-
-        /* calculating the sample variance: the sum of the squared deviations, divided by n-1 */
-        for (i = 0; i < done; i++) {
-            struct data *s = &stats[i];
-            double a;
-            a = ((double)s->time - meantot);
-            sdtot += a * a;
-            a = ((double)s->ctime - meancon);
-            sdcon += a * a;
-            a = ((double)s->time - (double)s->ctime - meand);
-            sdd += a * a;
-            a = ((double)s->waittime - meanwait);
-            sdwait += a * a;
-        }
-
-        sdtot = (done > 1) ? sqrt(sdtot / (done - 1)) : 0;
-        sdcon = (done > 1) ? sqrt(sdcon / (done - 1)) : 0;
-        sdd = (done > 1) ? sqrt(sdd / (done - 1)) : 0;
-        sdwait = (done > 1) ? sqrt(sdwait / (done - 1)) : 0;
-
-        /*
-         * XXX: what is better; this hideous cast of the compradre function; or
-         * the four warnings during compile ? dirkx just does not know and
-         * hates both/
-         */
-        qsort(stats, done, sizeof(struct data),
-              (int (*) (const void *, const void *)) compradre);
-        if ((done > 1) && (done % 2))
-            mediancon = (stats[done / 2].ctime + stats[done / 2 + 1].ctime) / 2;
-        else
-            mediancon = stats[done / 2].ctime;
-
-        qsort(stats, done, sizeof(struct data),
-              (int (*) (const void *, const void *)) compri);
-        if ((done > 1) && (done % 2))
-            mediand = (stats[done / 2].time + stats[done / 2 + 1].time \
-            -stats[done / 2].ctime - stats[done / 2 + 1].ctime) / 2;
-        else
-            mediand = stats[done / 2].time - stats[done / 2].ctime;
-
-        qsort(stats, done, sizeof(struct data),
-              (int (*) (const void *, const void *)) compwait);
-        if ((done > 1) && (done % 2))
-            medianwait = (stats[done / 2].waittime + stats[done / 2 + 1].waittime) / 2;
-        else
-            medianwait = stats[done / 2].waittime;
-
-        qsort(stats, done, sizeof(struct data),
-              (int (*) (const void *, const void *)) comprando);
-        if ((done > 1) && (done % 2))
-            mediantot = (stats[done / 2].time + stats[done / 2 + 1].time) / 2;
-        else
-            mediantot = stats[done / 2].time;
+        apr_interval_time_t mincon, mintot, mind, minwait;
+        apr_interval_time_t maxcon, maxtot, maxd, maxwait;
+        apr_interval_time_t mediancon, mediantot, mediand, medianwait;
+        double sdtot, sdcon, sdd, sdwait;
+
+        mincon = hcon->min;
+        mind = hd->min;
+        minwait = hwait->min;
+        mintot = htot->min;
+
+        maxcon = hcon->max;
+        maxd = hd->max;
+        maxwait = hwait->max;
+        maxtot = htot->max;
+
+        meancon = hcon->total / done;
+        meand = hd->total / done;
+        meanwait = hwait->total / done;
+        meantot = htot->total / done;
+
+        /* the sample variance: the sum of the squared deviations, divided by n-1 */
+        sdcon = hist_sd(hcon);
+        sdd = hist_sd(hd);
+        sdwait = hist_sd(hwait);
+        sdtot = hist_sd(htot);
+
+        mediancon = hist_at(hcon, done / 2);
+        mediand = hist_at(hd, done / 2);
+        medianwait = hist_at(hwait, done / 2);
+        mediantot = hist_at(htot, done / 2);
 
         printf("\nConnection Times (ms)\n");
         /*
@@ -1027,10 +1296,10 @@ static void output_results(int sig)
                     printf(" 0%%  <0> (never)\n");
                 else if (percs[i] >= 100)
                     printf(" 100%%  %5" APR_TIME_T_FMT " (longest request)\n",
-                           ap_round_ms(stats[done - 1].time));
+                           ap_round_ms(htot->max));
                 else
                     printf("  %d%%  %5" APR_TIME_T_FMT "\n", percs[i],
-                           ap_round_ms(stats[(unsigned long)done * percs[i] / 100].time));
+                           ap_round_ms(hist_at(htot, (apr_int64_t)done * percs[i] / 100)));
             }
         }
         if (csvperc) {
@@ -1043,11 +1312,9 @@ static void output_results(int sig)
             for (i = 0; i < 100; i++) {
                 double t;
                 if (i == 0)
-                    t = ap_double_ms(stats[0].time);
-                else if (i == 100)
-                    t = ap_double_ms(stats[done - 1].time);
+                    t = ap_double_ms(htot->min);
                 else
-                    t = ap_double_ms(stats[(unsigned long) (0.5 + (double)done * i / 100.0)].time);
+                    t = ap_double_ms(hist_at(htot, (apr_int64_t) (0.5 + (double)done * i / 100.0)));
                 fprintf(out, "%d,%.3f\n", i, t);
             }
             fclose(out);
@@ -1055,12 +1322,26 @@ static void output_results(int sig)
         if (gnuplot) {
             FILE *out = fopen(gnuplot, "w");
             char tmstring[APR_CTIME_LEN];
+            struct data *stats;
+            int n = 0;
+
             if (!out) {
                 perror("Cannot open gnuplot output file");
                 exit(1);
             }
+
+            /* all requests, sorted on total connect times */
+            stats = xcalloc(done, sizeof(struct data));
+            for (i = 0; i < threads; i++) {
+                int k = ap_min(workers[i].done, done - n);
+                memcpy(stats + n, workers[i].stats, k * sizeof(struct data));
+                n += k;
+            }
+            qsort(stats, n, sizeof(struct data),
+                  (int (*) (const void *, const void *)) comprando);
+
             fprintf(out, "starttime\tseconds\tctime\tdtime\tttime\twait\n");
-            for (i = 0; i < done; i++) {
+            for (i = 0; i < n; i++) {
                 (void) apr_ctime(tmstring, stats[i].starttime);
                 fprintf(out, "%s\t%" APR_TIME_T_FMT "\t%" APR_TIME_T_FMT
                                "\t%" APR_TIME_T_FMT "\t%" APR_TIME_T_FMT
@@ -1072,6 +1353,7 @@ static void output_results(int sig)
                         ap_round_ms(stats[i].waittime));
             }
             fclose(out);
+            free(stats);
         }
     }
 
@@ -1098,9 +1380,14 @@ static void output_html_results(void)
     printf("<tr %s><th colspan=2 %s>Server Port:</th>"
        "<td colspan=2 %s>%hu</td></tr>\n",
        trstring, tdstring, tdstring, port);
-    printf("<tr %s><th colspan=2 %s>Document Path:</th>"
-       "<td colspan=2 %s>%s</td></tr>\n",
-       trstring, tdstring, tdstring, path);
+    if (urlfile)
+        printf("<tr %s><th colspan=2 %s>Document Paths:</th>"
+           "<td colspan=2 %s>%d from %s</td></tr>\n",
+           trstring, tdstring, tdstring, nreqs, urlfile);
+    else
+        printf("<tr %s><th colspan=2 %s>Document Path:</th>"
+           "<td colspan=2 %s>%s</td></tr>\n",
+           trstring, tdstring, tdstring, path);
     if (nolength)
         printf("<tr %s><th colspan=2 %s>Document Length:</th>"
             "<td colspan=2 %s>Variable</td></tr>\n",
@@ -1165,20 +1452,13 @@ static void output_html_results(void)
     }
     {
         /* work out connection times */
-        int i;
-        apr_interval_time_t totalcon = 0, total = 0;
-        apr_interval_time_t mincon = AB_MAX, mintot = AB_MAX;
-        apr_interval_time_t maxcon = 0, maxtot = 0;
-
-        for (i = 0; i < done; i++) {
-            struct data *s = &stats[i];
-            mincon = ap_min(mincon, s->ctime);
-            mintot = ap_min(mintot, s->time);
-            maxcon = ap_max(maxcon, s->ctime);
-            maxtot = ap_max(maxtot, s->time);
-            totalcon += s->ctime;
-            total    += s->time;
-        }
+        apr_interval_time_t totalcon = hist[HIST_CONNECT].total,
+                            total = hist[HIST_TOTAL].total;
+        apr_interval_time_t mincon = hist[HIST_CONNECT].min,
+                            mintot = hist[HIST_TOTAL].min;
+        apr_interval_time_t maxcon = hist[HIST_CONNECT].max,
+                            maxtot = hist[HIST_TOTAL].max;
+
         /*
          * Reduce stats from apr time to milliseconds
          */
@@ -1221,11 +1501,15 @@ static void output_html_results(void)
 
 static void start_connect(struct connection * c)
 {
+    struct worker *w = c->w;
     apr_status_t rv;
 
-    if (!(started < requests))
+    if (!(w->started < w->requests))
     return;
 
+    if (pace(c))
+        return;
+
     c->read = 0;
     c->bread = 0;
     c->keepalive = 0;
@@ -1235,9 +1519,9 @@ static void start_connect(struct connection * c)
     if (c->ctx)
         apr_pool_clear(c->ctx);
     else
-        apr_pool_create(&c->ctx, cntxt);
+        apr_pool_create(&c->ctx, w->pool);
 
-    if ((rv = apr_socket_create(&c->aprsock, destsa->family,
+    if ((rv = apr_socket_create(&c->aprsock, w->destsa->family,
                 SOCK_STREAM, 0, c->ctx)) != APR_SUCCESS) {
     apr_err("socket", rv);
     }
@@ -1271,7 +1555,9 @@ static void start_connect(struct connection * c)
         }
     }
 
-    c->start = lasttime = apr_time_now();
+    c->start = w->lasttime = apr_time_now();
+    if (c->due)
+        c->start = c->due;
 #ifdef USE_SSL
     if (is_ssl) {
         BIO *bio;
@@ -1295,7 +1581,7 @@ static void start_connect(struct connection * c)
         c->ssl = NULL;
     }
 #endif
-    if ((rv = apr_socket_connect(c->aprsock, destsa)) != APR_SUCCESS) {
+    if ((rv = apr_socket_connect(c->aprsock, w->destsa)) != APR_SUCCESS) {
         if (APR_STATUS_IS_EINPROGRESS(rv)) {
             set_conn_state(c, STATE_CONNECTING);
             c->rwrite = 0;
@@ -1304,17 +1590,17 @@ static void start_connect(struct connection * c)
         else {
             set_conn_state(c, STATE_UNCONNECTED);
             apr_socket_close(c->aprsock);
-            if (good == 0 && destsa->next) {
-                destsa = destsa->next;
-                err_conn = 0;
+            if (w->good == 0 && w->destsa->next) {
+                w->destsa = w->destsa->next;
+                w->err_conn = 0;
             }
-            else if (bad++ > 10) {
+            else if (w->bad++ > 10) {
                 fprintf(stderr,
                    "\nTest aborted after 10 failures\n\n");
                 apr_err("apr_socket_connect()", rv);
             }
             else {
-                err_conn++;
+                w->err_conn++;
             }
 
             start_connect(c);
@@ -1340,34 +1626,27 @@ static void start_connect(struct connection * c)
 
 static void close_connection(struct connection * c)
 {
+    struct worker *w = c->w;
+
     if (c->read == 0 && c->keepalive) {
         /*
          * server has legitimately shut down an idle keep alive request
          */
-        if (good)
-            good--;     /* connection never happened */
+        if (w->good)
+            w->good--;  /* connection never happened */
     }
     else {
-        if (good == 1) {
+        if (w->good == 1) {
             /* first time here */
-            doclen = c->bread;
+            w->doclen = c->bread;
         }
-        else if ((c->bread != doclen) && !nolength) {
-            bad++;
-            err_length++;
+        else if ((c->bread != w->doclen) && !nolength) {
+            w->bad++;
+            w->err_length++;
         }
         /* save out time */
-        if (done < requests) {
-            struct data *s = &stats[done++];
-            c->done      = lasttime = apr_time_now();
-            s->starttime = c->start;
-            s->ctime     = ap_max(0, c->connect - c->start);
-            s->time      = ap_max(0, c->done - c->start);
-            s->waittime  = ap_max(0, c->beginread - c->endwrite);
-            if (heartbeatres && !(done % heartbeatres)) {
-                fprintf(stderr, "Completed %d requests\n", done);
-                fflush(stderr);
-            }
+        if (w->done < w->requests) {
+            save_stats(c);
         }
     }
 
@@ -1392,13 +1671,15 @@ static void close_connection(struct connection * c)
 
 static void read_connection(struct connection * c)
 {
+    struct worker *w = c->w;
+    char *buffer = w->buffer;
     apr_size_t r;
     apr_status_t status;
     char *part;
     char respcode[4];       /* 3 digits and null */
     int i;
 
-    r = sizeof(buffer);
+    r = sizeof(w->buffer);
 #ifdef USE_SSL
     if (c->ssl) {
         status = SSL_read(c->ssl, buffer, r);
@@ -1407,7 +1688,7 @@ static void read_connection(struct connection * c)
 
             if (scode == SSL_ERROR_ZERO_RETURN) {
                 /* connection closed cleanly: */
-                good++;
+                w->good++;
                 close_connection(c);
             }
             else if (scode == SSL_ERROR_SYSCALL
@@ -1417,14 +1698,14 @@ static void read_connection(struct connection * c)
                  * some data has already been read; this commonly happens, so
                  * let the length check catch any response errors
                  */
-                good++;
+                w->good++;
                 close_connection(c);
             }
             else if (scode == SSL_ERROR_SYSCALL 
                      && c->read == 0
-                     && destsa->next
+                     && w->destsa->next
                      && c->state == STATE_CONNECTING
-                     && good == 0) {
+                     && w->good == 0) {
                 return;
             }
             else if (scode != SSL_ERROR_WANT_WRITE
@@ -1446,33 +1727,33 @@ static void read_connection(struct connection * c)
         if (APR_STATUS_IS_EAGAIN(status))
             return;
         else if (r == 0 && APR_STATUS_IS_EOF(status)) {
-            good++;
+            w->good++;
             close_connection(c);
             return;
         }
         /* catch legitimate fatal apr_socket_recv errors */
         else if (status != APR_SUCCESS) {
             if (recverrok) {
-                err_recv++;
-                bad++;
+                w->err_recv++;
+                w->bad++;
                 close_connection(c);
                 if (verbosity >= 1) {
                     char buf[120];
                     fprintf(stderr,"%s: %s (%d)\n", "apr_socket_recv", apr_strerror(status, buf, sizeof buf), status);
                 }
                 return;
-            } else if (destsa->next && c->state == STATE_CONNECTING
-                       && c->read == 0 && good == 0) {
+            } else if (w->destsa->next && c->state == STATE_CONNECTING
+                       && c->read == 0 && w->good == 0) {
                 return;
             }
             else {
-                err_recv++;
+                w->err_recv++;
                 apr_err("apr_socket_recv", status);
             }
         }
     }
 
-    totalread += r;
+    w->totalread += r;
     if (c->read == 0) {
         c->beginread = apr_time_now();
     }
@@ -1522,8 +1803,8 @@ static void read_connection(struct connection * c)
             /* header is in invalid or too big - close connection */
                 set_conn_state(c, STATE_UNCONNECTED);
                 apr_socket_close(c->aprsock);
-                err_response++;
-                if (bad++ > 10) {
+                w->err_response++;
+                if (w->bad++ > 10) {
                     err("\nTest aborted after 10 failures\n\n");
                 }
                 start_connect(c);
@@ -1531,7 +1812,7 @@ static void read_connection(struct connection * c)
         }
         else {
             /* have full header */
-            if (!good) {
+            if (!w->good && w->id == 0) {
                 /*
                  * this is first time, extract some interesting info
                  */
@@ -1565,7 +1846,7 @@ static void read_connection(struct connection * c)
             }
 
             if (respcode[0] != '2') {
-                err_response++;
+                w->err_response++;
                 if (verbosity >= 2)
                     printf("WARNING: Response code not 2xx (%s)\n", respcode);
             }
@@ -1594,49 +1875,40 @@ static void read_connection(struct connection * c)
                 }
             }
             c->bread += c->cbx - (s + l - c->cbuff) + r - tocopy;
-            totalbread += c->bread;
+            w->totalbread += c->bread;
 
             /* We have received the header, so we know this destination socket
              * address is working, so initialize all remaining requests. */
-            if (!requests_initialized) {
-                for (i = 1; i < concurrency; i++) {
-                    con[i].socknum = i;
-                    start_connect(&con[i]);
+            if (!w->requests_initialized) {
+                for (i = 1; i < w->concurrency; i++) {
+                    w->con[i].socknum = i;
+                    start_connect(&w->con[i]);
                 }
-                requests_initialized = 1;
+                w->requests_initialized = 1;
             }
         }
     }
     else {
         /* outside header, everything we have read is entity body */
         c->bread += r;
-        totalbread += r;
+        w->totalbread += r;
     }
 
     if (c->keepalive && (c->bread >= c->length)) {
         /* finished a keep-alive connection */
-        good++;
+        w->good++;
         /* save out time */
-        if (good == 1) {
+        if (w->good == 1) {
             /* first time here */
-            doclen = c->bread;
+            w->doclen = c->bread;
         }
-        else if ((c->bread != doclen) && !nolength) {
-            bad++;
-            err_length++;
+        else if ((c->bread != w->doclen) && !nolength) {
+            w->bad++;
+            w->err_length++;
         }
-        if (done < requests) {
-            struct data *s = &stats[done++];
-            doneka++;
-            c->done      = apr_time_now();
-            s->starttime = c->start;
-            s->ctime     = ap_max(0, c->connect - c->start);
-            s->time      = ap_max(0, c->done - c->start);
-            s->waittime  = ap_max(0, c->beginread - c->endwrite);
-            if (heartbeatres && !(done % heartbeatres)) {
-                fprintf(stderr, "Completed %d requests\n", done);
-                fflush(stderr);
-            }
+        if (w->done < w->requests) {
+            w->doneka++;
+            save_stats(c);
         }
         c->keepalive = 0;
         c->length = 0;
@@ -1644,110 +1916,48 @@ static void read_connection(struct connection * c)
         c->cbx = 0;
         c->read = c->bread = 0;
         /* zero connect time with keep-alive */
-        c->start = c->connect = lasttime = apr_time_now();
+        c->start = c->connect = w->lasttime = apr_time_now();
         write_request(c);
     }
 }
 
 /* --------------------------------------------------------- */
 
-/* run the tests */
+/* build the request for a path, or for a full URL through a proxy */
 
-static void test(void)
+static void build_request(const char *target, struct request_buf *rb)
 {
-    apr_time_t stoptime;
-    apr_int16_t rtnev;
-    apr_status_t rv;
-    int i;
-    apr_status_t status;
+    char *request = apr_palloc(cntxt, REQBUFFSIZE);
     int snprintf_res = 0;
 #ifdef NOT_ASCII
     apr_size_t inbytes_left, outbytes_left;
+    apr_status_t status;
 #endif
 
-    if (isproxy) {
-        connecthost = apr_pstrdup(cntxt, proxyhost);
-        connectport = proxyport;
-    }
-    else {
-        connecthost = apr_pstrdup(cntxt, hostname);
-        connectport = port;
-    }
-
-    if (!use_html) {
-        printf("Benchmarking %s ", hostname);
-    if (isproxy)
-        printf("[through %s:%d] ", proxyhost, proxyport);
-    printf("(be patient)%s",
-           (heartbeatres ? "\n" : "..."));
-    fflush(stdout);
-    }
-
-    con = xcalloc(concurrency, sizeof(struct connection));
-
-    /*
-     * XXX: a way to calculate the stats without requiring O(requests) memory
-     * XXX: would be nice.
-     */
-    stats = xcalloc(requests, sizeof(struct data));
-
-    if ((status = apr_pollset_create(&readbits, concurrency, cntxt,
-                                     APR_POLLSET_NOCOPY)) != APR_SUCCESS) {
-        apr_err("apr_pollset_create failed", status);
-    }
-
-    /* add default headers if necessary */
-    if (!opt_host) {
-        /* Host: header not overridden, add default value to hdrs */
-        hdrs = apr_pstrcat(cntxt, hdrs, "Host: ", host_field, colonhost, "\r\n", NULL);
-    }
-    else {
-        /* Header overridden, no need to add, as it is already in hdrs */
-    }
-
-    if (!opt_useragent) {
-        /* User-Agent: header not overridden, add default value to hdrs */
-        hdrs = apr_pstrcat(cntxt, hdrs, "User-Agent: ApacheBench/", AP_AB_BASEREVISION, "\r\n", NULL);
-    }
-    else {
-        /* Header overridden, no need to add, as it is already in hdrs */
-    }
-
-    if (!opt_accept) {
-        /* Accept: header not overridden, add default value to hdrs */
-        hdrs = apr_pstrcat(cntxt, hdrs, "Accept: */*\r\n", NULL);
-    }
-    else {
-        /* Header overridden, no need to add, as it is already in hdrs */
-    }
-
-    /* setup request */
     if (!send_body) {
-        snprintf_res = apr_snprintf(request, sizeof(_request),
+        snprintf_res = apr_snprintf(request, REQBUFFSIZE,
             "%s %s HTTP/1.0\r\n"
             "%s" "%s" "%s"
             "%s" "\r\n",
-            method_str[method],
-            (isproxy) ? fullurl : path,
+            method_str[method], target,
             keepalive ? "Connection: Keep-Alive\r\n" : "",
             cookie, auth, hdrs);
     }
     else {
-        snprintf_res = apr_snprintf(request,  sizeof(_request),
+        snprintf_res = apr_snprintf(request, REQBUFFSIZE,
             "%s %s HTTP/1.0\r\n"
             "%s" "%s" "%s"
             "Content-length: %" APR_SIZE_T_FMT "\r\n"
             "Content-type: %s\r\n"
             "%s"
             "\r\n",
-            method_str[method],
-            (isproxy) ? fullurl : path,
+            method_str[method], target,
             keepalive ? "Connection: Keep-Alive\r\n" : "",
             cookie, auth,
             postlen,
             (content_type != NULL) ? content_type : "text/plain", hdrs);
     }
-    if (snprintf_res >= sizeof(_request)) {
+    if (snprintf_res >= REQBUFFSIZE) {
         err("Request too long\n");
     }
 
@@ -1755,20 +1965,20 @@ static void test(void)
         printf("INFO: %s header == \n---\n%s\n---\n",
                method_str[method], request);
 
-    reqlen = strlen(request);
+    rb->len = strlen(request);
 
     /*
      * Combine headers and (optional) post file into one continuous buffer
      */
     if (send_body) {
-        char *buff = xmalloc(postlen + reqlen + 1);
+        char *buff = xmalloc(postlen + rb->len + 1);
         strcpy(buff, request);
-        memcpy(buff + reqlen, postdata, postlen);
+        memcpy(buff + rb->len, postdata, postlen);
         request = buff;
     }
 
 #ifdef NOT_ASCII
-    inbytes_left = outbytes_left = reqlen;
+    inbytes_left = outbytes_left = rb->len;
     status = apr_xlate_conv_buffer(to_ascii, request, &inbytes_left,
                    request, &outbytes_left);
     if (status || inbytes_left || outbytes_left) {
@@ -1779,49 +1989,139 @@ static void test(void)
     }
 #endif              /* NOT_ASCII */
 
-    if (myhost) {
-        /* This only needs to be done once */
-        if ((rv = apr_sockaddr_info_get(&mysa, myhost, APR_UNSPEC, 0, 0, cntxt)) != APR_SUCCESS) {
-            char buf[120];
-            apr_snprintf(buf, sizeof(buf),
-                         "apr_sockaddr_info_get() for %s", myhost);
-            apr_err(buf, rv);
+    rb->buf = request;
+}
+
+/* --------------------------------------------------------- */
+
+/*
+ * read the paths to request from a file, one per line: either the path
+ * itself, a URL of which only the path is used, or a line of an access
+ * log, of which the path of the quoted request line is used
+ */
+
+static void read_urlfile(void)
+{
+    apr_array_header_t *paths = apr_array_make(cntxt, 64, sizeof(char *));
+    apr_file_t *fd;
+    apr_status_t rv;
+    char line[REQBUFFSIZE];
+    const char *prefix = NULL;
+    int i;
+
+    rv = apr_file_open(&fd, urlfile, APR_READ | APR_BUFFERED,
+                       APR_OS_DEFAULT, cntxt);
+    if (rv != APR_SUCCESS) {
+        apr_err(urlfile, rv);
+    }
+
+    while (apr_file_gets(line, sizeof(line), fd) == APR_SUCCESS) {
+        char *p = line, *q;
+
+        if ((q = strchr(p, '"')) != NULL) {
+            /* "METHOD /path PROTOCOL" */
+            p = q + 1;
+            while (*p && !apr_isspace(*p) && *p != '"')
+                p++;
+            while (*p == ' ')
+                p++;
+        }
+        else {
+            while (apr_isspace(*p))
+                p++;
+            if (*p == '#')
+                continue;
+            if (strncmp(p, "http://", 7) == 0 || strncmp(p, "https://", 8) == 0) {
+                p = strchr(strchr(p, ':') + 3, '/');
+                if (!p)
+                    continue;
+            }
         }
+        if (*p != '/')
+            continue;
+        for (q = p; *q && !apr_isspace(*q) && *q != '"'; q++)
+            ;
+        APR_ARRAY_PUSH(paths, char *) = apr_pstrmemdup(cntxt, p, q - p);
     }
+    apr_file_close(fd);
 
-    /* This too */
-    if ((rv = apr_sockaddr_info_get(&destsa, connecthost,
-                                    myhost ? mysa->family : APR_UNSPEC,
-                                    connectport, 0, cntxt))
-       != APR_SUCCESS) {
-        char buf[120];
-        apr_snprintf(buf, sizeof(buf),
-                 "apr_sockaddr_info_get() for %s", connecthost);
-        apr_err(buf, rv);
+    if (paths->nelts == 0) {
+        fprintf(stderr, "No paths found in %s\n", urlfile);
+        exit(1);
     }
 
-    /* ok - lets start */
-    start = lasttime = apr_time_now();
-    stoptime = tlimit ? (start + apr_time_from_sec(tlimit)) : AB_MAX;
+    if (isproxy) {
+        /* the scheme and host of the URL given on the command line */
+        prefix = apr_pstrmemdup(cntxt, fullurl, strlen(fullurl) - strlen(path));
+    }
 
-#ifdef SIGINT
-    /* Output the results if the user terminates the run early. */
-    apr_signal(SIGINT, output_results);
-#endif
+    nreqs = paths->nelts;
+    reqs = xcalloc(nreqs, sizeof(struct request_buf));
+    for (i = 0; i < nreqs; i++) {
+        const char *p = APR_ARRAY_IDX(paths, i, char *);
+
+        build_request(isproxy ? apr_pstrcat(cntxt, prefix, p, NULL) : p,
+                      &reqs[i]);
+    }
+}
+
+/* --------------------------------------------------------- */
+
+/* restart the parked connections whose requests are due */
+
+static void resume_parked(struct worker *w)
+{
+    while (w->parked && apr_time_now() >= w->next_send) {
+        struct connection *c = w->parked;
+
+        w->parked = c->next;
+        if (c->state == STATE_UNCONNECTED)
+            start_connect(c);
+        else
+            write_request(c);
+    }
+}
+
+/* --------------------------------------------------------- */
+
+/* run the share of the tests of a worker */
+
+static void run_worker(struct worker *w)
+{
+    apr_int16_t rtnev;
+    apr_status_t rv;
+    int i;
+    apr_status_t status;
 
     /* initialise first connection to determine destination socket address
      * which should be used for next connections. */
-    con[0].socknum = 0;
-    start_connect(&con[0]);
+    w->con[0].socknum = 0;
+    start_connect(&w->con[0]);
 
     do {
         apr_int32_t n;
         const apr_pollfd_t *pollresults, *pollfd;
+        apr_interval_time_t timeout = aprtimeout;
 
-        n = concurrency;
+        if (w->parked) {
+            apr_time_t now;
+
+            resume_parked(w);
+            now = apr_time_now();
+            if (w->parked && w->next_send - now < timeout) {
+                /* wake up when the next request is due */
+                timeout = ap_max(0, w->next_send - now);
+            }
+        }
+
+        n = w->concurrency;
         do {
-            status = apr_pollset_poll(readbits, aprtimeout, &n, &pollresults);
+            status = apr_pollset_poll(w->pollset, timeout, &n, &pollresults);
         } while (APR_STATUS_IS_EINTR(status));
+        if (APR_STATUS_IS_TIMEUP(status) && timeout < aprtimeout) {
+            w->lasttime = apr_time_now();
+            continue;
+        }
         if (status != APR_SUCCESS)
             apr_err("apr_pollset_poll", status);
 
@@ -1860,13 +2160,13 @@ static void test(void)
             if ((rtnev & APR_POLLIN) || (rtnev & APR_POLLPRI) || (rtnev & APR_POLLHUP))
                 read_connection(c);
             if ((rtnev & APR_POLLERR) || (rtnev & APR_POLLNVAL)) {
-                if (destsa->next && c->state == STATE_CONNECTING && good == 0) {
-                    destsa = destsa->next;
+                if (w->destsa->next && c->state == STATE_CONNECTING && w->good == 0) {
+                    w->destsa = w->destsa->next;
                     start_connect(c);
                 }
                 else {
-                    bad++;
-                    err_except++;
+                    w->bad++;
+                    w->err_except++;
                     /* avoid apr_poll/EINPROGRESS loop on HP-UX, let recv discover ECONNREFUSED */
                     if (c->state == STATE_CONNECTING) {
                         read_connection(c);
@@ -1879,12 +2179,12 @@ static void test(void)
             }
             if (rtnev & APR_POLLOUT) {
                 if (c->state == STATE_CONNECTING) {
-                    rv = apr_socket_connect(c->aprsock, destsa);
+                    rv = apr_socket_connect(c->aprsock, w->destsa);
                     if (rv != APR_SUCCESS) {
                         set_conn_state(c, STATE_UNCONNECTED);
                         apr_socket_close(c->aprsock);
-                        err_conn++;
-                        if (bad++ > 10) {
+                        w->err_conn++;
+                        if (w->bad++ > 10) {
                             fprintf(stderr,
                                     "\nTest aborted after 10 failures\n\n");
                             apr_err("apr_socket_connect()", rv);
@@ -1907,7 +2207,169 @@ static void test(void)
                 }
             }
         }
-    } while (lasttime < stoptime && done < requests);
+    } while (w->lasttime < stoptime && w->done < w->requests);
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC worker_thread(apr_thread_t *thd, void *data)
+{
+    run_worker(data);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+#endif
+
+/* --------------------------------------------------------- */
+
+/* run the tests */
+
+static void test(void)
+{
+    apr_status_t rv;
+    int i, j;
+    apr_status_t status;
+
+    if (isproxy) {
+        connecthost = apr_pstrdup(cntxt, proxyhost);
+        connectport = proxyport;
+    }
+    else {
+        connecthost = apr_pstrdup(cntxt, hostname);
+        connectport = port;
+    }
+
+    if (!use_html) {
+        printf("Benchmarking %s ", hostname);
+    if (isproxy)
+        printf("[through %s:%d] ", proxyhost, proxyport);
+    printf("(be patient)%s",
+           (heartbeatres ? "\n" : "..."));
+    fflush(stdout);
+    }
+
+    /* add default headers if necessary */
+    if (!opt_host) {
+        /* Host: header not overridden, add default value to hdrs */
+        hdrs = apr_pstrcat(cntxt, hdrs, "Host: ", host_field, colonhost, "\r\n", NULL);
+    }
+    else {
+        /* Header overridden, no need to add, as it is already in hdrs */
+    }
+
+    if (!opt_useragent) {
+        /* User-Agent: header not overridden, add default value to hdrs */
+        hdrs = apr_pstrcat(cntxt, hdrs, "User-Agent: ApacheBench/", AP_AB_BASEREVISION, "\r\n", NULL);
+    }
+    else {
+        /* Header overridden, no need to add, as it is already in hdrs */
+    }
+
+    if (!opt_accept) {
+        /* Accept: header not overridden, add default value to hdrs */
+        hdrs = apr_pstrcat(cntxt, hdrs, "Accept: */*\r\n", NULL);
+    }
+    else {
+        /* Header overridden, no need to add, as it is already in hdrs */
+    }
+
+    /* setup requests */
+    if (urlfile) {
+        read_urlfile();
+    }
+    else {
+        reqs = xcalloc(1, sizeof(struct request_buf));
+        build_request((isproxy) ? fullurl : path, &reqs[0]);
+    }
+
+    if (myhost) {
+        /* This only needs to be done once */
+        if ((rv = apr_sockaddr_info_get(&mysa, myhost, APR_UNSPEC, 0, 0, cntxt)) != APR_SUCCESS) {
+            char buf[120];
+            apr_snprintf(buf, sizeof(buf),
+                         "apr_sockaddr_info_get() for %s", myhost);
+            apr_err(buf, rv);
+        }
+    }
+
+    /* This too */
+    if ((rv = apr_sockaddr_info_get(&destsa, connecthost,
+                                    myhost ? mysa->family : APR_UNSPEC,
+                                    connectport, 0, cntxt))
+       != APR_SUCCESS) {
+        char buf[120];
+        apr_snprintf(buf, sizeof(buf),
+                 "apr_sockaddr_info_get() for %s", connecthost);
+        apr_err(buf, rv);
+    }
+
+    /* share the connections and requests between the workers */
+    workers = xcalloc(threads, sizeof(struct worker));
+    for (i = 0; i < threads; i++) {
+        struct worker *w = &workers[i];
+
+        w->id = i;
+        w->concurrency = concurrency / threads + (i < concurrency % threads);
+        w->requests = requests / threads + (i < requests % threads);
+        w->destsa = destsa;
+        w->nextreq = i;
+        apr_pool_create(&w->pool, cntxt);
+
+        w->con = xcalloc(w->concurrency, sizeof(struct connection));
+        for (j = 0; j < w->concurrency; j++) {
+            w->con[j].w = w;
+        }
+
+        /* requests are only kept one by one for the gnuplot output,
+         * the statistics use histograms of a fixed size
+         */
+        if (gnuplot) {
+            w->stats = xcalloc(w->requests, sizeof(struct data));
+        }
+
+        if ((status = apr_pollset_create(&w->pollset, w->concurrency,
+                                         w->pool, APR_POLLSET_NOCOPY))
+            != APR_SUCCESS) {
+            apr_err("apr_pollset_create failed", status);
+        }
+
+        if (rate) {
+            w->interval = APR_USEC_PER_SEC * threads / rate;
+        }
+    }
+
+    /* ok - lets start */
+    start = lasttime = apr_time_now();
+    stoptime = tlimit ? (start + apr_time_from_sec(tlimit)) : AB_MAX;
+
+    /* stagger the requests of the workers */
+    for (i = 0; i < threads; i++) {
+        workers[i].first_send = workers[i].next_send =
+            start + (apr_time_t)(i * APR_USEC_PER_SEC / (rate ? rate : 1));
+    }
+
+#ifdef SIGINT
+    /* Output the results if the user terminates the run early. */
+    apr_signal(SIGINT, output_results);
+#endif
+
+#if APR_HAS_THREADS
+    for (i = 1; i < threads; i++) {
+        rv = apr_thread_create(&workers[i].thread, NULL, worker_thread,
+                               &workers[i], cntxt);
+        if (rv != APR_SUCCESS) {
+            apr_err("apr_thread_create", rv);
+        }
+    }
+#endif
+    run_worker(&workers[0]);
+#if APR_HAS_THREADS
+    for (i = 1; i < threads; i++) {
+        apr_status_t thread_rv;
+        apr_thread_join(&thread_rv, workers[i].thread);
+    }
+#endif
+
+    collect_results();
 
     if (heartbeatres)
         fprintf(stderr, "Finished %d requests\n", done);
@@ -1953,6 +2415,13 @@ static void usage(const char *progname)
     fprintf(stderr, "Options are:\n");
     fprintf(stderr, "    -n requests     Number of requests to perform\n");
     fprintf(stderr, "    -c concurrency  Number of multiple requests to make at a time\n");
+#if APR_HAS_THREADS
+    fprintf(stderr, "    -W threads      Number of threads sharing the connections\n");
+#endif
+    fprintf(stderr, "    -R rate         Send requests at this rate per second, whether or not\n");
+    fprintf(stderr, "                    earlier requests have been answered (open loop)\n");
+    fprintf(stderr, "    -L urlfile      Request in turn the paths listed in urlfile, or found\n");
+    fprintf(stderr, "                    in an access log. This implies -l\n");
     fprintf(stderr, "    -t timelimit    Seconds to max. to spend on benchmarking\n");
     fprintf(stderr, "                    This implies -n 50000\n");
     fprintf(stderr, "    -s timeout      Seconds to max. wait for each response\n");
@@ -2166,7 +2635,7 @@ int main(int argc, const char * const argv[])
     myhost = NULL; /* 0.0.0.0 or :: */
 
     apr_getopt_init(&opt, cntxt, argc, argv);
-    while ((status = apr_getopt(opt, "n:c:t:s:b:T:p:u:v:lrkVhwix:y:z:C:H:P:A:g:X:de:SqB:m:"
+    while ((status = apr_getopt(opt, "n:c:t:s:b:T:p:u:v:lrkVhwix:y:z:C:H:P:A:g:X:de:SqB:m:W:R:L:"
 #ifdef USE_SSL
             "Z:f:"
 #endif
@@ -2190,6 +2659,19 @@ int main(int argc, const char * const argv[])
             case 'b':
                 windowsize = atoi(opt_arg);
                 break;
+            case 'W':
+                threads = atoi(opt_arg);
+                break;
+            case 'R':
+                rate = atof(opt_arg);
+                if (rate <= 0) {
+                    err("Invalid request rate\n");
+                }
+                break;
+            case 'L':
+                urlfile = apr_pstrdup(cntxt, opt_arg);
+                nolength = 1;
+                break;
             case 'i':
                 if (method != NO_METH)
                     err("Cannot mix HEAD with other methods\n");
@@ -2392,6 +2874,20 @@ int main(int argc, const char * const argv[])
         usage(argv[0]);
     }
 
+#if APR_HAS_THREADS
+    if ((threads < 1) || (threads > concurrency && threads > 1)) {
+        fprintf(stderr, "%s: Invalid number of threads [Range 1..%d]\n",
+                argv[0], concurrency);
+        usage(argv[0]);
+    }
+#else
+    if (threads != 1) {
+        fprintf(stderr, "%s: Threads are not supported on this platform\n",
+                argv[0]);
+        usage(argv[0]);
+    }
+#endif
+
     if ((heartbeatres) && (requests > 150)) {
         heartbeatres = requests / 10;   /* Print line every 10% of requests */
         if (heartbeatres < 100)
@@ -2432,6 +2928,11 @@ int main(int argc, const char * const argv[])
     if (verbosity >= 3) {
         SSL_CTX_set_info_callback(ssl_ctx, ssl_state_cb);
     }
+#if APR_HAS_THREADS && OPENSSL_VERSION_NUMBER < 0x10100000L
+    if (threads > 1) {
+        ssl_thread_setup(cntxt);
+    }
+#endif
 #endif
 #ifdef SIGPIPE
     apr_signal(SIGPIPE, SIG_IGN);       /* Ignore writes to connections that
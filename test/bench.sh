@@ -0,0 +1,369 @@
+#!/bin/sh
+#
+# Licensed to the Apache Software Foundation (ASF) under one or more
+# contributor license agreements.  See the NOTICE file distributed with
+# this work for additional information regarding copyright ownership.
+# The ASF licenses this file to You under the Apache License, Version 2.0
+# (the "License"); you may not use this file except in compliance with
+# the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# This script runs an installed httpd against a set of canned
+# configurations, loads it with ab over the loopback interface and writes
+# one CSV line of results per MPM and scenario, so that the performance of
+# two builds can be compared:
+#
+#   make install                       # of the baseline, then
+#   test/bench.sh -p /usr/local/apache2 -o base.csv
+#   make install                       # of the change, then
+#   test/bench.sh -p /usr/local/apache2 -o new.csv -b base.csv
+#
+# Each scenario is run with every MPM built as a module (or with the one
+# built in), after a warm-up run.  Scenarios whose modules are missing are
+# skipped.  CPU time per request and the resident memory of httpd are only
+# measured on systems with a Linux compatible /proc.
+#
+PREFIX=${PREFIX:-/usr/local/apache2}
+DIR=${DIR:-$PWD/bench}
+PORT=${PORT:-8529}
+REQUESTS=${REQUESTS:-20000}
+CONCURRENCY=${CONCURRENCY:-32}
+ABTHREADS=${ABTHREADS:-1}
+OPENSSL=${OPENSSL:-openssl}
+SCENARIOS=${SCENARIOS:-"static-small static-large close tls proxy cache rewrite"}
+MPMS=${MPMS:-}
+OUT=${OUT:-}
+BASE=${BASE:-}
+THRESHOLD=${THRESHOLD:-5}
+if [ -z "$LABEL" ]; then
+    LABEL=`cd \`dirname $0\` && git describe --always --dirty 2> /dev/null`
+    [ -n "$LABEL" ] || LABEL=`date '+%Y%m%d%H%M%S'`
+fi
+
+usage() {
+    echo "Syntax: $0 [-p prefix] [-d dir] [-n requests] [-c concurrency] [-W threads]"
+    echo "          [-s scenarios] [-m mpms] [-l label] [-o results.csv]"
+    echo "          [-b baseline.csv] [-t percent]"
+    echo "    -p prefix      Installation of httpd and ab to test (default is $PREFIX)"
+    echo "    -d dir         Directory for the configurations and logs (default is $DIR)"
+    echo "    -n requests    Number of requests per run (default is $REQUESTS)"
+    echo "    -c concurrency Number of concurrent connections (default is $CONCURRENCY)"
+    echo "    -W threads     Number of ab threads (default is $ABTHREADS)"
+    echo "    -s scenarios   Scenarios to run (default is $SCENARIOS)"
+    echo "    -m mpms        MPMs to run them with (default is all available)"
+    echo "    -l label       Label of the results, e.g. the commit (default is $LABEL)"
+    echo "    -o file        Append the results to file as well as printing them"
+    echo "    -b file        Compare the results with those of a previous run"
+    echo "    -t percent     Changes to report in the comparison (default is $THRESHOLD)"
+    exit 1
+}
+
+while getopts p:d:n:c:W:s:m:l:o:b:t:h opt
+do
+    case "$opt"
+    in
+        p) PREFIX=$OPTARG;;
+        d) DIR=$OPTARG;;
+        n) REQUESTS=$OPTARG;;
+        c) CONCURRENCY=$OPTARG;;
+        W) ABTHREADS=$OPTARG;;
+        s) SCENARIOS=$OPTARG;;
+        m) MPMS=$OPTARG;;
+        l) LABEL=$OPTARG;;
+        o) OUT=$OPTARG;;
+        b) BASE=$OPTARG;;
+        t) THRESHOLD=$OPTARG;;
+        *) usage;;
+    esac
+done
+
+HTTPD=$PREFIX/bin/httpd
+AB=$PREFIX/bin/ab
+BPORT=`expr $PORT + 1`
+HEADER="label,mpm,scenario,requests,concurrency,failed,rps,p50_ms,p99_ms,cpu_us_per_req,rss_kb"
+
+if [ ! -x $HTTPD -o ! -x $AB ]; then
+    echo "$0: no httpd or ab found in $PREFIX/bin"
+    exit 1
+fi
+
+mkdir -p $DIR/docs $DIR/run || exit 1
+RESULTS=$DIR/results.csv
+echo "$HEADER" > $RESULTS
+
+# Documents served
+dd if=/dev/zero bs=1024 count=1 2> /dev/null | tr '\0' 'x' > $DIR/docs/small.html
+dd if=/dev/zero of=$DIR/docs/large.bin bs=1024 count=1024 2> /dev/null
+# so that children running as another user can read them
+chmod -R go+rX $DIR
+
+STATIC=`$HTTPD -l`
+
+# Print the LoadModule line for a module unless it is built in.
+# Fails if the module is not available at all.
+load_module() {
+    if echo "$STATIC" | grep "mod_$1\.c" > /dev/null; then
+        return 0
+    fi
+    if [ -f $PREFIX/modules/mod_$1.so ]; then
+        echo "LoadModule $1_module modules/mod_$1.so"
+        return 0
+    fi
+    return 1
+}
+
+# The MPMs to run the scenarios with
+if [ -z "$MPMS" ]; then
+    for m in event worker prefork; do
+        if [ -f $PREFIX/modules/mod_mpm_$m.so ]; then
+            MPMS="$MPMS $m"
+        fi
+    done
+    if [ -z "$MPMS" ]; then
+        MPMS=`$HTTPD -V | sed -n 's/^Server MPM: *//p' | tr 'A-Z' 'a-z'`
+    fi
+fi
+
+# A self signed certificate for the tls scenario
+if [ ! -f $DIR/server.crt ]; then
+    $OPENSSL req -x509 -newkey rsa:2048 -nodes -days 30 -subj /CN=localhost \
+        -keyout $DIR/server.key -out $DIR/server.crt > /dev/null 2>&1 \
+        || rm -f $DIR/server.key $DIR/server.crt
+fi
+
+# Write the configuration of a scenario for an MPM to $DIR/httpd.conf,
+# and set URL and ABFLAGS.  Fails if a module is missing.
+configure() {
+    scenario=$1
+    mpm=$2
+    conf=$DIR/httpd.conf
+    URL=http://127.0.0.1:$PORT/small.html
+    ABFLAGS=-k
+    modules="authz_core"
+    case $scenario in
+        static-small) ;;
+        static-large) URL=http://127.0.0.1:$PORT/large.bin;;
+        close)        ABFLAGS=;;
+        tls)          URL=https://127.0.0.1:$PORT/small.html
+                      modules="$modules ssl socache_shmcb"
+                      [ -f $DIR/server.crt ] || return 1;;
+        proxy)        URL=http://127.0.0.1:$PORT/proxy/small.html
+                      modules="$modules proxy proxy_http";;
+        cache)        URL=http://127.0.0.1:$PORT/cache/small.html
+                      modules="$modules proxy proxy_http headers cache cache_socache socache_shmcb";;
+        rewrite)      URL=http://127.0.0.1:$PORT/rw/small.html
+                      modules="$modules rewrite";;
+        *)            echo "$0: unknown scenario $scenario"
+                      return 1;;
+    esac
+
+    (
+        echo "ServerRoot \"$PREFIX\""
+        if [ -f $PREFIX/modules/mod_mpm_$mpm.so ]; then
+            echo "LoadModule mpm_${mpm}_module modules/mod_mpm_$mpm.so"
+        fi
+        load_module unixd
+        for m in $modules; do
+            load_module $m || exit 1
+        done
+        cat << EOM
+ServerName localhost
+Listen 127.0.0.1:$PORT
+DefaultRuntimeDir $DIR/run
+PidFile $DIR/run/httpd.pid
+ErrorLog $DIR/run/error_log
+LogLevel warn
+DocumentRoot "$DIR/docs"
+<Directory "$DIR/docs">
+    Require all granted
+</Directory>
+KeepAlive On
+MaxKeepAliveRequests 0
+MaxConnectionsPerChild 0
+<IfModule mpm_prefork_module>
+    StartServers $CONCURRENCY
+    MinSpareServers $CONCURRENCY
+    MaxSpareServers `expr $CONCURRENCY \* 2`
+</IfModule>
+EOM
+        case $scenario in
+            tls) cat << EOM
+SSLEngine on
+SSLCertificateFile $DIR/server.crt
+SSLCertificateKeyFile $DIR/server.key
+SSLSessionCache shmcb:$DIR/run/ssl_scache(512000)
+EOM
+            ;;
+            proxy|cache) cat << EOM
+Listen 127.0.0.1:$BPORT
+<VirtualHost 127.0.0.1:$BPORT>
+    <IfModule headers_module>
+        Header set Cache-Control "max-age=3600"
+    </IfModule>
+</VirtualHost>
+ProxyPass /proxy/ http://127.0.0.1:$BPORT/
+ProxyPass /cache/ http://127.0.0.1:$BPORT/
+EOM
+            ;;
+        esac
+        if [ $scenario = cache ]; then
+            cat << EOM
+CacheQuickHandler On
+CacheEnable socache /cache/
+CacheSocache shmcb
+EOM
+        fi
+        if [ $scenario = rewrite ]; then
+            # rules that do not match, as in a site's accumulated redirects
+            echo "RewriteEngine On"
+            i=1
+            while [ $i -le 50 ]; do
+                echo "RewriteRule ^/old/section-$i/(.*)\$ /section-$i/\$1 [R=301,L]"
+                echo "RewriteCond %{HTTP_USER_AGENT} ^Agent-$i"
+                echo "RewriteRule ^/(.*)\$ /agent-$i/\$1 [L]"
+                i=`expr $i + 1`
+            done
+            echo "RewriteRule ^/rw/(.*)\$ /\$1 [L]"
+        fi
+    ) > $conf
+}
+
+start_httpd() {
+    rm -f $DIR/run/httpd.pid
+    $HTTPD -f $DIR/httpd.conf -k start || return 1
+    i=0
+    while [ ! -s $DIR/run/httpd.pid ]; do
+        i=`expr $i + 1`
+        [ $i -gt 50 ] && return 1
+        sleep 0.1 2> /dev/null || sleep 1
+    done
+    PID=`cat $DIR/run/httpd.pid`
+}
+
+stop_httpd() {
+    $HTTPD -f $DIR/httpd.conf -k stop
+    while kill -0 $PID 2> /dev/null; do
+        sleep 0.1 2> /dev/null || sleep 1
+    done
+}
+
+# The pids of httpd and its children
+httpd_pids() {
+    echo $PID
+    cat /proc/[0-9]*/stat 2> /dev/null | awk -v ppid=$PID '$4 == ppid { print $1 }'
+}
+
+# CPU time of httpd and its children so far, in clock ticks
+cpu_ticks() {
+    [ -r /proc/$PID/stat ] || return
+    for p in `httpd_pids`; do
+        cat /proc/$p/stat 2> /dev/null
+    done | awk '{ t += $14 + $15 + $16 + $17 } END { print t }'
+}
+
+# Resident memory of httpd and its children, in kB
+rss_kb() {
+    [ -r /proc/$PID/status ] || return
+    for p in `httpd_pids`; do
+        cat /proc/$p/status 2> /dev/null
+    done | awk '/^VmRSS:/ { kb += $2 } END { print kb }'
+}
+
+# Run ab, leave its output in $DIR/ab.out and its percentiles in $DIR/ab.csv
+run_ab() {
+    threads=
+    [ $ABTHREADS -gt 1 ] && threads="-W $ABTHREADS"
+    $AB -q -n $1 -c $CONCURRENCY $threads $ABFLAGS -e $DIR/ab.csv $URL \
+        > $DIR/ab.out 2>&1
+}
+
+TCK=`getconf CLK_TCK 2> /dev/null || echo 100`
+
+for mpm in $MPMS; do
+    for scenario in $SCENARIOS; do
+        if ! configure $scenario $mpm; then
+            echo "$mpm/$scenario: skipped, modules or certificate missing" >&2
+            continue
+        fi
+        if ! start_httpd; then
+            echo "$mpm/$scenario: httpd failed to start, see $DIR/run/error_log" >&2
+            continue
+        fi
+
+        warmup=`expr $REQUESTS / 10 + $CONCURRENCY`
+        if run_ab $warmup; then
+            cpu0=`cpu_ticks`
+            run_ab $REQUESTS
+            status=$?
+            cpu1=`cpu_ticks`
+            rss=`rss_kb`
+        else
+            status=1
+        fi
+        stop_httpd
+
+        if [ $status != 0 ]; then
+            echo "$mpm/$scenario: ab failed, see $DIR/ab.out" >&2
+            continue
+        fi
+
+        done=`awk '/^Complete requests:/ { print $3 }' $DIR/ab.out`
+        failed=`awk '/^Failed requests:/ { print $3 }' $DIR/ab.out`
+        rps=`awk '/^Requests per second:/ { print $4 }' $DIR/ab.out`
+        p50=`awk -F, '$1 == 50 { print $2 }' $DIR/ab.csv`
+        p99=`awk -F, '$1 == 99 { print $2 }' $DIR/ab.csv`
+        cpu=
+        if [ -n "$cpu0" -a -n "$cpu1" ] && [ "${done:-0}" -gt 0 ]; then
+            cpu=`echo "$cpu0 $cpu1 $done $TCK" \
+                 | awk '{ printf "%.1f", ($2 - $1) * 1000000 / $4 / $3 }'`
+        fi
+        echo "$LABEL,$mpm,$scenario,$done,$CONCURRENCY,$failed,$rps,$p50,$p99,$cpu,$rss" \
+            >> $RESULTS
+    done
+done
+
+cat $RESULTS
+if [ -n "$OUT" ]; then
+    if [ -s "$OUT" ]; then
+        sed 1d $RESULTS >> $OUT
+    else
+        cp $RESULTS $OUT
+    fi
+fi
+
+# Compare with the latest results of each MPM and scenario in the
+# baseline: changes of the request rate, the 99th percentile or the CPU
+# time per request beyond the threshold are reported
+if [ -n "$BASE" ]; then
+    echo
+    awk -F, -v t=$THRESHOLD '
+        function change(old, new) {
+            return old > 0 ? (new - old) * 100 / old : 0
+        }
+        function report(what, old, new, worse,    c) {
+            c = change(old, new)
+            if (c >= t || c <= -t) {
+                printf "%-24s %-16s %10s -> %10s %+7.1f%%%s\n", $2 "/" $3,
+                       what, old, new, c, (worse * c > 0 ? "  worse" : "")
+                n++
+            }
+        }
+        FNR == 1 { next }
+        NR == FNR { rps[$2, $3] = $7; p99[$2, $3] = $9; cpu[$2, $3] = $10
+                    next }
+        ($2, $3) in rps {
+            report("requests/s", rps[$2, $3], $7, -1)
+            report("p99 ms", p99[$2, $3], $9, 1)
+            if (cpu[$2, $3] != "" && $10 != "")
+                report("cpu us/request", cpu[$2, $3], $10, 1)
+        }
+        END { if (!n) printf "No change beyond %s%%\n", t }
+    ' $BASE $RESULTS
+fi
@@ -0,0 +1,323 @@
+#!/bin/sh
+#
+# Licensed to the Apache Software Foundation (ASF) under one or more
+# contributor license agreements.  See the NOTICE file distributed with
+# this work for additional information regarding copyright ownership.
+# The ASF licenses this file to You under the Apache License, Version 2.0
+# (the "License"); you may not use this file except in compliance with
+# the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# This script tests mod_dbd with a scratch SQLite database standing in for
+# a real database server.  It runs an installed httpd, built with
+# --enable-dbd-test and the sqlite3 driver of APR-util, and checks:
+#
+#   - ap_dbd_cached_select and ap_dbd_select_async, through mod_dbd_test
+#   - SQL NULL values and missing statements
+#   - a row which fails to fetch after some rows were read
+#   - the result cache, per child and in mod_socache_shmcb, and its expiry
+#   - RewriteMap dbd: maps and mod_authn_dbd, which use the cache
+#
+# with each MPM built as a module (or with the one built in).  The
+# asynchronous queries are expected to suspend the request with the event
+# MPM only, and to fall back to blocking queries with the others.
+#
+#   test/dbd-test.sh [-p prefix] [-d dir] [-m mpms]
+#
+# It needs the sqlite3 shell and curl, and exits with the number of checks
+# which failed.
+#
+PREFIX=${PREFIX:-/usr/local/apache2}
+DIR=${DIR:-$PWD/dbd-test}
+PORT=${PORT:-8539}
+MPMS=${MPMS:-}
+SQLITE3=${SQLITE3:-sqlite3}
+CURL=${CURL:-curl}
+
+usage() {
+    echo "Syntax: $0 [-p prefix] [-d dir] [-m mpms]"
+    echo "    -p prefix      Installation of httpd to test (default is $PREFIX)"
+    echo "    -d dir         Directory for the database, configuration and logs (default is $DIR)"
+    echo "    -m mpms        MPMs to test with (default is all available)"
+    exit 1
+}
+
+while getopts p:d:m:h opt
+do
+    case "$opt"
+    in
+        p) PREFIX=$OPTARG;;
+        d) DIR=$OPTARG;;
+        m) MPMS=$OPTARG;;
+        *) usage;;
+    esac
+done
+
+HTTPD=$PREFIX/bin/httpd
+HTPASSWD=$PREFIX/bin/htpasswd
+URL=http://127.0.0.1:$PORT
+DB=$DIR/test.db
+FAILED=0
+
+if [ ! -x $HTTPD -o ! -x $HTPASSWD ]; then
+    echo "$0: no httpd or htpasswd found in $PREFIX/bin"
+    exit 1
+fi
+for prog in $SQLITE3 $CURL; do
+    if ! $prog --version > /dev/null 2>&1; then
+        echo "$0: $prog not found"
+        exit 1
+    fi
+done
+
+mkdir -p $DIR/run || exit 1
+# so that children running as another user can use the database
+chmod go+rwx $DIR
+
+STATIC=`$HTTPD -l`
+
+# Print the LoadModule line for a module unless it is built in.
+# Fails if the module is not available at all.
+load_module() {
+    if echo "$STATIC" | grep "mod_$1\.c" > /dev/null; then
+        return 0
+    fi
+    if [ -f $PREFIX/modules/mod_$1.so ]; then
+        echo "LoadModule $1_module modules/mod_$1.so"
+        return 0
+    fi
+    return 1
+}
+
+# The MPMs to test with
+if [ -z "$MPMS" ]; then
+    for m in event worker prefork; do
+        if [ -f $PREFIX/modules/mod_mpm_$m.so ]; then
+            MPMS="$MPMS $m"
+        fi
+    done
+    if [ -z "$MPMS" ]; then
+        MPMS=`$HTTPD -V | sed -n 's/^Server MPM: *//p' | tr 'A-Z' 'a-z'`
+    fi
+fi
+
+# (Re)create the database.  abs() of the smallest integer fails in
+# SQLite, which is how the third row of "overflow" fails to fetch.
+create_db() {
+    rm -f $DB
+    pw=`$HTPASSWD -nbs alice secret | sed 's/^alice://'`
+    $SQLITE3 $DB << EOM || exit 1
+CREATE TABLE t (name TEXT PRIMARY KEY, value TEXT);
+INSERT INTO t VALUES ('foo', 'bar');
+INSERT INTO t VALUES ('nul', NULL);
+INSERT INTO t VALUES ('cached', 'old');
+CREATE TABLE nums (n INTEGER);
+INSERT INTO nums VALUES (1);
+INSERT INTO nums VALUES (-2);
+INSERT INTO nums VALUES (-9223372036854775808);
+CREATE TABLE users (name TEXT PRIMARY KEY, password TEXT);
+INSERT INTO users VALUES ('alice', '$pw');
+EOM
+    chmod go+rw $DB
+}
+
+# Write the configuration for an MPM and a cache ("child" or "shmcb")
+# to $DIR/httpd.conf.  Fails if a module is missing.
+configure() {
+    mpm=$1
+    cache=$2
+    modules="authz_core authn_core auth_basic authz_user dbd dbd_test
+             authn_dbd rewrite"
+    [ $cache = shmcb ] && modules="$modules socache_shmcb"
+
+    (
+        echo "ServerRoot \"$PREFIX\""
+        if [ -f $PREFIX/modules/mod_mpm_$mpm.so ]; then
+            echo "LoadModule mpm_${mpm}_module modules/mod_mpm_$mpm.so"
+        fi
+        load_module unixd
+        for m in $modules; do
+            load_module $m || exit 1
+        done
+        cat << EOM
+ServerName localhost
+Listen 127.0.0.1:$PORT
+DefaultRuntimeDir $DIR/run
+PidFile $DIR/run/httpd.pid
+ErrorLog $DIR/run/error_log
+LogLevel warn
+DocumentRoot "$DIR/run"
+
+# a single child, so that the per child cache is seen by every request
+StartServers 1
+ServerLimit 1
+<IfModule mpm_prefork_module>
+    MinSpareServers 1
+    MaxSpareServers 1
+    MaxRequestWorkers 1
+</IfModule>
+<IfModule !mpm_prefork_module>
+    ThreadsPerChild 16
+    MaxRequestWorkers 16
+    MinSpareThreads 1
+    MaxSpareThreads 16
+</IfModule>
+
+DBDriver sqlite3
+DBDParams "$DB"
+DBDResultCacheTimeout 2
+DBDAsyncThreads 2
+DBDPrepareSQL "SELECT value FROM t WHERE name = %s" byname
+DBDPrepareSQL "SELECT name, value FROM t ORDER BY name" all
+DBDPrepareSQL "SELECT abs(n) FROM nums ORDER BY rowid" overflow
+
+<Location /sync>
+    SetHandler dbd-test
+</Location>
+<Location /async>
+    SetHandler dbd-test-async
+</Location>
+<Location /auth>
+    SetHandler dbd-test
+    AuthType Basic
+    AuthName dbd
+    AuthBasicProvider dbd
+    AuthDBDUserPWQuery "SELECT password FROM users WHERE name = %s"
+    Require valid-user
+</Location>
+
+RewriteEngine On
+RewriteMap byname "dbd:SELECT value FROM t WHERE name = %s"
+RewriteRule "^/map/(.*)" "/value/\${byname:\$1|none}" [R,L]
+EOM
+        if [ $cache = shmcb ]; then
+            echo "DBDResultCacheSOCache shmcb:$DIR/run/dbd_cache(65536)"
+        fi
+    ) > $DIR/httpd.conf
+}
+
+start_httpd() {
+    rm -f $DIR/run/httpd.pid
+    $HTTPD -f $DIR/httpd.conf -k start || return 1
+    i=0
+    while [ ! -s $DIR/run/httpd.pid ]; do
+        i=`expr $i + 1`
+        [ $i -gt 50 ] && return 1
+        sleep 0.1 2> /dev/null || sleep 1
+    done
+    PID=`cat $DIR/run/httpd.pid`
+}
+
+stop_httpd() {
+    $HTTPD -f $DIR/httpd.conf -k stop
+    while kill -0 $PID 2> /dev/null; do
+        sleep 0.1 2> /dev/null || sleep 1
+    done
+}
+
+# check name expected actual
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "ok     $TEST: $1"
+    else
+        echo "FAILED $TEST: $1"
+        echo "  expected: `echo "$2" | tr '\t\n' ' |'`"
+        echo "  got:      `echo "$3" | tr '\t\n' ' |'`"
+        FAILED=`expr $FAILED + 1`
+    fi
+}
+
+get() {
+    $CURL -s "$URL$1"
+}
+
+TAB=`printf '\t'`
+
+run_checks() {
+    mpm=$1
+    mode=sync
+    [ $mpm = event ] && mode=async
+
+    check "select" "sync ok
+bar" "`get '/sync?byname&foo'`"
+    check "async select" "$mode ok
+bar" "`get '/async?byname&foo'`"
+    check "no rows" "sync ok" "`get '/sync?byname&none'`"
+    check "async no rows" "$mode ok" "`get '/async?byname&none'`"
+    check "NULL" "sync ok
+\\N" "`get '/sync?byname&nul'`"
+    check "columns" "sync ok
+cached${TAB}old
+foo${TAB}bar
+nul${TAB}\\N" "`get '/sync?all'`"
+    check "missing statement" "sync error" \
+          "`get '/sync?nosuch' | cut -d' ' -f1-2`"
+    check "async missing statement" "$mode error" \
+          "`get '/async?nosuch' | cut -d' ' -f1-2`"
+
+    # the sqlite3 driver may also read all rows in pselect, and fail
+    # there; otherwise the rows before the failing one must be returned
+    out=`get '/sync?overflow'`
+    case "$out" in
+        "sync error"*) ;;
+        *) check "failing row" "sync incomplete
+1
+2" "`echo "$out" | sed '1s/^\(sync incomplete\).*/\1/'`";;
+    esac
+    check "map" "$URL/value/bar" \
+          "`$CURL -s -o /dev/null -w '%{redirect_url}' $URL/map/foo`"
+    check "map, no rows" "$URL/value/none" \
+          "`$CURL -s -o /dev/null -w '%{redirect_url}' $URL/map/none`"
+    check "authn" "200" "`$CURL -s -o /dev/null -w '%{http_code}' \
+                          -u alice:secret "$URL/auth?byname&foo"`"
+    check "authn, wrong password" "401" \
+          "`$CURL -s -o /dev/null -w '%{http_code}' \
+            -u alice:wrong "$URL/auth?byname&foo"`"
+
+    # cache: the old value is served until the result expires
+    check "cache fill" "sync ok
+old" "`get '/sync?byname&cached'`"
+    $SQLITE3 $DB "UPDATE t SET value = 'new' WHERE name = 'cached'"
+    check "cache hit" "sync ok
+old" "`get '/sync?byname&cached'`"
+    check "async cache hit" "$mode ok
+old" "`get '/async?byname&cached'`"
+    check "map cache hit" "$URL/value/old" \
+          "`$CURL -s -o /dev/null -w '%{redirect_url}' $URL/map/cached`"
+    sleep 3
+    check "cache expiry" "sync ok
+new" "`get '/sync?byname&cached'`"
+}
+
+for mpm in $MPMS; do
+    for cache in child shmcb; do
+        TEST=$mpm/$cache
+        create_db
+        if ! configure $mpm $cache; then
+            echo "$TEST: skipped, modules missing" >&2
+            continue
+        fi
+        if ! start_httpd; then
+            echo "$TEST: httpd failed to start, see $DIR/run/error_log" >&2
+            FAILED=`expr $FAILED + 1`
+            continue
+        fi
+        run_checks $mpm
+        stop_httpd
+    done
+done
+
+echo
+if [ $FAILED = 0 ]; then
+    echo "All checks passed"
+else
+    echo "$FAILED checks failed, see $DIR/run/error_log"
+fi
+exit $FAILED
@@ -0,0 +1,183 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * time-expr.c times the evaluation of ap_expr expressions, using a chain
+ * of conditions as they are typically found in <If>, Require expr and
+ * SetEnvIfExpr directives.  Each simulated request sets up a fake request,
+ * evaluates the expressions and then clears the request pool; the cost of
+ * setting up the request alone is measured first and subtracted.
+ *
+ * argv[1] is the number of requests (default 100000).  Further arguments
+ * replace the built-in chain with the given expressions.
+ *
+ * Build httpd first, then link this program the same way httpd itself is
+ * linked, with time-expr.o in place of server/main.o, e.g.
+ *
+ *   cd test && gcc -O2 -c -I../include -I../os/unix \
+ *       `../srclib/apr/apr-1-config --includes --cppflags` time-expr.c
+ *
+ * Run it before and after changes to server/util_expr_eval.c and compare
+ * the per-expression figures.
+ */
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_main.h"
+#include "ap_expr.h"
+
+#include "apr_general.h"
+#include "apr_hooks.h"
+#include "apr_strings.h"
+#include "apr_time.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char *default_chain[] = {
+    "%{HTTP_HOST} == 'www.example.com'",
+    "%{REQUEST_URI} =~ m#^/app/#",
+    "%{REQUEST_METHOD} in { 'GET', 'HEAD', 'POST' }",
+    "%{REMOTE_ADDR} -ipmatch '192.0.2.0/24'",
+    "%{HTTP:Accept-Language} =~ /^de/ || tolower('DE') == 'de'",
+    "%{API_VERSION} -ge 20120211 && %{SERVER_PROTOCOL} == 'HTTP/1.1'",
+    "%{TIME_HOUR} -ge 8 && %{TIME_HOUR} -lt 18 && %{TIME_WDAY} -lt 6",
+    "sha1('static') == '01f7a1f2d67e1d0b0ed3a0da8a0a0ac3a4cfa91f' || true",
+    "!(%{HTTPS} == 'on') && -n %{QUERY_STRING}",
+    "%{REQUEST_URI} -strmatch '*.html' && 'a' . 'b' == 'ab'",
+    NULL
+};
+
+static void fill_request(request_rec *r)
+{
+    r->headers_in = apr_table_make(r->pool, 8);
+    r->headers_out = apr_table_make(r->pool, 8);
+    r->err_headers_out = apr_table_make(r->pool, 4);
+    r->subprocess_env = apr_table_make(r->pool, 4);
+    r->notes = apr_table_make(r->pool, 4);
+    apr_table_setn(r->headers_in, "Host", "www.example.com");
+    apr_table_setn(r->headers_in, "User-Agent", "time-expr/1.0");
+    apr_table_setn(r->headers_in, "Accept-Language", "de-DE,de;q=0.9");
+    r->method = "GET";
+    r->method_number = M_GET;
+    r->protocol = "HTTP/1.1";
+    r->proto_num = HTTP_VERSION(1, 1);
+    r->uri = "/app/index.html";
+    r->args = "id=42";
+    r->the_request = "GET /app/index.html?id=42 HTTP/1.1";
+    r->useragent_ip = "192.0.2.10";
+    r->request_time = apr_time_now();
+}
+
+/* Time 'requests' requests evaluating the expressions first to last - 1 */
+static apr_interval_time_t run(request_rec *r, apr_pool_t *rpool,
+                               ap_expr_info_t **infos, int first, int last,
+                               int requests)
+{
+    apr_time_t start = apr_time_now();
+    int n, i;
+
+    for (n = 0; n < requests; n++) {
+        r->pool = rpool;
+        fill_request(r);
+        for (i = first; i < last; i++) {
+            const char *err;
+
+            if (ap_expr_exec(r, infos[i], &err) < 0) {
+                fprintf(stderr, "Cannot evaluate expression %d: %s\n",
+                        i + 1, err);
+                exit(1);
+            }
+        }
+        apr_pool_clear(rpool);
+    }
+
+    return apr_time_now() - start;
+}
+
+int main(int argc, const char * const argv[])
+{
+    apr_pool_t *pool, *rpool;
+    server_rec *s;
+    conn_rec *c;
+    request_rec *r;
+    const char **chain = default_chain;
+    ap_expr_info_t **infos;
+    apr_interval_time_t base, spent;
+    int requests = 100000, i, num;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    atexit(apr_terminate);
+    apr_pool_create(&pool, NULL);
+
+    if (argc > 1)
+        requests = atoi(argv[1]);
+    if (argc > 2)
+        chain = (const char **)argv + 2;
+    for (num = 0; chain[num]; num++)
+        ;
+
+    ap_expr_init(pool);
+    apr_hook_sort_all();
+
+    s = apr_pcalloc(pool, sizeof(*s));
+    s->process = apr_pcalloc(pool, sizeof(*s->process));
+    s->process->pool = pool;
+    s->process->pconf = pool;
+    s->log.level = APLOG_WARNING;
+    s->server_hostname = "www.example.com";
+    s->port = 80;
+    ap_server_conf = s;
+
+    c = apr_pcalloc(pool, sizeof(*c));
+    c->pool = pool;
+    c->base_server = s;
+    c->client_ip = "192.0.2.10";
+    c->log_id = "-";
+
+    infos = apr_pcalloc(pool, num * sizeof(*infos));
+    for (i = 0; i < num; i++) {
+        const char *err;
+
+        infos[i] = apr_pcalloc(pool, sizeof(ap_expr_info_t));
+        infos[i]->filename = "time-expr";
+        infos[i]->line_number = i + 1;
+        err = ap_expr_parse(pool, pool, infos[i], chain[i], NULL);
+        if (err) {
+            fprintf(stderr, "Cannot parse '%s': %s\n", chain[i], err);
+            return 1;
+        }
+    }
+
+    apr_pool_create(&rpool, pool);
+    r = apr_pcalloc(pool, sizeof(*r));
+    r->connection = c;
+    r->server = s;
+
+    base = run(r, rpool, infos, 0, 0, requests);
+
+    printf("%d requests, %d expressions\n\n", requests, num);
+    for (i = 0; i < num; i++) {
+        spent = run(r, rpool, infos, i, i + 1, requests) - base;
+        printf("%9.1f ns  %s\n", spent * 1000.0 / requests, chain[i]);
+    }
+    spent = run(r, rpool, infos, 0, num, requests) - base;
+    printf("%9.1f ns  per request, all expressions\n",
+           spent * 1000.0 / requests);
+
+    return 0;
+}
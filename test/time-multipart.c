@@ -0,0 +1,236 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * time-multipart.c measures the throughput of the apreq multipart/form-data
+ * parser.  It builds a request body in memory with a few form fields and
+ * one file part of pseudo-random binary data, which contains CRs and
+ * partial boundaries as real uploads do, and feeds it to the parser the
+ * way mod_apreq's input filter does: in runs of APREQ_DEFAULT_READ_BLOCK_SIZE
+ * bytes, made of buckets of the size the core input filter typically
+ * delivers, which are set aside before the parser sees them.
+ * The body is parsed once with a hook which throws the file data away, so
+ * that mostly the boundary search is timed, and once with the upload
+ * spooled to a temp file as usual.  The size of the upload is checked.
+ *
+ *   time-multipart [megabytes [bucket-size [brigade-limit [temp-dir]]]]
+ *
+ * The defaults are 256 MB, 8000 byte buckets, a 256 KB brigade limit and
+ * the system's temp directory.
+ *
+ * The program only needs APR, APR-util and the apreq sources of the server
+ * directory, e.g.
+ *
+ *   cd test && gcc -O2 -I../include -I../os/unix \
+ *       `../srclib/apr/apr-1-config --includes --cppflags` \
+ *       -o time-multipart time-multipart.c ../server/apreq_error.c \
+ *       ../server/apreq_param.c ../server/apreq_parser.c \
+ *       ../server/apreq_parser_header.c ../server/apreq_parser_multipart.c \
+ *       ../server/apreq_parser_urlencoded.c ../server/apreq_util.c \
+ *       `../srclib/apr-util/apu-1-config --link-ld --libs` \
+ *       `../srclib/apr/apr-1-config --link-ld --libs`
+ *
+ * Run it before and after changes to server/apreq_parser_multipart.c or
+ * server/apreq_util.c and compare the MB/s figures.
+ */
+
+#include "apreq_param.h"
+#include "apreq_parser.h"
+#include "apreq_util.h"
+
+#include "apr_buckets.h"
+#include "apr_file_info.h"
+#include "apr_general.h"
+#include "apr_strings.h"
+#include "apr_time.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BOUNDARY "----------time-multipart-0123456789"
+#define CT "multipart/form-data; boundary=" BOUNDARY
+
+static const char head[] =
+    "--" BOUNDARY "\r\n"
+    "Content-Disposition: form-data; name=\"title\"\r\n"
+    "\r\n"
+    "A title\r\n"
+    "--" BOUNDARY "\r\n"
+    "Content-Disposition: form-data; name=\"comment\"\r\n"
+    "\r\n"
+    "Some longer text\r\nspanning lines.\r\n"
+    "--" BOUNDARY "\r\n"
+    "Content-Disposition: form-data; name=\"file\"; filename=\"data.bin\"\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "\r\n";
+
+static const char tail[] =
+    "\r\n--" BOUNDARY "--\r\n";
+
+/* Random bytes, with a CR every few hundred bytes and now and then the
+ * first part of a boundary, which the parser must pass over.
+ */
+static char *make_body(apr_pool_t *p, apr_size_t file_len, apr_size_t *len)
+{
+    const apr_size_t hlen = sizeof(head) - 1, tlen = sizeof(tail) - 1;
+    char *body = apr_palloc(p, hlen + file_len + tlen);
+    char *data = body + hlen;
+    apr_uint32_t x = 2463534242U;
+    apr_size_t i;
+
+    memcpy(body, head, hlen);
+    for (i = 0; i < file_len; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = (char)x;
+        if (data[i] == '\r' && i + 8 < file_len && (x & 0x300) == 0) {
+            memcpy(data + i, "\r\n--" BOUNDARY, 8);
+            i += 7;
+        }
+    }
+    memcpy(data + file_len, tail, tlen);
+
+    *len = hlen + file_len + tlen;
+    return body;
+}
+
+/* Drops the file data, but keeps the EOS bucket, which the parser removes
+ * again itself.
+ */
+static apr_status_t discard_data(APREQ_HOOK_ARGS)
+{
+    apr_bucket *e;
+
+    if (bb == NULL)
+        return APR_SUCCESS;
+
+    while ((e = APR_BRIGADE_FIRST(bb)) != APR_BRIGADE_SENTINEL(bb)
+           && !APR_BUCKET_IS_EOS(e))
+        apr_bucket_delete(e);
+
+    return APR_SUCCESS;
+}
+
+static apr_interval_time_t run(apr_pool_t *p, const char *body,
+                               apr_size_t len, apr_size_t bucket_size,
+                               apr_size_t limit, const char *temp_dir,
+                               int discard, apr_off_t *upload_len)
+{
+    apr_bucket_alloc_t *ba = apr_bucket_alloc_create(p);
+    apr_bucket_brigade *bb = apr_brigade_create(p, ba);
+    apr_table_t *t = apr_table_make(p, APREQ_DEFAULT_NELTS);
+    apreq_parser_t *psr;
+    const char *val;
+    apr_status_t s = APR_INCOMPLETE;
+    apr_size_t off, run_len = 0;
+    apr_time_t start;
+
+    psr = apreq_parser_make(p, ba, CT, apreq_parse_multipart, limit,
+                            temp_dir, NULL, NULL);
+    if (discard)
+        apreq_parser_add_hook(psr, apreq_hook_make(p, discard_data,
+                                                   NULL, NULL));
+
+    start = apr_time_now();
+    for (off = 0; off < len; off += bucket_size) {
+        apr_size_t n = len - off < bucket_size ? len - off : bucket_size;
+
+        APR_BRIGADE_INSERT_TAIL(bb,
+            apr_bucket_transient_create(body + off, n, ba));
+        run_len += n;
+        if (off + n == len)
+            APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(ba));
+        else if (run_len + bucket_size <= APREQ_DEFAULT_READ_BLOCK_SIZE)
+            continue;
+
+        /* as apreq_filter_prefetch() does */
+        apreq_brigade_setaside(bb, p);
+        s = apreq_parser_run(psr, t, bb);
+        apr_brigade_cleanup(bb);
+        run_len = 0;
+        if (s != APR_SUCCESS && s != APR_INCOMPLETE)
+            break;
+    }
+    start = apr_time_now() - start;
+
+    val = apr_table_get(t, "file");
+    if (s != APR_SUCCESS || val == NULL) {
+        fprintf(stderr, "Parsing failed (%d)\n", s);
+        exit(1);
+    }
+    apr_brigade_length(apreq_value_to_param(val)->upload, 1, upload_len);
+
+    return start;
+}
+
+int main(int argc, const char * const argv[])
+{
+    apr_pool_t *pool, *p;
+    apr_size_t megs = 256, bucket_size = 8000, limit = 256 * 1024;
+    apr_size_t file_len, len, i;
+    const char *temp_dir = NULL, *body;
+    static const char *modes[] = { "scan only", "spooled" };
+
+    apr_app_initialize(&argc, &argv, NULL);
+    atexit(apr_terminate);
+    apr_pool_create(&pool, NULL);
+
+    if (argc > 1)
+        megs = atoi(argv[1]);
+    if (argc > 2)
+        bucket_size = atoi(argv[2]);
+    if (argc > 3)
+        limit = (apr_size_t)apreq_atoi64f(argv[3]);
+    if (argc > 4)
+        temp_dir = argv[4];
+    else if (apr_temp_dir_get(&temp_dir, pool) != APR_SUCCESS)
+        temp_dir = ".";
+    if (megs == 0 || bucket_size == 0) {
+        fprintf(stderr, "Usage: %s [megabytes [bucket-size [brigade-limit "
+                "[temp-dir]]]]\n", argv[0]);
+        return 1;
+    }
+
+    file_len = megs * 1024 * 1024;
+    body = make_body(pool, file_len, &len);
+    apr_pool_create(&p, pool);
+
+    printf("%" APR_SIZE_T_FMT " bytes in %" APR_SIZE_T_FMT " byte buckets,"
+           " brigade limit %" APR_SIZE_T_FMT "\n\n", len, bucket_size, limit);
+
+    for (i = 0; i < 2; i++) {
+        apr_interval_time_t spent;
+        apr_off_t upload_len;
+
+        spent = run(p, body, len, bucket_size, limit, temp_dir, i == 0,
+                    &upload_len);
+        if (upload_len != (i ? (apr_off_t)file_len : 0)) {
+            fprintf(stderr, "Upload is %" APR_OFF_T_FMT " bytes, expected %"
+                    APR_SIZE_T_FMT "\n", upload_len, i ? file_len : 0);
+            return 1;
+        }
+        printf("%9.1f MB/s  %s\n",
+               (double)len / (1024 * 1024) / (spent / 1000000.0 + 1e-9),
+               modes[i]);
+
+        /* closes and removes the spool file */
+        apr_pool_clear(p);
+    }
+
+    return 0;
+}